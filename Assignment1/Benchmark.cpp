@@ -0,0 +1,154 @@
+//***************************************************************************************
+// Benchmark.cpp
+//***************************************************************************************
+
+#include "Benchmark.h"
+#include <iomanip>
+
+using namespace DirectX;
+
+Benchmark::Benchmark(UINT frameCount, UINT warmupFrames)
+	: mFrameCount(frameCount), mWarmupFrames(warmupFrames)
+{
+	// Default path: around the castle close up, then out over the forest.
+	mCameraPath =
+	{
+		{ XMFLOAT3(0.0f, 15.0f, -50.0f), XMFLOAT3(0.0f, 6.0f, 0.0f) },
+		{ XMFLOAT3(40.0f, 25.0f, -30.0f), XMFLOAT3(0.0f, 6.0f, 0.0f) },
+		{ XMFLOAT3(45.0f, 12.0f, 30.0f), XMFLOAT3(0.0f, 8.0f, 0.0f) },
+		{ XMFLOAT3(120.0f, 40.0f, 140.0f), XMFLOAT3(0.0f, 10.0f, 0.0f) },
+		{ XMFLOAT3(-80.0f, 60.0f, 180.0f), XMFLOAT3(-150.0f, 0.0f, 0.0f) },
+		{ XMFLOAT3(-180.0f, 45.0f, -60.0f), XMFLOAT3(0.0f, 0.0f, 0.0f) },
+		{ XMFLOAT3(-40.0f, 20.0f, -60.0f), XMFLOAT3(0.0f, 6.0f, 0.0f) },
+	};
+
+	mFrameMs.reserve(mFrameCount);
+}
+
+void Benchmark::SetCameraPath(const std::vector<CameraKey>& keys)
+{
+	if(keys.size() >= 2)
+		mCameraPath = keys;
+}
+
+bool Benchmark::LoadCameraPath(const std::wstring& filename, std::vector<CameraKey>& keys)
+{
+	std::ifstream file(filename);
+	if(!file)
+		return false;
+
+	keys.clear();
+	CameraKey key;
+	while(file >> key.EyePos.x >> key.EyePos.y >> key.EyePos.z
+		>> key.Target.x >> key.Target.y >> key.Target.z)
+	{
+		keys.push_back(key);
+	}
+	return keys.size() >= 2;
+}
+
+bool Benchmark::AppendCameraKey(const std::wstring& filename, const CameraKey& key)
+{
+	std::ofstream file(filename, std::ios::app);
+	if(!file)
+		return false;
+
+	file << key.EyePos.x << ' ' << key.EyePos.y << ' ' << key.EyePos.z << ' '
+		<< key.Target.x << ' ' << key.Target.y << ' ' << key.Target.z << '\n';
+	return true;
+}
+
+Benchmark::CameraKey Benchmark::Camera()const
+{
+	// The whole run covers the loop once.
+	UINT keyCount = (UINT)mCameraPath.size();
+	float u = (float)mFrame / (mWarmupFrames + mFrameCount) * keyCount;
+	UINT segment = std::min<UINT>((UINT)u, keyCount - 1);
+	float t = u - segment;
+
+	auto key = [&](int offset) -> const CameraKey&
+	{
+		return mCameraPath[(segment + keyCount + offset) % keyCount];
+	};
+
+	CameraKey camera;
+	XMStoreFloat3(&camera.EyePos, XMVectorCatmullRom(
+		XMLoadFloat3(&key(-1).EyePos), XMLoadFloat3(&key(0).EyePos),
+		XMLoadFloat3(&key(1).EyePos), XMLoadFloat3(&key(2).EyePos), t));
+	XMStoreFloat3(&camera.Target, XMVectorCatmullRom(
+		XMLoadFloat3(&key(-1).Target), XMLoadFloat3(&key(0).Target),
+		XMLoadFloat3(&key(1).Target), XMLoadFloat3(&key(2).Target), t));
+	return camera;
+}
+
+bool Benchmark::EndFrame(Profiler& profiler)
+{
+	// Real time between consecutive frame ends, waits included.
+	__int64 now = GameTimer::Counter();
+	if(mFrame > mWarmupFrames)
+		mFrameMs.push_back((float)((now - mLastFrameCount) * mClock.SecondsPerCount() * 1000.0));
+	mLastFrameCount = now;
+
+	if(mFrame == mWarmupFrames)
+		profiler.ResetHistory();
+
+	++mFrame;
+	return mFrame == mWarmupFrames + mFrameCount + 1;
+}
+
+UINT Benchmark::FrameCount()const
+{
+	return mFrameCount;
+}
+
+UINT Benchmark::WarmupFrames()const
+{
+	return mWarmupFrames;
+}
+
+bool Benchmark::WriteReport(const std::wstring& filename, const Profiler& profiler,
+	const std::vector<std::pair<std::string, std::string>>& config)const
+{
+	std::ofstream json(filename);
+	if(!json)
+		return false;
+
+	json << std::fixed << std::setprecision(4);
+
+	auto writeStats = [&json](const Profiler::Stats& s)
+	{
+		json << "{ \"min\": " << s.MinMs << ", \"avg\": " << s.AvgMs <<
+			", \"p50\": " << s.P50Ms << ", \"p95\": " << s.P95Ms <<
+			", \"p99\": " << s.P99Ms << ", \"max\": " << s.MaxMs <<
+			", \"samples\": " << s.Samples << " }";
+	};
+
+	json << "{\n";
+	json << "  \"config\": {";
+	for(size_t i = 0; i < config.size(); ++i)
+		json << (i ? "," : "") << "\n    \"" << config[i].first << "\": " << config[i].second;
+	json << "\n  },\n";
+
+	json << "  \"frame_ms\": ";
+	writeStats(Profiler::ComputeStats(mFrameMs));
+	json << ",\n";
+
+	json << "  \"cpu_ms\": {";
+	for(UINT i = 0; i < profiler.CpuScopeCount(); ++i)
+	{
+		json << (i ? "," : "") << "\n    \"" << profiler.CpuScopeName(i) << "\": ";
+		writeStats(profiler.CpuStats(i));
+	}
+	json << "\n  },\n";
+
+	json << "  \"gpu_ms\": {";
+	for(UINT i = 0; i < profiler.GpuScopeCount(); ++i)
+	{
+		json << (i ? "," : "") << "\n    \"" << profiler.GpuScopeName(i) << "\": ";
+		writeStats(profiler.GpuStats(i));
+	}
+	json << "\n  }\n";
+	json << "}\n";
+
+	return (bool)json;
+}
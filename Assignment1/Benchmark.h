@@ -0,0 +1,66 @@
+//***************************************************************************************
+// Benchmark.h
+//
+// Scripted benchmark runs.  The camera follows a closed Catmull-Rom spline through a
+// list of keys, parameterized by the frame number instead of the time, and the app
+// steps its clock by a fixed amount per frame, so every run renders the same frames.
+// After a warm-up the real frame times are collected, and once the run is over a JSON
+// report of their percentiles and of the profiler's per-scope timings is written.
+//***************************************************************************************
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "../Common/d3dUtil.h"
+#include "../Common/Profiler.h"
+
+class Benchmark
+{
+public:
+	// Runs warmupFrames unmeasured frames followed by frameCount measured ones.
+	Benchmark(UINT frameCount, UINT warmupFrames);
+	Benchmark(const Benchmark& rhs) = delete;
+	Benchmark& operator=(const Benchmark& rhs) = delete;
+	~Benchmark() = default;
+
+	struct CameraKey
+	{
+		DirectX::XMFLOAT3 EyePos;
+		DirectX::XMFLOAT3 Target;
+	};
+
+	// Replaces the default camera path.  Needs at least two keys.
+	void SetCameraPath(const std::vector<CameraKey>& keys);
+
+	// A path file holds one key per line: eye x y z, then target x y z.
+	static bool LoadCameraPath(const std::wstring& filename, std::vector<CameraKey>& keys);
+	static bool AppendCameraKey(const std::wstring& filename, const CameraKey& key);
+
+	// Camera of the frame being built.
+	CameraKey Camera()const;
+
+	// Call once per frame after its submission.  Discards the profiler's warm-up
+	// samples; returns true once, when the last measured frame is done.
+	bool EndFrame(Profiler& profiler);
+
+	UINT FrameCount()const;
+	UINT WarmupFrames()const;
+
+	// config holds "name": value pairs for the report, with the values already
+	// formatted as JSON.
+	bool WriteReport(const std::wstring& filename, const Profiler& profiler,
+		const std::vector<std::pair<std::string, std::string>>& config)const;
+
+private:
+	UINT mFrameCount = 0;
+	UINT mWarmupFrames = 0;
+	UINT mFrame = 0;
+
+	std::vector<CameraKey> mCameraPath;
+
+	GameTimer mClock;
+	__int64 mLastFrameCount = 0;
+	std::vector<float> mFrameMs;
+};
+
+#endif // BENCHMARK_H
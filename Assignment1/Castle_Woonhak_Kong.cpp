@@ -6,8 +6,27 @@
 #include "../Common/MathHelper.h"
 #include "../Common/UploadBuffer.h"
 #include "../Common/GeometryGenerator.h"
+#include "../Common/MeshOptimizer.h"
 #include "FrameResource.h"
 #include "Waves.h"
+#include "GpuWaves.h"
+#include "GpuCulling.h"
+#include "ClusteredLighting.h"
+#include "Terrain.h"
+#include "Foliage.h"
+#include "Benchmark.h"
+#include "ScenePack.h"
+#include "DynamicResolution.h"
+#include "../Common/Profiler.h"
+#include "../Common/GpuAllocator.h"
+#include "../Common/ResidencyManager.h"
+#include "../Common/ShaderCache.h"
+#include "../Common/ShaderPermutations.h"
+#include "../Common/StagingRing.h"
+#include "../Common/TextureStreamer.h"
+#include "../Common/LinearAllocator.h"
+#include "../Common/Registry.h"
+#include <ppl.h>
 
 using Microsoft::WRL::ComPtr;
 using namespace DirectX;
@@ -16,7 +35,108 @@ using namespace DirectX::PackedVector;
 //#pragma comment(lib, "d3dcompiler.lib")
 //#pragma comment(lib, "D3D12.lib")
 
-const int gNumFrameResources = 3;
+// Overridden by -frames on the command line.
+int gNumFrameResources = 3;
+
+// Diffuse textures in SRV heap order; Material::DiffuseSrvHeapIndex indexes this table.
+struct DiffuseTextureDesc
+{
+	const char* Name;
+	const wchar_t* Filename;
+	bool IsArray;
+};
+
+const DiffuseTextureDesc gDiffuseTextures[] =
+{
+	{ "grassTex",     L"../Textures/grass.dds",       false },
+	{ "waterTex",     L"../Textures/water1.dds",      false },
+	{ "fenceTex",     L"../Textures/WoodCrate01.dds", false },
+	{ "stoneTex",     L"../Textures/stone2.dds",      false },
+	{ "stone2Tex",    L"../Textures/stone1.dds",      false },
+	{ "sapphireTex",  L"../Textures/sapphire.dds",    false },
+	{ "carpetTex",    L"../Textures/carpet.dds",      false },
+	{ "emeraldTex",   L"../Textures/emerald.dds",     false },
+	{ "tiger_gemTex", L"../Textures/tiger_gem.dds",   false },
+	{ "treeArrayTex", L"../Textures/treeArray.dds",   true },
+};
+
+const UINT gDiffuseTextureCount = _countof(gDiffuseTextures);
+
+// SRV heap layout: the diffuse textures, a 2D and a 2D array view of the placeholder
+// texture, the diffuse textures' mip tail views, the terrain height map, the GPU
+// culling views, the dynamic resolution scene view, then the GPU wave simulation's
+// descriptors.
+const UINT gPlaceholderSrvIndex = gDiffuseTextureCount;
+const UINT gPlaceholderArraySrvIndex = gDiffuseTextureCount + 1;
+const UINT gMipTailSrvIndex = gDiffuseTextureCount + 2;
+const UINT gTerrainSrvIndex = gMipTailSrvIndex + gDiffuseTextureCount;
+const UINT gGpuCullingSrvIndex = gTerrainSrvIndex + 1;
+const UINT gDynResSrvIndex = gGpuCullingSrvIndex + GpuCulling::DescriptorCount;
+const UINT gGpuWavesSrvIndex = gDynResSrvIndex + 1;
+
+// The texture SRVs a material may reference, all ahead of the terrain map; the
+// bindless table covers only these, so it never reaches the UAVs further on.
+const UINT gTextureSrvCount = gTerrainSrvIndex;
+
+// Clear color of the scene, also the optimized clear value of its offscreen target.
+const XMVECTORF32 gClearColor = { {{1.0f, 0.32f, 0.32f, 1.0f}} };
+
+// Upload memory shared by all static geometry and texture uploads.  A multiple of
+// D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT; larger textures get a dedicated buffer.
+const UINT64 gStagingRingSize = 16 * 1024 * 1024;
+
+// Page size of the frame resources' constant allocators.
+const UINT64 gFrameConstantsPageSize = 256 * 1024;
+
+// Capacity of the clustered point and spot lights, and the torches per face of each
+// castle wall among them.
+const UINT gMaxLightCount = 512;
+const int gTorchesPerWall = 24;
+
+// Trees are scattered over the terrain in gFoliageCellsPerSide^2 culling cells, each
+// drawing one of the gTreeArraySlices slices of treeArray.dds.
+const int gFoliageCellsPerSide = 32;
+const UINT gTreeArraySlices = 3;
+
+// Benchmark runs: unmeasured frames before the measured ones, the fixed clock step,
+// and the sites of the castle copies, a grid of (2*gCastleSiteRadius+1)^2 cells
+// gCastleSpacing apart centred on the original.
+const UINT gBenchmarkWarmupFrames = 60;
+const double gBenchmarkFrameStep = 1.0 / 60.0;
+const float gCastleSpacing = 60.0f;
+const int gCastleSiteRadius = 3;
+
+// Steps the CPU waves' AoS and SoA solvers are compared over at the end of a benchmark.
+const int gWaveSolverCheckSteps = 60;
+
+// GPU water is drawn as a clipmap of gWaterClipmapLevels nested square rings with
+// gWaterClipmapQuads quads per side; the finest ring has the simulation's spacing and
+// each coarser ring twice the spacing of the one inside it.
+const int gWaterClipmapQuads = 64;
+const int gWaterClipmapLevels = 4;
+
+// Feature bits of the Default.hlsl and TreeSprite.hlsl variants, and NUM_DIR_LIGHTS in
+// the two bits from gDirLightCountShift.  The vertex and pixel shaders are keyed by
+// their own bits only, so variants differing in the other stage share a compile.
+enum ShaderFeature : UINT
+{
+	FeatureAlphaTest       = 1 << 0,
+	FeatureFog             = 1 << 1,
+	FeaturePointLights     = 1 << 2,	// CLUSTERED_POINT_LIGHTS
+	FeatureSpotLights      = 1 << 3,	// CLUSTERED_SPOT_LIGHTS
+	FeatureTexTransform    = 1 << 4,
+	FeatureInstanced       = 1 << 5,
+	FeatureTerrain         = 1 << 6,
+	FeatureDisplacementMap = 1 << 7,
+	FeatureCompactVertex   = 1 << 8,
+};
+
+const UINT gDirLightCountShift = 9;
+
+const UINT gPixelShaderFeatures = FeatureAlphaTest | FeatureFog | FeaturePointLights |
+	FeatureSpotLights | (3u << gDirLightCountShift);
+const UINT gVertexShaderFeatures = FeatureTexTransform | FeatureInstanced | FeatureTerrain |
+	FeatureDisplacementMap | FeatureCompactVertex;
 
 // Lightweight structure stores parameters to draw a shape.  This will
 // vary from app-to-app.
@@ -31,13 +151,8 @@ struct RenderItem
 
 	XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
 
-	// Dirty flag indicating the object data has changed and we need to update the constant buffer.
-	// Because we have an object cbuffer for each FrameResource, we have to apply the
-	// update to each FrameResource.  Thus, when we modify obect data we should set 
-	// NumFramesDirty = gNumFrameResources so that each frame resource gets the update.
-	int NumFramesDirty = gNumFrameResources;
-
-	// Index into GPU constant buffer corresponding to the ObjectCB for this render item.
+	// Handle in mAllRitems, and index into mObjectConstants and this frame's ObjectCB.
+	// After changing the object data, pass it to mAllRitems.MarkDirty.
 	UINT ObjCBIndex = -1;
 
 	Material* Mat = nullptr;
@@ -50,6 +165,36 @@ struct RenderItem
     UINT IndexCount = 0;
     UINT StartIndexLocation = 0;
     int BaseVertexLocation = 0;
+
+	// Only used by the GPU waves render item to displace the grid in the vertex shader.
+	XMFLOAT2 DisplacementMapTexelSize = { 1.0f, 1.0f };
+	float GridSpatialStep = 1.0f;
+
+	// Local space bounds of the submesh, for frustum culling.
+	BoundingBox Bounds;
+
+	// Result of the last frustum test, made in UpdateDrawLists.
+	bool Visible = true;
+};
+
+// Render items sharing the same submesh and material, drawn with one
+// DrawIndexedInstanced.  Their instances are contiguous in the InstanceBuffer.
+struct InstancedBatch
+{
+	Material* Mat = nullptr;
+	MeshGeometry* Geo = nullptr;
+
+	D3D12_PRIMITIVE_TOPOLOGY PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+
+	UINT IndexCount = 0;
+	UINT StartIndexLocation = 0;
+	int BaseVertexLocation = 0;
+
+	// Every item of the batch; the visible ones are packed into the InstanceBuffer
+	// from FirstInstance on each frame.
+	std::vector<RenderItem*> Instances;
+	UINT FirstInstance = 0;
+	UINT VisibleCount = 0;
 };
 
 enum class RenderLayer : int
@@ -59,13 +204,26 @@ enum class RenderLayer : int
 	Transparent,
 	AlphaTested,
 	AlphaTestedTreeSprites,
+	GpuWaves,
+	OpaqueInstanced,
+	Terrain,
+	Count
+};
+
+// Groups of render layers recorded together on one worker command list.  The
+// lists are submitted in this order, which is also the drawing order.
+enum class DrawPass : int
+{
+	Opaque = 0,		// Opaque, OpaqueInstanced
+	AlphaTested,	// AlphaTested, AlphaTestedTreeSprites
+	Transparent,	// Transparent, GpuWaves
 	Count
 };
 
 class TexWavesApp : public D3DApp
 {
 public:
-    TexWavesApp(HINSTANCE hInstance);
+    TexWavesApp(HINSTANCE hInstance, const std::string& cmdLine);
     TexWavesApp(const TexWavesApp& rhs) = delete;
     TexWavesApp& operator=(const TexWavesApp& rhs) = delete;
     ~TexWavesApp();
@@ -77,9 +235,15 @@ private:
     virtual void Update(const GameTimer& gt)override;
     virtual void Draw(const GameTimer& gt)override;
 
+	virtual std::wstring FrameStatsText()const override;
+	std::vector<std::pair<std::string, std::string>> BenchmarkConfig()const;
+
     virtual void OnMouseDown(WPARAM btnState, int x, int y)override;
     virtual void OnMouseUp(WPARAM btnState, int x, int y)override;
     virtual void OnMouseMove(WPARAM btnState, int x, int y)override;
+	virtual void OnKeyUp(WPARAM key)override;
+
+	void ParseCommandLine(const std::string& cmdLine);
 
     void OnKeyboardInput(const GameTimer& gt);
 	void UpdateCamera(const GameTimer& gt);
@@ -88,58 +252,282 @@ private:
 	void UpdateMaterialCBs(const GameTimer& gt);
 	void UpdateMainPassCB(const GameTimer& gt);
 	void UpdateWaves(const GameTimer& gt); 
+	void UpdateDrawLists();
+	void UpdateFoliage();
+	void UpdateTerrain();
+	void UpdateWaterClipmap();
+	void UpdateInstanceBuffer(const GameTimer& gt);
+	void UpdateWavesGPU(const GameTimer& gt, ID3D12GraphicsCommandList* cmdList);
+	void UpdateTextureStreaming();
+	void UpdateResidency();
 
 	void LoadTextures();
+	void BuildTextureSrv(UINT index, UINT heapIndex);
     void BuildRootSignature();
+	void BuildWavesRootSignature();
+	void BuildCullRootSignatures();
+	void BuildLightCullRootSignature();
+	void BuildUpscaleRootSignature();
 	void BuildDescriptorHeaps();
     void BuildShadersAndInputLayout();
 	void BuildCastleGeometry();
     void BuildLandGeometry();
     void BuildWavesGeometry();
+	void BuildGpuWavesGeometry();
 	void BuildBoxGeometry();
-	void BuildTreeSpritesGeometry();
     void BuildPSOs();
+	void BuildShaderVariants();
+	UINT LayerShaderFeatures(RenderLayer layer)const;
+	ID3D12PipelineState* VariantPipeline(RenderLayer layer, UINT features);
     void BuildFrameResources();
+	void BuildComputeQueue();
     void BuildMaterials();
+	void BuildLights();
     void BuildRenderItems();
-    void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems);
+	void BuildCastleRenderItems();
+	void BuildCastleCopies(UINT firstItem, UINT endItem);
+	void AddPackedRenderItems(const std::vector<ScenePack::Placement>& placements);
+	std::string ScenePackDescription()const;
+	void BakeScenePack(UINT64 key);
+	void BuildInstancedBatches();
+	void BuildIndirectItems();
+	RenderItem* AddRenderItem(std::unique_ptr<RenderItem> ri);
+	Material* AddMaterial(std::unique_ptr<Material> mat);
+	Material* FindMaterial(const std::string& name)const;
+    void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, RenderLayer layer, const std::vector<RenderItem*>& ritems, bool bindless);
+	void DrawInstancedBatches(ID3D12GraphicsCommandList* cmdList);
+	void DrawFoliage(ID3D12GraphicsCommandList* cmdList);
+	void DrawIndirectLayer(ID3D12GraphicsCommandList* cmdList, RenderLayer layer);
+	bool IsDrawnIndirect(int layer)const;
+	void RecordComputePasses(const GameTimer& gt, ID3D12GraphicsCommandList* cmdList);
+	void RecordDrawPass(DrawPass pass, ID3D12GraphicsCommandList* cmdList);
+	D3D12_CPU_DESCRIPTOR_HANDLE SceneRenderTargetView()const;
 
 	std::array<const CD3DX12_STATIC_SAMPLER_DESC, 6> GetStaticSamplers();
 
     float GetHillsHeight(float x, float z)const;
+	float TerrainHeight(float x, float z)const;
     XMFLOAT3 GetHillsNormal(float x, float z)const;
 
 private:
 
+	// Backs the placed resources of every member below, so it is declared first and
+	// destroyed last.
+	std::unique_ptr<GpuAllocator> mGpuAllocator;
+
     std::vector<std::unique_ptr<FrameResource>> mFrameResources;
     FrameResource* mCurrFrameResource = nullptr;
     int mCurrFrameResourceIndex = 0;
 
+	// The wave simulation and the light binning run on mComputeQueue, unless
+	// -noasynccompute.  Each frame's compute list is submitted before its graphics
+	// lists, which wait for mComputeFence on the GPU, so it overlaps what is left of
+	// the previous frame on the direct queue.
+	bool mAsyncCompute = true;
+	ComPtr<ID3D12CommandQueue> mComputeQueue;
+	ComPtr<ID3D12GraphicsCommandList> mComputeCommandList;
+	ComPtr<ID3D12Fence> mComputeFence;
+	UINT64 mCurrentComputeFence = 0;
+
     UINT mCbvSrvDescriptorSize = 0;
 
     ComPtr<ID3D12RootSignature> mRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mWavesRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mCullRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mHiZRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mLightCullRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mUpscaleRootSignature = nullptr;
 
 	ComPtr<ID3D12DescriptorHeap> mSrvDescriptorHeap = nullptr;
 
 	std::unordered_map<std::string, std::unique_ptr<MeshGeometry>> mGeometries;
-	std::unordered_map<std::string, std::unique_ptr<Material>> mMaterials;
+
+	// The meshes and the castle's render items come from mScenePackFile when it matches
+	// the options, and are generated and baked into it otherwise.  -noscenepack always
+	// generates them; -nocpugeometry drops the meshes' CPU copies, which nothing reads.
+	std::wstring mScenePackFile = L"scene.pack";
+	bool mUseScenePack = true;
+	bool mKeepCpuGeometry = true;
+	bool mScenePackLoaded = false;
+	std::vector<ScenePack::Placement> mPackedPlacements;
+
+	// Handles of the castle's render items, copies included, for baking.
+	UINT mCastleItemsBegin = 0;
+	UINT mCastleItemsEnd = 0;
+	// Material handles are their MatCBIndex.  Names are only looked up while building
+	// the scene; per-frame code keeps handles.
+	Registry<Material> mMaterials;
+	std::unordered_map<std::string, Registry<Material>::Handle> mMaterialHandles;
+	Registry<Material>::Handle mWaterMat = 0;
 	std::unordered_map<std::string, std::unique_ptr<Texture>> mTextures;
+
+	// CPU copies of the object and material constants, indexed by ObjCBIndex and
+	// MatCBIndex.  The dirty entries are written here; each frame then copies the
+	// arrays whole into memory from its constant allocator.
+	std::vector<ObjectConstants> mObjectConstants;
+	std::vector<MaterialData> mMaterialData;
+
+	// The diffuse textures load on the copy queue in the background, mip tail first.
+	// Until one is resident, mDiffuseSrvRemap sends its materials to a placeholder
+	// SRV, then to a view of the mip tail; each real SRV is only written once, into a
+	// slot no in-flight frame refers to.
+	std::unique_ptr<StagingRing> mStagingRing;
+	std::unique_ptr<TextureStreamer> mTextureStreamer;
+	std::vector<UINT> mDiffuseSrvRemap;
+	ComPtr<ID3D12Resource> mPlaceholderTex = nullptr;
+
+	// Video memory budget and usage.  Once fully loaded, the diffuse textures are
+	// tracked, created committed for it, so that those nothing visible samples can be
+	// evicted under pressure.  -vidmembudget caps the budget, in MB.
+	std::unique_ptr<ResidencyManager> mResidency;
+	std::vector<UINT> mTextureResidencyIds;
+	UINT mVideoMemoryBudgetMB = 0;
+
+	std::unique_ptr<ShaderCache> mShaderCache;
 	std::unordered_map<std::string, ComPtr<ID3DBlob>> mShaders;
 	std::unordered_map<std::string, ComPtr<ID3D12PipelineState>> mPSOs;
 
+	// The Default.hlsl and TreeSprite.hlsl variants, keyed by ShaderFeature bits.  Each
+	// material of a layer gets the cheapest variant that draws its items the same, see
+	// BuildShaderVariants, and the layer's PSO of that variant, indexed by MatCBIndex;
+	// the PSOs are created from mLayerPsoDescs when first needed.  SortId tells the
+	// layer's PSOs apart in the draw list keys.
+	struct MaterialPipeline
+	{
+		bool Used = false;
+		UINT Features = 0;
+		ID3D12PipelineState* PSO = nullptr;
+		UINT SortId = 0;
+	};
+	std::unique_ptr<ShaderPermutations> mDefaultShaders;
+	std::unique_ptr<ShaderPermutations> mTreeSpriteShaders;
+	std::vector<MaterialPipeline> mMaterialPipelines[(int)RenderLayer::Count];
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC mLayerPsoDescs[(int)RenderLayer::Count];
+
+	// Each layer's variant PSOs in creation order; a SortId is an index into it.
+	std::vector<ID3D12PipelineState*> mLayerPipelines[(int)RenderLayer::Count];
+
+	// -fog: every pass blends in the pass constants' fog.
+	bool mFog = false;
+
+	// Directional lights at the front of the pass constants' lights, set by BuildLights.
+	UINT mDirLightCount = 1;
+
     std::vector<D3D12_INPUT_ELEMENT_DESC> mInputLayout;
-	std::vector<D3D12_INPUT_ELEMENT_DESC> mTreeSpriteInputLayout;
+
+	// -compactvertices: the castle meshes use CompactVertex and mCompactInputLayout.
+	// The Opaque and OpaqueInstanced layers hold nothing else, so only their PSOs change.
+	bool mCompactVertices = false;
+	std::vector<D3D12_INPUT_ELEMENT_DESC> mCompactInputLayout;
  
     RenderItem* mWavesRitem = nullptr;
 
 	// List of all the render items.
-	std::vector<std::unique_ptr<RenderItem>> mAllRitems;
+	Registry<RenderItem> mAllRitems;
 
 	// Render items divided by PSO.
 	std::vector<RenderItem*> mRitemLayer[(int)RenderLayer::Count];
 
+	// mRitemLayer sorted for submission by UpdateDrawLists.  Rebuilt only when
+	// mDrawListsDirty is set (the layers changed) or the camera has moved or turned,
+	// i.e. the view or projection differs from the one they were culled with.
+	std::vector<RenderItem*> mDrawLists[(int)RenderLayer::Count];
+	bool mDrawListsDirty = true;
+	XMFLOAT4X4 mDrawListsView = MathHelper::Identity4x4();
+	XMFLOAT4X4 mDrawListsProj = MathHelper::Identity4x4();
+
+	// Frustum test results of the last draw list rebuild.
+	UINT mVisibleCount = 0;
+	UINT mCulledCount = 0;
+
+	// Batches over mRitemLayer[OpaqueInstanced], in InstanceBuffer order.
+	std::vector<InstancedBatch> mInstancedBatches;
+
+	// -bindless: Default.hlsl fetches the object constants, material and diffuse texture
+	// through indices in root constants, from the frame resource's ObjectCB and
+	// MaterialCB viewed as StructuredBuffers and from a table over the texture SRVs at
+	// the start of the heap.  Cleared at startup without resource binding tier 2.  The
+	// tree sprites stay bound.
+	bool mBindless = false;
+
+	// -gpudriven: the Opaque, AlphaTested and Terrain layers are culled on the GPU and
+	// drawn with one ExecuteIndirect per group of items sharing a layer, a PSO and,
+	// unless bindless, a texture.
+	struct IndirectGroup
+	{
+		RenderLayer Layer;
+		UINT DiffuseSrvHeapIndex;
+		ID3D12PipelineState* PSO;
+	};
+	bool mGpuDriven = false;
+	std::unique_ptr<GpuCulling> mGpuCulling;
+	std::vector<IndirectGroup> mIndirectGroups;
+
+	// GpuCulling item of each terrain tile, in mTerrainRitems order.
+	std::vector<UINT> mTerrainIndirectItems;
+
+	// The point and spot lights, binned into clusters each frame before the draws.
+	std::unique_ptr<ClusteredLighting> mClusteredLighting;
+
+	// -dynres: the passes render offscreen at a scale steered to hold mDynResTargetMs
+	// of GPU time, no lower than mDynResMinScale, then are upscaled to the back buffer.
+	// The depth buffer is shared and its top-left corner used the same way.
+	float mDynResTargetMs = 0.0f;
+	float mDynResMinScale = 0.5f;
+	std::unique_ptr<DynamicResolution> mDynamicResolution;
+
+	// Exactly one of the two wave simulations exists, selected by mUseGpuWaves and
+	// cleared by -cpuwaves.  The GPU one keeps its height fields resident and displaces
+	// the grid in the VS; the CPU one rewrites the frame's wave VB, solved with
+	// mWaveSolver until F3 switches it.
+	bool mUseGpuWaves = true;
+	Waves::Solver mWaveSolver = Waves::Solver::AoS;
 	std::unique_ptr<Waves> mWaves;
 
+	// -syncwaves: the CPU waves step on the main thread, inside the UpdateWaves marker,
+	// instead of on a background job overlapping the frame.
+	bool mAsyncWaves = true;
+
+	// Largest AoS/SoA height difference over gWaveSolverCheckSteps steps, measured on
+	// the waves as the benchmark left them; -1 until then.
+	float mWaveSolverDiff = -1.0f;
+	std::unique_ptr<GpuWaves> mGpuWaves;
+
+	// The land; one render item per tile, whose draw arguments follow the tile's LOD.
+	std::unique_ptr<Terrain> mTerrain;
+	std::vector<RenderItem*> mTerrainRitems;
+
+	// Billboard trees on the hills, drawn in the AlphaTestedTreeSprites layer.
+	std::unique_ptr<Foliage> mFoliage;
+	Material* mTreeMaterial = nullptr;
+	UINT mTreeCount = 100000;
+
+	// Scene scale: castles including the original, and the wave grid's rows and
+	// columns (0 keeps the simulation's default).
+	int mCastleCopies = 1;
+	int mWaveGridSize = 0;
+
+	// Set when -benchmark is given; the run then quits by itself.
+	std::unique_ptr<Benchmark> mBenchmark;
+	UINT mBenchmarkFrames = 0;
+	UINT mBenchmarkSeed = 1;
+	bool mOffscreen = false;
+	std::wstring mCameraPathFile;
+	std::wstring mReportFile = L"benchmark.json";
+
+	// Time of the last random disturbance.
+	float mWavesDisturbTime = 0.0f;
+
+	// CPU markers cover Update/Draw; GPU timestamps bracket each render layer and,
+	// in GPU mode, the wave simulation.  F4 writes the statistics to profile.csv.
+	std::unique_ptr<Profiler> mProfiler;
+	UINT mLayerGpuScopes[(int)RenderLayer::Count];
+	UINT mWavesGpuScope = 0;
+	UINT mCullGpuScope = 0;
+	UINT mHiZGpuScope = 0;
+	UINT mLightCullGpuScope = 0;
+	UINT mUpscaleGpuScope = 0;
+
     PassConstants mMainPassCB;
 
 	XMFLOAT3 mEyePos = { 0.0f, 0.0f, 0.0f };
@@ -165,7 +553,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE prevInstance,
 
     try
     {
-        TexWavesApp theApp(hInstance);
+        TexWavesApp theApp(hInstance, cmdLine);
         if(!theApp.Initialize())
             return 0;
 
@@ -178,15 +566,117 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE prevInstance,
     }
 }
 
-TexWavesApp::TexWavesApp(HINSTANCE hInstance)
+TexWavesApp::TexWavesApp(HINSTANCE hInstance, const std::string& cmdLine)
     : D3DApp(hInstance)
 {
+	ParseCommandLine(cmdLine);
 }
 
 TexWavesApp::~TexWavesApp()
 {
+	// The direct queue waits for every compute submission, so this drains both.
     if(md3dDevice != nullptr)
         FlushCommandQueue();
+
+	gGpuAllocator = nullptr;
+}
+
+// Frame pacing options:
+//   -frames <n>   number of frame resources, i.e. CPU frames in flight (1..8)
+//   -latency <n>  maximum frame latency; enables the waitable swap chain (0 = off)
+//   -vsync <n>    Present sync interval (0 = off)
+//   -tearing      allow tearing when vsync is off and the display supports it
+//   -trees <n>    number of billboard trees scattered over the terrain
+//   -castles <n>  number of castles, the original and copies on the hills around it
+//   -waves <n>    rows and columns of the wave grid
+//   -cpuwaves     simulate the waves on the CPU and upload the grid every frame
+//   -wavesolver <aos|soa>  layout the CPU waves start with; F3 switches it
+//   -syncwaves    step the CPU waves on the main thread rather than a background job
+//   -compactvertices  store the castle meshes as CompactVertex
+//   -scenepack <file> scene pack to load or bake (default scene.pack)
+//   -noscenepack  always generate the meshes
+//   -nocpugeometry    keep no CPU copies of the meshes
+//   -dynres <ms>  scale the scene resolution to hold this GPU frame time
+//   -dynresmin <f>    lowest scale of each axis with -dynres (default 0.5)
+//   -vidmembudget <n> cap the video memory budget at n MB, to try out eviction
+//   -fog          blend the fog of the pass constants into every pass
+//   -noasynccompute   simulate the waves and bin the lights on the direct queue
+// Benchmark options:
+//   -benchmark <n>  measure n frames after a warm-up, write the report and quit; the
+//                   clock steps a fixed 1/60 s per frame and the camera is scripted
+//   -seed <n>       random seed of the scene and the wave disturbances (default 1)
+//   -camera <file>  camera path to follow instead of the default one, see Benchmark.h;
+//                   F5 appends the current camera to camera_path.txt
+//   -report <file>  JSON report to write (default benchmark.json)
+//   -offscreen      render to offscreen textures, without a window
+void TexWavesApp::ParseCommandLine(const std::string& cmdLine)
+{
+	std::istringstream args(cmdLine);
+	std::string arg;
+	while(args >> arg)
+	{
+		int value = 0;
+		float number = 0.0f;
+		std::string text;
+		if(arg == "-frames" && args >> value)
+			gNumFrameResources = MathHelper::Clamp(value, 1, 8);
+		else if(arg == "-latency" && args >> value)
+			mMaxFrameLatency = (UINT)MathHelper::Clamp(value, 0, 16);
+		else if(arg == "-vsync" && args >> value)
+			mSyncInterval = (UINT)MathHelper::Clamp(value, 0, 4);
+		else if(arg == "-tearing")
+			mAllowTearing = true;
+		else if(arg == "-gpudriven")
+			mGpuDriven = true;
+		else if(arg == "-bindless")
+			mBindless = true;
+		else if(arg == "-compactvertices")
+			mCompactVertices = true;
+		else if(arg == "-scenepack" && args >> text)
+			mScenePackFile = AnsiToWString(text);
+		else if(arg == "-noscenepack")
+			mUseScenePack = false;
+		else if(arg == "-nocpugeometry")
+			mKeepCpuGeometry = false;
+		else if(arg == "-dynres" && args >> number)
+			mDynResTargetMs = std::max<float>(number, 0.0f);
+		else if(arg == "-dynresmin" && args >> number)
+			mDynResMinScale = MathHelper::Clamp(number, 0.25f, 1.0f);
+		else if(arg == "-vidmembudget" && args >> value)
+			mVideoMemoryBudgetMB = (UINT)std::max<int>(value, 0);
+		else if(arg == "-fog")
+			mFog = true;
+		else if(arg == "-noasynccompute")
+			mAsyncCompute = false;
+		else if(arg == "-trees" && args >> value)
+			mTreeCount = (UINT)MathHelper::Clamp(value, 0, 1 << 20);
+		else if(arg == "-castles" && args >> value)
+			mCastleCopies = MathHelper::Clamp(value, 1, (2 * gCastleSiteRadius + 1) * (2 * gCastleSiteRadius + 1));
+		else if(arg == "-waves" && args >> value)
+			mWaveGridSize = MathHelper::Clamp(value, 16, 1024);
+		else if(arg == "-cpuwaves")
+			mUseGpuWaves = false;
+		else if(arg == "-wavesolver" && args >> text)
+			mWaveSolver = text == "soa" ? Waves::Solver::SoA : Waves::Solver::AoS;
+		else if(arg == "-syncwaves")
+			mAsyncWaves = false;
+		else if(arg == "-benchmark" && args >> value)
+			mBenchmarkFrames = (UINT)std::max<int>(value, 1);
+		else if(arg == "-seed" && args >> value)
+			mBenchmarkSeed = (UINT)value;
+		else if(arg == "-camera" && args >> text)
+			mCameraPathFile = AnsiToWString(text);
+		else if(arg == "-report" && args >> text)
+			mReportFile = AnsiToWString(text);
+		else if(arg == "-offscreen")
+			mOffscreen = true;
+	}
+
+	if(mBenchmarkFrames > 0)
+	{
+		mHeadless = mOffscreen;
+		mTimer.SetFixedStep(gBenchmarkFrameStep);
+	}
 }
 
 bool TexWavesApp::Initialize()
@@ -194,6 +684,27 @@ bool TexWavesApp::Initialize()
     if(!D3DApp::Initialize())
         return false;
 
+	// Seed before the scene is scattered, so benchmark runs build the same scene.
+	if(mBenchmarkFrames > 0)
+	{
+		srand(mBenchmarkSeed);
+		mBenchmark = std::make_unique<Benchmark>(mBenchmarkFrames, gBenchmarkWarmupFrames);
+
+		std::vector<Benchmark::CameraKey> cameraPath;
+		if(!mCameraPathFile.empty() && Benchmark::LoadCameraPath(mCameraPathFile, cameraPath))
+			mBenchmark->SetCameraPath(cameraPath);
+	}
+
+	// Everything created through the d3dUtil helpers from here on is placed.
+	mGpuAllocator = std::make_unique<GpuAllocator>(md3dDevice.Get());
+	gGpuAllocator = mGpuAllocator.get();
+
+	ComPtr<IDXGIAdapter3> adapter;
+	ThrowIfFailed(mdxgiFactory->EnumAdapterByLuid(md3dDevice->GetAdapterLuid(), IID_PPV_ARGS(&adapter)));
+	mResidency = std::make_unique<ResidencyManager>(md3dDevice.Get(), adapter.Get());
+	mResidency->SetBudgetOverride((UINT64)mVideoMemoryBudgetMB << 20);
+	mTextureResidencyIds.assign(gDiffuseTextureCount, ResidencyManager::InvalidId);
+
     // Reset the command list to prep for initialization commands.
     ThrowIfFailed(mCommandList->Reset(mDirectCmdListAlloc.Get(), nullptr));
 
@@ -201,21 +712,130 @@ bool TexWavesApp::Initialize()
 	// so we have to query this information.
     mCbvSrvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
 
-    mWaves = std::make_unique<Waves>(250, 250, 1.0f, 0.03f, 4.0f, 0.2f);
+	// Dynamically indexing more SRVs than tier 1's 128 per table needs resource binding tier 2.
+	if(mBindless)
+	{
+		D3D12_FEATURE_DATA_D3D12_OPTIONS options = {};
+		ThrowIfFailed(md3dDevice->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options)));
+		mBindless = options.ResourceBindingTier >= D3D12_RESOURCE_BINDING_TIER_2;
+	}
+
+	if(mUseGpuWaves)
+	{
+		int gridSize = mWaveGridSize > 0 ? mWaveGridSize : 256;
+		mGpuWaves = std::make_unique<GpuWaves>(md3dDevice.Get(), mCommandList.Get(),
+			gridSize, gridSize, 1.0f, 0.03f, 4.0f, 0.2f);
+	}
+	else
+	{
+		int gridSize = mWaveGridSize > 0 ? mWaveGridSize : 250;
+		mWaves = std::make_unique<Waves>(gridSize, gridSize, 1.0f, 0.03f, 4.0f, 0.2f);
+		mWaves->SetSolver(mWaveSolver);
+	}
  
+	mShaderCache = std::make_unique<ShaderCache>(md3dDevice.Get(), L"ShaderCache");
+
+	mClusteredLighting = std::make_unique<ClusteredLighting>(md3dDevice.Get(), gMaxLightCount, gNumFrameResources);
+
+	if(mDynResTargetMs > 0.0f)
+		mDynamicResolution = std::make_unique<DynamicResolution>(md3dDevice.Get(), mDynResTargetMs, mDynResMinScale);
+
 	LoadTextures();
+
+	// 16x16 tiles of 64x64 quads.
+	auto terrainHeight = [this](float x, float z) { return TerrainHeight(x, z); };
+	mTerrain = std::make_unique<Terrain>(md3dDevice.Get(), mCommandList.Get(), *mStagingRing,
+		16, 64, 500.0f, terrainHeight);
+
+	// Trees on the terrain above the water, away from the castle.
+	mFoliage = std::make_unique<Foliage>(md3dDevice.Get(), mCommandList.Get(), *mStagingRing,
+		mTreeCount, gFoliageCellsPerSide, 500.0f, gTreeArraySlices, terrainHeight,
+		[terrainHeight](float x, float z)
+		{
+			return terrainHeight(x, z) > 1.0f && (fabsf(x) > 40.0f || fabsf(z) > 40.0f);
+		});
+
     BuildRootSignature();
+	BuildWavesRootSignature();
+	if(mGpuDriven)
+		BuildCullRootSignatures();
+	BuildLightCullRootSignature();
+	if(mDynamicResolution != nullptr)
+		BuildUpscaleRootSignature();
 	BuildDescriptorHeaps();
     BuildShadersAndInputLayout();
-	BuildCastleGeometry();
-    BuildLandGeometry();
-    BuildWavesGeometry();
-	BuildBoxGeometry();
-	BuildTreeSpritesGeometry();
 	BuildMaterials();
+
+	// A current scene pack replaces the mesh generation with one mapped upload.  One
+	// that does not check out against the materials and the geometries BuildRenderItems
+	// uses is rebaked, like a stale one.
+	UINT64 scenePackKey = ScenePack::HashKey(ScenePackDescription());
+	if(mUseScenePack)
+	{
+		std::vector<std::string> materialNames;
+		for(auto& e : mMaterialHandles)
+			materialNames.push_back(e.first);
+
+		ScenePack pack;
+		if(pack.Open(mScenePackFile, scenePackKey, (UINT)RenderLayer::Count, materialNames, { "landGeo", "waterGeo" }))
+		{
+			for(auto& geo : pack.CreateGeometries(md3dDevice.Get(), mCommandList.Get(), *mStagingRing, mKeepCpuGeometry))
+				mGeometries[geo->Name] = std::move(geo);
+			mPackedPlacements = pack.Placements();
+			mScenePackLoaded = true;
+		}
+	}
+	if(!mScenePackLoaded)
+	{
+		BuildCastleGeometry();
+		BuildLandGeometry();
+		if(mUseGpuWaves)
+			BuildGpuWavesGeometry();
+		else
+			BuildWavesGeometry();
+		BuildBoxGeometry();
+	}
+	BuildLights();
     BuildRenderItems();
+
+	if(mUseScenePack && !mScenePackLoaded)
+		BakeScenePack(scenePackKey);
+	if(!mKeepCpuGeometry)
+	{
+		for(auto& e : mGeometries)
+		{
+			e.second->VertexBufferCPU = nullptr;
+			e.second->IndexBufferCPU = nullptr;
+		}
+	}
+	BuildInstancedBatches();
     BuildFrameResources();
+	if(mAsyncCompute)
+		BuildComputeQueue();
+	BuildShaderVariants();
     BuildPSOs();
+	if(mGpuDriven)
+		BuildIndirectItems();
+	mShaderCache->SavePipelineLibrary();
+
+	// A benchmark keeps the samples of the whole measured run.
+	mProfiler = std::make_unique<Profiler>(md3dDevice.Get(), mCommandQueue.Get(), gNumFrameResources,
+		16, std::max<UINT>(Profiler::HistoryLength, mBenchmarkFrames));
+	const char* layerNames[] = { "Opaque", "Transparent", "AlphaTested", "AlphaTestedTreeSprites", "GpuWaves", "OpaqueInstanced", "Terrain" };
+	static_assert(_countof(layerNames) == (int)RenderLayer::Count, "one name per RenderLayer");
+	for(int i = 0; i < (int)RenderLayer::Count; ++i)
+		mLayerGpuScopes[i] = mProfiler->RegisterGpuScope(layerNames[i]);
+	ID3D12CommandQueue* computeQueue = mAsyncCompute ? mComputeQueue.Get() : nullptr;
+	mLightCullGpuScope = mProfiler->RegisterGpuScope("LightCulling", computeQueue);
+	if(mUseGpuWaves)
+		mWavesGpuScope = mProfiler->RegisterGpuScope("WavesSimulation", computeQueue);
+	if(mGpuDriven)
+	{
+		mCullGpuScope = mProfiler->RegisterGpuScope("GpuCulling");
+		mHiZGpuScope = mProfiler->RegisterGpuScope("HiZ");
+	}
+	if(mDynamicResolution != nullptr)
+		mUpscaleGpuScope = mProfiler->RegisterGpuScope("Upscale");
 
     // Execute the initialization commands.
     ThrowIfFailed(mCommandList->Close());
@@ -224,6 +844,15 @@ bool TexWavesApp::Initialize()
 
     // Wait until initialization is complete.
     FlushCommandQueue();
+	mStagingRing->Submitted(mCommandList.Get(), mFence.Get(), mCurrentFence);
+	mStagingRing->Reclaim();
+
+	// Start streaming only now, so the uploads do not queue behind the
+	// initialization commands' share of the staging ring.  The streamed textures are
+	// committed so they can be evicted one by one.
+	mGpuAllocator->SetTexturesCommitted(true);
+	for(UINT i = 0; i < gDiffuseTextureCount; ++i)
+		mTextureStreamer->Load(mTextures[gDiffuseTextures[i].Name].get());
 
     return true;
 }
@@ -235,10 +864,26 @@ void TexWavesApp::OnResize()
     // The window resized, so update the aspect ratio and recompute the projection matrix.
     XMMATRIX P = XMMatrixPerspectiveFovLH(0.25f*MathHelper::Pi, AspectRatio(), 1.0f, 1000.0f);
     XMStoreFloat4x4(&mProj, P);
+
+	// The frustum changed, so the culling results are stale.
+	mDrawListsDirty = true;
+
+	// The depth buffer was recreated.  Before Initialize, BuildIndirectItems does this.
+	if(mGpuCulling != nullptr)
+		mGpuCulling->OnResize(mDepthStencilBuffer.Get(), mClientWidth, mClientHeight, m4xMsaaState);
+
+	// The scene target follows the back buffers.  Before Initialize, BuildDescriptorHeaps does this.
+	if(mDynamicResolution != nullptr)
+	{
+		mDynamicResolution->OnResize(mClientWidth, mClientHeight, mBackBufferFormat,
+			m4xMsaaState ? 4 : 1, m4xMsaaState ? (m4xMsaaQuality - 1) : 0, gClearColor);
+	}
 }
 
 void TexWavesApp::Update(const GameTimer& gt)
 {
+	Profiler::ScopedCpu marker(*mProfiler, "Update");
+
     OnKeyboardInput(gt);
 	UpdateCamera(gt);
 
@@ -250,21 +895,69 @@ void TexWavesApp::Update(const GameTimer& gt)
     // If not, wait until the GPU has completed commands up to this fence point.
     if(mCurrFrameResource->Fence != 0 && mFence->GetCompletedValue() < mCurrFrameResource->Fence)
     {
-        HANDLE eventHandle = CreateEventEx(nullptr, nullptr, false, EVENT_ALL_ACCESS);
-        ThrowIfFailed(mFence->SetEventOnCompletion(mCurrFrameResource->Fence, eventHandle));
-        WaitForSingleObject(eventHandle, INFINITE);
-        CloseHandle(eventHandle);
+        ThrowIfFailed(mFence->SetEventOnCompletion(mCurrFrameResource->Fence, mCurrFrameResource->FenceEvent));
+        WaitForSingleObject(mCurrFrameResource->FenceEvent, INFINITE);
     }
 
+	// The GPU is done with this frame resource, so its timestamps can be read and its
+	// constants reused.
+	mProfiler->BeginFrame(mCurrFrameResourceIndex);
+	mCurrFrameResource->Constants->Reset();
+
+	// Rescale from the frame just collected, before the pass constants record the size.
+	if(mDynamicResolution != nullptr)
+		mDynamicResolution->Update(mProfiler->GpuTotalLastMs());
+
+	UpdateTextureStreaming();
 	AnimateMaterials(gt);
+	if(mUseGpuWaves)
+		UpdateWaterClipmap();
 	UpdateObjectCBs(gt);
 	UpdateMaterialCBs(gt);
 	UpdateMainPassCB(gt);
-    UpdateWaves(gt);
+	UpdateTerrain();
+	UpdateDrawLists();
+	UpdateFoliage();
+	UpdateResidency();
+	UpdateInstanceBuffer(gt);
+	if(!mUseGpuWaves)
+		UpdateWaves(gt);
 }
 
 void TexWavesApp::Draw(const GameTimer& gt)
 {
+	Profiler::ScopedCpu marker(*mProfiler, "Draw");
+
+	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
+
+	// Submit the frame's compute work first.  The GPU starts it as soon as the queue is
+	// free, typically while the previous frame is still rasterizing.
+	if(mAsyncCompute)
+	{
+		auto computeAlloc = mCurrFrameResource->ComputeCmdListAlloc;
+		ThrowIfFailed(computeAlloc->Reset());
+		ThrowIfFailed(mComputeCommandList->Reset(computeAlloc.Get(), nullptr));
+		mComputeCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+		RecordComputePasses(gt, mComputeCommandList.Get());
+		ThrowIfFailed(mComputeCommandList->Close());
+
+		// A wave step overwrites the solution drawn three frames ago.  Update only
+		// waited for the frame gNumFrameResources ago, so with more frame resources
+		// the compute queue waits for that frame's fence itself.
+		if(mUseGpuWaves && gNumFrameResources > 3)
+		{
+			int drawnIndex = (mCurrFrameResourceIndex + gNumFrameResources - 3) % gNumFrameResources;
+			mComputeQueue->Wait(mFence.Get(), mFrameResources[drawnIndex]->Fence);
+		}
+
+		ID3D12CommandList* computeLists[] = { mComputeCommandList.Get() };
+		mComputeQueue->ExecuteCommandLists(_countof(computeLists), computeLists);
+		mComputeQueue->Signal(mComputeFence.Get(), ++mCurrentComputeFence);
+
+		// The draws read the waves and the light lists.
+		mCommandQueue->Wait(mComputeFence.Get(), mCurrentComputeFence);
+	}
+
     auto cmdListAlloc = mCurrFrameResource->CmdListAlloc;
 
     // Reuse the memory associated with command recording.
@@ -273,81 +966,310 @@ void TexWavesApp::Draw(const GameTimer& gt)
 
     // A command list can be reset after it has been added to the command queue via ExecuteCommandList.
     // Reusing the command list reuses memory.
-    ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), mPSOs["opaque"].Get()));
+    ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), nullptr));
 
-    mCommandList->RSSetViewports(1, &mScreenViewport);
-    mCommandList->RSSetScissorRects(1, &mScissorRect);
+	mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+
+	if(!mAsyncCompute)
+		RecordComputePasses(gt, mCommandList.Get());
+
+	// Build this frame's indirect arguments before any pass consumes them.  This stays
+	// on the direct queue: it tests against the Hi-Z of the previous frame's depth.
+	if(mGpuDriven)
+	{
+		// Only read by the bound commands; the bindless ones carry indices.
+		UINT objCBByteSize = sizeof(ObjectConstants);
+		UINT matCBByteSize = sizeof(MaterialData);
+
+		XMFLOAT4X4 viewProj;
+		XMStoreFloat4x4(&viewProj, XMMatrixMultiply(XMLoadFloat4x4(&mView), XMLoadFloat4x4(&mProj)));
+
+		mProfiler->BeginGpu(mCommandList.Get(), mCullGpuScope);
+		mGpuCulling->Cull(mCommandList.Get(), mCurrFrameResourceIndex,
+			mCullRootSignature.Get(), mPSOs["gpuCull"].Get(),
+			mCurrFrameResource->ObjectCB, objCBByteSize,
+			mCurrFrameResource->MaterialCB, matCBByteSize,
+			viewProj, true);
+		mProfiler->EndGpu(mCommandList.Get(), mCullGpuScope);
+	}
 
     // Indicate a state transition on the resource usage.
 	mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
 		D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET));
 
-    // Clear the back buffer and depth buffer.
-	const XMVECTORF32 color = { {{1.0f, 0.32f, 0.32f, 1.0f}} };
-    mCommandList->ClearRenderTargetView(CurrentBackBufferView(), color, 0, nullptr);
+    // Clear the scene target and depth buffer.  With dynamic resolution the upscale
+    // covers the whole back buffer, which is then not cleared.
+    mCommandList->ClearRenderTargetView(SceneRenderTargetView(), gClearColor, 0, nullptr);
     mCommandList->ClearDepthStencilView(DepthStencilView(), D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 0, nullptr);
 
-    // Specify the buffers we are going to render to.
-    mCommandList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &DepthStencilView());
+    // Done recording the setup commands.
+    ThrowIfFailed(mCommandList->Close());
 
-	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
-	mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+	// Record the render layers on the worker command lists in parallel.  Each pass
+	// only reads the app state, which is not modified until after the join.
+	concurrency::parallel_for(0, (int)DrawPass::Count, [&](int pass)
+	{
+		RecordDrawPass((DrawPass)pass, mCurrFrameResource->WorkerCmdLists[pass].Get());
+	});
 
-	mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+    // Submit the setup list and the passes in order, in a single call.
+	std::vector<ID3D12CommandList*> cmdsLists = { mCommandList.Get() };
+	for(auto& cmdList : mCurrFrameResource->WorkerCmdLists)
+		cmdsLists.push_back(cmdList.Get());
+    mCommandQueue->ExecuteCommandLists((UINT)cmdsLists.size(), cmdsLists.data());
 
-	auto passCB = mCurrFrameResource->PassCB->Resource();
-	mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
+    // Swap the back and front buffers
+	PresentBackBuffer();
 
-    DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
+    // Advance the fence value to mark commands up to this fence point.
+    mCurrFrameResource->Fence = ++mCurrentFence;
 
-	//////
-	//step 2
-	mCommandList->SetPipelineState(mPSOs["alphaTested"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::AlphaTested]);
+    // Add an instruction to the command queue to set a new fence point. 
+    // Because we are on the GPU timeline, the new fence point won't be 
+    // set until the GPU finishes processing all the commands prior to this Signal().
+    mCommandQueue->Signal(mFence.Get(), mCurrentFence);
 
-	mCommandList->SetPipelineState(mPSOs["treeSprites"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::AlphaTestedTreeSprites]);
+	mProfiler->EndFrame();
 
-	//when you draw, you can set the blend factor that modulate values for a pixel shader, render target, or both.
-	//You could also use the following blend factor when you set your blend to D3D12_BLEND_BLEND_FACTOR in PSO like following:	
-	//transparencyBlendDesc.SrcBlend = D3D12_BLEND_BLEND_FACTOR;
-	//transparencyBlendDesc.DestBlend = D3D12_BLEND_INV_BLEND_FACTOR;
-	//and then we set the blend factor here!
+	if(mBenchmark != nullptr && mBenchmark->EndFrame(*mProfiler))
+	{
+		if(mWaves != nullptr)
+			mWaveSolverDiff = mWaves->CompareSolvers(gWaveSolverCheckSteps);
 
-	//float blendFactor[4] = { 0.9f, 0.9f, 0.9f, 1.f };  //change that water to high opacity
-	//float blendFactor[4] = { 0.3f, 0.3f, 0.3f, 1.f };  //change the water to high transparency
-	//mCommandList->OMSetBlendFactor(blendFactor);
+		bool written = mBenchmark->WriteReport(mReportFile, *mProfiler, BenchmarkConfig());
+		PostQuitMessage(written ? 0 : 1);
+	}
+}
 
-	mCommandList->SetPipelineState(mPSOs["transparent"].Get());
-	DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Transparent]);
-	//////
+// Records one DrawPass into cmdList, using the frame resource's allocator of the
+// same index.  Called from worker threads, so PSOs are looked up with find() only.
+// The work the draws wait for that needs nothing drawn this frame, so it may run on
+// the compute queue.
+void TexWavesApp::RecordComputePasses(const GameTimer& gt, ID3D12GraphicsCommandList* cmdList)
+{
+	// Run the wave simulation on the compute pipeline before any drawing reads it.
+	if(mUseGpuWaves)
+	{
+		mProfiler->BeginGpu(cmdList, mWavesGpuScope);
+		UpdateWavesGPU(gt, cmdList);
+		mProfiler->EndGpu(cmdList, mWavesGpuScope);
+	}
 
+	// Bin the lights for this frame's camera.
+	mProfiler->BeginGpu(cmdList, mLightCullGpuScope);
+	mClusteredLighting->Cull(cmdList, mCurrFrameResourceIndex, *mCurrFrameResource->Constants,
+		mLightCullRootSignature.Get(), mPSOs["lightCull"].Get(),
+		mView, mProj, mMainPassCB.NearZ, mMainPassCB.FarZ);
+	mProfiler->EndGpu(cmdList, mLightCullGpuScope);
+}
 
+void TexWavesApp::RecordDrawPass(DrawPass pass, ID3D12GraphicsCommandList* cmdList)
+{
+	auto cmdListAlloc = mCurrFrameResource->WorkerCmdListAllocs[(int)pass];
+	ThrowIfFailed(cmdListAlloc->Reset());
 
+	auto pso = [this](const char* name) { return mPSOs.find(name)->second.Get(); };
 
+	ThrowIfFailed(cmdList->Reset(cmdListAlloc.Get(), nullptr));
 
-    // Indicate a state transition on the resource usage.
-	mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
-		D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
+	// Nothing but the resource states carries over between command lists.
+	ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
+	cmdList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
 
-    // Done recording commands.
-    ThrowIfFailed(mCommandList->Close());
+	D3D12_VIEWPORT viewport = mDynamicResolution != nullptr ? mDynamicResolution->Viewport() : mScreenViewport;
+	D3D12_RECT scissorRect = mDynamicResolution != nullptr ? mDynamicResolution->ScissorRect() : mScissorRect;
+	cmdList->RSSetViewports(1, &viewport);
+	cmdList->RSSetScissorRects(1, &scissorRect);
 
-    // Add the command list to the queue for execution.
-    ID3D12CommandList* cmdsLists[] = { mCommandList.Get() };
-    mCommandQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
+	D3D12_CPU_DESCRIPTOR_HANDLE sceneView = SceneRenderTargetView();
+	D3D12_CPU_DESCRIPTOR_HANDLE depthStencilView = DepthStencilView();
+	cmdList->OMSetRenderTargets(1, &sceneView, true, &depthStencilView);
 
-    // Swap the back and front buffers
-    ThrowIfFailed(mSwapChain->Present(0, 0));
-	mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
+	cmdList->SetGraphicsRootSignature(mRootSignature.Get());
 
-    // Advance the fence value to mark commands up to this fence point.
-    mCurrFrameResource->Fence = ++mCurrentFence;
+	cmdList->SetGraphicsRootConstantBufferView(2, mCurrFrameResource->PassCB);
+	cmdList->SetGraphicsRootShaderResourceView(7, mClusteredLighting->LightBuffer(mCurrFrameResourceIndex));
+	cmdList->SetGraphicsRootShaderResourceView(8, mClusteredLighting->ClusterBuffer(mCurrFrameResourceIndex));
 
-    // Add an instruction to the command queue to set a new fence point. 
-    // Because we are on the GPU timeline, the new fence point won't be 
-    // set until the GPU finishes processing all the commands prior to this Signal().
-    mCommandQueue->Signal(mFence.Get(), mCurrentFence);
+	// The bindless draws only change root constants.
+	if(mBindless)
+	{
+		cmdList->SetGraphicsRootShaderResourceView(10, mCurrFrameResource->ObjectCB);
+		cmdList->SetGraphicsRootShaderResourceView(11, mCurrFrameResource->MaterialCB);
+		cmdList->SetGraphicsRootDescriptorTable(12, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+	}
+
+	// Draws a layer, bracketed by the layer's timestamps.  The Default.hlsl layers set
+	// the PSO of each material's variant.
+	auto drawLayer = [&](RenderLayer layer)
+	{
+		mProfiler->BeginGpu(cmdList, mLayerGpuScopes[(int)layer]);
+		if(layer == RenderLayer::OpaqueInstanced)
+			DrawInstancedBatches(cmdList);
+		else if(layer == RenderLayer::AlphaTestedTreeSprites)
+			DrawFoliage(cmdList);
+		else if(IsDrawnIndirect((int)layer))
+			DrawIndirectLayer(cmdList, layer);
+		else
+			DrawRenderItems(cmdList, layer, mDrawLists[(int)layer], mBindless);
+		mProfiler->EndGpu(cmdList, mLayerGpuScopes[(int)layer]);
+	};
+
+	switch(pass)
+	{
+	case DrawPass::Opaque:
+		drawLayer(RenderLayer::Opaque);
+		drawLayer(RenderLayer::OpaqueInstanced);
+		cmdList->SetGraphicsRootDescriptorTable(4, mTerrain->HeightMap());
+		drawLayer(RenderLayer::Terrain);
+		break;
+
+	case DrawPass::AlphaTested:
+		drawLayer(RenderLayer::AlphaTested);
+		cmdList->SetPipelineState(pso("treeSprites"));
+		drawLayer(RenderLayer::AlphaTestedTreeSprites);
+		break;
+
+	case DrawPass::Transparent:
+		//when you draw, you can set the blend factor that modulate values for a pixel shader, render target, or both.
+		//You could also use the following blend factor when you set your blend to D3D12_BLEND_BLEND_FACTOR in PSO like following:	
+		//transparencyBlendDesc.SrcBlend = D3D12_BLEND_BLEND_FACTOR;
+		//transparencyBlendDesc.DestBlend = D3D12_BLEND_INV_BLEND_FACTOR;
+		//and then we set the blend factor here!
+
+		//float blendFactor[4] = { 0.9f, 0.9f, 0.9f, 1.f };  //change that water to high opacity
+		//float blendFactor[4] = { 0.3f, 0.3f, 0.3f, 1.f };  //change the water to high transparency
+		//cmdList->OMSetBlendFactor(blendFactor);
+
+		drawLayer(RenderLayer::Transparent);
+
+		// Bracketed even when empty: every GPU scope is resolved every frame.
+		mProfiler->BeginGpu(cmdList, mLayerGpuScopes[(int)RenderLayer::GpuWaves]);
+		if(mUseGpuWaves)
+		{
+			cmdList->SetGraphicsRootDescriptorTable(4, mGpuWaves->DisplacementMap());
+			DrawRenderItems(cmdList, RenderLayer::GpuWaves, mDrawLists[(int)RenderLayer::GpuWaves], mBindless);
+		}
+		mProfiler->EndGpu(cmdList, mLayerGpuScopes[(int)RenderLayer::GpuWaves]);
+		break;
+	}
+
+	// The last pass hands the back buffer to Present and, being submitted last,
+	// resolves the frame's timestamps.
+	if((int)pass == (int)DrawPass::Count - 1)
+	{
+		// Every depth writer has been recorded by now; next frame occludes against it.
+		if(mGpuDriven)
+		{
+			// A scaled viewport covers only the depth buffer's top-left corner, so the
+			// pyramid's uvs are scaled towards it: ndc' = s * ndc + (s - 1, 1 - s).
+			XMMATRIX toViewport = XMMatrixIdentity();
+			if(mDynamicResolution != nullptr)
+			{
+				float sx = viewport.Width / mClientWidth;
+				float sy = viewport.Height / mClientHeight;
+				toViewport = XMMATRIX(
+					sx, 0.0f, 0.0f, 0.0f,
+					0.0f, sy, 0.0f, 0.0f,
+					0.0f, 0.0f, 1.0f, 0.0f,
+					sx - 1.0f, 1.0f - sy, 0.0f, 1.0f);
+			}
+
+			XMFLOAT4X4 viewProj;
+			XMStoreFloat4x4(&viewProj, XMLoadFloat4x4(&mView) * XMLoadFloat4x4(&mProj) * toViewport);
+
+			mProfiler->BeginGpu(cmdList, mHiZGpuScope);
+			mGpuCulling->BuildHiZ(cmdList, mHiZRootSignature.Get(),
+				pso(m4xMsaaState ? "hiZDepthMS" : "hiZDepth"), pso("hiZDownsample"), viewProj);
+			mProfiler->EndGpu(cmdList, mHiZGpuScope);
+		}
+
+		if(mDynamicResolution != nullptr)
+		{
+			mProfiler->BeginGpu(cmdList, mUpscaleGpuScope);
+			mDynamicResolution->Upscale(cmdList, mUpscaleRootSignature.Get(), pso("upscale"),
+				CurrentBackBufferView(), mScreenViewport, mScissorRect);
+			mProfiler->EndGpu(cmdList, mUpscaleGpuScope);
+		}
+
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
+			D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
+
+		mProfiler->ResolveGpu(cmdList);
+	}
+
+	ThrowIfFailed(cmdList->Close());
+}
+
+// Where the passes draw: the dynamic resolution target, or else the back buffer.
+D3D12_CPU_DESCRIPTOR_HANDLE TexWavesApp::SceneRenderTargetView()const
+{
+	return mDynamicResolution != nullptr ? mDynamicResolution->RenderTargetView() : CurrentBackBufferView();
+}
+
+std::wstring TexWavesApp::FrameStatsText()const
+{
+	std::wstring text = L"   visible: " + std::to_wstring(mVisibleCount) +
+		L"   culled: " + std::to_wstring(mCulledCount) +
+		L"   trees: " + std::to_wstring(mFoliage->VisibleTreeCount()) + L"/" + std::to_wstring(mFoliage->TreeCount()) +
+		L"   gpu ms: " + std::to_wstring(mProfiler->GpuTotalAvgMs());
+
+	// The GPU-culled items are not in the counts above.
+	if(mGpuDriven)
+		text += L"   gpu-driven: " + std::to_wstring(mGpuCulling->ItemCount());
+
+	if(mDynamicResolution != nullptr)
+		text += L"   res: " + std::to_wstring((int)(100.0f * mDynamicResolution->Scale() + 0.5f)) + L"%";
+
+	GpuAllocator::Stats mem = mGpuAllocator->GetStats();
+	text += L"   heaps: " + std::to_wstring(mem.HeapCount) +
+		L" (" + std::to_wstring(mem.AllocatedBytes >> 20) + L"/" + std::to_wstring(mem.ReservedBytes >> 20) + L" MB)" +
+		L"   frag: " + std::to_wstring((int)(100.0f * mem.ExternalFragmentation())) + L"%" +
+		L"   tex/buf/upload: " + std::to_wstring(mem.TextureBytes >> 20) + L"/" + std::to_wstring(mem.BufferBytes >> 20) +
+		L"/" + std::to_wstring(mem.UploadBytes >> 20) + L" MB";
+
+	ResidencyManager::Stats vram = mResidency->GetStats();
+	text += L"   vram: " + std::to_wstring(vram.LocalUsage >> 20) + L"/" + std::to_wstring(vram.LocalBudget >> 20) + L" MB" +
+		L"   shared: " + std::to_wstring(vram.NonLocalUsage >> 20) + L"/" + std::to_wstring(vram.NonLocalBudget >> 20) + L" MB";
+	if(vram.EvictedCount > 0)
+		text += L"   evicted: " + std::to_wstring(vram.EvictedCount) + L" (" + std::to_wstring(vram.EvictedBytes >> 20) + L" MB)";
+
+	return text;
+}
+
+// What the benchmark report records about the run, as JSON values.
+std::vector<std::pair<std::string, std::string>> TexWavesApp::BenchmarkConfig()const
+{
+	auto flag = [](bool b) { return std::string(b ? "true" : "false"); };
+	int waveGrid = mUseGpuWaves ? mGpuWaves->RowCount() : mWaves->RowCount();
+
+	return
+	{
+		{ "frames", std::to_string(mBenchmark->FrameCount()) },
+		{ "warmup_frames", std::to_string(mBenchmark->WarmupFrames()) },
+		{ "seed", std::to_string(mBenchmarkSeed) },
+		{ "offscreen", flag(mHeadless) },
+		{ "width", std::to_string(mClientWidth) },
+		{ "height", std::to_string(mClientHeight) },
+		{ "castles", std::to_string(mCastleCopies) },
+		{ "wave_grid", std::to_string(waveGrid) },
+		{ "trees", std::to_string(mFoliage->TreeCount()) },
+		{ "gpu_waves", flag(mUseGpuWaves) },
+		{ "wave_solver", mWaves == nullptr ? "gpu" : mWaves->GetSolver() == Waves::Solver::SoA ? "soa" : "aos" },
+		{ "wave_solver_max_diff", std::to_string(mWaveSolverDiff) },
+		{ "async_waves", flag(mWaves != nullptr && mAsyncWaves) },
+		{ "gpu_driven", flag(mGpuDriven) },
+		{ "bindless", flag(mBindless) },
+		{ "compact_vertices", flag(mCompactVertices) },
+		{ "fog", flag(mFog) },
+		{ "async_compute", flag(mAsyncCompute) },
+		{ "shader_variants", std::to_string(mDefaultShaders->VariantCount()) },
+		{ "scene_pack", flag(mScenePackLoaded) },
+		{ "dynres_target_ms", std::to_string(mDynResTargetMs) },
+		{ "dynres_min_scale", std::to_string(mDynamicResolution != nullptr ? mDynResMinScale : 1.0f) },
+		{ "video_memory_budget_mb", std::to_string(mResidency->GetStats().LocalBudget >> 20) },
+		{ "frame_resources", std::to_string(gNumFrameResources) },
+	};
 }
 
 void TexWavesApp::OnMouseDown(WPARAM btnState, int x, int y)
@@ -395,20 +1317,48 @@ void TexWavesApp::OnMouseMove(WPARAM btnState, int x, int y)
     mLastMousePos.y = y;
 }
  
+void TexWavesApp::OnKeyUp(WPARAM key)
+{
+	// F3 flips the CPU wave solver between the AoS and SIMD SoA layouts.
+	if(key == VK_F3 && mWaves != nullptr)
+	{
+		mWaves->SetSolver(mWaves->GetSolver() == Waves::Solver::AoS ?
+			Waves::Solver::SoA : Waves::Solver::AoS);
+	}
+
+	// F4 dumps the rolling profiler statistics.
+	if(key == VK_F4 && mProfiler != nullptr)
+		mProfiler->WriteCsv(L"profile.csv");
+
+	// F5 records the camera as the next key of a benchmark camera path.
+	if(key == VK_F5)
+		Benchmark::AppendCameraKey(L"camera_path.txt", { mEyePos, XMFLOAT3(0.0f, 0.0f, 0.0f) });
+}
+
 void TexWavesApp::OnKeyboardInput(const GameTimer& gt)
 {
 }
  
 void TexWavesApp::UpdateCamera(const GameTimer& gt)
 {
-	// Convert Spherical to Cartesian coordinates.
-	mEyePos.x = mRadius*sinf(mPhi)*cosf(mTheta);
-	mEyePos.z = mRadius*sinf(mPhi)*sinf(mTheta);
-	mEyePos.y = mRadius*cosf(mPhi);
+	XMVECTOR target = XMVectorZero();
+	if(mBenchmark != nullptr)
+	{
+		// The scripted camera replaces the mouse-driven orbit.
+		Benchmark::CameraKey camera = mBenchmark->Camera();
+		mEyePos = camera.EyePos;
+		target = XMLoadFloat3(&camera.Target);
+	}
+	else
+	{
+		// Convert Spherical to Cartesian coordinates.
+		mEyePos.x = mRadius*sinf(mPhi)*cosf(mTheta);
+		mEyePos.z = mRadius*sinf(mPhi)*sinf(mTheta);
+		mEyePos.y = mRadius*cosf(mPhi);
+	}
 
 	// Build the view matrix.
 	XMVECTOR pos = XMVectorSet(mEyePos.x, mEyePos.y, mEyePos.z, 1.0f);
-	XMVECTOR target = XMVectorZero();
 	XMVECTOR up = XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
 
 	XMMATRIX view = XMMatrixLookAtLH(pos, target, up);
@@ -418,7 +1368,7 @@ void TexWavesApp::UpdateCamera(const GameTimer& gt)
 void TexWavesApp::AnimateMaterials(const GameTimer& gt)
 {
 	// Scroll the water material texture coordinates.
-	auto waterMat = mMaterials["water"].get();
+	auto waterMat = mMaterials.Get(mWaterMat);
 
 	float& tu = waterMat->MatTransform(3, 0);
 	float& tv = waterMat->MatTransform(3, 1);
@@ -436,59 +1386,82 @@ void TexWavesApp::AnimateMaterials(const GameTimer& gt)
 	waterMat->MatTransform(3, 1) = tv;
 
 	// Material has changed, so need to update cbuffer.
-	waterMat->NumFramesDirty = gNumFrameResources;
+	mMaterials.MarkDirty(mWaterMat);
 }
 
 void TexWavesApp::UpdateObjectCBs(const GameTimer& gt)
 {
-	auto currObjectCB = mCurrFrameResource->ObjectCB.get();
-	for(auto& e : mAllRitems)
-	{
-		// Only update the cbuffer data if the constants have changed.  
-		// This needs to be tracked per frame resource.
-		if(e->NumFramesDirty > 0)
-		{
-			XMMATRIX world = XMLoadFloat4x4(&e->World);
-			XMMATRIX texTransform = XMLoadFloat4x4(&e->TexTransform);
-
-			ObjectConstants objConstants;
-			XMStoreFloat4x4(&objConstants.World, XMMatrixTranspose(world));
-			XMStoreFloat4x4(&objConstants.TexTransform, XMMatrixTranspose(texTransform));
+	Profiler::ScopedCpu marker(*mProfiler, "UpdateObjectCBs");
 
-			currObjectCB->CopyData(e->ObjCBIndex, objConstants);
+	// Render items added since the last frame get their slots here.
+	if(mObjectConstants.size() < mAllRitems.Size())
+		mObjectConstants.resize(mAllRitems.Size());
 
-			// Next FrameResource need to be updated too.
-			e->NumFramesDirty--;
-		}
-	}
+	// Only update the constants that have changed.
+	mAllRitems.FlushDirty([this](UINT handle, const RenderItem& e)
+	{
+		XMMATRIX world = XMLoadFloat4x4(&e.World);
+		XMMATRIX texTransform = XMLoadFloat4x4(&e.TexTransform);
+
+		ObjectConstants& objConstants = mObjectConstants[handle];
+		XMStoreFloat4x4(&objConstants.World, XMMatrixTranspose(world));
+		XMStoreFloat4x4(&objConstants.TexTransform, XMMatrixTranspose(texTransform));
+		objConstants.DisplacementMapTexelSize = e.DisplacementMapTexelSize;
+		objConstants.GridSpatialStep = e.GridSpatialStep;
+		objConstants.Pad = 0.0f;
+	});
+
+	UINT64 byteSize = mObjectConstants.size() * sizeof(ObjectConstants);
+	auto objectCB = mCurrFrameResource->Constants->Allocate(byteSize);
+	memcpy(objectCB.CpuAddress, mObjectConstants.data(), byteSize);
+	mCurrFrameResource->ObjectCB = objectCB.GpuAddress;
 }
 
-void TexWavesApp::UpdateMaterialCBs(const GameTimer& gt)
+// Packs the visible instances of each batch; rewritten every frame because the
+// visible set depends on the camera.
+void TexWavesApp::UpdateInstanceBuffer(const GameTimer& gt)
 {
-	auto currMaterialCB = mCurrFrameResource->MaterialCB.get();
-	for(auto& e : mMaterials)
+	auto currInstanceBuffer = mCurrFrameResource->InstanceBuffer.get();
+	for(auto& b : mInstancedBatches)
 	{
-		// Only update the cbuffer data if the constants have changed.  If the cbuffer
-		// data changes, it needs to be updated for each FrameResource.
-		Material* mat = e.second.get();
-		if(mat->NumFramesDirty > 0)
+		b.VisibleCount = 0;
+		for(auto ri : b.Instances)
 		{
-			XMMATRIX matTransform = XMLoadFloat4x4(&mat->MatTransform);
-
-			MaterialConstants matConstants;
-			matConstants.DiffuseAlbedo = mat->DiffuseAlbedo;
-			matConstants.FresnelR0 = mat->FresnelR0;
-			matConstants.Roughness = mat->Roughness;
-			XMStoreFloat4x4(&matConstants.MatTransform, XMMatrixTranspose(matTransform));
+			if(!ri->Visible)
+				continue;
 
-			currMaterialCB->CopyData(mat->MatCBIndex, matConstants);
-
-			// Next FrameResource need to be updated too.
-			mat->NumFramesDirty--;
+			InstanceData& instData = *currInstanceBuffer->ElementPtr(b.FirstInstance + b.VisibleCount++);
+			XMStoreFloat4x4(&instData.World, XMMatrixTranspose(XMLoadFloat4x4(&ri->World)));
+			XMStoreFloat4x4(&instData.TexTransform, XMMatrixTranspose(XMLoadFloat4x4(&ri->TexTransform)));
 		}
 	}
 }
 
+void TexWavesApp::UpdateMaterialCBs(const GameTimer& gt)
+{
+	if(mMaterialData.size() < mMaterials.Size())
+		mMaterialData.resize(mMaterials.Size());
+
+	// Only update the constants that have changed; every frame copies mMaterialData
+	// whole, so one write is enough.
+	mMaterials.FlushDirty([this](UINT handle, const Material& mat)
+	{
+		XMMATRIX matTransform = XMLoadFloat4x4(&mat.MatTransform);
+
+		MaterialData& matData = mMaterialData[handle];
+		matData.DiffuseAlbedo = mat.DiffuseAlbedo;
+		matData.FresnelR0 = mat.FresnelR0;
+		matData.Roughness = mat.Roughness;
+		XMStoreFloat4x4(&matData.MatTransform, XMMatrixTranspose(matTransform));
+		matData.DiffuseMapIndex = mDiffuseSrvRemap[mat.DiffuseSrvHeapIndex];
+	});
+
+	UINT64 byteSize = mMaterialData.size() * sizeof(MaterialData);
+	auto materialCB = mCurrFrameResource->Constants->Allocate(byteSize);
+	memcpy(materialCB.CpuAddress, mMaterialData.data(), byteSize);
+	mCurrFrameResource->MaterialCB = materialCB.GpuAddress;
+}
+
 void TexWavesApp::UpdateMainPassCB(const GameTimer& gt)
 {
 	XMMATRIX view = XMLoadFloat4x4(&mView);
@@ -506,183 +1479,355 @@ void TexWavesApp::UpdateMainPassCB(const GameTimer& gt)
 	XMStoreFloat4x4(&mMainPassCB.ViewProj, XMMatrixTranspose(viewProj));
 	XMStoreFloat4x4(&mMainPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
 	mMainPassCB.EyePosW = mEyePos;
-	mMainPassCB.RenderTargetSize = XMFLOAT2((float)mClientWidth, (float)mClientHeight);
-	mMainPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / mClientWidth, 1.0f / mClientHeight);
+	// The size actually rendered, which the screen space lookups are relative to.
+	D3D12_VIEWPORT viewport = mDynamicResolution != nullptr ? mDynamicResolution->Viewport() : mScreenViewport;
+	mMainPassCB.RenderTargetSize = XMFLOAT2(viewport.Width, viewport.Height);
+	mMainPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / viewport.Width, 1.0f / viewport.Height);
 	mMainPassCB.NearZ = 1.0f;
 	mMainPassCB.FarZ = 1000.0f;
 	mMainPassCB.TotalTime = gt.TotalTime();
 	mMainPassCB.DeltaTime = gt.DeltaTime();
 	mMainPassCB.AmbientLight = { 0.4f, 0.4f, 0.4f, 1.0f };
 
-	// directional
-	mMainPassCB.Lights[0].Direction = { 0.57735f, -0.57735f, 0.57735f };
-	mMainPassCB.Lights[0].Strength = { 0.5f, 0.1f, 0.0f };
+	auto passCB = mCurrFrameResource->Constants->Allocate(d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants)));
+	memcpy(passCB.CpuAddress, &mMainPassCB, sizeof(PassConstants));
+	mCurrFrameResource->PassCB = passCB.GpuAddress;
+}
 
-	// point
-	mMainPassCB.Lights[1].Position = { 0.0f, 18.0f, 0.0f };
-	//mMainPassCB.Light1[5].Direction = { 0.0f, -5.0f, 0.0f };
-	mMainPassCB.Lights[1].Strength = { 0.196f, 0.784f, 0.305f };
-	//mMainPassCB.Lights[1].SpotPower = 0.95;
-	mMainPassCB.Lights[1].FalloffStart = 1.0f;
-	mMainPassCB.Lights[1].FalloffEnd = 50;
-
-	// spotlight
-	mMainPassCB.Lights[2].Position = { -9.0f, 13.0f, -9.0f };
-	mMainPassCB.Lights[2].Direction = { 0.0f, -5.0f, 0.0f };
-	mMainPassCB.Lights[2].Strength = { 0.541f, 0.984f, 1.0f };
-	mMainPassCB.Lights[2].SpotPower = 0.45;
-
-	mMainPassCB.Lights[3].Position = { 9.0f, 13.0f, -9.0f };
-	mMainPassCB.Lights[3].Direction = { 0.0f, -5.0f, 0.0f };
-	mMainPassCB.Lights[3].Strength = { 0.541f, 0.984f, 1.0f };
-	mMainPassCB.Lights[3].SpotPower = 0.45;
-
-	mMainPassCB.Lights[4].Position = { -9.0f, 13.0f, 9.0f };
-	mMainPassCB.Lights[4].Direction = { 0.0f, -5.0f, 0.0f };
-	mMainPassCB.Lights[4].Strength = { 0.541f, 0.984f, 1.0f };
-	mMainPassCB.Lights[4].SpotPower = 0.45;
-
-	mMainPassCB.Lights[5].Position = { 9.0f, 13.0f, 9.0f };
-	mMainPassCB.Lights[5].Direction = { 0.0f, -5.0f, 0.0f };
-	mMainPassCB.Lights[5].Strength = { 0.541f, 0.984f, 1.0f };
-	mMainPassCB.Lights[5].SpotPower = 0.45;
+void TexWavesApp::UpdateWaves(const GameTimer& gt)
+{
+	Profiler::ScopedCpu marker(*mProfiler, "UpdateWaves");
 
-	
+	// Every quarter second, generate a random wave.
+	if((mTimer.TotalTime() - mWavesDisturbTime) >= 0.25f)
+	{
+		mWavesDisturbTime += 0.25f;
+
+		int i = MathHelper::Rand(4, mWaves->RowCount() - 5);
+		int j = MathHelper::Rand(4, mWaves->ColumnCount() - 5);
+
+		float r = MathHelper::RandF(0.2f, 0.5f);
+
+		mWaves->Disturb(i, j, r);
+	}
 
-	//mMainPassCB.Lights[1].Direction = { -0.57735f, -0.57735f, 0.57735f };
-	//mMainPassCB.Lights[1].Strength = { 0.5f, 0.5f, 0.5f };
-	//mMainPassCB.Lights[2].Direction = { 0.0f, -0.707f, -0.707f };
-	//mMainPassCB.Lights[2].Strength = { 0.2f, 0.2f, 0.2f };
+	// Update the wave simulation.  Asynchronously this only kicks off (or polls) the
+	// background job; the accessors return the latest finished solution.
+	if(mAsyncWaves)
+		mWaves->UpdateAsync(gt.DeltaTime());
+	else
+		mWaves->Update(gt.DeltaTime());
 
-	auto currPassCB = mCurrFrameResource->PassCB.get();
-	currPassCB->CopyData(0, mMainPassCB);
+	// Update the wave vertex buffer with the new solution, written straight
+	// into the mapped upload memory.  Skip it if this frame's buffer already
+	// holds that solution.
+	auto currWavesVB = mCurrFrameResource->WavesVB.get();
+	if(mCurrFrameResource->WavesVersion != mWaves->SolutionVersion())
+	{
+		mWaves->CopyVertices(currWavesVB->MappedData());
+		mCurrFrameResource->WavesVersion = mWaves->SolutionVersion();
+	}
+
+	// Set the dynamic VB of the wave renderitem to the current frame VB.
+	mWavesRitem->Geo->VertexBufferGPU = currWavesVB->Resource();
 }
 
-void TexWavesApp::UpdateWaves(const GameTimer& gt)
+void TexWavesApp::UpdateWavesGPU(const GameTimer& gt, ID3D12GraphicsCommandList* cmdList)
+{
+	// Every quarter second, generate a random wave.
+	if((mTimer.TotalTime() - mWavesDisturbTime) >= 0.25f)
+	{
+		mWavesDisturbTime += 0.25f;
+
+		int i = MathHelper::Rand(4, mGpuWaves->RowCount() - 5);
+		int j = MathHelper::Rand(4, mGpuWaves->ColumnCount() - 5);
+
+		float r = MathHelper::RandF(0.2f, 0.5f);
+
+		mGpuWaves->Disturb(i, j, r);
+	}
+
+	mGpuWaves->Update(gt, cmdList, mWavesRootSignature.Get(),
+		mPSOs["wavesUpdate"].Get(), mPSOs["wavesDisturb"].Get());
+}
+
+// Picks the tiles' levels of detail for this frame's eye position.  Only the draw
+// arguments change, so the per-object constants stay clean.
+void TexWavesApp::UpdateTerrain()
+{
+	if(!mTerrain->SelectLods(mEyePos))
+		return;
+
+	for(int tile = 0; tile < (int)mTerrainRitems.size(); ++tile)
+	{
+		const SubmeshGeometry& args = mTerrain->TileDrawArgs(tile);
+		mTerrainRitems[tile]->IndexCount = args.IndexCount;
+		mTerrainRitems[tile]->StartIndexLocation = args.StartIndexLocation;
+		mTerrainRitems[tile]->BaseVertexLocation = args.BaseVertexLocation;
+
+		if(mGpuDriven)
+		{
+			mGpuCulling->SetItemDraw(mTerrainIndirectItems[tile],
+				args.IndexCount, args.StartIndexLocation, args.BaseVertexLocation);
+		}
+	}
+}
+
+// Keeps the water clipmap centred under the camera.  The centre moves in steps of the
+// coarsest ring's doubled spacing, so every ring's vertices stay on their own lattice
+// and the waves do not swim, and the rings stay nested.
+void TexWavesApp::UpdateWaterClipmap()
+{
+	float step = 2.0f * mGpuWaves->SpatialStep() * (1 << (gWaterClipmapLevels - 1));
+	float x = step * std::floor(mEyePos.x / step + 0.5f);
+	float z = step * std::floor(mEyePos.z / step + 0.5f);
+
+	XMFLOAT4X4& world = mWavesRitem->World;
+	if(world._41 == x && world._43 == z)
+		return;
+
+	world._41 = x;
+	world._43 = z;
+	mAllRitems.MarkDirty(mWavesRitem->ObjCBIndex);
+}
+
+// Sort key, most significant first:
+//   opaque:       layer | PSO | geometry | material | front-to-back distance
+//   transparent:  layer | back-to-front distance | geometry | material
+// The layer and the material's variant select the PSO, so state changes are grouped
+// before depth for opaque items; blended items must be drawn in order, so depth comes
+// first for them.
+void TexWavesApp::UpdateDrawLists()
+{
+	// The view holds the eye position as well as the look direction.
+	bool cameraChanged = memcmp(&mView, &mDrawListsView, sizeof(XMFLOAT4X4)) != 0 ||
+		memcmp(&mProj, &mDrawListsProj, sizeof(XMFLOAT4X4)) != 0;
+	if(!mDrawListsDirty && !cameraChanged)
+		return;
+
+	// Small ids for the geometries so they fit in the key.
+	std::unordered_map<const MeshGeometry*, UINT64> geoIds;
+	for(auto& e : mGeometries)
+		geoIds[e.second.get()] = (UINT64)geoIds.size();
+
+	XMVECTOR eyePos = XMLoadFloat3(&mEyePos);
+
+	// World space view frustum.  mView/mProj are from this frame's UpdateCamera.
+	XMMATRIX view = XMLoadFloat4x4(&mView);
+	XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+	BoundingFrustum frustum;
+	BoundingFrustum::CreateFromMatrix(frustum, XMLoadFloat4x4(&mProj));
+	frustum.Transform(frustum, invView);
+
+	mVisibleCount = 0;
+	mCulledCount = 0;
+
+	std::vector<std::pair<UINT64, RenderItem*>> keyed;
+	for(int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		bool backToFront = layer == (int)RenderLayer::Transparent ||
+			layer == (int)RenderLayer::GpuWaves;
+
+		// Culled and drawn by GpuCulling; the CPU never walks these items.
+		if(IsDrawnIndirect(layer))
+			continue;
+
+		keyed.clear();
+		for(auto ri : mRitemLayer[layer])
+		{
+			BoundingBox worldBounds;
+			ri->Bounds.Transform(worldBounds, XMLoadFloat4x4(&ri->World));
+			ri->Visible = frustum.Contains(worldBounds) != DirectX::DISJOINT;
+			if(!ri->Visible)
+			{
+				mCulledCount++;
+				continue;
+			}
+			mVisibleCount++;
+
+			XMVECTOR posW = XMVectorSet(ri->World._41, ri->World._42, ri->World._43, 1.0f);
+			float distSq = XMVectorGetX(XMVector3LengthSq(posW - eyePos));
+
+			// Non-negative floats order the same as their bit patterns.
+			UINT64 depth = *reinterpret_cast<const UINT32*>(&distSq);
+			UINT64 geo = geoIds[ri->Geo] & 0x3ff;
+			UINT64 mat = (UINT64)ri->Mat->MatCBIndex & 0x3ff;
+			UINT64 pso = (UINT64)mMaterialPipelines[layer][ri->Mat->MatCBIndex].SortId & 0xff;
+
+			UINT64 key = (UINT64)layer << 60;
+			if(backToFront)
+				key |= ((~depth & 0xffffffff) << 20) | (geo << 10) | mat;
+			else
+				key |= (pso << 52) | (geo << 42) | (mat << 32) | depth;
+
+			keyed.push_back({ key, ri });
+		}
+
+		// Instanced items are drawn per batch, not from the draw list.
+		if(layer == (int)RenderLayer::OpaqueInstanced)
+			continue;
+
+		std::sort(keyed.begin(), keyed.end(),
+			[](const std::pair<UINT64, RenderItem*>& a, const std::pair<UINT64, RenderItem*>& b)
+			{ return a.first < b.first; });
+
+		mDrawLists[layer].clear();
+		for(auto& k : keyed)
+			mDrawLists[layer].push_back(k.second);
+	}
+
+	mDrawListsView = mView;
+	mDrawListsProj = mProj;
+	mDrawListsDirty = false;
+}
+
+// The cells depend on the camera's direction as well as its position, so they are
+// culled every frame; there are only gFoliageCellsPerSide^2 of them.
+void TexWavesApp::UpdateFoliage()
+{
+	XMMATRIX view = XMLoadFloat4x4(&mView);
+	XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+	BoundingFrustum frustum;
+	BoundingFrustum::CreateFromMatrix(frustum, XMLoadFloat4x4(&mProj));
+	frustum.Transform(frustum, invView);
+
+	mFoliage->Cull(frustum, mEyePos);
+}
+
+// Creates the placeholder texture and the streamer; Initialize starts the loads once
+// the initialization commands are submitted.
+void TexWavesApp::LoadTextures()
 {
-	// Every quarter second, generate a random wave.
-	static float t_base = 0.0f;
-	if((mTimer.TotalTime() - t_base) >= 0.25f)
+	mStagingRing = std::make_unique<StagingRing>(md3dDevice.Get(), gStagingRingSize);
+
+	// 1x1 white placeholder, uploaded with the rest of the initialization commands.
+	D3D12_RESOURCE_DESC texDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R8G8B8A8_UNORM, 1, 1, 1, 1);
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&texDesc,
+		D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr,
+		IID_PPV_ARGS(&mPlaceholderTex)));
+
+	StagingRing::Allocation upload = mStagingRing->Allocate(mCommandList.Get(),
+		GetRequiredIntermediateSize(mPlaceholderTex.Get(), 0, 1));
+
+	const UINT white = 0xffffffff;
+	D3D12_SUBRESOURCE_DATA texData = {};
+	texData.pData = &white;
+	texData.RowPitch = sizeof(white);
+	texData.SlicePitch = sizeof(white);
+	UpdateSubresources(mCommandList.Get(), mPlaceholderTex.Get(), upload.Resource, upload.Offset, 0, 1, &texData);
+	mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mPlaceholderTex.Get(),
+		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+
+	mTextureStreamer = std::make_unique<TextureStreamer>(md3dDevice.Get(), *mStagingRing);
+	for(UINT i = 0; i < gDiffuseTextureCount; ++i)
 	{
-		t_base += 0.25f;
-
-		int i = MathHelper::Rand(4, mWaves->RowCount() - 5);
-		int j = MathHelper::Rand(4, mWaves->ColumnCount() - 5);
+		auto tex = std::make_unique<Texture>();
+		tex->Name = gDiffuseTextures[i].Name;
+		tex->Filename = gDiffuseTextures[i].Filename;
 
-		float r = MathHelper::RandF(0.2f, 0.5f);
-
-		mWaves->Disturb(i, j, r);
+		mTextures[tex->Name] = std::move(tex);
 	}
+}
 
-	// Update the wave simulation.
-	mWaves->Update(gt.DeltaTime());
+// Writes the SRV of gDiffuseTextures[index]'s resident mips into heapIndex.
+void TexWavesApp::BuildTextureSrv(UINT index, UINT heapIndex)
+{
+	Texture* tex = mTextures[gDiffuseTextures[index].Name].get();
+	auto resource = tex->Resource;
 
-	// Update the wave vertex buffer with the new solution.
-	auto currWavesVB = mCurrFrameResource->WavesVB.get();
-	for(int i = 0; i < mWaves->VertexCount(); ++i)
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = resource->GetDesc().Format;
+	if(gDiffuseTextures[index].IsArray)
 	{
-		Vertex v;
+		srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DARRAY;
+		srvDesc.Texture2DArray.MostDetailedMip = tex->ResidentMip;
+		srvDesc.Texture2DArray.MipLevels = -1;
+		srvDesc.Texture2DArray.FirstArraySlice = 0;
+		srvDesc.Texture2DArray.ArraySize = resource->GetDesc().DepthOrArraySize;
+	}
+	else
+	{
+		srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+		srvDesc.Texture2D.MostDetailedMip = tex->ResidentMip;
+		srvDesc.Texture2D.MipLevels = -1;
+	}
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hDescriptor(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), heapIndex, mCbvSrvDescriptorSize);
+	md3dDevice->CreateShaderResourceView(resource.Get(), &srvDesc, hDescriptor);
+}
 
-		v.Pos = mWaves->Position(i);
-		v.Normal = mWaves->Normal(i);
-		
-		// Derive tex-coords from position by 
-		// mapping [-w/2,w/2] --> [0,1]
-		v.TexC.x = 0.5f + v.Pos.x / mWaves->Width();
-		v.TexC.y = 0.5f - v.Pos.z / mWaves->Depth();
+// Switches the materials of textures whose copies have completed to a view of their
+// mip tail, then to their real SRV.
+void TexWavesApp::UpdateTextureStreaming()
+{
+	mStagingRing->Reclaim();
 
-		currWavesVB->CopyData(i, v);
+	for(Texture* tex : mTextureStreamer->CollectCompleted())
+	{
+		for(UINT i = 0; i < gDiffuseTextureCount; ++i)
+		{
+			if(tex->Name == gDiffuseTextures[i].Name)
+			{
+				UINT heapIndex = tex->ResidentMip > 0 ? gMipTailSrvIndex + i : i;
+				BuildTextureSrv(i, heapIndex);
+				mDiffuseSrvRemap[i] = heapIndex;
+
+				// The copy queue is done with it, so it may be paged from now on.
+				if(tex->ResidentMip == 0)
+				{
+					D3D12_RESOURCE_DESC desc = tex->Resource->GetDesc();
+					UINT64 bytes = md3dDevice->GetResourceAllocationInfo(0, 1, &desc).SizeInBytes;
+					mTextureResidencyIds[i] = mResidency->Track(tex->Resource.Get(), bytes, ResidencyManager::Priority::Low);
+				}
+
+				// The bindless materials hold the SRV index.
+				for(auto& mat : mMaterials)
+				{
+					if(mat->DiffuseSrvHeapIndex == (int)i)
+						mMaterials.MarkDirty(mat->MatCBIndex);
+				}
+			}
+		}
 	}
-
-	// Set the dynamic VB of the wave renderitem to the current frame VB.
-	mWavesRitem->Geo->VertexBufferGPU = currWavesVB->Resource();
 }
 
-void TexWavesApp::LoadTextures()
+// Marks the diffuse textures this frame can sample as used, making evicted ones
+// resident again, and lets the residency manager evict the others if over budget.
+void TexWavesApp::UpdateResidency()
 {
-	auto grassTex = std::make_unique<Texture>();
-	grassTex->Name = "grassTex";
-	grassTex->Filename = L"../Textures/grass.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), grassTex->Filename.c_str(),
-		grassTex->Resource, grassTex->UploadHeap));
-
-	auto waterTex = std::make_unique<Texture>();
-	waterTex->Name = "waterTex";
-	waterTex->Filename = L"../Textures/water1.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), waterTex->Filename.c_str(),
-		waterTex->Resource, waterTex->UploadHeap));
-
-	auto fenceTex = std::make_unique<Texture>();
-	fenceTex->Name = "fenceTex";
-	fenceTex->Filename = L"../Textures/WoodCrate01.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), fenceTex->Filename.c_str(),
-		fenceTex->Resource, fenceTex->UploadHeap));
-
-	auto stoneTex = std::make_unique<Texture>();
-	stoneTex->Name = "stoneTex";
-	stoneTex->Filename = L"../Textures/stone2.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), stoneTex->Filename.c_str(),
-		stoneTex->Resource, stoneTex->UploadHeap));
-
-	auto stone2Tex = std::make_unique<Texture>();
-	stone2Tex->Name = "stone2Tex";
-	stone2Tex->Filename = L"../Textures/stone1.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), stone2Tex->Filename.c_str(),
-		stone2Tex->Resource, stone2Tex->UploadHeap));
-
-	auto sapphireTex = std::make_unique<Texture>();
-	sapphireTex->Name = "sapphireTex";
-	sapphireTex->Filename = L"../Textures/sapphire.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), sapphireTex->Filename.c_str(),
-		sapphireTex->Resource, sapphireTex->UploadHeap));
-
-	auto carpetTex = std::make_unique<Texture>();
-	carpetTex->Name = "carpetTex";
-	carpetTex->Filename = L"../Textures/carpet.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), carpetTex->Filename.c_str(),
-		carpetTex->Resource, carpetTex->UploadHeap));
-
-	auto emeraldTex = std::make_unique<Texture>();
-	emeraldTex->Name = "emeraldTex";
-	emeraldTex->Filename = L"../Textures/emerald.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), emeraldTex->Filename.c_str(),
-		emeraldTex->Resource, emeraldTex->UploadHeap));
-
-	auto tiger_gemTex = std::make_unique<Texture>();
-	tiger_gemTex->Name = "tiger_gemTex";
-	tiger_gemTex->Filename = L"../Textures/tiger_gem.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), tiger_gemTex->Filename.c_str(),
-		tiger_gemTex->Resource, tiger_gemTex->UploadHeap));
-
-	auto treeArrayTex = std::make_unique<Texture>();
-	treeArrayTex->Name = "treeArrayTex";
-	treeArrayTex->Filename = L"../Textures/treeArray.dds";
-	ThrowIfFailed(DirectX::CreateDDSTextureFromFile12(md3dDevice.Get(),
-		mCommandList.Get(), treeArrayTex->Filename.c_str(),
-		treeArrayTex->Resource, treeArrayTex->UploadHeap));
-
-
-	mTextures[grassTex->Name] = std::move(grassTex);
-	mTextures[waterTex->Name] = std::move(waterTex);
-	mTextures[fenceTex->Name] = std::move(fenceTex);
-	mTextures[stoneTex->Name] = std::move(stoneTex);
-	mTextures[stone2Tex->Name] = std::move(stone2Tex);
-	mTextures[sapphireTex->Name] = std::move(sapphireTex);
-	mTextures[carpetTex->Name] = std::move(carpetTex);
-	mTextures[emeraldTex->Name] = std::move(emeraldTex);
-	mTextures[tiger_gemTex->Name] = std::move(tiger_gemTex);
-	mTextures[treeArrayTex->Name] = std::move(treeArrayTex);
+	std::vector<bool> used(gDiffuseTextureCount, false);
+	auto markMaterial = [&used](const Material* mat)
+	{
+		if(mat->DiffuseSrvHeapIndex >= 0 && mat->DiffuseSrvHeapIndex < (int)gDiffuseTextureCount)
+			used[mat->DiffuseSrvHeapIndex] = true;
+	};
+
+	// The GPU-culled layers may draw any of their items.
+	for(int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		bool indirect = IsDrawnIndirect(layer);
+		for(auto ri : mRitemLayer[layer])
+		{
+			if(indirect || ri->Visible)
+				markMaterial(ri->Mat);
+		}
+	}
+	if(mFoliage->VisibleTreeCount() > 0)
+		markMaterial(mTreeMaterial);
 
+	// This frame signals the next fence value.
+	for(UINT i = 0; i < gDiffuseTextureCount; ++i)
+	{
+		if(used[i] && mTextureResidencyIds[i] != ResidencyManager::InvalidId)
+			mResidency->Use(mTextureResidencyIds[i], mCurrentFence + 1);
+	}
 
+	mResidency->Update(mFence->GetCompletedValue());
 }
 
 void TexWavesApp::BuildRootSignature()
@@ -690,19 +1835,40 @@ void TexWavesApp::BuildRootSignature()
 	CD3DX12_DESCRIPTOR_RANGE texTable;
 	texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
 
+	CD3DX12_DESCRIPTOR_RANGE displacementMapTable;
+	displacementMapTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 1);
+
+	// Bindless: the texture SRVs at the start of the heap.
+	CD3DX12_DESCRIPTOR_RANGE bindlessTable;
+	bindlessTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, gTextureSrvCount, 0, 3);
+
     // Root parameter can be a table, root descriptor or root constants.
-    CD3DX12_ROOT_PARAMETER slotRootParameter[4];
+    CD3DX12_ROOT_PARAMETER slotRootParameter[13];
 
 	// Perfomance TIP: Order from most frequent to least frequent.
 	slotRootParameter[0].InitAsDescriptorTable(1, &texTable, D3D12_SHADER_VISIBILITY_PIXEL);
     slotRootParameter[1].InitAsConstantBufferView(0);
     slotRootParameter[2].InitAsConstantBufferView(1);
     slotRootParameter[3].InitAsConstantBufferView(2);
+	slotRootParameter[4].InitAsDescriptorTable(1, &displacementMapTable, D3D12_SHADER_VISIBILITY_VERTEX);
+	slotRootParameter[5].InitAsShaderResourceView(0, 1, D3D12_SHADER_VISIBILITY_VERTEX);
+	slotRootParameter[6].InitAsConstants(1, 3, 0, D3D12_SHADER_VISIBILITY_VERTEX);
+
+	// The clustered lights and the cluster light lists.
+	slotRootParameter[7].InitAsShaderResourceView(0, 4, D3D12_SHADER_VISIBILITY_PIXEL);
+	slotRootParameter[8].InitAsShaderResourceView(1, 4, D3D12_SHADER_VISIBILITY_PIXEL);
+
+	// Bindless only: object and material indices, the object and material arrays and
+	// the texture table.
+	slotRootParameter[9].InitAsConstants(2, 4);
+	slotRootParameter[10].InitAsShaderResourceView(0, 2, D3D12_SHADER_VISIBILITY_VERTEX);
+	slotRootParameter[11].InitAsShaderResourceView(1, 2);
+	slotRootParameter[12].InitAsDescriptorTable(1, &bindlessTable, D3D12_SHADER_VISIBILITY_PIXEL);
 
 	auto staticSamplers = GetStaticSamplers();
 
     // A root signature is an array of root parameters.
-	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(4, slotRootParameter,
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(mBindless ? 13 : 9, slotRootParameter,
 		(UINT)staticSamplers.size(), staticSamplers.data(),
 		D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
 
@@ -725,127 +1891,314 @@ void TexWavesApp::BuildRootSignature()
         IID_PPV_ARGS(mRootSignature.GetAddressOf())));
 }
 
-void TexWavesApp::BuildDescriptorHeaps()
+void TexWavesApp::BuildWavesRootSignature()
 {
-	//
-	// Create the SRV heap.
-	//
-	D3D12_DESCRIPTOR_HEAP_DESC srvHeapDesc = {};
-	srvHeapDesc.NumDescriptors = 10;
-	srvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
-	srvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
-	ThrowIfFailed(md3dDevice->CreateDescriptorHeap(&srvHeapDesc, IID_PPV_ARGS(&mSrvDescriptorHeap)));
+	CD3DX12_DESCRIPTOR_RANGE srvTable0;
+	srvTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
 
-	//
-	// Fill out the heap with actual descriptors.
-	//
-	CD3DX12_CPU_DESCRIPTOR_HANDLE hDescriptor(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart());
+	CD3DX12_DESCRIPTOR_RANGE srvTable1;
+	srvTable1.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 1);
 
-	auto grassTex = mTextures["grassTex"]->Resource;
-	auto waterTex = mTextures["waterTex"]->Resource;
-	auto fenceTex = mTextures["fenceTex"]->Resource;
-	auto stoneTex = mTextures["stoneTex"]->Resource;
-	auto stone2Tex = mTextures["stone2Tex"]->Resource;
+	CD3DX12_DESCRIPTOR_RANGE uavTable0;
+	uavTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 0);
 
-	auto sapphireTex = mTextures["sapphireTex"]->Resource;
-	auto carpetTex = mTextures["carpetTex"]->Resource;
-	auto emeraldTex = mTextures["emeraldTex"]->Resource;
-	auto tiger_gemTex = mTextures["tiger_gemTex"]->Resource;
+	// Root parameter can be a table, root descriptor or root constants.
+	CD3DX12_ROOT_PARAMETER slotRootParameter[4];
 
-	auto treeArrayTex = mTextures["treeArrayTex"]->Resource;
+	// Perfomance TIP: Order from most frequent to least frequent.
+	slotRootParameter[0].InitAsConstants(6, 0);
+	slotRootParameter[1].InitAsDescriptorTable(1, &srvTable0);
+	slotRootParameter[2].InitAsDescriptorTable(1, &srvTable1);
+	slotRootParameter[3].InitAsDescriptorTable(1, &uavTable0);
 
-	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
-	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-	srvDesc.Format = grassTex->GetDesc().Format;
-	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
-	srvDesc.Texture2D.MostDetailedMip = 0;
-	srvDesc.Texture2D.MipLevels = -1;
-	md3dDevice->CreateShaderResourceView(grassTex.Get(), &srvDesc, hDescriptor);
+	// A root signature is an array of root parameters.
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(4, slotRootParameter,
+		0, nullptr,
+		D3D12_ROOT_SIGNATURE_FLAG_NONE);
+
+	ComPtr<ID3DBlob> serializedRootSig = nullptr;
+	ComPtr<ID3DBlob> errorBlob = nullptr;
+	HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+		serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+	if(errorBlob != nullptr)
+	{
+		::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+	}
+	ThrowIfFailed(hr);
+
+	ThrowIfFailed(md3dDevice->CreateRootSignature(
+		0,
+		serializedRootSig->GetBufferPointer(),
+		serializedRootSig->GetBufferSize(),
+		IID_PPV_ARGS(mWavesRootSignature.GetAddressOf())));
+}
+
+void TexWavesApp::BuildLightCullRootSignature()
+{
+	CD3DX12_ROOT_PARAMETER slotRootParameter[3];
+
+	slotRootParameter[0].InitAsConstantBufferView(0);
+	slotRootParameter[1].InitAsShaderResourceView(0);
+	slotRootParameter[2].InitAsUnorderedAccessView(0);
+
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(3, slotRootParameter,
+		0, nullptr,
+		D3D12_ROOT_SIGNATURE_FLAG_NONE);
+
+	ComPtr<ID3DBlob> serializedRootSig = nullptr;
+	ComPtr<ID3DBlob> errorBlob = nullptr;
+	HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+		serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+	if(errorBlob != nullptr)
+	{
+		::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+	}
+	ThrowIfFailed(hr);
+
+	ThrowIfFailed(md3dDevice->CreateRootSignature(
+		0,
+		serializedRootSig->GetBufferPointer(),
+		serializedRootSig->GetBufferSize(),
+		IID_PPV_ARGS(mLightCullRootSignature.GetAddressOf())));
+}
+
+void TexWavesApp::BuildUpscaleRootSignature()
+{
+	// Upscale.hlsl: uv scale and clamp, and the scene.
+	CD3DX12_DESCRIPTOR_RANGE sceneTable;
+	sceneTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
+
+	CD3DX12_ROOT_PARAMETER slotRootParameter[2];
+
+	slotRootParameter[0].InitAsConstants(4, 0);
+	slotRootParameter[1].InitAsDescriptorTable(1, &sceneTable, D3D12_SHADER_VISIBILITY_PIXEL);
+
+	auto staticSamplers = GetStaticSamplers();
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(2, slotRootParameter,
+		(UINT)staticSamplers.size(), staticSamplers.data(),
+		D3D12_ROOT_SIGNATURE_FLAG_NONE);
 
-	srvDesc.Format = waterTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(waterTex.Get(), &srvDesc, hDescriptor);
+	ComPtr<ID3DBlob> serializedRootSig = nullptr;
+	ComPtr<ID3DBlob> errorBlob = nullptr;
+	HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+		serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	if(errorBlob != nullptr)
+	{
+		::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+	}
+	ThrowIfFailed(hr);
 
-	srvDesc.Format = fenceTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(fenceTex.Get(), &srvDesc, hDescriptor);
+	ThrowIfFailed(md3dDevice->CreateRootSignature(
+		0,
+		serializedRootSig->GetBufferPointer(),
+		serializedRootSig->GetBufferSize(),
+		IID_PPV_ARGS(mUpscaleRootSignature.GetAddressOf())));
+}
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+void TexWavesApp::BuildCullRootSignatures()
+{
+	auto createRootSignature = [this](const CD3DX12_ROOT_SIGNATURE_DESC& rootSigDesc, ComPtr<ID3D12RootSignature>& rootSig)
+	{
+		ComPtr<ID3DBlob> serializedRootSig = nullptr;
+		ComPtr<ID3DBlob> errorBlob = nullptr;
+		HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+			serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
 
-	srvDesc.Format = stoneTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(stoneTex.Get(), &srvDesc, hDescriptor);
+		if(errorBlob != nullptr)
+		{
+			::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+		}
+		ThrowIfFailed(hr);
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+		ThrowIfFailed(md3dDevice->CreateRootSignature(
+			0,
+			serializedRootSig->GetBufferPointer(),
+			serializedRootSig->GetBufferSize(),
+			IID_PPV_ARGS(rootSig.GetAddressOf())));
+	};
 
-	srvDesc.Format = stone2Tex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(stone2Tex.Get(), &srvDesc, hDescriptor);
+	// Culling: constants, items, Hi-Z, commands and counters.
+	CD3DX12_DESCRIPTOR_RANGE hiZTable;
+	hiZTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 1);
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	CD3DX12_ROOT_PARAMETER cullParameters[5];
+	cullParameters[0].InitAsConstantBufferView(0);
+	cullParameters[1].InitAsShaderResourceView(0);
+	cullParameters[2].InitAsDescriptorTable(1, &hiZTable);
+	cullParameters[3].InitAsUnorderedAccessView(0);
+	cullParameters[4].InitAsUnorderedAccessView(1);
 
-	srvDesc.Format = sapphireTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(sapphireTex.Get(), &srvDesc, hDescriptor);
+	createRootSignature(CD3DX12_ROOT_SIGNATURE_DESC(5, cullParameters, 0, nullptr,
+		D3D12_ROOT_SIGNATURE_FLAG_NONE), mCullRootSignature);
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	// Hi-Z: sizes, depth buffer, source and destination mip.
+	CD3DX12_DESCRIPTOR_RANGE depthTable;
+	depthTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);
 
-	srvDesc.Format = carpetTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(carpetTex.Get(), &srvDesc, hDescriptor);
+	CD3DX12_DESCRIPTOR_RANGE srcTable;
+	srcTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 0);
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	CD3DX12_DESCRIPTOR_RANGE dstTable;
+	dstTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 1);
 
-	srvDesc.Format = emeraldTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(emeraldTex.Get(), &srvDesc, hDescriptor);
+	CD3DX12_ROOT_PARAMETER hiZParameters[4];
+	hiZParameters[0].InitAsConstants(4, 0);
+	hiZParameters[1].InitAsDescriptorTable(1, &depthTable);
+	hiZParameters[2].InitAsDescriptorTable(1, &srcTable);
+	hiZParameters[3].InitAsDescriptorTable(1, &dstTable);
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	createRootSignature(CD3DX12_ROOT_SIGNATURE_DESC(4, hiZParameters, 0, nullptr,
+		D3D12_ROOT_SIGNATURE_FLAG_NONE), mHiZRootSignature);
+}
 
-	srvDesc.Format = tiger_gemTex->GetDesc().Format;
-	md3dDevice->CreateShaderResourceView(tiger_gemTex.Get(), &srvDesc, hDescriptor);
+void TexWavesApp::BuildDescriptorHeaps()
+{
+	//
+	// Create the SRV heap.
+	//
+	D3D12_DESCRIPTOR_HEAP_DESC srvHeapDesc = {};
+	srvHeapDesc.NumDescriptors = gGpuWavesSrvIndex + (mUseGpuWaves ? mGpuWaves->DescriptorCount() : 0);
+	srvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
+	srvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
+	ThrowIfFailed(md3dDevice->CreateDescriptorHeap(&srvHeapDesc, IID_PPV_ARGS(&mSrvDescriptorHeap)));
 
-	// next descriptor
-	hDescriptor.Offset(1, mCbvSrvDescriptorSize);
+	//
+	// The textures are not resident yet; point every material at the placeholder.
+	//
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = mPlaceholderTex->GetDesc().Format;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.MipLevels = -1;
+	md3dDevice->CreateShaderResourceView(mPlaceholderTex.Get(), &srvDesc,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gPlaceholderSrvIndex, mCbvSrvDescriptorSize));
 
-	auto desc = treeArrayTex->GetDesc();
 	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DARRAY;
-	srvDesc.Format = treeArrayTex->GetDesc().Format;
 	srvDesc.Texture2DArray.MostDetailedMip = 0;
 	srvDesc.Texture2DArray.MipLevels = -1;
 	srvDesc.Texture2DArray.FirstArraySlice = 0;
-	srvDesc.Texture2DArray.ArraySize = treeArrayTex->GetDesc().DepthOrArraySize;
-	md3dDevice->CreateShaderResourceView(treeArrayTex.Get(), &srvDesc, hDescriptor);
+	srvDesc.Texture2DArray.ArraySize = 1;
+	md3dDevice->CreateShaderResourceView(mPlaceholderTex.Get(), &srvDesc,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gPlaceholderArraySrvIndex, mCbvSrvDescriptorSize));
+
+	mDiffuseSrvRemap.resize(gDiffuseTextureCount);
+	for(UINT i = 0; i < gDiffuseTextureCount; ++i)
+		mDiffuseSrvRemap[i] = gDiffuseTextures[i].IsArray ? gPlaceholderArraySrvIndex : gPlaceholderSrvIndex;
+
+	mTerrain->BuildDescriptor(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gTerrainSrvIndex, mCbvSrvDescriptorSize),
+		CD3DX12_GPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), gTerrainSrvIndex, mCbvSrvDescriptorSize));
+
+	// The wave simulation SRVs/UAVs follow the textures.
+	if(mUseGpuWaves)
+	{
+		mGpuWaves->BuildDescriptors(
+			CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gGpuWavesSrvIndex, mCbvSrvDescriptorSize),
+			CD3DX12_GPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), gGpuWavesSrvIndex, mCbvSrvDescriptorSize),
+			mCbvSrvDescriptorSize);
+	}
+
+	// Before Initialize, OnResize had no scene target to size.
+	if(mDynamicResolution != nullptr)
+	{
+		mDynamicResolution->BuildDescriptors(
+			CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gDynResSrvIndex, mCbvSrvDescriptorSize),
+			CD3DX12_GPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), gDynResSrvIndex, mCbvSrvDescriptorSize));
+		mDynamicResolution->OnResize(mClientWidth, mClientHeight, mBackBufferFormat,
+			m4xMsaaState ? 4 : 1, m4xMsaaState ? (m4xMsaaQuality - 1) : 0, gClearColor);
+	}
 }
 
 void TexWavesApp::BuildShadersAndInputLayout()
 {
+	// The Default.hlsl and TreeSprite.hlsl variants are requested and compiled by
+	// BuildMaterialPipelines once the materials and render items exist.
+	const std::vector<ShaderPermutations::Feature> defaultFeatures =
+	{
+		{ "ALPHA_TEST",             0, 1 },
+		{ "FOG",                    1, 1 },
+		{ "CLUSTERED_POINT_LIGHTS", 2, 1 },
+		{ "CLUSTERED_SPOT_LIGHTS",  3, 1 },
+		{ "TEX_TRANSFORM",          4, 1 },
+		{ "INSTANCED",              5, 1 },
+		{ "TERRAIN",                6, 1 },
+		{ "DISPLACEMENT_MAP",       7, 1 },
+		{ "COMPACT_VERTEX",         8, 1 },
+		{ "NUM_DIR_LIGHTS",         gDirLightCountShift, 2 },
+	};
 
-	/*const D3D_SHADER_MACRO defines[] =
+	// Every Default.hlsl variant gets BINDLESS in bindless mode, and the size of the
+	// texture table; 5.1 for its dynamically indexed texture array.
+	static const std::string textureCount = std::to_string(gTextureSrvCount);
+	std::vector<D3D_SHADER_MACRO> defaultDefines;
+	if(mBindless)
 	{
-		"FOG", "1",
-		NULL, NULL
-	};*/
+		defaultDefines.push_back({ "BINDLESS", "1" });
+		defaultDefines.push_back({ "BINDLESS_TEXTURE_COUNT", textureCount.c_str() });
+	}
+
+	mDefaultShaders = std::make_unique<ShaderPermutations>(mShaderCache.get(),
+		L"Shaders\\Default.hlsl", defaultFeatures, defaultDefines);
 
-	const D3D_SHADER_MACRO alphaTestDefines[] =
+	const std::vector<ShaderPermutations::Feature> treeSpriteFeatures =
 	{
-		"FOG", "1",
-		"ALPHA_TEST",
+		{ "ALPHA_TEST",     0, 1 },
+		{ "FOG",            1, 1 },
+		{ "NUM_DIR_LIGHTS", gDirLightCountShift, 2 },
+	};
+
+	mTreeSpriteShaders = std::make_unique<ShaderPermutations>(mShaderCache.get(),
+		L"Shaders\\TreeSprite.hlsl", treeSpriteFeatures, std::vector<D3D_SHADER_MACRO>());
+
+	mShaders["wavesUpdateCS"] = mShaderCache->CompileShader(L"Shaders\\WaveSim.hlsl", nullptr, "UpdateWavesCS", "cs_5_0");
+	mShaders["wavesDisturbCS"] = mShaderCache->CompileShader(L"Shaders\\WaveSim.hlsl", nullptr, "DisturbWavesCS", "cs_5_0");
+
+	const D3D_SHADER_MACRO lightCullDefines[] =
+	{
+		"CULL_LIGHTS", "1",
 		NULL, NULL
 	};
 
-	mShaders["standardVS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "VS", "vs_5_0");
-	mShaders["opaquePS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "PS", "ps_5_0");
-	mShaders["alphaTestedPS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", alphaTestDefines, "PS", "ps_5_1");
+	mShaders["lightCullCS"] = mShaderCache->CompileShader(L"Shaders\\ClusteredLighting.hlsl", lightCullDefines, "CullLightsCS", "cs_5_0");
+
+	if(mGpuDriven)
+	{
+		const D3D_SHADER_MACRO cullDefines[] =
+		{
+			"CULL", "1",
+			NULL, NULL
+		};
+
+		const D3D_SHADER_MACRO bindlessCullDefines[] =
+		{
+			"CULL", "1",
+			"BINDLESS", "1",
+			NULL, NULL
+		};
+
+		const D3D_SHADER_MACRO msaaDefines[] =
+		{
+			"MSAA", "1",
+			NULL, NULL
+		};
+
+		mShaders["gpuCullCS"] = mShaderCache->CompileShader(L"Shaders\\GpuCulling.hlsl", mBindless ? bindlessCullDefines : cullDefines, "CullCS", "cs_5_0");
+		mShaders["hiZDepthCS"] = mShaderCache->CompileShader(L"Shaders\\GpuCulling.hlsl", nullptr, "HiZDepthCS", "cs_5_0");
+		mShaders["hiZDepthMSCS"] = mShaderCache->CompileShader(L"Shaders\\GpuCulling.hlsl", msaaDefines, "HiZDepthCS", "cs_5_0");
+		mShaders["hiZDownsampleCS"] = mShaderCache->CompileShader(L"Shaders\\GpuCulling.hlsl", nullptr, "HiZDownsampleCS", "cs_5_0");
+	}
+
+	if(mDynamicResolution != nullptr)
+	{
+		mShaders["upscaleVS"] = mShaderCache->CompileShader(L"Shaders\\Upscale.hlsl", nullptr, "VS", "vs_5_0");
+		mShaders["upscalePS"] = mShaderCache->CompileShader(L"Shaders\\Upscale.hlsl", nullptr, "PS", "ps_5_0");
+	}
 
-	mShaders["treeSpriteVS"] = d3dUtil::CompileShader(L"Shaders\\TreeSprite.hlsl", nullptr, "VS", "vs_5_1");
-	mShaders["treeSpriteGS"] = d3dUtil::CompileShader(L"Shaders\\TreeSprite.hlsl", nullptr, "GS", "gs_5_1");
-	mShaders["treeSpritePS"] = d3dUtil::CompileShader(L"Shaders\\TreeSprite.hlsl", alphaTestDefines, "PS", "ps_5_1");
 	
     mInputLayout =
     {
@@ -854,10 +2207,11 @@ void TexWavesApp::BuildShadersAndInputLayout()
 		{ "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
     };
 
-	mTreeSpriteInputLayout =
+	mCompactInputLayout =
 	{
 		{ "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
-		{ "SIZE", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "NORMAL", 0, DXGI_FORMAT_R16G16_SNORM, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+		{ "TEXCOORD", 0, DXGI_FORMAT_R16G16_FLOAT, 0, 16, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
 	};
 }
 
@@ -876,6 +2230,11 @@ void TexWavesApp::BuildCastleGeometry()
 	GeometryGenerator::MeshData Base3 = geoGen.CreateCylinder(0.5f, 0.0f, 1.0f, 10, 1);
 	GeometryGenerator::MeshData top = geoGen.CreateSphere(0.5f, 11, 10);
 
+	// Reorder for the vertex cache, overdraw and vertex fetch; the counts the offsets
+	// below are computed from do not change.
+	for(GeometryGenerator::MeshData* mesh : { &wholeWall, &grid, &column, &columnTop, &Base1, &Base2, &Base3, &top })
+		MeshOptimizer::Optimize(*mesh);
+
 	shapesVector.push_back(wholeWall);
 	shapesVector.push_back(grid);
 	shapesVector.push_back(column);
@@ -970,6 +2329,21 @@ void TexWavesApp::BuildCastleGeometry()
 	topSubmesh.StartIndexLocation = topIndexOffset;
 	topSubmesh.BaseVertexLocation = topVertexOffset;
 
+	// Local space bounds of each shape, for frustum culling.
+	auto computeBounds = [](const GeometryGenerator::MeshData& mesh, SubmeshGeometry& submesh)
+	{
+		BoundingBox::CreateFromPoints(submesh.Bounds, mesh.Vertices.size(),
+			&mesh.Vertices[0].Position, sizeof(GeometryGenerator::Vertex));
+	};
+	computeBounds(wholeWall, wholeWallSubmesh);
+	computeBounds(grid, gridSubmesh);
+	computeBounds(column, columnSubmesh);
+	computeBounds(columnTop, columnTopSubmesh);
+	computeBounds(Base1, Base1Submesh);
+	computeBounds(Base2, Base2Submesh);
+	computeBounds(Base3, Base3Submesh);
+	computeBounds(top, topSubmesh);
+
 	//step4
 	/*SubmeshGeometry gridSubmesh;
 	gridSubmesh.IndexCount = (UINT)grid.Indices32.size();
@@ -1084,25 +2458,41 @@ void TexWavesApp::BuildCastleGeometry()
 
 	//indices.insert(indices.end(), std::begin(cylinder.GetIndices16()), std::end(cylinder.GetIndices16()));
 
-	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
+	// Repack in place of the full vertices when the compact layout is used.
+	std::vector<CompactVertex> compactVertices;
+	if(mCompactVertices)
+	{
+		compactVertices.resize(vertices.size());
+		for(size_t i = 0; i < vertices.size(); ++i)
+		{
+			XMFLOAT2 normal = MeshOptimizer::OctahedralEncode(vertices[i].Normal);
+			compactVertices[i].Pos = vertices[i].Pos;
+			compactVertices[i].Normal = XMSHORTN2(normal.x, normal.y);
+			compactVertices[i].TexC = XMHALF2(vertices[i].TexC.x, vertices[i].TexC.y);
+		}
+	}
+
+	const void* vertexData = mCompactVertices ? (const void*)compactVertices.data() : vertices.data();
+	const UINT vertexStride = mCompactVertices ? sizeof(CompactVertex) : sizeof(Vertex);
+	const UINT vbByteSize = (UINT)vertices.size() * vertexStride;
 	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
 
 	auto geo = std::make_unique<MeshGeometry>();
 	geo->Name = "shapeGeo";
 
 	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
+	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertexData, vbByteSize);
 
 	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
 	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+		mCommandList.Get(), vertexData, vbByteSize, *mStagingRing);
 
 	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+		mCommandList.Get(), indices.data(), ibByteSize, *mStagingRing);
 
-	geo->VertexByteStride = sizeof(Vertex);
+	geo->VertexByteStride = vertexStride;
 	geo->VertexBufferByteSize = vbByteSize;
 	geo->IndexFormat = DXGI_FORMAT_R16_UINT;
 	geo->IndexBufferByteSize = ibByteSize;
@@ -1124,120 +2514,31 @@ void TexWavesApp::BuildCastleGeometry()
 
 }
 
+// The flat patch every terrain tile draws; the heights come from the terrain's
+// height map in the vertex shader.
 void TexWavesApp::BuildLandGeometry()
 {
-    GeometryGenerator geoGen;
-    GeometryGenerator::MeshData grid = geoGen.CreateGrid(500.0f, 500.0f, 50, 50);
-
-    //
-    // Extract the vertex elements we are interested and apply the height function to
-    // each vertex.  In addition, color the vertices based on their height so we have
-    // sandy looking beaches, grassy low hills, and snow mountain peaks.
-    //
-
-    std::vector<Vertex> vertices(grid.Vertices.size());
-    for(size_t i = 0; i < grid.Vertices.size(); ++i)
-    {
-        auto& p = grid.Vertices[i].Position;
-        vertices[i].Pos = p;
-		if (p.x > 35 || p.x < -35 && p.z > 35 || p.z < -35)
-		{
-			vertices[i].Pos.y = GetHillsHeight(p.x, p.z);
-			vertices[i].Normal = GetHillsNormal(p.x, p.z);
-		}
-		else
-		{
-			vertices[i].Normal = grid.Vertices[i].Normal;
-		}
-		vertices[i].TexC = grid.Vertices[i].TexC;
-    }
-
-    const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
-
-    std::vector<std::uint16_t> indices = grid.GetIndices16();
-    const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
-
-	auto geo = std::make_unique<MeshGeometry>();
-	geo->Name = "landGeo";
-
-	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
-	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
-
-	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
-	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
-
-	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
-
-	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
-
-	geo->VertexByteStride = sizeof(Vertex);
-	geo->VertexBufferByteSize = vbByteSize;
-	geo->IndexFormat = DXGI_FORMAT_R16_UINT;
-	geo->IndexBufferByteSize = ibByteSize;
-
-	SubmeshGeometry submesh;
-	submesh.IndexCount = (UINT)indices.size();
-	submesh.StartIndexLocation = 0;
-	submesh.BaseVertexLocation = 0;
-
-	geo->DrawArgs["grid"] = submesh;
-
-	mGeometries["landGeo"] = std::move(geo);
-}
-
-void TexWavesApp::BuildTreeSpritesGeometry()
-{
-	srand(time(nullptr));
-	//step5
-	struct TreeSpriteVertex
-	{
-		XMFLOAT3 Pos;
-		XMFLOAT2 Size;
-	};
+	const int quads = mTerrain->PatchQuads();
 
-	static const int treeCount = 16;
-	std::array<TreeSpriteVertex, 16> vertices;
-	for (UINT i = 0; i < treeCount; ++i)
+	std::vector<Vertex> vertices((quads + 1) * (quads + 1));
+	for(int z = 0; z <= quads; ++z)
 	{
-		float factor = MathHelper::RandF(0.0f, 360.0f);
-		float x = cos(factor) * 30;
-		float z = sin(factor) * 30;
-		float y = 0.0f;
-		/*float x = MathHelper::RandF(10.0f, 60.0f);
-		if(MathHelper::Rand(0,1) == 0)
-		{
-			x *= -1;
-		}
-		float z = MathHelper::RandF(10.0f, 60.0f);
-		if (MathHelper::Rand(0, 1) == 0)
+		for(int x = 0; x <= quads; ++x)
 		{
-			z *= -1;
+			Vertex& v = vertices[z * (quads + 1) + x];
+			v.Pos = XMFLOAT3((float)x / quads, 0.0f, (float)z / quads);
+			v.Normal = XMFLOAT3(0.0f, 1.0f, 0.0f);
+			v.TexC = XMFLOAT2(v.Pos.x, v.Pos.z);
 		}
-		
-		if (x > 30 || x < -30 && z > 30 || z < -30)
-		{
-			y = GetHillsHeight(x, z);
-		}*/
-		// Move tree slightly above land height.
-		y += 8.0f;
-
-		vertices[i].Pos = XMFLOAT3(x, y, z);
-		vertices[i].Size = XMFLOAT2(20.0f, 20.0f);
 	}
 
-	std::array<std::uint16_t, 16> indices =
-	{
-		0, 1, 2, 3, 4, 5, 6, 7,
-		8, 9, 10, 11, 12, 13, 14, 15
-	};
+	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
 
-	const UINT vbByteSize = (UINT)vertices.size() * sizeof(TreeSpriteVertex);
+	const std::vector<std::uint16_t>& indices = mTerrain->Indices();
 	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
 
 	auto geo = std::make_unique<MeshGeometry>();
-	geo->Name = "treeSpritesGeo";
+	geo->Name = "landGeo";
 
 	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
 	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
@@ -1246,30 +2547,23 @@ void TexWavesApp::BuildTreeSpritesGeometry()
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
 	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+		mCommandList.Get(), vertices.data(), vbByteSize, *mStagingRing);
 
 	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+		mCommandList.Get(), indices.data(), ibByteSize, *mStagingRing);
 
-	geo->VertexByteStride = sizeof(TreeSpriteVertex);
+	geo->VertexByteStride = sizeof(Vertex);
 	geo->VertexBufferByteSize = vbByteSize;
 	geo->IndexFormat = DXGI_FORMAT_R16_UINT;
 	geo->IndexBufferByteSize = ibByteSize;
 
-	SubmeshGeometry submesh;
-	submesh.IndexCount = (UINT)indices.size();
-	submesh.StartIndexLocation = 0;
-	submesh.BaseVertexLocation = 0;
-
-	geo->DrawArgs["points"] = submesh;
-
-	mGeometries["treeSpritesGeo"] = std::move(geo);
+	// The tiles draw the ranges of Terrain::TileDrawArgs.
+	mGeometries["landGeo"] = std::move(geo);
 }
 
 void TexWavesApp::BuildWavesGeometry()
 {
-    std::vector<std::uint16_t> indices(3 * mWaves->TriangleCount()); // 3 indices per face
-	assert(mWaves->VertexCount() < 0x0000ffff);
+    std::vector<std::uint32_t> indices(3 * mWaves->TriangleCount()); // 3 indices per face
 
     // Iterate over each quad.
     int m = mWaves->RowCount();
@@ -1292,7 +2586,7 @@ void TexWavesApp::BuildWavesGeometry()
     }
 
 	UINT vbByteSize = mWaves->VertexCount()*sizeof(Vertex);
-	UINT ibByteSize = (UINT)indices.size()*sizeof(std::uint16_t);
+	UINT ibByteSize = (UINT)indices.size()*sizeof(std::uint32_t);
 
 	auto geo = std::make_unique<MeshGeometry>();
 	geo->Name = "waterGeo";
@@ -1305,11 +2599,120 @@ void TexWavesApp::BuildWavesGeometry()
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
 	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+		mCommandList.Get(), indices.data(), ibByteSize, *mStagingRing);
 
 	geo->VertexByteStride = sizeof(Vertex);
 	geo->VertexBufferByteSize = vbByteSize;
-	geo->IndexFormat = DXGI_FORMAT_R16_UINT;
+	geo->IndexFormat = DXGI_FORMAT_R32_UINT;
+	geo->IndexBufferByteSize = ibByteSize;
+
+	SubmeshGeometry submesh;
+	submesh.IndexCount = (UINT)indices.size();
+	submesh.StartIndexLocation = 0;
+	submesh.BaseVertexLocation = 0;
+
+	// The heights are dynamic; allow for the largest expected crest.
+	submesh.Bounds.Center = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	submesh.Bounds.Extents = XMFLOAT3(0.5f*mWaves->Width(), 4.0f, 0.5f*mWaves->Depth());
+
+	geo->DrawArgs["grid"] = submesh;
+
+	mGeometries["waterGeo"] = std::move(geo);
+}
+
+void TexWavesApp::BuildGpuWavesGeometry()
+{
+	// The rendered mesh is independent of the simulation grid: a flat clipmap centred
+	// on the local origin, displaced by the simulation in the vertex shader.  Level 0
+	// is a full grid; every coarser level is the same grid at twice the spacing with
+	// the area of the level inside it cut out.
+	const int n = gWaterClipmapQuads;
+	float dx = mGpuWaves->SpatialStep();
+
+	std::vector<Vertex> vertices;
+	std::vector<std::uint32_t> indices;
+	for(int level = 0; level < gWaterClipmapLevels; ++level)
+	{
+		float h = dx * (1 << level);
+		UINT base = (UINT)vertices.size();
+
+		for(int i = 0; i <= n; ++i)
+		{
+			for(int j = 0; j <= n; ++j)
+			{
+				Vertex v;
+				v.Pos = XMFLOAT3((j - n / 2)*h, 0.0f, (i - n / 2)*h);
+				v.Normal = XMFLOAT3(0.0f, 1.0f, 0.0f);
+				v.TexC = XMFLOAT2(0.0f, 0.0f);
+				vertices.push_back(v);
+			}
+		}
+
+		// The outer edge meets the next level's inner edge, which has half as many
+		// vertices; snapping the odd ones to their even neighbour avoids T-junctions.
+		bool stitch = level + 1 < gWaterClipmapLevels;
+		auto vertex = [&](int i, int j)
+		{
+			if(stitch)
+			{
+				if((i == 0 || i == n) && (j & 1))
+					--j;
+				if((j == 0 || j == n) && (i & 1))
+					--i;
+			}
+			return base + (UINT)(i*(n + 1) + j);
+		};
+
+		auto addTriangle = [&](UINT a, UINT b, UINT c)
+		{
+			if(a == b || b == c || a == c)
+				return;
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+		};
+
+		for(int i = 0; i < n; ++i)
+		{
+			for(int j = 0; j < n; ++j)
+			{
+				bool inner = i >= n / 4 && i < 3 * n / 4 && j >= n / 4 && j < 3 * n / 4;
+				if(level > 0 && inner)
+					continue;
+
+				UINT v00 = vertex(i, j);
+				UINT v10 = vertex(i, j + 1);
+				UINT v01 = vertex(i + 1, j);
+				UINT v11 = vertex(i + 1, j + 1);
+				addTriangle(v00, v01, v10);
+				addTriangle(v10, v01, v11);
+			}
+		}
+	}
+
+	auto geo = std::make_unique<MeshGeometry>();
+	geo->Name = "waterGeo";
+
+	const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
+
+	ThrowIfFailed(D3DCreateBlob(vbByteSize, &geo->VertexBufferCPU));
+	CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), vertices.data(), vbByteSize);
+
+	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
+		mCommandList.Get(), vertices.data(), vbByteSize, *mStagingRing);
+
+	geo->VertexByteStride = sizeof(Vertex);
+	geo->VertexBufferByteSize = vbByteSize;
+
+	const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint32_t);
+
+	ThrowIfFailed(D3DCreateBlob(ibByteSize, &geo->IndexBufferCPU));
+	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
+
+	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
+		mCommandList.Get(), indices.data(), ibByteSize, *mStagingRing);
+
+	geo->IndexFormat = DXGI_FORMAT_R32_UINT;
 	geo->IndexBufferByteSize = ibByteSize;
 
 	SubmeshGeometry submesh;
@@ -1317,6 +2720,11 @@ void TexWavesApp::BuildWavesGeometry()
 	submesh.StartIndexLocation = 0;
 	submesh.BaseVertexLocation = 0;
 
+	// The heights come from the displacement map; allow for the largest expected crest.
+	float extent = 0.5f * n * dx * (1 << (gWaterClipmapLevels - 1));
+	submesh.Bounds.Center = XMFLOAT3(0.0f, 0.0f, 0.0f);
+	submesh.Bounds.Extents = XMFLOAT3(extent, 4.0f, extent);
+
 	geo->DrawArgs["grid"] = submesh;
 
 	mGeometries["waterGeo"] = std::move(geo);
@@ -1351,10 +2759,10 @@ void TexWavesApp::BuildBoxGeometry()
 	CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), indices.data(), ibByteSize);
 
 	geo->VertexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), vertices.data(), vbByteSize, geo->VertexBufferUploader);
+		mCommandList.Get(), vertices.data(), vbByteSize, *mStagingRing);
 
 	geo->IndexBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
-		mCommandList.Get(), indices.data(), ibByteSize, geo->IndexBufferUploader);
+		mCommandList.Get(), indices.data(), ibByteSize, *mStagingRing);
 
 	geo->VertexByteStride = sizeof(Vertex);
 	geo->VertexBufferByteSize = vbByteSize;
@@ -1365,6 +2773,7 @@ void TexWavesApp::BuildBoxGeometry()
 	submesh.IndexCount = (UINT)indices.size();
 	submesh.StartIndexLocation = 0;
 	submesh.BaseVertexLocation = 0;
+	BoundingBox::CreateFromPoints(submesh.Bounds, vertices.size(), &vertices[0].Pos, sizeof(Vertex));
 
 	geo->DrawArgs["box"] = submesh;
 
@@ -1376,21 +2785,12 @@ void TexWavesApp::BuildPSOs()
     D3D12_GRAPHICS_PIPELINE_STATE_DESC opaquePsoDesc;
 
 	//
-	// PSO for opaque objects.
+	// PSO for opaque objects.  The Default.hlsl layers only keep their descs here;
+	// VariantPipeline adds the shaders of each variant.
 	//
     ZeroMemory(&opaquePsoDesc, sizeof(D3D12_GRAPHICS_PIPELINE_STATE_DESC));
 	opaquePsoDesc.InputLayout = { mInputLayout.data(), (UINT)mInputLayout.size() };
-	opaquePsoDesc.pRootSignature = mRootSignature.Get();
-	opaquePsoDesc.VS = 
-	{ 
-		reinterpret_cast<BYTE*>(mShaders["standardVS"]->GetBufferPointer()), 
-		mShaders["standardVS"]->GetBufferSize()
-	};
-	opaquePsoDesc.PS = 
-	{ 
-		reinterpret_cast<BYTE*>(mShaders["opaquePS"]->GetBufferPointer()),
-		mShaders["opaquePS"]->GetBufferSize()
-	};
+	opaquePsoDesc.pRootSignature = mRootSignature.Get();
 	opaquePsoDesc.RasterizerState = CD3DX12_RASTERIZER_DESC(D3D12_DEFAULT);
 	opaquePsoDesc.BlendState = CD3DX12_BLEND_DESC(D3D12_DEFAULT);
 	opaquePsoDesc.DepthStencilState = CD3DX12_DEPTH_STENCIL_DESC(D3D12_DEFAULT);
@@ -1401,7 +2801,24 @@ void TexWavesApp::BuildPSOs()
 	opaquePsoDesc.SampleDesc.Count = m4xMsaaState ? 4 : 1;
 	opaquePsoDesc.SampleDesc.Quality = m4xMsaaState ? (m4xMsaaQuality - 1) : 0;
 	opaquePsoDesc.DSVFormat = mDepthStencilFormat;
-    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&opaquePsoDesc, IID_PPV_ARGS(&mPSOs["opaque"])));
+
+	// The opaque layers hold only the castle meshes, which may be compact; the other
+	// PSOs derive from opaquePsoDesc and keep the full layout.  The compact variants
+	// have their own keys, hence pipeline library names.
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC castlePsoDesc = opaquePsoDesc;
+	if(mCompactVertices)
+		castlePsoDesc.InputLayout = { mCompactInputLayout.data(), (UINT)mCompactInputLayout.size() };
+	mLayerPsoDescs[(int)RenderLayer::Opaque] = castlePsoDesc;
+
+	//
+	// PSO for instanced opaque objects
+	//
+	mLayerPsoDescs[(int)RenderLayer::OpaqueInstanced] = castlePsoDesc;
+
+	//
+	// PSO for the terrain tiles
+	//
+	mLayerPsoDescs[(int)RenderLayer::Terrain] = opaquePsoDesc;
 
 	// step1:
 	// PSO for transparent objects
@@ -1443,44 +2860,258 @@ void TexWavesApp::BuildPSOs()
 	//transparencyBlendDesc.RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_BLUE;
 	//Direct3D supports rendering to up to eight render targets simultaneously.
 	transparentPsoDesc.BlendState.RenderTarget[0] = transparencyBlendDesc;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&transparentPsoDesc, IID_PPV_ARGS(&mPSOs["transparent"])));
+	mLayerPsoDescs[(int)RenderLayer::Transparent] = transparentPsoDesc;
+
+	//
+	// PSO for drawing waves displaced by the GPU simulation
+	//
+	mLayerPsoDescs[(int)RenderLayer::GpuWaves] = transparentPsoDesc;
 
 	// PSO for alpha tested objects
 
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC alphaTestedPsoDesc = opaquePsoDesc;
-	alphaTestedPsoDesc.PS =
-	{
-		reinterpret_cast<BYTE*>(mShaders["alphaTestedPS"]->GetBufferPointer()),
-		mShaders["alphaTestedPS"]->GetBufferSize()
-	};
 	alphaTestedPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&alphaTestedPsoDesc, IID_PPV_ARGS(&mPSOs["alphaTested"])));
+	mLayerPsoDescs[(int)RenderLayer::AlphaTested] = alphaTestedPsoDesc;
+
+	//
+	// PSOs of the materials' variants, created as the materials need them
+	//
+	for(int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		for(auto& p : mMaterialPipelines[layer])
+		{
+			if(!p.Used)
+				continue;
+
+			p.PSO = VariantPipeline((RenderLayer)layer, p.Features);
+			p.SortId = (UINT)(std::find(mLayerPipelines[layer].begin(), mLayerPipelines[layer].end(), p.PSO) -
+				mLayerPipelines[layer].begin());
+		}
+	}
 
 	//
 	// PSO for tree sprites
 	//
 	D3D12_GRAPHICS_PIPELINE_STATE_DESC treeSpritePsoDesc = opaquePsoDesc;
-	treeSpritePsoDesc.VS =
+	treeSpritePsoDesc.VS = mTreeSpriteShaders->Get(0, "VS");
+	treeSpritePsoDesc.PS = mTreeSpriteShaders->Get(LayerShaderFeatures(RenderLayer::AlphaTestedTreeSprites), "PS");
+	// The vertex shader makes up the quads from the instance buffer.
+	treeSpritePsoDesc.InputLayout = { nullptr, 0 };
+	treeSpritePsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+
+	mPSOs["treeSprites"] = mShaderCache->CreateGraphicsPipeline("treeSprites", treeSpritePsoDesc);
+
+	//
+	// PSO for the dynamic resolution upscale: a full screen triangle without depth,
+	// into the back buffer.
+	//
+	if(mDynamicResolution != nullptr)
+	{
+		D3D12_GRAPHICS_PIPELINE_STATE_DESC upscalePsoDesc = opaquePsoDesc;
+		upscalePsoDesc.InputLayout = { nullptr, 0 };
+		upscalePsoDesc.pRootSignature = mUpscaleRootSignature.Get();
+		upscalePsoDesc.VS =
+		{
+			reinterpret_cast<BYTE*>(mShaders["upscaleVS"]->GetBufferPointer()),
+			mShaders["upscaleVS"]->GetBufferSize()
+		};
+		upscalePsoDesc.PS =
+		{
+			reinterpret_cast<BYTE*>(mShaders["upscalePS"]->GetBufferPointer()),
+			mShaders["upscalePS"]->GetBufferSize()
+		};
+		upscalePsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+		upscalePsoDesc.DepthStencilState.DepthEnable = false;
+		upscalePsoDesc.DepthStencilState.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ZERO;
+		upscalePsoDesc.DSVFormat = DXGI_FORMAT_UNKNOWN;
+		mPSOs["upscale"] = mShaderCache->CreateGraphicsPipeline("upscale", upscalePsoDesc);
+	}
+
+	//
+	// PSO for disturbing waves
+	//
+	D3D12_COMPUTE_PIPELINE_STATE_DESC wavesDisturbPSO = {};
+	wavesDisturbPSO.pRootSignature = mWavesRootSignature.Get();
+	wavesDisturbPSO.CS =
 	{
-		reinterpret_cast<BYTE*>(mShaders["treeSpriteVS"]->GetBufferPointer()),
-		mShaders["treeSpriteVS"]->GetBufferSize()
+		reinterpret_cast<BYTE*>(mShaders["wavesDisturbCS"]->GetBufferPointer()),
+		mShaders["wavesDisturbCS"]->GetBufferSize()
 	};
-	treeSpritePsoDesc.GS =
+	wavesDisturbPSO.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+	mPSOs["wavesDisturb"] = mShaderCache->CreateComputePipeline("wavesDisturb", wavesDisturbPSO);
+
+	//
+	// PSO for updating waves
+	//
+	D3D12_COMPUTE_PIPELINE_STATE_DESC wavesUpdatePSO = {};
+	wavesUpdatePSO.pRootSignature = mWavesRootSignature.Get();
+	wavesUpdatePSO.CS =
 	{
-		reinterpret_cast<BYTE*>(mShaders["treeSpriteGS"]->GetBufferPointer()),
-		mShaders["treeSpriteGS"]->GetBufferSize()
+		reinterpret_cast<BYTE*>(mShaders["wavesUpdateCS"]->GetBufferPointer()),
+		mShaders["wavesUpdateCS"]->GetBufferSize()
 	};
-	treeSpritePsoDesc.PS =
+	wavesUpdatePSO.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+	mPSOs["wavesUpdate"] = mShaderCache->CreateComputePipeline("wavesUpdate", wavesUpdatePSO);
+
+	//
+	// PSO for binning the clustered lights
+	//
+	D3D12_COMPUTE_PIPELINE_STATE_DESC lightCullPSO = {};
+	lightCullPSO.pRootSignature = mLightCullRootSignature.Get();
+	lightCullPSO.CS =
 	{
-		reinterpret_cast<BYTE*>(mShaders["treeSpritePS"]->GetBufferPointer()),
-		mShaders["treeSpritePS"]->GetBufferSize()
+		reinterpret_cast<BYTE*>(mShaders["lightCullCS"]->GetBufferPointer()),
+		mShaders["lightCullCS"]->GetBufferSize()
 	};
-	//step1
-	treeSpritePsoDesc.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_POINT;
-	treeSpritePsoDesc.InputLayout = { mTreeSpriteInputLayout.data(), (UINT)mTreeSpriteInputLayout.size() };
-	treeSpritePsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+	lightCullPSO.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+	mPSOs["lightCull"] = mShaderCache->CreateComputePipeline("lightCull", lightCullPSO);
+
+	//
+	// PSOs for GPU-driven culling.
+	//
+	if(mGpuDriven)
+	{
+		auto computePso = [this](const char* name, ID3D12RootSignature* rootSig, const char* shader)
+		{
+			D3D12_COMPUTE_PIPELINE_STATE_DESC psoDesc = {};
+			psoDesc.pRootSignature = rootSig;
+			psoDesc.CS =
+			{
+				reinterpret_cast<BYTE*>(mShaders[shader]->GetBufferPointer()),
+				mShaders[shader]->GetBufferSize()
+			};
+			psoDesc.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+			mPSOs[name] = mShaderCache->CreateComputePipeline(name, psoDesc);
+		};
+		computePso("gpuCull", mCullRootSignature.Get(), "gpuCullCS");
+		computePso("hiZDepth", mHiZRootSignature.Get(), "hiZDepthCS");
+		computePso("hiZDepthMS", mHiZRootSignature.Get(), "hiZDepthMSCS");
+		computePso("hiZDownsample", mHiZRootSignature.Get(), "hiZDownsampleCS");
+	}
+}
+
+// Picks the cheapest Default.hlsl variant for each material of each layer, then
+// compiles the new variants in parallel.  On top of the layer's features, a material
+// only gets the texture transform if it or one of its items transforms the
+// tex-coords, and only shades the clustered light types whose range reaches one of its
+// items.  The lights and world matrices are static, but for the water's.
+void TexWavesApp::BuildShaderVariants()
+{
+	std::vector<BoundingSphere> pointLights;
+	std::vector<BoundingSphere> spotLights;
+	for(auto& light : mClusteredLighting->Lights())
+	{
+		BoundingSphere sphere(light.L.Position, light.L.FalloffEnd);
+		if(light.Type == ClusteredLighting::SpotLight)
+			spotLights.push_back(sphere);
+		else
+			pointLights.push_back(sphere);
+	}
+
+	auto reaches = [](const std::vector<BoundingSphere>& lights, const BoundingBox& bounds)
+	{
+		return std::any_of(lights.begin(), lights.end(),
+			[&bounds](const BoundingSphere& s) { return s.Intersects(bounds); });
+	};
+
+	const Material* waterMat = mMaterials.Get(mWaterMat);
+
+	for(int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		auto& pipelines = mMaterialPipelines[layer];
+		pipelines.assign(mMaterials.Size(), MaterialPipeline());
+
+		UINT layerFeatures = LayerShaderFeatures((RenderLayer)layer);
+		for(auto ri : mRitemLayer[layer])
+		{
+			UINT features = layerFeatures;
+
+			// AnimateMaterials scrolls the water's texture.
+			if(ri->Mat == waterMat ||
+				!XMMatrixIsIdentity(XMLoadFloat4x4(&ri->TexTransform)) ||
+				!XMMatrixIsIdentity(XMLoadFloat4x4(&ri->Mat->MatTransform)))
+			{
+				features |= FeatureTexTransform;
+			}
+
+			// The water clipmap follows the camera, so any light may reach it.
+			BoundingBox worldBounds;
+			ri->Bounds.Transform(worldBounds, XMLoadFloat4x4(&ri->World));
+			if(!pointLights.empty() && (ri == mWavesRitem || reaches(pointLights, worldBounds)))
+				features |= FeaturePointLights;
+			if(!spotLights.empty() && (ri == mWavesRitem || reaches(spotLights, worldBounds)))
+				features |= FeatureSpotLights;
+
+			pipelines[ri->Mat->MatCBIndex].Used = true;
+			pipelines[ri->Mat->MatCBIndex].Features |= features;
+		}
+
+		for(auto& p : pipelines)
+		{
+			if(!p.Used)
+				continue;
 
-	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&treeSpritePsoDesc, IID_PPV_ARGS(&mPSOs["treeSprites"])));
+			mDefaultShaders->Request(p.Features & gVertexShaderFeatures, "VS", "vs_5_1");
+			mDefaultShaders->Request(p.Features & gPixelShaderFeatures, "PS", "ps_5_1");
+		}
+	}
+
+	mTreeSpriteShaders->Request(0, "VS", "vs_5_1");
+	mTreeSpriteShaders->Request(LayerShaderFeatures(RenderLayer::AlphaTestedTreeSprites), "PS", "ps_5_1");
+
+	mDefaultShaders->CompilePending();
+	mTreeSpriteShaders->CompilePending();
+}
+
+// The features of every variant drawn in the layer: the pass's, and the layer's
+// vertex format and alpha test.
+UINT TexWavesApp::LayerShaderFeatures(RenderLayer layer)const
+{
+	UINT features = mDirLightCount << gDirLightCountShift;
+	if(mFog)
+		features |= FeatureFog;
+
+	switch(layer)
+	{
+	case RenderLayer::Opaque:
+		return features | (mCompactVertices ? FeatureCompactVertex : 0);
+	case RenderLayer::OpaqueInstanced:
+		return features | FeatureInstanced | (mCompactVertices ? FeatureCompactVertex : 0);
+	case RenderLayer::Terrain:
+		return features | FeatureTerrain;
+	case RenderLayer::AlphaTested:
+	case RenderLayer::AlphaTestedTreeSprites:
+		return features | FeatureAlphaTest;
+	case RenderLayer::GpuWaves:
+		return features | FeatureDisplacementMap;
+	default:
+		return features;
+	}
+}
+
+// The layer's PSO with the Default.hlsl variant of features, created through the
+// pipeline library the first time it is asked for.  Not called while recording, so
+// the draws only read the pointers.
+ID3D12PipelineState* TexWavesApp::VariantPipeline(RenderLayer layer, UINT features)
+{
+	const char* layerNames[] = { "opaque", "transparent", "alphaTested", "treeSprites", "wavesRender", "opaqueInstanced", "terrain" };
+	static_assert(_countof(layerNames) == (int)RenderLayer::Count, "one name per RenderLayer");
+
+	std::ostringstream name;
+	name << layerNames[(int)layer] << "_" << std::hex << features;
+
+	auto it = mPSOs.find(name.str());
+	if(it != mPSOs.end())
+		return it->second.Get();
+
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC psoDesc = mLayerPsoDescs[(int)layer];
+	psoDesc.VS = mDefaultShaders->Get(features & gVertexShaderFeatures, "VS");
+	psoDesc.PS = mDefaultShaders->Get(features & gPixelShaderFeatures, "PS");
+
+	ComPtr<ID3D12PipelineState> pso = mShaderCache->CreateGraphicsPipeline(name.str(), psoDesc);
+	mPSOs[name.str()] = pso;
+	mLayerPipelines[(int)layer].push_back(pso.Get());
+	return pso.Get();
 }
 
 void TexWavesApp::BuildFrameResources()
@@ -1488,18 +3119,37 @@ void TexWavesApp::BuildFrameResources()
     for(int i = 0; i < gNumFrameResources; ++i)
     {
         mFrameResources.push_back(std::make_unique<FrameResource>(md3dDevice.Get(),
-            1, (UINT)mAllRitems.size(), (UINT)mMaterials.size(), mWaves->VertexCount()));
+            gFrameConstantsPageSize, mUseGpuWaves ? 0 : mWaves->VertexCount(),
+            (UINT)mRitemLayer[(int)RenderLayer::OpaqueInstanced].size(), (UINT)DrawPass::Count));
     }
 }
 
+void TexWavesApp::BuildComputeQueue()
+{
+	D3D12_COMMAND_QUEUE_DESC queueDesc = {};
+	queueDesc.Type = D3D12_COMMAND_LIST_TYPE_COMPUTE;
+	queueDesc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+	ThrowIfFailed(md3dDevice->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&mComputeQueue)));
+
+	ThrowIfFailed(md3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE,
+		IID_PPV_ARGS(&mComputeFence)));
+
+	// Created closed; Draw resets it with the frame resource's allocator.
+	ThrowIfFailed(md3dDevice->CreateCommandList(
+		0,
+		D3D12_COMMAND_LIST_TYPE_COMPUTE,
+		mFrameResources[0]->ComputeCmdListAlloc.Get(),
+		nullptr,
+		IID_PPV_ARGS(mComputeCommandList.GetAddressOf())));
+	ThrowIfFailed(mComputeCommandList->Close());
+}
+
 void TexWavesApp::BuildMaterials()
 {
 
-	int cbi = 0;
 	int SHI = 0;
 	auto grass = std::make_unique<Material>();
 	grass->Name = "grass";
-	grass->MatCBIndex = cbi++;
 	grass->DiffuseSrvHeapIndex = SHI++;
 	grass->DiffuseAlbedo = XMFLOAT4(1.0f, 0.5f, 0.0f, 1.0f);
 	grass->FresnelR0 = XMFLOAT3(0.01f, 0.01f, 0.01f);
@@ -1509,7 +3159,6 @@ void TexWavesApp::BuildMaterials()
 	// tools we need (transparency, environment reflection), so we fake it for now.
 	auto water = std::make_unique<Material>();
 	water->Name = "water";
-	water->MatCBIndex = cbi++;
 	water->DiffuseSrvHeapIndex = SHI++;
 	water->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 0.5f);
 	water->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1517,7 +3166,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto wirefence = std::make_unique<Material>();
 	wirefence->Name = "wirefence";
-	wirefence->MatCBIndex = cbi++;
 	wirefence->DiffuseSrvHeapIndex = SHI++;
 	wirefence->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	wirefence->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1525,7 +3173,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto stone = std::make_unique<Material>();
 	stone->Name = "stone";
-	stone->MatCBIndex = cbi++;
 	stone->DiffuseSrvHeapIndex = SHI++;
 	stone->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	stone->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1533,7 +3180,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto stone2 = std::make_unique<Material>();
 	stone2->Name = "stone2";
-	stone2->MatCBIndex = cbi++;
 	stone2->DiffuseSrvHeapIndex = SHI++;
 	stone2->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	stone2->FresnelR0 = XMFLOAT3(0.1f, 0.1f, 0.1f);
@@ -1541,7 +3187,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto sapphire = std::make_unique<Material>();
 	sapphire->Name = "sapphire";
-	sapphire->MatCBIndex = cbi++;
 	sapphire->DiffuseSrvHeapIndex = SHI++;
 	sapphire->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	sapphire->FresnelR0 = XMFLOAT3(0.9f, 0.9f, 0.9f);
@@ -1549,7 +3194,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto carpet = std::make_unique<Material>();
 	carpet->Name = "carpet";
-	carpet->MatCBIndex = cbi++;
 	carpet->DiffuseSrvHeapIndex = SHI++;
 	carpet->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	carpet->FresnelR0 = XMFLOAT3(0.8f, 0.8f, 0.8f);
@@ -1557,7 +3201,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto emerald = std::make_unique<Material>();
 	emerald->Name = "emerald";
-	emerald->MatCBIndex = cbi++;
 	emerald->DiffuseSrvHeapIndex = SHI++;
 	emerald->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	emerald->FresnelR0 = XMFLOAT3(0.5f, 0.5f, 0.5f);
@@ -1565,7 +3208,6 @@ void TexWavesApp::BuildMaterials()
 
 	auto tiger_gem = std::make_unique<Material>();
 	tiger_gem->Name = "tiger_gem";
-	tiger_gem->MatCBIndex = cbi++;
 	tiger_gem->DiffuseSrvHeapIndex = SHI++;
 	tiger_gem->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	tiger_gem->FresnelR0 = XMFLOAT3(0.9f, 0.9f, 0.9f);
@@ -1573,70 +3215,166 @@ void TexWavesApp::BuildMaterials()
 
 	auto treeSprites = std::make_unique<Material>();
 	treeSprites->Name = "treeSprites";
-	treeSprites->MatCBIndex = cbi++;
 	treeSprites->DiffuseSrvHeapIndex = SHI++;
 	treeSprites->DiffuseAlbedo = XMFLOAT4(1.0f, 1.0f, 1.0f, 1.0f);
 	treeSprites->FresnelR0 = XMFLOAT3(0.01f, 0.01f, 0.01f);
 	treeSprites->Roughness = 0.125f;
 
-	mMaterials["grass"] = std::move(grass);
-	mMaterials["water"] = std::move(water);
-	mMaterials["wirefence"] = std::move(wirefence);
-	mMaterials["stone"] = std::move(stone);
-	mMaterials["stone2"] = std::move(stone2);
+	AddMaterial(std::move(grass));
+	AddMaterial(std::move(water));
+	AddMaterial(std::move(wirefence));
+	AddMaterial(std::move(stone));
+	AddMaterial(std::move(stone2));
 
-	mMaterials["sapphire"] = std::move(sapphire);
-	mMaterials["carpet"] = std::move(carpet);
-	mMaterials["emerald"] = std::move(emerald);
-	mMaterials["tiger_gem"] = std::move(tiger_gem);
+	AddMaterial(std::move(sapphire));
+	AddMaterial(std::move(carpet));
+	AddMaterial(std::move(emerald));
+	AddMaterial(std::move(tiger_gem));
 
-	mMaterials["treeSprites"] = std::move(treeSprites);
-	
+	AddMaterial(std::move(treeSprites));
+
+	mWaterMat = mMaterialHandles["water"];
+}
+
+// Registers ri, whose handle becomes its ObjCBIndex.
+RenderItem* TexWavesApp::AddRenderItem(std::unique_ptr<RenderItem> ri)
+{
+	RenderItem* p = ri.get();
+	p->ObjCBIndex = mAllRitems.Size();
+	mAllRitems.Add(std::move(ri));
+	return p;
+}
+
+// Registers mat under its name; its handle becomes its MatCBIndex.
+Material* TexWavesApp::AddMaterial(std::unique_ptr<Material> mat)
+{
+	Material* p = mat.get();
+	p->MatCBIndex = mMaterials.Size();
+	mMaterialHandles[p->Name] = mMaterials.Add(std::move(mat));
+	return p;
+}
+
+void TexWavesApp::BuildLights()
+{
+	// directional
+	mMainPassCB.Lights[0].Direction = { 0.57735f, -0.57735f, 0.57735f };
+	mMainPassCB.Lights[0].Strength = { 0.5f, 0.1f, 0.0f };
+	mDirLightCount = 1;
+
+	std::vector<ClusteredLighting::LightData> lights;
+
+	// point
+	ClusteredLighting::LightData point;
+	point.L.Position = { 0.0f, 18.0f, 0.0f };
+	point.L.Strength = { 0.196f, 0.784f, 0.305f };
+	point.L.FalloffStart = 1.0f;
+	point.L.FalloffEnd = 50.0f;
+	lights.push_back(point);
+
+	// spotlights on the columns
+	const float columnCorners[4][2] = { { -9.0f, -9.0f }, { 9.0f, -9.0f }, { -9.0f, 9.0f }, { 9.0f, 9.0f } };
+	for(auto& corner : columnCorners)
+	{
+		ClusteredLighting::LightData spot;
+		spot.L.Position = { corner[0], 13.0f, corner[1] };
+		spot.L.Direction = { 0.0f, -5.0f, 0.0f };
+		spot.L.Strength = { 0.541f, 0.984f, 1.0f };
+		spot.L.SpotPower = 0.45f;
+		spot.Type = ClusteredLighting::SpotLight;
+		lights.push_back(spot);
+	}
+
+	// torches along both faces of the four walls
+	for(int wall = 0; wall < 4; ++wall)
+	{
+		float side = wall % 2 == 0 ? -9.0f : 9.0f;
+		bool alongX = wall < 2;
+
+		for(int face = 0; face < 2; ++face)
+		{
+			float offset = face == 0 ? -0.4f : 0.4f;
+
+			for(int i = 0; i < gTorchesPerWall; ++i)
+			{
+				float t = -8.0f + 16.0f * (i + 0.5f) / gTorchesPerWall;
+
+				ClusteredLighting::LightData torch;
+				torch.L.Position = alongX ? XMFLOAT3(t, 6.0f, side + offset) : XMFLOAT3(side + offset, 6.0f, t);
+				torch.L.Strength = { 0.35f, 0.18f, 0.04f };
+				torch.L.FalloffStart = 0.5f;
+				torch.L.FalloffEnd = 2.0f;
+				lights.push_back(torch);
+			}
+		}
+	}
+
+	mClusteredLighting->SetLights(lights);
+}
+
+// Build time only.
+Material* TexWavesApp::FindMaterial(const std::string& name)const
+{
+	return mMaterials.Get(mMaterialHandles.at(name));
 }
 
 void TexWavesApp::BuildRenderItems()
 {
-	int cbindex = 0;
 
     auto wavesRitem = std::make_unique<RenderItem>();
     //wavesRitem->World = MathHelper::Identity4x4();
 	XMStoreFloat4x4(&wavesRitem->World, XMMatrixTranslation(0.0f, 0.5f, 0.0f));
 	XMStoreFloat4x4(&wavesRitem->TexTransform, XMMatrixScaling(5.0f, 5.0f, 1.0f));
-	wavesRitem->ObjCBIndex = cbindex++;
-	wavesRitem->Mat = mMaterials["water"].get();
+	wavesRitem->Mat = FindMaterial("water");
 	wavesRitem->Geo = mGeometries["waterGeo"].get();
 	wavesRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	wavesRitem->IndexCount = wavesRitem->Geo->DrawArgs["grid"].IndexCount;
 	wavesRitem->StartIndexLocation = wavesRitem->Geo->DrawArgs["grid"].StartIndexLocation;
 	wavesRitem->BaseVertexLocation = wavesRitem->Geo->DrawArgs["grid"].BaseVertexLocation;
+	wavesRitem->Bounds = wavesRitem->Geo->DrawArgs["grid"].Bounds;
+	if(mUseGpuWaves)
+	{
+		wavesRitem->DisplacementMapTexelSize.x = 1.0f / mGpuWaves->ColumnCount();
+		wavesRitem->DisplacementMapTexelSize.y = 1.0f / mGpuWaves->RowCount();
+		wavesRitem->GridSpatialStep = mGpuWaves->SpatialStep();
+	}
 
 	//// we use mVavesRitem in updatewaves() to set the dynamic VB of the wave renderitem to the current frame VB.
     mWavesRitem = wavesRitem.get();
 
-	mRitemLayer[(int)RenderLayer::Transparent].push_back(wavesRitem.get());
-	mAllRitems.push_back(std::move(wavesRitem));
+	mRitemLayer[mUseGpuWaves ? (int)RenderLayer::GpuWaves : (int)RenderLayer::Transparent].push_back(wavesRitem.get());
+	AddRenderItem(std::move(wavesRitem));
 	
 	//mRitemLayer[(int)RenderLayer::Opaque].push_back(wavesRitem.get());
 
-    auto gridRitem = std::make_unique<RenderItem>();
-    gridRitem->World = MathHelper::Identity4x4();
-	XMStoreFloat4x4(&gridRitem->TexTransform, XMMatrixScaling(5.0f, 5.0f, 1.0f));
-	gridRitem->ObjCBIndex = cbindex++;
-	gridRitem->Mat = mMaterials["grass"].get();
-	gridRitem->Geo = mGeometries["landGeo"].get();
-	gridRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-    gridRitem->IndexCount = gridRitem->Geo->DrawArgs["grid"].IndexCount;
-    gridRitem->StartIndexLocation = gridRitem->Geo->DrawArgs["grid"].StartIndexLocation;
-    gridRitem->BaseVertexLocation = gridRitem->Geo->DrawArgs["grid"].BaseVertexLocation;
-
-	mRitemLayer[(int)RenderLayer::Opaque].push_back(gridRitem.get());
-	mAllRitems.push_back(std::move(gridRitem));
+	// One item per terrain tile.  The grass repeats 5 times across the whole land.
+	const float tileTexScale = 5.0f / mTerrain->TilesPerSide();
+	for(int tile = 0; tile < mTerrain->TileCount(); ++tile)
+	{
+		auto tileRitem = std::make_unique<RenderItem>();
+		tileRitem->World = mTerrain->TileWorld(tile);
+		XMStoreFloat4x4(&tileRitem->TexTransform,
+			XMMatrixScaling(tileTexScale, tileTexScale, 1.0f) *
+			XMMatrixTranslation((tile % mTerrain->TilesPerSide()) * tileTexScale, (tile / mTerrain->TilesPerSide()) * tileTexScale, 0.0f));
+		tileRitem->Mat = FindMaterial("grass");
+		tileRitem->Geo = mGeometries["landGeo"].get();
+		tileRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+		tileRitem->IndexCount = mTerrain->TileDrawArgs(tile).IndexCount;
+		tileRitem->StartIndexLocation = mTerrain->TileDrawArgs(tile).StartIndexLocation;
+		tileRitem->BaseVertexLocation = mTerrain->TileDrawArgs(tile).BaseVertexLocation;
+		tileRitem->Bounds = mTerrain->TileBounds(tile);
+		tileRitem->DisplacementMapTexelSize = mTerrain->HeightMapTexelSize();
+		tileRitem->GridSpatialStep = mTerrain->SpatialStep();
+
+		mTerrainRitems.push_back(tileRitem.get());
+		mRitemLayer[(int)RenderLayer::Terrain].push_back(tileRitem.get());
+		AddRenderItem(std::move(tileRitem));
+	}
 	
 
 	//auto boxRitem = std::make_unique<RenderItem>();
 	//XMStoreFloat4x4(&boxRitem->World, XMMatrixTranslation(3.0f, 2.0f, -9.0f));
 	//boxRitem->ObjCBIndex = cbindex++;
-	//boxRitem->Mat = mMaterials["wirefence"].get();
+	//boxRitem->Mat = FindMaterial("wirefence");
 	//boxRitem->Geo = mGeometries["boxGeo"].get();
 	//boxRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	//boxRitem->IndexCount = boxRitem->Geo->DrawArgs["box"].IndexCount;
@@ -1650,7 +3388,7 @@ void TexWavesApp::BuildRenderItems()
 	/*auto gridRitem2 = std::make_unique<RenderItem>();
 	gridRitem2->World = MathHelper::Identity4x4();
 	gridRitem2->ObjCBIndex = cbindex++;
-	gridRitem2->Mat = mMaterials["wirefence"].get();
+	gridRitem2->Mat = FindMaterial("wirefence");
 	gridRitem2->Geo = mGeometries["shapeGeo"].get();
 	gridRitem2->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	gridRitem2->IndexCount = gridRitem2->Geo->DrawArgs["ground"].IndexCount;
@@ -1661,252 +3399,258 @@ void TexWavesApp::BuildRenderItems()
 	mAllRitems.push_back(std::move(gridRitem2));*/
 
 
+	mCastleItemsBegin = mAllRitems.Size();
+	if(mScenePackLoaded)
+		AddPackedRenderItems(mPackedPlacements);
+	else
+		BuildCastleRenderItems();
+	mCastleItemsEnd = mAllRitems.Size();
+	mPackedPlacements.clear();
+
+	// The trees are drawn by mFoliage rather than from render items.
+	mTreeMaterial = FindMaterial("treeSprites");
+}
+
+// The walls, columns and keep of the castle, and its copies.
+void TexWavesApp::BuildCastleRenderItems()
+{
+	// The castle's items, from here to the top, are what BuildCastleCopies copies.
+	UINT firstCastleItem = mAllRitems.Size();
+
 	auto backWall = std::make_unique<RenderItem>();
 	//backWall->World = MathHelper::Identity4x4();
 	XMStoreFloat4x4(&backWall->World, XMMatrixScaling(18.0f, 8.0f, 0.5f) * XMMatrixTranslation(0.0f, 4.0f, 9.0f));
 	XMStoreFloat4x4(&backWall->TexTransform, XMMatrixScaling(4.0f, 1.6f, 1.0f));
-	backWall->ObjCBIndex = cbindex++;
-	backWall->Mat = mMaterials["stone"].get();
+	backWall->Mat = FindMaterial("stone");
 	backWall->Geo = mGeometries["shapeGeo"].get();
 	backWall->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	backWall->IndexCount = backWall->Geo->DrawArgs["wholeWall"].IndexCount;
 	backWall->StartIndexLocation = backWall->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	backWall->BaseVertexLocation = backWall->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	backWall->Bounds = backWall->Geo->DrawArgs["wholeWall"].Bounds;
 	
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(backWall.get());
-	mAllRitems.push_back(std::move(backWall));
+	AddRenderItem(std::move(backWall));
 
 	auto leftWall = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&leftWall->World, XMMatrixScaling(18.0f, 8.0f, 0.5f) * XMMatrixRotationAxis(XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMConvertToRadians(90.0f)) * XMMatrixTranslation(-9.0f, 4.0f, 0.0f));
 	XMStoreFloat4x4(&leftWall->TexTransform, XMMatrixScaling(4.0f, 1.6f, 1.0f));
-	leftWall->ObjCBIndex = cbindex++;
-	leftWall->Mat = mMaterials["stone"].get();
+	leftWall->Mat = FindMaterial("stone");
 	leftWall->Geo = mGeometries["shapeGeo"].get();
 	leftWall->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	leftWall->IndexCount = leftWall->Geo->DrawArgs["wholeWall"].IndexCount;
 	leftWall->StartIndexLocation = leftWall->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	leftWall->BaseVertexLocation = leftWall->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	leftWall->Bounds = leftWall->Geo->DrawArgs["wholeWall"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(leftWall.get());
-	mAllRitems.push_back(std::move(leftWall));
+	AddRenderItem(std::move(leftWall));
 
 	auto rightWall = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&rightWall->World, XMMatrixScaling(18.0f, 8.0f, 0.5f) * XMMatrixRotationAxis(XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMConvertToRadians(90.0f)) * XMMatrixTranslation(9.0f, 4.0f, 0.0f));
 	XMStoreFloat4x4(&rightWall->TexTransform, XMMatrixScaling(4.0f, 1.6f, 1.0f));
-	rightWall->ObjCBIndex = cbindex++;
-	rightWall->Mat = mMaterials["stone"].get();
+	rightWall->Mat = FindMaterial("stone");
 	rightWall->Geo = mGeometries["shapeGeo"].get();
 	rightWall->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	rightWall->IndexCount = rightWall->Geo->DrawArgs["wholeWall"].IndexCount;
 	rightWall->StartIndexLocation = rightWall->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	rightWall->BaseVertexLocation = rightWall->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	rightWall->Bounds = rightWall->Geo->DrawArgs["wholeWall"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(rightWall.get());
-	mAllRitems.push_back(std::move(rightWall));
+	AddRenderItem(std::move(rightWall));
 
 	auto frontWall1 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&frontWall1->World, XMMatrixScaling(6.0f, 5.0f, 0.5f) * XMMatrixTranslation(-5.0f, 2.5f, -9.0f));
 	XMStoreFloat4x4(&frontWall1->TexTransform, XMMatrixScaling(1.33f, 1.11f, 1.0f));
-	frontWall1->ObjCBIndex = cbindex++;
-	frontWall1->Mat = mMaterials["stone"].get();
+	frontWall1->Mat = FindMaterial("stone");
 	frontWall1->Geo = mGeometries["shapeGeo"].get();
 	frontWall1->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	frontWall1->IndexCount = frontWall1->Geo->DrawArgs["wholeWall"].IndexCount;
 	frontWall1->StartIndexLocation = frontWall1->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	frontWall1->BaseVertexLocation = frontWall1->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	frontWall1->Bounds = frontWall1->Geo->DrawArgs["wholeWall"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(frontWall1.get());
-	mAllRitems.push_back(std::move(frontWall1));
+	AddRenderItem(std::move(frontWall1));
 
 	auto frontWall2 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&frontWall2->World, XMMatrixScaling(6.0f, 5.0f, 0.5f) * XMMatrixTranslation(5.0f, 2.5f, -9.0f));
 	XMStoreFloat4x4(&frontWall2->TexTransform, XMMatrixScaling(1.33f, 1.11f, 1.0f));
-	frontWall2->ObjCBIndex = cbindex++;
-	frontWall2->Mat = mMaterials["stone"].get();
+	frontWall2->Mat = FindMaterial("stone");
 	frontWall2->Geo = mGeometries["shapeGeo"].get();
 	frontWall2->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	frontWall2->IndexCount = frontWall2->Geo->DrawArgs["wholeWall"].IndexCount;
 	frontWall2->StartIndexLocation = frontWall2->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	frontWall2->BaseVertexLocation = frontWall2->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	frontWall2->Bounds = frontWall2->Geo->DrawArgs["wholeWall"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(frontWall2.get());
-	mAllRitems.push_back(std::move(frontWall2));
+	AddRenderItem(std::move(frontWall2));
 
 	auto frontWall3 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&frontWall3->World, XMMatrixScaling(18.0f, 3.0f, 0.5f) * XMMatrixTranslation(0.0f, 6.5f, -9.0f));
 	XMStoreFloat4x4(&frontWall3->TexTransform, XMMatrixScaling(4.0f, 0.66f, 1.0f));
-	frontWall3->ObjCBIndex = cbindex++;
-	frontWall3->Mat = mMaterials["stone"].get();
+	frontWall3->Mat = FindMaterial("stone");
 	frontWall3->Geo = mGeometries["shapeGeo"].get();
 	frontWall3->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	frontWall3->IndexCount = frontWall3->Geo->DrawArgs["wholeWall"].IndexCount;
 	frontWall3->StartIndexLocation = frontWall3->Geo->DrawArgs["wholeWall"].StartIndexLocation;
 	frontWall3->BaseVertexLocation = frontWall3->Geo->DrawArgs["wholeWall"].BaseVertexLocation;
+	frontWall3->Bounds = frontWall3->Geo->DrawArgs["wholeWall"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(frontWall3.get());
-	mAllRitems.push_back(std::move(frontWall3));
+	AddRenderItem(std::move(frontWall3));
 
 	auto columnFrontLeft = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnFrontLeft->World, XMMatrixScaling(2.0f, 10.0f, 2.0f) * XMMatrixTranslation(-9.0f, 5.0f, -9.0f));
 	XMStoreFloat4x4(&columnFrontLeft->TexTransform, XMMatrixScaling(2.0f, 4.0f, 1.0f));
-	columnFrontLeft->ObjCBIndex = cbindex++;
-	columnFrontLeft->Mat = mMaterials["stone2"].get();
+	columnFrontLeft->Mat = FindMaterial("stone2");
 	columnFrontLeft->Geo = mGeometries["shapeGeo"].get();
 	columnFrontLeft->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnFrontLeft->IndexCount = columnFrontLeft->Geo->DrawArgs["column"].IndexCount;
 	columnFrontLeft->StartIndexLocation = columnFrontLeft->Geo->DrawArgs["column"].StartIndexLocation;
 	columnFrontLeft->BaseVertexLocation = columnFrontLeft->Geo->DrawArgs["column"].BaseVertexLocation;
+	columnFrontLeft->Bounds = columnFrontLeft->Geo->DrawArgs["column"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnFrontLeft.get());
-	mAllRitems.push_back(std::move(columnFrontLeft));
+	AddRenderItem(std::move(columnFrontLeft));
 
 	auto columnFrontRight = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnFrontRight->World, XMMatrixScaling(2.0f, 10.0f, 2.0f) * XMMatrixTranslation(9.0f, 5.0f, -9.0f));
 	XMStoreFloat4x4(&columnFrontRight->TexTransform, XMMatrixScaling(2.0f, 4.0f, 1.0f));
-	columnFrontRight->ObjCBIndex = cbindex++;
-	columnFrontRight->Mat = mMaterials["stone2"].get();
+	columnFrontRight->Mat = FindMaterial("stone2");
 	columnFrontRight->Geo = mGeometries["shapeGeo"].get();
 	columnFrontRight->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnFrontRight->IndexCount = columnFrontRight->Geo->DrawArgs["column"].IndexCount;
 	columnFrontRight->StartIndexLocation = columnFrontRight->Geo->DrawArgs["column"].StartIndexLocation;
 	columnFrontRight->BaseVertexLocation = columnFrontRight->Geo->DrawArgs["column"].BaseVertexLocation;
+	columnFrontRight->Bounds = columnFrontRight->Geo->DrawArgs["column"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnFrontRight.get());
-	mAllRitems.push_back(std::move(columnFrontRight));
+	AddRenderItem(std::move(columnFrontRight));
 
 	auto columnBackLeft = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnBackLeft->World, XMMatrixScaling(2.0f, 10.0f, 2.0f) * XMMatrixTranslation(-9.0f, 5.0f, 9.0f));
 	XMStoreFloat4x4(&columnBackLeft->TexTransform, XMMatrixScaling(2.0f, 4.0f, 1.0f));
-	columnBackLeft->ObjCBIndex = cbindex++;
-	columnBackLeft->Mat = mMaterials["stone2"].get();
+	columnBackLeft->Mat = FindMaterial("stone2");
 	columnBackLeft->Geo = mGeometries["shapeGeo"].get();
 	columnBackLeft->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnBackLeft->IndexCount = columnBackLeft->Geo->DrawArgs["column"].IndexCount;
 	columnBackLeft->StartIndexLocation = columnBackLeft->Geo->DrawArgs["column"].StartIndexLocation;
 	columnBackLeft->BaseVertexLocation = columnBackLeft->Geo->DrawArgs["column"].BaseVertexLocation;
+	columnBackLeft->Bounds = columnBackLeft->Geo->DrawArgs["column"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnBackLeft.get());
-	mAllRitems.push_back(std::move(columnBackLeft));
+	AddRenderItem(std::move(columnBackLeft));
 
 
 	auto columnBackRight = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnBackRight->World, XMMatrixScaling(2.0f, 10.0f, 2.0f) * XMMatrixTranslation(9.0f, 5.0f, 9.0f));
 	XMStoreFloat4x4(&columnBackRight->TexTransform, XMMatrixScaling(2.0f, 4.0f, 1.0f));
-	columnBackRight->ObjCBIndex = cbindex++;
-	columnBackRight->Mat = mMaterials["stone2"].get();
+	columnBackRight->Mat = FindMaterial("stone2");
 	columnBackRight->Geo = mGeometries["shapeGeo"].get();
 	columnBackRight->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnBackRight->IndexCount = columnBackRight->Geo->DrawArgs["column"].IndexCount;
 	columnBackRight->StartIndexLocation = columnBackRight->Geo->DrawArgs["column"].StartIndexLocation;
 	columnBackRight->BaseVertexLocation = columnBackRight->Geo->DrawArgs["column"].BaseVertexLocation;
+	columnBackRight->Bounds = columnBackRight->Geo->DrawArgs["column"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnBackRight.get());
-	mAllRitems.push_back(std::move(columnBackRight));
+	AddRenderItem(std::move(columnBackRight));
 
 	auto columnTopFLeft = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnTopFLeft->World, XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(-9.0f, 13.0f, -9.0f));
-	columnTopFLeft->ObjCBIndex = cbindex++;
-	columnTopFLeft->Mat = mMaterials["sapphire"].get();
+	columnTopFLeft->Mat = FindMaterial("sapphire");
 	columnTopFLeft->Geo = mGeometries["shapeGeo"].get();
 	columnTopFLeft->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnTopFLeft->IndexCount = columnTopFLeft->Geo->DrawArgs["columnTop"].IndexCount;
 	columnTopFLeft->StartIndexLocation = columnTopFLeft->Geo->DrawArgs["columnTop"].StartIndexLocation;
 	columnTopFLeft->BaseVertexLocation = columnTopFLeft->Geo->DrawArgs["columnTop"].BaseVertexLocation;
+	columnTopFLeft->Bounds = columnTopFLeft->Geo->DrawArgs["columnTop"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnTopFLeft.get());
-	mAllRitems.push_back(std::move(columnTopFLeft));
+	AddRenderItem(std::move(columnTopFLeft));
 
 	auto columnTopFRight = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnTopFRight->World, XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(9.0f, 13.0f, -9.0f));
-	columnTopFRight->ObjCBIndex = cbindex++;
-	columnTopFRight->Mat = mMaterials["sapphire"].get();
+	columnTopFRight->Mat = FindMaterial("sapphire");
 	columnTopFRight->Geo = mGeometries["shapeGeo"].get();
 	columnTopFRight->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnTopFRight->IndexCount = columnTopFRight->Geo->DrawArgs["columnTop"].IndexCount;
 	columnTopFRight->StartIndexLocation = columnTopFRight->Geo->DrawArgs["columnTop"].StartIndexLocation;
 	columnTopFRight->BaseVertexLocation = columnTopFRight->Geo->DrawArgs["columnTop"].BaseVertexLocation;
+	columnTopFRight->Bounds = columnTopFRight->Geo->DrawArgs["columnTop"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnTopFRight.get());
-	mAllRitems.push_back(std::move(columnTopFRight));
+	AddRenderItem(std::move(columnTopFRight));
 
 
 	auto columnTopBLeft = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnTopBLeft->World, XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(-9.0f, 13.0f, 9.0f));
-	columnTopBLeft->ObjCBIndex = cbindex++;
-	columnTopBLeft->Mat = mMaterials["sapphire"].get();
+	columnTopBLeft->Mat = FindMaterial("sapphire");
 	columnTopBLeft->Geo = mGeometries["shapeGeo"].get();
 	columnTopBLeft->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnTopBLeft->IndexCount = columnTopBLeft->Geo->DrawArgs["columnTop"].IndexCount;
 	columnTopBLeft->StartIndexLocation = columnTopBLeft->Geo->DrawArgs["columnTop"].StartIndexLocation;
 	columnTopBLeft->BaseVertexLocation = columnTopBLeft->Geo->DrawArgs["columnTop"].BaseVertexLocation;
+	columnTopBLeft->Bounds = columnTopBLeft->Geo->DrawArgs["columnTop"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnTopBLeft.get());
-	mAllRitems.push_back(std::move(columnTopBLeft));
+	AddRenderItem(std::move(columnTopBLeft));
 
 
 	auto columnTopBRight = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&columnTopBRight->World, XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(9.0f, 13.0f, 9.0f));
-	columnTopBRight->ObjCBIndex = cbindex++;
-	columnTopBRight->Mat = mMaterials["sapphire"].get();
+	columnTopBRight->Mat = FindMaterial("sapphire");
 	columnTopBRight->Geo = mGeometries["shapeGeo"].get();
 	columnTopBRight->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	columnTopBRight->IndexCount = columnTopBRight->Geo->DrawArgs["columnTop"].IndexCount;
 	columnTopBRight->StartIndexLocation = columnTopBRight->Geo->DrawArgs["columnTop"].StartIndexLocation;
 	columnTopBRight->BaseVertexLocation = columnTopBRight->Geo->DrawArgs["columnTop"].BaseVertexLocation;
+	columnTopBRight->Bounds = columnTopBRight->Geo->DrawArgs["columnTop"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(columnTopBRight.get());
-	mAllRitems.push_back(std::move(columnTopBRight));
+	AddRenderItem(std::move(columnTopBRight));
 
 	auto Base1 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&Base1->World, XMMatrixScaling(14.0f, 6.0f, 14.0f) * XMMatrixTranslation(0.0f, 3.0f, 0.0f));
 	XMStoreFloat4x4(&Base1->TexTransform, XMMatrixScaling(6.0f, 3.0f, 1.0f));
-	Base1->ObjCBIndex = cbindex++;
-	Base1->Mat = mMaterials["carpet"].get();
+	Base1->Mat = FindMaterial("carpet");
 	Base1->Geo = mGeometries["shapeGeo"].get();
 	Base1->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	Base1->IndexCount = Base1->Geo->DrawArgs["Base1"].IndexCount;
 	Base1->StartIndexLocation = Base1->Geo->DrawArgs["Base1"].StartIndexLocation;
 	Base1->BaseVertexLocation = Base1->Geo->DrawArgs["Base1"].BaseVertexLocation;
+	Base1->Bounds = Base1->Geo->DrawArgs["Base1"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(Base1.get());
-	mAllRitems.push_back(std::move(Base1));
+	AddRenderItem(std::move(Base1));
 
 	auto Base2 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&Base2->World, XMMatrixScaling(10.0f, 4.0f, 10.0f) * XMMatrixTranslation(0.0f, 8.0f, 0.0f));
 	XMStoreFloat4x4(&Base2->TexTransform, XMMatrixScaling(6.0f, 1.0f, 1.0f));
-	Base2->ObjCBIndex = cbindex++;
-	Base2->Mat = mMaterials["tiger_gem"].get();
+	Base2->Mat = FindMaterial("tiger_gem");
 	Base2->Geo = mGeometries["shapeGeo"].get();
 	Base2->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	Base2->IndexCount = Base2->Geo->DrawArgs["Base2"].IndexCount;
 	Base2->StartIndexLocation = Base2->Geo->DrawArgs["Base2"].StartIndexLocation;
 	Base2->BaseVertexLocation = Base2->Geo->DrawArgs["Base2"].BaseVertexLocation;
+	Base2->Bounds = Base2->Geo->DrawArgs["Base2"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(Base2.get());
-	mAllRitems.push_back(std::move(Base2));
+	AddRenderItem(std::move(Base2));
 
 	auto Base3 = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&Base3->World, XMMatrixScaling(4.0f, 6.0f, 4.0f) * XMMatrixTranslation(0.0f, 13.0f, 0.0f));
-	Base3->ObjCBIndex = cbindex++;
-	Base3->Mat = mMaterials["emerald"].get();
+	Base3->Mat = FindMaterial("emerald");
 	Base3->Geo = mGeometries["shapeGeo"].get();
 	Base3->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	Base3->IndexCount = Base3->Geo->DrawArgs["Base3"].IndexCount;
 	Base3->StartIndexLocation = Base3->Geo->DrawArgs["Base3"].StartIndexLocation;
 	Base3->BaseVertexLocation = Base3->Geo->DrawArgs["Base3"].BaseVertexLocation;
+	Base3->Bounds = Base3->Geo->DrawArgs["Base3"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(Base3.get());
-	mAllRitems.push_back(std::move(Base3));
+	AddRenderItem(std::move(Base3));
 
 	auto top = std::make_unique<RenderItem>();
 	XMStoreFloat4x4(&top->World, XMMatrixScaling(2.0f, 2.0f, 2.0f) * XMMatrixTranslation(0.0f, 18.0f, 0.0f));
-	top->ObjCBIndex = cbindex++;
-	top->Mat = mMaterials["emerald"].get();
+	top->Mat = FindMaterial("emerald");
 	top->Geo = mGeometries["shapeGeo"].get();
 	top->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
 	top->IndexCount = top->Geo->DrawArgs["top"].IndexCount;
 	top->StartIndexLocation = top->Geo->DrawArgs["top"].StartIndexLocation;
 	top->BaseVertexLocation = top->Geo->DrawArgs["top"].BaseVertexLocation;
+	top->Bounds = top->Geo->DrawArgs["top"].Bounds;
 	mRitemLayer[(int)RenderLayer::Opaque].push_back(top.get());
-	mAllRitems.push_back(std::move(top));
-
-	auto treeSpritesRitem = std::make_unique<RenderItem>();
-	treeSpritesRitem->World = MathHelper::Identity4x4();
-	treeSpritesRitem->ObjCBIndex = cbindex++;
-	treeSpritesRitem->Mat = mMaterials["treeSprites"].get();
-	treeSpritesRitem->Geo = mGeometries["treeSpritesGeo"].get();
-	//step2
-	treeSpritesRitem->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_POINTLIST;
-	treeSpritesRitem->IndexCount = treeSpritesRitem->Geo->DrawArgs["points"].IndexCount;
-	treeSpritesRitem->StartIndexLocation = treeSpritesRitem->Geo->DrawArgs["points"].StartIndexLocation;
-	treeSpritesRitem->BaseVertexLocation = treeSpritesRitem->Geo->DrawArgs["points"].BaseVertexLocation;
-
-	mRitemLayer[(int)RenderLayer::AlphaTestedTreeSprites].push_back(treeSpritesRitem.get());
-	mAllRitems.push_back(std::move(treeSpritesRitem));
+	AddRenderItem(std::move(top));
+
+	BuildCastleCopies(firstCastleItem, mAllRitems.Size());
 
 	//mRitemLayer[(int)RenderLayer::Opaque].push_back(gridRitem.get());
 	// All the render items are opaque.
@@ -1915,37 +3659,443 @@ void TexWavesApp::BuildRenderItems()
 	
 }
 
-void TexWavesApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems)
+// Places mCastleCopies - 1 copies of the items [firstItem, endItem) on the castle
+// sites nearest the original, each lifted to the terrain height at its centre.  The
+// copies join their originals' layers, so BuildInstancedBatches batches them.
+void TexWavesApp::BuildCastleCopies(UINT firstItem, UINT endItem)
+{
+	std::vector<std::pair<int, XMINT2>> sites;
+	for(int z = -gCastleSiteRadius; z <= gCastleSiteRadius; ++z)
+	{
+		for(int x = -gCastleSiteRadius; x <= gCastleSiteRadius; ++x)
+		{
+			if(x != 0 || z != 0)
+				sites.push_back({ x * x + z * z, XMINT2(x, z) });
+		}
+	}
+	std::stable_sort(sites.begin(), sites.end(),
+		[](const std::pair<int, XMINT2>& a, const std::pair<int, XMINT2>& b) { return a.first < b.first; });
+
+	for(int copy = 1; copy < mCastleCopies && copy <= (int)sites.size(); ++copy)
+	{
+		float x = sites[copy - 1].second.x * gCastleSpacing;
+		float z = sites[copy - 1].second.y * gCastleSpacing;
+		XMMATRIX offset = XMMatrixTranslation(x, TerrainHeight(x, z), z);
+
+		for(auto& layer : mRitemLayer)
+		{
+			size_t count = layer.size();
+			for(size_t i = 0; i < count; ++i)
+			{
+				RenderItem* ri = layer[i];
+				if(ri->ObjCBIndex < firstItem || ri->ObjCBIndex >= endItem)
+					continue;
+
+				auto item = std::make_unique<RenderItem>(*ri);
+				XMStoreFloat4x4(&item->World, XMLoadFloat4x4(&ri->World) * offset);
+				layer.push_back(item.get());
+				AddRenderItem(std::move(item));
+			}
+		}
+	}
+}
+
+// Render items of a scene pack.  Every castle item is a triangle list.
+void TexWavesApp::AddPackedRenderItems(const std::vector<ScenePack::Placement>& placements)
+{
+	for(const ScenePack::Placement& p : placements)
+	{
+		auto ri = std::make_unique<RenderItem>();
+		ri->World = p.World;
+		ri->TexTransform = p.TexTransform;
+		ri->Mat = FindMaterial(p.Material);
+		ri->Geo = mGeometries.at(p.Geometry).get();
+		ri->PrimitiveType = D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+		ri->IndexCount = p.IndexCount;
+		ri->StartIndexLocation = p.StartIndexLocation;
+		ri->BaseVertexLocation = p.BaseVertexLocation;
+		ri->Bounds = p.Bounds;
+
+		mRitemLayer[p.Layer].push_back(ri.get());
+		AddRenderItem(std::move(ri));
+	}
+}
+
+// Everything the generated meshes and castle items depend on.  A pack baked with any
+// other value is regenerated.
+std::string TexWavesApp::ScenePackDescription()const
+{
+	std::ostringstream text;
+	text << "castle compact=" << mCompactVertices << " copies=" << mCastleCopies <<
+		"; land quads=" << mTerrain->PatchQuads() << " indices=" << mTerrain->Indices().size();
+	if(mUseGpuWaves)
+	{
+		text << "; gpu water step=" << mGpuWaves->SpatialStep() <<
+			" clipmap=" << gWaterClipmapQuads << "x" << gWaterClipmapLevels;
+	}
+	else
+	{
+		text << "; cpu water " << mWaves->RowCount() << "x" << mWaves->ColumnCount();
+	}
+	return text.str();
+}
+
+// Writes every geometry and the castle's items to mScenePackFile.  A pack that fails
+// to write is simply baked again on the next start.
+void TexWavesApp::BakeScenePack(UINT64 key)
+{
+	std::vector<const MeshGeometry*> geometries;
+	for(auto& e : mGeometries)
+		geometries.push_back(e.second.get());
+	std::sort(geometries.begin(), geometries.end(),
+		[](const MeshGeometry* a, const MeshGeometry* b) { return a->Name < b->Name; });
+
+	// In handle order, so a loaded pack recreates the items in the same order.
+	std::vector<std::pair<UINT, UINT>> items;
+	for(UINT layer = 0; layer < (UINT)RenderLayer::Count; ++layer)
+	{
+		for(RenderItem* ri : mRitemLayer[layer])
+		{
+			if(ri->ObjCBIndex >= mCastleItemsBegin && ri->ObjCBIndex < mCastleItemsEnd)
+				items.push_back({ ri->ObjCBIndex, layer });
+		}
+	}
+	std::sort(items.begin(), items.end());
+
+	std::vector<ScenePack::Placement> placements;
+	for(auto& item : items)
+	{
+		const RenderItem* ri = mAllRitems.Get(item.first);
+
+		ScenePack::Placement p;
+		p.Geometry = ri->Geo->Name;
+		p.Material = ri->Mat->Name;
+		p.Layer = item.second;
+		p.IndexCount = ri->IndexCount;
+		p.StartIndexLocation = ri->StartIndexLocation;
+		p.BaseVertexLocation = ri->BaseVertexLocation;
+		p.World = ri->World;
+		p.TexTransform = ri->TexTransform;
+		p.Bounds = ri->Bounds;
+		placements.push_back(p);
+	}
+
+	ScenePack::Write(mScenePackFile, key, geometries, placements);
+}
+
+// Moves the opaque items that share a submesh and material with at least one other
+// item into the OpaqueInstanced layer and builds one batch for each such group.
+void TexWavesApp::BuildInstancedBatches()
+{
+	auto sameDraw = [](const RenderItem* a, const RenderItem* b)
+	{
+		return a->Geo == b->Geo && a->Mat == b->Mat &&
+			a->PrimitiveType == b->PrimitiveType &&
+			a->IndexCount == b->IndexCount &&
+			a->StartIndexLocation == b->StartIndexLocation &&
+			a->BaseVertexLocation == b->BaseVertexLocation;
+	};
+
+	// Group the opaque items, keeping the order in which each group first appears.
+	std::vector<std::vector<RenderItem*>> groups;
+	for(auto ri : mRitemLayer[(int)RenderLayer::Opaque])
+	{
+		auto it = std::find_if(groups.begin(), groups.end(),
+			[&](const std::vector<RenderItem*>& g) { return sameDraw(g[0], ri); });
+		if(it != groups.end())
+			it->push_back(ri);
+		else
+			groups.push_back({ ri });
+	}
+
+	auto& opaque = mRitemLayer[(int)RenderLayer::Opaque];
+	auto& instanced = mRitemLayer[(int)RenderLayer::OpaqueInstanced];
+	opaque.clear();
+
+	for(auto& g : groups)
+	{
+		// A single item gains nothing from the instanced path.
+		if(g.size() < 2)
+		{
+			opaque.push_back(g[0]);
+			continue;
+		}
+
+		InstancedBatch batch;
+		batch.Mat = g[0]->Mat;
+		batch.Geo = g[0]->Geo;
+		batch.PrimitiveType = g[0]->PrimitiveType;
+		batch.IndexCount = g[0]->IndexCount;
+		batch.StartIndexLocation = g[0]->StartIndexLocation;
+		batch.BaseVertexLocation = g[0]->BaseVertexLocation;
+		batch.Instances = g;
+		batch.FirstInstance = (UINT)instanced.size();
+		batch.VisibleCount = (UINT)g.size();
+
+		instanced.insert(instanced.end(), g.begin(), g.end());
+
+		mInstancedBatches.push_back(batch);
+	}
+
+	mDrawListsDirty = true;
+}
+
+// Hands the items of the GPU-driven layers to GpuCulling, grouped by layer, PSO and,
+// unless bindless, diffuse texture, since a command signature cannot change the PSO
+// or descriptor tables.
+// Their world matrices must not change afterwards: the bounds are uploaded only here.
+void TexWavesApp::BuildIndirectItems()
+{
+	if(mBindless)
+		mGpuCulling = std::make_unique<GpuCulling>(md3dDevice.Get(), mRootSignature.Get(), 9, gNumFrameResources);
+	else
+		mGpuCulling = std::make_unique<GpuCulling>(md3dDevice.Get(), mRootSignature.Get(), 1, 3, gNumFrameResources);
+	mGpuCulling->OnResize(mDepthStencilBuffer.Get(), mClientWidth, mClientHeight, m4xMsaaState);
+	mGpuCulling->BuildDescriptors(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetCPUDescriptorHandleForHeapStart(), gGpuCullingSrvIndex, mCbvSrvDescriptorSize),
+		CD3DX12_GPU_DESCRIPTOR_HANDLE(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart(), gGpuCullingSrvIndex, mCbvSrvDescriptorSize),
+		mCbvSrvDescriptorSize);
+
+	std::vector<GpuCulling::Item> items;
+	std::unordered_map<const RenderItem*, UINT> itemIndices;
+	for(int layer = 0; layer < (int)RenderLayer::Count; ++layer)
+	{
+		if(!IsDrawnIndirect(layer))
+			continue;
+
+		for(auto ri : mRitemLayer[layer])
+		{
+			// DrawIndirectLayer sets a single topology.
+			assert(ri->PrimitiveType == D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+			UINT texture = mBindless ? 0 : (UINT)ri->Mat->DiffuseSrvHeapIndex;
+			ID3D12PipelineState* pso = mMaterialPipelines[layer][ri->Mat->MatCBIndex].PSO;
+
+			UINT group = 0;
+			while(group < (UINT)mIndirectGroups.size() &&
+				!(mIndirectGroups[group].Layer == (RenderLayer)layer &&
+				  mIndirectGroups[group].DiffuseSrvHeapIndex == texture &&
+				  mIndirectGroups[group].PSO == pso))
+				++group;
+			if(group == (UINT)mIndirectGroups.size())
+				mIndirectGroups.push_back({ (RenderLayer)layer, texture, pso });
+
+			GpuCulling::Item item;
+			ri->Bounds.Transform(item.Bounds, XMLoadFloat4x4(&ri->World));
+			item.ObjCBIndex = ri->ObjCBIndex;
+			item.MatCBIndex = ri->Mat->MatCBIndex;
+			item.Group = group;
+			item.VertexBufferView = ri->Geo->VertexBufferView();
+			item.IndexBufferView = ri->Geo->IndexBufferView();
+			item.IndexCount = ri->IndexCount;
+			item.StartIndexLocation = ri->StartIndexLocation;
+			item.BaseVertexLocation = ri->BaseVertexLocation;
+
+			itemIndices[ri] = (UINT)items.size();
+			items.push_back(item);
+		}
+	}
+
+	mGpuCulling->SetItems(items, (UINT)mIndirectGroups.size());
+
+	for(auto ri : mTerrainRitems)
+		mTerrainIndirectItems.push_back(itemIndices[ri]);
+}
+
+// With bindless, the object and material are selected by the root constants instead
+// of CBVs and a texture table.  Each material is drawn with the PSO of its variant in
+// the layer.
+void TexWavesApp::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, RenderLayer layer, const std::vector<RenderItem*>& ritems, bool bindless)
 {
-    UINT objCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(ObjectConstants));
-    UINT matCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(MaterialConstants));
+    UINT objCBByteSize = sizeof(ObjectConstants);
+    UINT matCBByteSize = sizeof(MaterialData);
+
+	D3D12_GPU_VIRTUAL_ADDRESS objectCB = mCurrFrameResource->ObjectCB;
+	D3D12_GPU_VIRTUAL_ADDRESS matCB = mCurrFrameResource->MaterialCB;
 
-	auto objectCB = mCurrFrameResource->ObjectCB->Resource();
-	auto matCB = mCurrFrameResource->MaterialCB->Resource();
+	const auto& pipelines = mMaterialPipelines[(int)layer];
+
+	// Only emit the state that differs from the previous item; the draw lists are
+	// sorted so that items sharing a PSO, geometry and material are adjacent.
+	const MeshGeometry* lastGeo = nullptr;
+	D3D12_GPU_VIRTUAL_ADDRESS lastVB = 0;
+	D3D12_PRIMITIVE_TOPOLOGY lastTopology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+	const Material* lastMat = nullptr;
+	ID3D12PipelineState* lastPso = nullptr;
 
     // For each render item...
     for(size_t i = 0; i < ritems.size(); ++i)
     {
         auto ri = ritems[i];
 
-        cmdList->IASetVertexBuffers(0, 1, &ri->Geo->VertexBufferView());
-        cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
-        cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
+		// The CPU waves swap their dynamic VB every frame, so compare the address too.
+		auto vbv = ri->Geo->VertexBufferView();
+		if(ri->Geo != lastGeo || vbv.BufferLocation != lastVB)
+		{
+			cmdList->IASetVertexBuffers(0, 1, &vbv);
+			cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
+			lastGeo = ri->Geo;
+			lastVB = vbv.BufferLocation;
+		}
 
-		CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
-		tex.Offset(ri->Mat->DiffuseSrvHeapIndex, mCbvSrvDescriptorSize);
+		if(ri->PrimitiveType != lastTopology)
+		{
+			cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
+			lastTopology = ri->PrimitiveType;
+		}
 
-        D3D12_GPU_VIRTUAL_ADDRESS objCBAddress = objectCB->GetGPUVirtualAddress() + ri->ObjCBIndex*objCBByteSize;
-		D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = matCB->GetGPUVirtualAddress() + ri->Mat->MatCBIndex*matCBByteSize;
+		if(ri->Mat != lastMat)
+		{
+			ID3D12PipelineState* pso = pipelines[ri->Mat->MatCBIndex].PSO;
+			if(pso != lastPso)
+			{
+				cmdList->SetPipelineState(pso);
+				lastPso = pso;
+			}
+
+			if(bindless)
+			{
+				cmdList->SetGraphicsRoot32BitConstant(9, ri->Mat->MatCBIndex, 1);
+			}
+			else
+			{
+				CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+				tex.Offset(mDiffuseSrvRemap[ri->Mat->DiffuseSrvHeapIndex], mCbvSrvDescriptorSize);
+
+				D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = matCB + ri->Mat->MatCBIndex*matCBByteSize;
+
+				cmdList->SetGraphicsRootDescriptorTable(0, tex);
+				cmdList->SetGraphicsRootConstantBufferView(3, matCBAddress);
+			}
+			lastMat = ri->Mat;
+		}
 
-		cmdList->SetGraphicsRootDescriptorTable(0, tex);
-        cmdList->SetGraphicsRootConstantBufferView(1, objCBAddress);
-        cmdList->SetGraphicsRootConstantBufferView(3, matCBAddress);
+		if(bindless)
+		{
+			cmdList->SetGraphicsRoot32BitConstant(9, ri->ObjCBIndex, 0);
+		}
+		else
+		{
+			D3D12_GPU_VIRTUAL_ADDRESS objCBAddress = objectCB + ri->ObjCBIndex*objCBByteSize;
+			cmdList->SetGraphicsRootConstantBufferView(1, objCBAddress);
+		}
 
         cmdList->DrawIndexedInstanced(ri->IndexCount, 1, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
     }
 }
 
+void TexWavesApp::DrawInstancedBatches(ID3D12GraphicsCommandList* cmdList)
+{
+	if(mInstancedBatches.empty())
+		return;
+
+	UINT matCBByteSize = sizeof(MaterialData);
+
+	D3D12_GPU_VIRTUAL_ADDRESS matCB = mCurrFrameResource->MaterialCB;
+	auto instanceBuffer = mCurrFrameResource->InstanceBuffer->Resource();
+	cmdList->SetGraphicsRootShaderResourceView(5, instanceBuffer->GetGPUVirtualAddress());
+
+	const auto& pipelines = mMaterialPipelines[(int)RenderLayer::OpaqueInstanced];
+
+	const MeshGeometry* lastGeo = nullptr;
+	D3D12_PRIMITIVE_TOPOLOGY lastTopology = D3D_PRIMITIVE_TOPOLOGY_UNDEFINED;
+	ID3D12PipelineState* lastPso = nullptr;
+
+	for(auto& b : mInstancedBatches)
+	{
+		if(b.VisibleCount == 0)
+			continue;
+
+		ID3D12PipelineState* pso = pipelines[b.Mat->MatCBIndex].PSO;
+		if(pso != lastPso)
+		{
+			cmdList->SetPipelineState(pso);
+			lastPso = pso;
+		}
+
+		if(b.Geo != lastGeo)
+		{
+			cmdList->IASetVertexBuffers(0, 1, &b.Geo->VertexBufferView());
+			cmdList->IASetIndexBuffer(&b.Geo->IndexBufferView());
+			lastGeo = b.Geo;
+		}
+
+		if(b.PrimitiveType != lastTopology)
+		{
+			cmdList->IASetPrimitiveTopology(b.PrimitiveType);
+			lastTopology = b.PrimitiveType;
+		}
+
+		if(mBindless)
+		{
+			cmdList->SetGraphicsRoot32BitConstant(9, b.Mat->MatCBIndex, 1);
+		}
+		else
+		{
+			CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+			tex.Offset(mDiffuseSrvRemap[b.Mat->DiffuseSrvHeapIndex], mCbvSrvDescriptorSize);
+
+			D3D12_GPU_VIRTUAL_ADDRESS matCBAddress = matCB + b.Mat->MatCBIndex*matCBByteSize;
+
+			cmdList->SetGraphicsRootDescriptorTable(0, tex);
+			cmdList->SetGraphicsRootConstantBufferView(3, matCBAddress);
+		}
+		cmdList->SetGraphicsRoot32BitConstant(6, b.FirstInstance, 0);
+
+		cmdList->DrawIndexedInstanced(b.IndexCount, b.VisibleCount, b.StartIndexLocation, b.BaseVertexLocation, 0);
+	}
+}
+
+// The trees share one material; Foliage sets the instance buffer and a root constant
+// per cell.
+void TexWavesApp::DrawFoliage(ID3D12GraphicsCommandList* cmdList)
+{
+	CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+	tex.Offset(mDiffuseSrvRemap[mTreeMaterial->DiffuseSrvHeapIndex], mCbvSrvDescriptorSize);
+
+	cmdList->SetGraphicsRootDescriptorTable(0, tex);
+	cmdList->SetGraphicsRootConstantBufferView(3, mCurrFrameResource->MaterialCB + mTreeMaterial->MatCBIndex*sizeof(MaterialData));
+
+	mFoliage->Draw(cmdList, 5, 6);
+}
+
+// The object and material CBVs or indices, buffers and draw arguments come from the
+// commands GpuCulling wrote this frame; the PSO and, unless bindless, the texture
+// are set per group.
+void TexWavesApp::DrawIndirectLayer(ID3D12GraphicsCommandList* cmdList, RenderLayer layer)
+{
+	cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	ID3D12PipelineState* lastPso = nullptr;
+	for(UINT group = 0; group < (UINT)mIndirectGroups.size(); ++group)
+	{
+		if(mIndirectGroups[group].Layer != layer)
+			continue;
+
+		if(mIndirectGroups[group].PSO != lastPso)
+		{
+			cmdList->SetPipelineState(mIndirectGroups[group].PSO);
+			lastPso = mIndirectGroups[group].PSO;
+		}
+
+		if(!mBindless)
+		{
+			CD3DX12_GPU_DESCRIPTOR_HANDLE tex(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+			tex.Offset(mDiffuseSrvRemap[mIndirectGroups[group].DiffuseSrvHeapIndex], mCbvSrvDescriptorSize);
+			cmdList->SetGraphicsRootDescriptorTable(0, tex);
+		}
+
+		mGpuCulling->Draw(cmdList, group);
+	}
+}
+
+bool TexWavesApp::IsDrawnIndirect(int layer)const
+{
+	return mGpuDriven && (layer == (int)RenderLayer::Opaque ||
+		layer == (int)RenderLayer::AlphaTested ||
+		layer == (int)RenderLayer::Terrain);
+}
+
 std::array<const CD3DX12_STATIC_SAMPLER_DESC, 6> TexWavesApp::GetStaticSamplers()
 {
 	// Applications usually only need a handful of samplers.  So just define them all up front
@@ -2008,6 +4158,12 @@ float TexWavesApp::GetHillsHeight(float x, float z)const
     return 0.3f*(z*sinf(0.1f*x) + x*cosf(0.1f*z));
 }
 
+// The hills, with the castle courtyard kept flat.
+float TexWavesApp::TerrainHeight(float x, float z)const
+{
+	return (x > 35 || x < -35 && z > 35 || z < -35) ? GetHillsHeight(x, z) : 0.0f;
+}
+
 XMFLOAT3 TexWavesApp::GetHillsNormal(float x, float z)const
 {
     // n = (-df/dx, 1, -df/dz)
@@ -0,0 +1,116 @@
+//***************************************************************************************
+// ClusteredLighting.cpp
+//***************************************************************************************
+
+#include "ClusteredLighting.h"
+#include "../Common/GpuAllocator.h"
+
+using Microsoft::WRL::ComPtr;
+using namespace DirectX;
+
+ClusteredLighting::ClusteredLighting(ID3D12Device* device, UINT maxLightCount, UINT frameResourceCount)
+	: md3dDevice(device), mMaxLightCount(maxLightCount)
+{
+	static_assert(sizeof(LightData) == 64, "LightData must match ClusteredLighting.hlsl");
+	static_assert(sizeof(ClusterConstants) == 144, "ClusterConstants must match ClusteredLighting.hlsl");
+
+	mFrameBuffers.resize(frameResourceCount);
+	for(auto& frame : mFrameBuffers)
+	{
+		ThrowIfFailed(CreateGpuResource(md3dDevice,
+			D3D12_HEAP_TYPE_DEFAULT,
+			&CD3DX12_RESOURCE_DESC::Buffer(std::max<UINT>(mMaxLightCount, 1) * sizeof(LightData)),
+			D3D12_RESOURCE_STATE_COMMON,
+			nullptr,
+			IID_PPV_ARGS(&frame.Lights)));
+
+		ThrowIfFailed(CreateGpuResource(md3dDevice,
+			D3D12_HEAP_TYPE_DEFAULT,
+			&CD3DX12_RESOURCE_DESC::Buffer((UINT64)ClusterCount * (MaxLightsPerCluster + 1) * sizeof(UINT),
+				D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+			D3D12_RESOURCE_STATE_COMMON,
+			nullptr,
+			IID_PPV_ARGS(&frame.Clusters)));
+	}
+}
+
+void ClusteredLighting::SetLights(const std::vector<LightData>& lights)
+{
+	mLights.assign(lights.begin(), lights.begin() + std::min<size_t>(lights.size(), mMaxLightCount));
+	++mLightsVersion;
+}
+
+UINT ClusteredLighting::LightCount()const
+{
+	return (UINT)mLights.size();
+}
+
+const std::vector<ClusteredLighting::LightData>& ClusteredLighting::Lights()const
+{
+	return mLights;
+}
+
+void ClusteredLighting::Cull(
+	ID3D12GraphicsCommandList* cmdList,
+	UINT frameResourceIndex,
+	LinearAllocator& frameAllocator,
+	ID3D12RootSignature* rootSig,
+	ID3D12PipelineState* cullPso,
+	const XMFLOAT4X4& view,
+	const XMFLOAT4X4& proj,
+	float nearZ, float farZ)
+{
+	FrameBuffers& frame = mFrameBuffers[frameResourceIndex];
+
+	// The upload memory lives until this frame's fence, which covers the copy.
+	if(frame.LightsVersion != mLightsVersion && !mLights.empty())
+	{
+		UINT64 byteSize = mLights.size() * sizeof(LightData);
+		auto upload = frameAllocator.Allocate(byteSize);
+		memcpy(upload.CpuAddress, mLights.data(), byteSize);
+
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(frame.Lights.Get(),
+			D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+		cmdList->CopyBufferRegion(frame.Lights.Get(), 0, upload.Resource, upload.Offset, byteSize);
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(frame.Lights.Get(),
+			D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_COMMON));
+	}
+	frame.LightsVersion = mLightsVersion;
+
+	XMMATRIX P = XMLoadFloat4x4(&proj);
+
+	ClusterConstants constants = {};
+	XMStoreFloat4x4(&constants.View, XMMatrixTranspose(XMLoadFloat4x4(&view)));
+	XMStoreFloat4x4(&constants.InvProj, XMMatrixTranspose(XMMatrixInverse(&XMMatrixDeterminant(P), P)));
+	constants.NearZ = nearZ;
+	constants.FarZ = farZ;
+	constants.LightCount = (UINT)mLights.size();
+
+	auto cb = frameAllocator.Allocate(sizeof(ClusterConstants));
+	memcpy(cb.CpuAddress, &constants, sizeof(ClusterConstants));
+
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(frame.Clusters.Get(),
+		D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+	cmdList->SetComputeRootSignature(rootSig);
+	cmdList->SetPipelineState(cullPso);
+	cmdList->SetComputeRootConstantBufferView(0, cb.GpuAddress);
+	cmdList->SetComputeRootShaderResourceView(1, frame.Lights->GetGPUVirtualAddress());
+	cmdList->SetComputeRootUnorderedAccessView(2, frame.Clusters->GetGPUVirtualAddress());
+
+	// 64 clusters per group, see CullLightsCS.
+	cmdList->Dispatch((ClusterCount + 63) / 64, 1, 1);
+
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(frame.Clusters.Get(),
+		D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COMMON));
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS ClusteredLighting::LightBuffer(UINT frameResourceIndex)const
+{
+	return mFrameBuffers[frameResourceIndex].Lights->GetGPUVirtualAddress();
+}
+
+D3D12_GPU_VIRTUAL_ADDRESS ClusteredLighting::ClusterBuffer(UINT frameResourceIndex)const
+{
+	return mFrameBuffers[frameResourceIndex].Clusters->GetGPUVirtualAddress();
+}
@@ -0,0 +1,107 @@
+//***************************************************************************************
+// ClusteredLighting.h
+//
+// Clustered forward lighting.  The point and spot lights live in a structured buffer
+// that is only uploaded after SetLights.  Each frame a compute pass bins them into
+// view space clusters, screen tiles times exponentially spaced depth slices, and
+// writes one light list per cluster; the pixel shaders then shade only the lights of
+// their own cluster, so the per-pixel cost follows the lights nearby rather than the
+// scene's total.  Directional lights reach every pixel and stay in the pass constants.
+//***************************************************************************************
+
+#pragma once
+
+#include "../Common/d3dUtil.h"
+#include "../Common/LinearAllocator.h"
+
+class ClusteredLighting
+{
+public:
+	ClusteredLighting(ID3D12Device* device, UINT maxLightCount, UINT frameResourceCount);
+	ClusteredLighting(const ClusteredLighting& rhs) = delete;
+	ClusteredLighting& operator=(const ClusteredLighting& rhs) = delete;
+	~ClusteredLighting() = default;
+
+	// Cluster grid; must match ClusteredLighting.hlsl.
+	static const UINT ClusterCountX = 16;
+	static const UINT ClusterCountY = 8;
+	static const UINT ClusterCountZ = 24;
+	static const UINT ClusterCount = ClusterCountX * ClusterCountY * ClusterCountZ;
+
+	// A cluster's list is its light count followed by up to this many light indices;
+	// lights beyond it are dropped from the cluster.
+	static const UINT MaxLightsPerCluster = 63;
+
+	enum LightType : UINT
+	{
+		PointLight = 0,
+		SpotLight = 1,
+	};
+
+	// Layout shared with ClusteredLighting.hlsl.
+	struct LightData
+	{
+		Light L;
+		UINT Type = PointLight;
+		DirectX::XMFLOAT3 Pad = { 0.0f, 0.0f, 0.0f };
+	};
+
+	// Replaces the lights, keeping the first maxLightCount.  The next Cull of each frame
+	// resource uploads them.
+	void SetLights(const std::vector<LightData>& lights);
+	UINT LightCount()const;
+	const std::vector<LightData>& Lights()const;
+
+	// Records the binning pass for this frame's camera into the frame resource's
+	// buffers.  Its constants, and the lights after a SetLights, are allocated from the
+	// frame resource's allocator.  Only uses states valid on a compute queue.
+	void Cull(
+		ID3D12GraphicsCommandList* cmdList,
+		UINT frameResourceIndex,
+		LinearAllocator& frameAllocator,
+		ID3D12RootSignature* rootSig,
+		ID3D12PipelineState* cullPso,
+		const DirectX::XMFLOAT4X4& view,
+		const DirectX::XMFLOAT4X4& proj,
+		float nearZ, float farZ);
+
+	// Bound as root SRVs by the draws of the frame resource.
+	D3D12_GPU_VIRTUAL_ADDRESS LightBuffer(UINT frameResourceIndex)const;
+	D3D12_GPU_VIRTUAL_ADDRESS ClusterBuffer(UINT frameResourceIndex)const;
+
+private:
+	// Layout shared with ClusteredLighting.hlsl.
+	struct ClusterConstants
+	{
+		DirectX::XMFLOAT4X4 View;
+		DirectX::XMFLOAT4X4 InvProj;
+		float NearZ;
+		float FarZ;
+		UINT LightCount;
+		UINT Pad;
+	};
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	UINT mMaxLightCount = 0;
+
+	std::vector<LightData> mLights;
+
+	// Incremented by SetLights.
+	UINT64 mLightsVersion = 0;
+
+	// One set per frame resource, so Cull may run on another queue while the draws of
+	// the frames before still read theirs.  Between frames both buffers are in the
+	// COMMON state: the pixel shaders read them through implicit promotion, which the
+	// compute queue could not transition to.
+	struct FrameBuffers
+	{
+		Microsoft::WRL::ComPtr<ID3D12Resource> Lights;
+		Microsoft::WRL::ComPtr<ID3D12Resource> Clusters;
+
+		// mLightsVersion last uploaded into Lights.
+		UINT64 LightsVersion = 0;
+	};
+
+	std::vector<FrameBuffers> mFrameBuffers;
+};
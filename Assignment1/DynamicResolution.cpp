@@ -0,0 +1,223 @@
+//***************************************************************************************
+// DynamicResolution.cpp
+//***************************************************************************************
+
+#include "DynamicResolution.h"
+#include "../Common/GpuAllocator.h"
+
+using Microsoft::WRL::ComPtr;
+
+const float DynamicResolution::MaxScale = 1.0f;
+const float DynamicResolution::ScaleStep = 1.0f / 32.0f;
+
+namespace
+{
+	// Fractions of the way to the ideal scale moved per frame.  The timings arrive a few
+	// frames late, so a full step would overshoot; dropping quickly avoids long runs of
+	// missed frames, rising slowly avoids bouncing straight back.
+	const float gDownGain = 0.2f;
+	const float gUpGain = 0.04f;
+}
+
+DynamicResolution::DynamicResolution(ID3D12Device* device, float targetMs, float minScale)
+	: md3dDevice(device), mTargetMs(targetMs), mMinScale(MathHelper::Clamp(minScale, ScaleStep, MaxScale))
+{
+	D3D12_DESCRIPTOR_HEAP_DESC rtvHeapDesc = {};
+	rtvHeapDesc.NumDescriptors = 1;
+	rtvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
+	rtvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
+	ThrowIfFailed(md3dDevice->CreateDescriptorHeap(&rtvHeapDesc, IID_PPV_ARGS(&mRtvHeap)));
+}
+
+void DynamicResolution::BuildDescriptors(
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv)
+{
+	mhCpuSrv = hCpuSrv;
+	mhGpuSrv = hGpuSrv;
+}
+
+void DynamicResolution::OnResize(UINT width, UINT height, DXGI_FORMAT format, UINT sampleCount, UINT sampleQuality,
+	const float clearColor[4])
+{
+	mWidth = std::max<UINT>(width, 1);
+	mHeight = std::max<UINT>(height, 1);
+	mFormat = format;
+	mSampleCount = sampleCount;
+
+	D3D12_RESOURCE_DESC texDesc;
+	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
+	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	texDesc.Alignment = 0;
+	texDesc.Width = mWidth;
+	texDesc.Height = mHeight;
+	texDesc.DepthOrArraySize = 1;
+	texDesc.MipLevels = 1;
+	texDesc.Format = mFormat;
+	texDesc.SampleDesc.Count = sampleCount;
+	texDesc.SampleDesc.Quality = sampleQuality;
+	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+	texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
+
+	D3D12_CLEAR_VALUE optClear;
+	optClear.Format = mFormat;
+	memcpy(optClear.Color, clearColor, sizeof(optClear.Color));
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_DEFAULT,
+		&texDesc,
+		D3D12_RESOURCE_STATE_RENDER_TARGET,
+		&optClear,
+		IID_PPV_ARGS(mSceneTarget.ReleaseAndGetAddressOf())));
+
+	md3dDevice->CreateRenderTargetView(mSceneTarget.Get(), nullptr, mRtvHeap->GetCPUDescriptorHandleForHeapStart());
+
+	// The upscale samples a single-sampled copy.
+	ID3D12Resource* source = mSceneTarget.Get();
+	mResolveTarget = nullptr;
+	if(sampleCount > 1)
+	{
+		texDesc.SampleDesc.Count = 1;
+		texDesc.SampleDesc.Quality = 0;
+		texDesc.Flags = D3D12_RESOURCE_FLAG_NONE;
+
+		ThrowIfFailed(CreateGpuResource(md3dDevice,
+			D3D12_HEAP_TYPE_DEFAULT,
+			&texDesc,
+			D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
+			nullptr,
+			IID_PPV_ARGS(mResolveTarget.ReleaseAndGetAddressOf())));
+		source = mResolveTarget.Get();
+	}
+
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = mFormat;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.MipLevels = 1;
+	md3dDevice->CreateShaderResourceView(source, &srvDesc, mhCpuSrv);
+}
+
+void DynamicResolution::Update(float gpuFrameMs)
+{
+	if(gpuFrameMs <= 0.0f || mTargetMs <= 0.0f)
+		return;
+
+	// GPU time goes roughly with the pixel count, the square of the scale, so this is
+	// the scale that would have just met the target.
+	float ideal = mFilteredScale * sqrtf(mTargetMs / gpuFrameMs);
+	float gain = ideal < mFilteredScale ? gDownGain : gUpGain;
+	mFilteredScale = MathHelper::Clamp(mFilteredScale + gain * (ideal - mFilteredScale), mMinScale, MaxScale);
+
+	// Only step once the filtered scale is past the middle of the next step, to keep
+	// a scale sitting near a boundary from flickering between two sizes.
+	if(fabsf(mFilteredScale - mScale) > 0.75f * ScaleStep)
+		mScale = MathHelper::Clamp(floorf(mFilteredScale / ScaleStep + 0.5f) * ScaleStep, mMinScale, MaxScale);
+}
+
+float DynamicResolution::Scale()const
+{
+	return mScale;
+}
+
+float DynamicResolution::TargetMs()const
+{
+	return mTargetMs;
+}
+
+UINT DynamicResolution::ScaledWidth()const
+{
+	return MathHelper::Clamp((UINT)(mScale * mWidth + 0.5f), 1u, mWidth);
+}
+
+UINT DynamicResolution::ScaledHeight()const
+{
+	return MathHelper::Clamp((UINT)(mScale * mHeight + 0.5f), 1u, mHeight);
+}
+
+D3D12_VIEWPORT DynamicResolution::Viewport()const
+{
+	D3D12_VIEWPORT viewport;
+	viewport.TopLeftX = 0.0f;
+	viewport.TopLeftY = 0.0f;
+	viewport.Width = (float)ScaledWidth();
+	viewport.Height = (float)ScaledHeight();
+	viewport.MinDepth = 0.0f;
+	viewport.MaxDepth = 1.0f;
+	return viewport;
+}
+
+D3D12_RECT DynamicResolution::ScissorRect()const
+{
+	return { 0, 0, (LONG)ScaledWidth(), (LONG)ScaledHeight() };
+}
+
+D3D12_CPU_DESCRIPTOR_HANDLE DynamicResolution::RenderTargetView()const
+{
+	return mRtvHeap->GetCPUDescriptorHandleForHeapStart();
+}
+
+void DynamicResolution::Upscale(
+	ID3D12GraphicsCommandList* cmdList,
+	ID3D12RootSignature* rootSig,
+	ID3D12PipelineState* pso,
+	D3D12_CPU_DESCRIPTOR_HANDLE outputView,
+	const D3D12_VIEWPORT& outputViewport,
+	const D3D12_RECT& outputScissorRect)
+{
+	if(mResolveTarget != nullptr)
+	{
+		D3D12_RESOURCE_BARRIER toResolve[] =
+		{
+			CD3DX12_RESOURCE_BARRIER::Transition(mSceneTarget.Get(),
+				D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_RESOLVE_SOURCE),
+			CD3DX12_RESOURCE_BARRIER::Transition(mResolveTarget.Get(),
+				D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_RESOLVE_DEST),
+		};
+		cmdList->ResourceBarrier(_countof(toResolve), toResolve);
+
+		cmdList->ResolveSubresource(mResolveTarget.Get(), 0, mSceneTarget.Get(), 0, mFormat);
+
+		D3D12_RESOURCE_BARRIER fromResolve[] =
+		{
+			CD3DX12_RESOURCE_BARRIER::Transition(mSceneTarget.Get(),
+				D3D12_RESOURCE_STATE_RESOLVE_SOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET),
+			CD3DX12_RESOURCE_BARRIER::Transition(mResolveTarget.Get(),
+				D3D12_RESOURCE_STATE_RESOLVE_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE),
+		};
+		cmdList->ResourceBarrier(_countof(fromResolve), fromResolve);
+	}
+	else
+	{
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mSceneTarget.Get(),
+			D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+	}
+
+	// The rendered corner in uv, and the last texel centre inside it, so the bilinear
+	// taps never reach the texels it did not cover.
+	float constants[4] =
+	{
+		(float)ScaledWidth() / mWidth,
+		(float)ScaledHeight() / mHeight,
+		(ScaledWidth() - 0.5f) / mWidth,
+		(ScaledHeight() - 0.5f) / mHeight,
+	};
+
+	cmdList->RSSetViewports(1, &outputViewport);
+	cmdList->RSSetScissorRects(1, &outputScissorRect);
+	cmdList->OMSetRenderTargets(1, &outputView, true, nullptr);
+
+	cmdList->SetGraphicsRootSignature(rootSig);
+	cmdList->SetPipelineState(pso);
+	cmdList->SetGraphicsRoot32BitConstants(0, 4, constants, 0);
+	cmdList->SetGraphicsRootDescriptorTable(1, mhGpuSrv);
+	cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	cmdList->DrawInstanced(3, 1, 0, 0);
+
+	if(mResolveTarget == nullptr)
+	{
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mSceneTarget.Get(),
+			D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_RENDER_TARGET));
+	}
+}
@@ -0,0 +1,89 @@
+//***************************************************************************************
+// DynamicResolution.h
+//
+// Renders the scene into an offscreen target at a variable fraction of the output
+// size, and upscales it into the back buffer.  The fraction is steered each frame from
+// the measured GPU time towards a target frame time.
+//
+// The targets are allocated at the full output size by OnResize only; a smaller scale
+// just renders into the top-left corner of them, so rescaling never reallocates.  With
+// MSAA the scene target is multisampled and resolved before the upscale.
+//***************************************************************************************
+
+#pragma once
+
+#include "../Common/d3dUtil.h"
+
+class DynamicResolution
+{
+public:
+	DynamicResolution(ID3D12Device* device, float targetMs, float minScale);
+	DynamicResolution(const DynamicResolution& rhs) = delete;
+	DynamicResolution& operator=(const DynamicResolution& rhs) = delete;
+	~DynamicResolution() = default;
+
+	// The scale changes in steps of ScaleStep, per axis, so the viewport does not
+	// change size every frame.
+	static const float MaxScale;
+	static const float ScaleStep;
+
+	// The SRV the upscale reads, in the caller's shader visible heap.
+	void BuildDescriptors(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv);
+
+	// (Re)creates the targets at the output size; call before the first frame and
+	// whenever the back buffers are recreated.  clearColor is the scene's clear color.
+	void OnResize(UINT width, UINT height, DXGI_FORMAT format, UINT sampleCount, UINT sampleQuality,
+		const float clearColor[4]);
+
+	// Adjusts the scale from the GPU time of a completed frame; 0 means no sample.
+	void Update(float gpuFrameMs);
+
+	float Scale()const;
+	float TargetMs()const;
+
+	// The scaled scene viewport and scissor rectangle.
+	D3D12_VIEWPORT Viewport()const;
+	D3D12_RECT ScissorRect()const;
+
+	// The scene target, kept in RENDER_TARGET outside of Upscale.
+	D3D12_CPU_DESCRIPTOR_HANDLE RenderTargetView()const;
+
+	// Resolves the scene if multisampled and draws it over outputView, which must be in
+	// RENDER_TARGET, with rootSig and pso set up for Shaders/Upscale.hlsl.  The output
+	// viewport and scissor rectangle are left set.
+	void Upscale(
+		ID3D12GraphicsCommandList* cmdList,
+		ID3D12RootSignature* rootSig,
+		ID3D12PipelineState* pso,
+		D3D12_CPU_DESCRIPTOR_HANDLE outputView,
+		const D3D12_VIEWPORT& outputViewport,
+		const D3D12_RECT& outputScissorRect);
+
+private:
+	UINT ScaledWidth()const;
+	UINT ScaledHeight()const;
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	float mTargetMs = 0.0f;
+	float mMinScale = 0.5f;
+
+	// mFilteredScale follows the controller continuously; mScale is it quantized.
+	float mFilteredScale = 1.0f;
+	float mScale = 1.0f;
+
+	UINT mWidth = 0;
+	UINT mHeight = 0;
+	DXGI_FORMAT mFormat = DXGI_FORMAT_UNKNOWN;
+	UINT mSampleCount = 1;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mSceneTarget;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mResolveTarget;	// only with MSAA
+	Microsoft::WRL::ComPtr<ID3D12DescriptorHeap> mRtvHeap;
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuSrv;
+};
@@ -0,0 +1,155 @@
+//***************************************************************************************
+// Foliage.cpp
+//***************************************************************************************
+
+#include "Foliage.h"
+#include "../Common/StagingRing.h"
+#include <algorithm>
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+Foliage::Foliage(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList, StagingRing& staging,
+	UINT treeCount, int cellsPerSide, float size, UINT sliceCount,
+	const std::function<float(float, float)>& height,
+	const std::function<bool(float, float)>& keep)
+{
+	static_assert(sizeof(TreeInstance) == 32, "TreeInstance must match TreeSprite.hlsl");
+
+	const float halfSize = 0.5f * size;
+	const float cellSize = size / cellsPerSide;
+	const int maxAttempts = 16;
+
+	std::vector<TreeInstance> trees;
+	std::vector<UINT> treeCells;
+	trees.reserve(treeCount);
+	treeCells.reserve(treeCount);
+
+	for(UINT i = 0; i < treeCount; ++i)
+	{
+		// Retry the points keep rejects; a tree that finds no place is dropped.
+		for(int attempt = 0; attempt < maxAttempts; ++attempt)
+		{
+			float x = MathHelper::RandF(-halfSize, halfSize);
+			float z = MathHelper::RandF(-halfSize, halfSize);
+			if(!keep(x, z))
+				continue;
+
+			TreeInstance tree;
+			float width = MathHelper::RandF(10.0f, 16.0f);
+			tree.Size = XMFLOAT2(width, width * MathHelper::RandF(0.9f, 1.2f));
+
+			// Sunk slightly so the trunk meets sloped ground.
+			tree.Position = XMFLOAT3(x, height(x, z) + 0.45f * tree.Size.y, z);
+			tree.Slice = (UINT)MathHelper::Rand(0, (int)sliceCount - 1);
+
+			int cellX = MathHelper::Clamp((int)((x + halfSize) / cellSize), 0, cellsPerSide - 1);
+			int cellZ = MathHelper::Clamp((int)((z + halfSize) / cellSize), 0, cellsPerSide - 1);
+
+			trees.push_back(tree);
+			treeCells.push_back(cellZ * cellsPerSide + cellX);
+			break;
+		}
+	}
+	mTreeCount = (UINT)trees.size();
+
+	// Counting sort by cell so every cell's trees are contiguous.
+	mCells.resize(cellsPerSide * cellsPerSide);
+	for(UINT cell : treeCells)
+		mCells[cell].InstanceCount++;
+
+	UINT offset = 0;
+	for(auto& c : mCells)
+	{
+		c.FirstInstance = offset;
+		offset += c.InstanceCount;
+		c.InstanceCount = 0;
+	}
+
+	std::vector<TreeInstance> instances(std::max<UINT>(mTreeCount, 1));
+	std::vector<XMFLOAT3> cellMin(mCells.size(), XMFLOAT3(+MathHelper::Infinity, +MathHelper::Infinity, +MathHelper::Infinity));
+	std::vector<XMFLOAT3> cellMax(mCells.size(), XMFLOAT3(-MathHelper::Infinity, -MathHelper::Infinity, -MathHelper::Infinity));
+	for(UINT i = 0; i < mTreeCount; ++i)
+	{
+		Cell& c = mCells[treeCells[i]];
+		const TreeInstance& tree = trees[i];
+		instances[c.FirstInstance + c.InstanceCount++] = tree;
+
+		// The quad turns about its vertical axis, so bound it by its half width in x and z.
+		XMFLOAT3& lo = cellMin[treeCells[i]];
+		XMFLOAT3& hi = cellMax[treeCells[i]];
+		float halfWidth = 0.5f * tree.Size.x;
+		float halfHeight = 0.5f * tree.Size.y;
+		lo = XMFLOAT3(std::min<float>(lo.x, tree.Position.x - halfWidth), std::min<float>(lo.y, tree.Position.y - halfHeight), std::min<float>(lo.z, tree.Position.z - halfWidth));
+		hi = XMFLOAT3(std::max<float>(hi.x, tree.Position.x + halfWidth), std::max<float>(hi.y, tree.Position.y + halfHeight), std::max<float>(hi.z, tree.Position.z + halfWidth));
+	}
+
+	for(size_t i = 0; i < mCells.size(); ++i)
+	{
+		if(mCells[i].InstanceCount > 0)
+			BoundingBox::CreateFromPoints(mCells[i].Bounds, XMLoadFloat3(&cellMin[i]), XMLoadFloat3(&cellMax[i]));
+	}
+
+	mInstanceBuffer = d3dUtil::CreateDefaultBuffer(device, cmdList,
+		instances.data(), instances.size() * sizeof(TreeInstance), staging);
+}
+
+void Foliage::Cull(const BoundingFrustum& frustumW, const XMFLOAT3& eyePosW)
+{
+	XMVECTOR eyePos = XMLoadFloat3(&eyePosW);
+
+	std::vector<std::pair<float, UINT>> visible;
+	mVisibleTreeCount = 0;
+	for(UINT i = 0; i < (UINT)mCells.size(); ++i)
+	{
+		const Cell& c = mCells[i];
+		if(c.InstanceCount == 0)
+			continue;
+
+		// Distance from the eye to the nearest point of the cell.
+		XMVECTOR center = XMLoadFloat3(&c.Bounds.Center);
+		XMVECTOR extents = XMLoadFloat3(&c.Bounds.Extents);
+		XMVECTOR nearest = XMVectorClamp(eyePos, center - extents, center + extents);
+		float distSq = XMVectorGetX(XMVector3LengthSq(nearest - eyePos));
+
+		if(distSq > FadeEnd * FadeEnd || frustumW.Contains(c.Bounds) == DirectX::DISJOINT)
+			continue;
+
+		visible.push_back({ distSq, i });
+		mVisibleTreeCount += c.InstanceCount;
+	}
+
+	// Front to back so the nearer cells occlude the farther ones.
+	std::sort(visible.begin(), visible.end());
+
+	mVisibleCells.clear();
+	for(auto& v : visible)
+		mVisibleCells.push_back(v.second);
+}
+
+void Foliage::Draw(ID3D12GraphicsCommandList* cmdList, UINT instanceParameter, UINT firstInstanceParameter)const
+{
+	if(mVisibleCells.empty())
+		return;
+
+	cmdList->SetGraphicsRootShaderResourceView(instanceParameter, mInstanceBuffer->GetGPUVirtualAddress());
+	cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+
+	// Four strip vertices per tree, made up by the vertex shader.
+	for(UINT i : mVisibleCells)
+	{
+		const Cell& c = mCells[i];
+		cmdList->SetGraphicsRoot32BitConstant(firstInstanceParameter, c.FirstInstance, 0);
+		cmdList->DrawInstanced(4, c.InstanceCount, 0, 0);
+	}
+}
+
+UINT Foliage::TreeCount()const
+{
+	return mTreeCount;
+}
+
+UINT Foliage::VisibleTreeCount()const
+{
+	return mVisibleTreeCount;
+}
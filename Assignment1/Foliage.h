@@ -0,0 +1,81 @@
+//***************************************************************************************
+// Foliage.h
+//
+// Billboard trees scattered over the terrain.  Each tree is one element of a static
+// instance buffer, and the vertex shader expands it into a camera facing quad from
+// SV_VertexID, so no geometry shader or vertex buffer is needed.
+//
+// The trees are grouped by the cell of a square grid they stand in; a cell's trees are
+// contiguous in the instance buffer and drawn by one DrawInstanced.  Cells are culled
+// against the view frustum and the fade distance on the CPU; within FadeStart..FadeEnd
+// the trees dissolve with a screen-door dither, and past FadeEnd the vertex shader
+// collapses them.
+//***************************************************************************************
+
+#ifndef FOLIAGE_H
+#define FOLIAGE_H
+
+#include "../Common/d3dUtil.h"
+#include <functional>
+
+class StagingRing;
+
+class Foliage
+{
+public:
+	// Scatters treeCount trees over size x size world units centred on the origin,
+	// grouped into cellsPerSide x cellsPerSide cells.  Trees are only placed where
+	// keep(x, z) is true, at height(x, z), and pick one of sliceCount texture array
+	// slices each.
+	Foliage(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList, StagingRing& staging,
+		UINT treeCount, int cellsPerSide, float size, UINT sliceCount,
+		const std::function<float(float, float)>& height,
+		const std::function<bool(float, float)>& keep);
+	Foliage(const Foliage& rhs) = delete;
+	Foliage& operator=(const Foliage& rhs) = delete;
+	~Foliage() = default;
+
+	// Fade distances; must match TreeSprite.hlsl.
+	static constexpr float FadeStart = 160.0f;
+	static constexpr float FadeEnd = 200.0f;
+
+	// Layout shared with TreeSprite.hlsl.
+	struct TreeInstance
+	{
+		DirectX::XMFLOAT3 Position;	// centre of the quad
+		UINT Slice = 0;
+		DirectX::XMFLOAT2 Size;
+		DirectX::XMFLOAT2 Pad = { 0.0f, 0.0f };
+	};
+
+	// Picks the cells to draw for a world space frustum, nearest first.
+	void Cull(const DirectX::BoundingFrustum& frustumW, const DirectX::XMFLOAT3& eyePosW);
+
+	// Draws the visible cells with the root signature, PSO, pass constants and material
+	// already set.  The instance buffer is bound as the root SRV at instanceParameter
+	// and each cell's first instance as the root constant at firstInstanceParameter.
+	void Draw(ID3D12GraphicsCommandList* cmdList, UINT instanceParameter, UINT firstInstanceParameter)const;
+
+	UINT TreeCount()const;
+	UINT VisibleTreeCount()const;
+
+private:
+	struct Cell
+	{
+		DirectX::BoundingBox Bounds;
+		UINT FirstInstance = 0;
+		UINT InstanceCount = 0;
+	};
+
+private:
+	std::vector<Cell> mCells;
+	UINT mTreeCount = 0;
+
+	// Indices into mCells, nearest first.
+	std::vector<UINT> mVisibleCells;
+	UINT mVisibleTreeCount = 0;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mInstanceBuffer = nullptr;
+};
+
+#endif // FOLIAGE_H
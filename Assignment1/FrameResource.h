@@ -3,13 +3,50 @@
 #include "../Common/d3dUtil.h"
 #include "../Common/MathHelper.h"
 #include "../Common/UploadBuffer.h"
+#include "../Common/LinearAllocator.h"
 
+// Padded to a constant buffer view, so that an array of them is both a CBV per element
+// and a StructuredBuffer for the bindless shaders.
 struct ObjectConstants
 {
     DirectX::XMFLOAT4X4 World = MathHelper::Identity4x4();
 	DirectX::XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
+	DirectX::XMFLOAT2 DisplacementMapTexelSize = { 1.0f, 1.0f };
+	float GridSpatialStep = 1.0f;
+	float Pad = 0.0f;
+	DirectX::XMFLOAT4 Pad1[7];
 };
 
+static_assert(sizeof(ObjectConstants) == D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT,
+	"ObjectConstants must be one constant buffer view");
+
+// Per-instance data of the instanced castle pieces, read by the VS from a
+// structured buffer indexed by SV_InstanceID.
+struct InstanceData
+{
+	DirectX::XMFLOAT4X4 World = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
+};
+
+// MaterialConstants plus the SRV heap index of the diffuse texture.  Starts with the
+// cbMaterial layout and is padded like ObjectConstants, so one array serves the bound
+// shaders as CBVs and the bindless ones as a StructuredBuffer indexed by MatCBIndex.
+struct MaterialData
+{
+	DirectX::XMFLOAT4 DiffuseAlbedo = { 1.0f, 1.0f, 1.0f, 1.0f };
+	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
+	float Roughness = 0.25f;
+	DirectX::XMFLOAT4X4 MatTransform = MathHelper::Identity4x4();
+	UINT DiffuseMapIndex = 0;
+	UINT Pad0 = 0;
+	UINT Pad1 = 0;
+	UINT Pad2 = 0;
+	DirectX::XMFLOAT4 Pad3[9];
+};
+
+static_assert(sizeof(MaterialData) == D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT,
+	"MaterialData must be one constant buffer view");
+
 struct PassConstants
 {
     DirectX::XMFLOAT4X4 View = MathHelper::Identity4x4();
@@ -35,10 +72,8 @@ struct PassConstants
 	float gFogRange = 150.0f;
 	DirectX::XMFLOAT2 cbPerObjectPad2;
 
-    // Indices [0, NUM_DIR_LIGHTS) are directional lights;
-    // indices [NUM_DIR_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHTS) are point lights;
-    // indices [NUM_DIR_LIGHTS+NUM_POINT_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHT+NUM_SPOT_LIGHTS)
-    // are spot lights for a maximum of MaxLights per object.
+    // Indices [0, NUM_DIR_LIGHTS) are directional lights; the point and spot lights are
+    // clustered, see ClusteredLighting.h, and NUM_POINT_LIGHTS and NUM_SPOT_LIGHTS stay 0.
     Light Lights[MaxLights];
 };
 
@@ -49,13 +84,23 @@ struct Vertex
 	DirectX::XMFLOAT2 TexC;
 };
 
+// The castle meshes' layout with -compactvertices: the normal octahedral encoded in two
+// snorm16s and the tex-coords as halfs, 20 bytes instead of 32.
+struct CompactVertex
+{
+    DirectX::XMFLOAT3 Pos;
+    DirectX::PackedVector::XMSHORTN2 Normal;
+    DirectX::PackedVector::XMHALF2 TexC;
+};
+
 // Stores the resources needed for the CPU to build the command lists
 // for a frame.  
 struct FrameResource
 {
 public:
     
-    FrameResource(ID3D12Device* device, UINT passCount, UINT objectCount, UINT materialCount, UINT waveVertCount);
+    FrameResource(ID3D12Device* device, UINT64 constantsPageSize, UINT waveVertCount, UINT instanceCount,
+        UINT workerCount);
     FrameResource(const FrameResource& rhs) = delete;
     FrameResource& operator=(const FrameResource& rhs) = delete;
     ~FrameResource();
@@ -64,18 +109,43 @@ public:
     // So each frame needs their own allocator.
     Microsoft::WRL::ComPtr<ID3D12CommandAllocator> CmdListAlloc;
 
+    // The frame's work on the compute queue.  The direct queue waits for it before the
+    // frame's lists, so Fence covers it as well.
+    Microsoft::WRL::ComPtr<ID3D12CommandAllocator> ComputeCmdListAlloc;
+
+    // One allocator/command list pair per worker thread, so the render layers can
+    // be recorded in parallel.  The lists are created closed.
+    std::vector<Microsoft::WRL::ComPtr<ID3D12CommandAllocator>> WorkerCmdListAllocs;
+    std::vector<Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList>> WorkerCmdLists;
+
     // We cannot update a cbuffer until the GPU is done processing the commands
-    // that reference it.  So each frame needs their own cbuffers.
-   // std::unique_ptr<UploadBuffer<FrameConstants>> FrameCB = nullptr;
-    std::unique_ptr<UploadBuffer<PassConstants>> PassCB = nullptr;
-    std::unique_ptr<UploadBuffer<MaterialConstants>> MaterialCB = nullptr;
-    std::unique_ptr<UploadBuffer<ObjectConstants>> ObjectCB = nullptr;
+    // that reference it.  So each frame allocates its cbuffers from its own
+    // allocator, which is reset once Fence has been reached.
+    std::unique_ptr<LinearAllocator> Constants;
+
+    // This frame's allocations: the pass constants, one ObjectConstants per
+    // ObjCBIndex and one MaterialData per MatCBIndex.
+    D3D12_GPU_VIRTUAL_ADDRESS PassCB = 0;
+    D3D12_GPU_VIRTUAL_ADDRESS ObjectCB = 0;
+    D3D12_GPU_VIRTUAL_ADDRESS MaterialCB = 0;
+
+    // Transforms of the instanced render items, bound as a root SRV.
+    // Null when nothing is drawn instanced (instanceCount == 0).
+    std::unique_ptr<UploadBuffer<InstanceData>> InstanceBuffer = nullptr;
 
     // We cannot update a dynamic vertex buffer until the GPU is done processing
     // the commands that reference it.  So each frame needs their own.
+    // Null when the waves are simulated on the GPU (waveVertCount == 0).
     std::unique_ptr<UploadBuffer<Vertex>> WavesVB = nullptr;
 
+    // Waves::SolutionVersion() last written into WavesVB.
+    UINT64 WavesVersion = 0;
+
     // Fence value to mark commands up to this fence point.  This lets us
     // check if these frame resources are still in use by the GPU.
     UINT64 Fence = 0;
+
+    // Signalled by the fence when Fence is reached; created once and reused
+    // for every wait on this frame resource.
+    HANDLE FenceEvent = nullptr;
 };
\ No newline at end of file
@@ -0,0 +1,406 @@
+//***************************************************************************************
+// GpuCulling.cpp
+//***************************************************************************************
+
+#include "GpuCulling.h"
+#include "../Common/GpuAllocator.h"
+
+using Microsoft::WRL::ComPtr;
+using namespace DirectX;
+
+GpuCulling::GpuCulling(ID3D12Device* device, ID3D12RootSignature* drawRootSig,
+	UINT objectCBParameter, UINT materialCBParameter, UINT frameResourceCount)
+	: md3dDevice(device)
+{
+	D3D12_INDIRECT_ARGUMENT_DESC args[5] = {};
+	args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT_BUFFER_VIEW;
+	args[0].ConstantBufferView.RootParameterIndex = objectCBParameter;
+	args[1].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT_BUFFER_VIEW;
+	args[1].ConstantBufferView.RootParameterIndex = materialCBParameter;
+	args[2].Type = D3D12_INDIRECT_ARGUMENT_TYPE_VERTEX_BUFFER_VIEW;
+	args[2].VertexBuffer.Slot = 0;
+	args[3].Type = D3D12_INDIRECT_ARGUMENT_TYPE_INDEX_BUFFER_VIEW;
+	args[4].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
+
+	Initialize(args, _countof(args), sizeof(IndirectCommand), drawRootSig, frameResourceCount);
+}
+
+GpuCulling::GpuCulling(ID3D12Device* device, ID3D12RootSignature* drawRootSig,
+	UINT drawIndicesParameter, UINT frameResourceCount)
+	: md3dDevice(device)
+{
+	D3D12_INDIRECT_ARGUMENT_DESC args[4] = {};
+	args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT;
+	args[0].Constant.RootParameterIndex = drawIndicesParameter;
+	args[0].Constant.DestOffsetIn32BitValues = 0;
+	args[0].Constant.Num32BitValuesToSet = 2;
+	args[1].Type = D3D12_INDIRECT_ARGUMENT_TYPE_VERTEX_BUFFER_VIEW;
+	args[1].VertexBuffer.Slot = 0;
+	args[2].Type = D3D12_INDIRECT_ARGUMENT_TYPE_INDEX_BUFFER_VIEW;
+	args[3].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
+
+	Initialize(args, _countof(args), sizeof(BindlessIndirectCommand), drawRootSig, frameResourceCount);
+}
+
+void GpuCulling::Initialize(const D3D12_INDIRECT_ARGUMENT_DESC* args, UINT argCount,
+	UINT byteStride, ID3D12RootSignature* drawRootSig, UINT frameResourceCount)
+{
+	static_assert(sizeof(IndirectCommand) == 72, "IndirectCommand must match GpuCulling.hlsl");
+	static_assert(sizeof(BindlessIndirectCommand) == 64, "BindlessIndirectCommand must match GpuCulling.hlsl");
+	static_assert(sizeof(GpuItem) == 120, "GpuItem must match GpuCulling.hlsl");
+	static_assert(sizeof(CullConstants) == 208, "CullConstants must match GpuCulling.hlsl");
+
+	D3D12_COMMAND_SIGNATURE_DESC signatureDesc = {};
+	signatureDesc.ByteStride = byteStride;
+	signatureDesc.NumArgumentDescs = argCount;
+	signatureDesc.pArgumentDescs = args;
+	signatureDesc.NodeMask = 0;
+	ThrowIfFailed(md3dDevice->CreateCommandSignature(&signatureDesc, drawRootSig,
+		IID_PPV_ARGS(&mCommandSignature)));
+	mCommandByteStride = byteStride;
+
+	mItemBuffers.resize(frameResourceCount);
+	mCullCB = std::make_unique<UploadBuffer<CullConstants>>(md3dDevice, frameResourceCount, true);
+}
+
+void GpuCulling::SetItems(const std::vector<Item>& items, UINT groupCount)
+{
+	mGroupCount = groupCount;
+	mGroupCapacities.assign(groupCount, 0);
+	for(auto& item : items)
+		mGroupCapacities[item.Group]++;
+
+	mGroupOffsets.assign(groupCount, 0);
+	UINT commandCount = 0;
+	for(UINT g = 0; g < groupCount; ++g)
+	{
+		mGroupOffsets[g] = commandCount;
+		commandCount += mGroupCapacities[g];
+	}
+
+	mItems.resize(items.size());
+	for(size_t i = 0; i < items.size(); ++i)
+	{
+		const Item& src = items[i];
+		GpuItem& dst = mItems[i];
+		dst = {};
+		dst.Center = src.Bounds.Center;
+		dst.Extents = src.Bounds.Extents;
+		dst.ObjCBIndex = src.ObjCBIndex;
+		dst.MatCBIndex = src.MatCBIndex;
+		dst.Group = src.Group;
+		dst.ArgOffset = mGroupOffsets[src.Group];
+		dst.Command.VertexBufferView = src.VertexBufferView;
+		dst.Command.IndexBufferView = src.IndexBufferView;
+		dst.Command.DrawArguments.IndexCountPerInstance = src.IndexCount;
+		dst.Command.DrawArguments.InstanceCount = 1;
+		dst.Command.DrawArguments.StartIndexLocation = src.StartIndexLocation;
+		dst.Command.DrawArguments.BaseVertexLocation = src.BaseVertexLocation;
+		dst.Command.DrawArguments.StartInstanceLocation = 0;
+	}
+
+	for(auto& buffer : mItemBuffers)
+		buffer = std::make_unique<UploadBuffer<GpuItem>>(md3dDevice, std::max<UINT>((UINT)mItems.size(), 1), false);
+	mItemsDirtyFrames = (int)mItemBuffers.size();
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_DEFAULT,
+		&CD3DX12_RESOURCE_DESC::Buffer(std::max<UINT>(commandCount, 1) * mCommandByteStride,
+			D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+		D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT,
+		nullptr,
+		IID_PPV_ARGS(mArgumentBuffer.ReleaseAndGetAddressOf())));
+
+	const UINT countByteSize = std::max<UINT>(groupCount, 1) * sizeof(UINT);
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_DEFAULT,
+		&CD3DX12_RESOURCE_DESC::Buffer(countByteSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+		D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT,
+		nullptr,
+		IID_PPV_ARGS(mCountBuffer.ReleaseAndGetAddressOf())));
+
+	// Copied over the counters before every culling pass.
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_UPLOAD,
+		&CD3DX12_RESOURCE_DESC::Buffer(countByteSize),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(mZeroCountBuffer.ReleaseAndGetAddressOf())));
+
+	void* zeros = nullptr;
+	ThrowIfFailed(mZeroCountBuffer->Map(0, nullptr, &zeros));
+	ZeroMemory(zeros, countByteSize);
+	mZeroCountBuffer->Unmap(0, nullptr);
+}
+
+void GpuCulling::SetItemDraw(UINT item, UINT indexCount, UINT startIndexLocation, INT baseVertexLocation)
+{
+	D3D12_DRAW_INDEXED_ARGUMENTS& args = mItems[item].Command.DrawArguments;
+	if(args.IndexCountPerInstance == indexCount &&
+		args.StartIndexLocation == startIndexLocation &&
+		args.BaseVertexLocation == baseVertexLocation)
+		return;
+
+	args.IndexCountPerInstance = indexCount;
+	args.StartIndexLocation = startIndexLocation;
+	args.BaseVertexLocation = baseVertexLocation;
+	mItemsDirtyFrames = (int)mItemBuffers.size();
+}
+
+UINT GpuCulling::ItemCount()const
+{
+	return (UINT)mItems.size();
+}
+
+void GpuCulling::BuildDescriptors(
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDescriptor,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuDescriptor,
+	UINT descriptorSize)
+{
+	mhCpuDescriptor = hCpuDescriptor;
+	mhGpuDescriptor = hGpuDescriptor;
+	mDescriptorSize = descriptorSize;
+
+	if(mHiZ != nullptr)
+		WriteDescriptors();
+}
+
+void GpuCulling::OnResize(ID3D12Resource* depthBuffer, UINT width, UINT height, bool msaa)
+{
+	mDepthBuffer = depthBuffer;
+	mDepthWidth = width;
+	mDepthHeight = height;
+	mMsaa = msaa;
+
+	BuildHiZResources();
+
+	if(mDescriptorSize != 0)
+		WriteDescriptors();
+}
+
+void GpuCulling::BuildHiZResources()
+{
+	mHiZWidth = std::max<UINT>((mDepthWidth + 1) / 2, 1);
+	mHiZHeight = std::max<UINT>((mDepthHeight + 1) / 2, 1);
+
+	mHiZMipCount = 1;
+	while(mHiZMipCount < MaxHiZMips && std::max<UINT>(mHiZWidth, mHiZHeight) >> mHiZMipCount != 0)
+		++mHiZMipCount;
+
+	D3D12_RESOURCE_DESC texDesc;
+	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
+	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	texDesc.Alignment = 0;
+	texDesc.Width = mHiZWidth;
+	texDesc.Height = mHiZHeight;
+	texDesc.DepthOrArraySize = 1;
+	texDesc.MipLevels = (UINT16)mHiZMipCount;
+	texDesc.Format = DXGI_FORMAT_R32_FLOAT;
+	texDesc.SampleDesc.Count = 1;
+	texDesc.SampleDesc.Quality = 0;
+	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+	texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_DEFAULT,
+		&texDesc,
+		D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE,
+		nullptr,
+		IID_PPV_ARGS(mHiZ.ReleaseAndGetAddressOf())));
+
+	mHiZValid = false;
+}
+
+// Layout: depth buffer SRV, Hi-Z SRV, then one Hi-Z UAV per mip.
+void GpuCulling::WriteDescriptors()
+{
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hDescriptor = mhCpuDescriptor;
+
+	D3D12_SHADER_RESOURCE_VIEW_DESC depthSrvDesc = {};
+	depthSrvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	depthSrvDesc.Format = DXGI_FORMAT_R24_UNORM_X8_TYPELESS;
+	if(mMsaa)
+	{
+		depthSrvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2DMS;
+	}
+	else
+	{
+		depthSrvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+		depthSrvDesc.Texture2D.MostDetailedMip = 0;
+		depthSrvDesc.Texture2D.MipLevels = 1;
+	}
+	md3dDevice->CreateShaderResourceView(mDepthBuffer, &depthSrvDesc, hDescriptor);
+
+	D3D12_SHADER_RESOURCE_VIEW_DESC hiZSrvDesc = {};
+	hiZSrvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	hiZSrvDesc.Format = DXGI_FORMAT_R32_FLOAT;
+	hiZSrvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	hiZSrvDesc.Texture2D.MostDetailedMip = 0;
+	hiZSrvDesc.Texture2D.MipLevels = mHiZMipCount;
+	md3dDevice->CreateShaderResourceView(mHiZ.Get(), &hiZSrvDesc, hDescriptor.Offset(1, mDescriptorSize));
+
+	// The unused slots get views of the last mip, so every descriptor is valid.
+	for(UINT mip = 0; mip < MaxHiZMips; ++mip)
+	{
+		D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+		uavDesc.Format = DXGI_FORMAT_R32_FLOAT;
+		uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+		uavDesc.Texture2D.MipSlice = std::min<UINT>(mip, mHiZMipCount - 1);
+		md3dDevice->CreateUnorderedAccessView(mHiZ.Get(), nullptr, &uavDesc, hDescriptor.Offset(1, mDescriptorSize));
+	}
+}
+
+void GpuCulling::Cull(
+	ID3D12GraphicsCommandList* cmdList,
+	UINT frameResourceIndex,
+	ID3D12RootSignature* rootSig,
+	ID3D12PipelineState* cullPso,
+	D3D12_GPU_VIRTUAL_ADDRESS objectCB, UINT objCBByteSize,
+	D3D12_GPU_VIRTUAL_ADDRESS materialCB, UINT matCBByteSize,
+	const XMFLOAT4X4& viewProj,
+	bool occlusion)
+{
+	auto& itemBuffer = mItemBuffers[frameResourceIndex];
+	if(mItemsDirtyFrames > 0)
+	{
+		itemBuffer->CopyRange(0, (int)mItems.size(), mItems.data());
+		mItemsDirtyFrames--;
+	}
+
+	// Frustum planes of the row-vector viewProj, pointing inwards (Gribb-Hartmann).
+	CullConstants constants = {};
+	XMMATRIX columns = XMMatrixTranspose(XMLoadFloat4x4(&viewProj));
+	XMVECTOR planes[6] =
+	{
+		columns.r[3] + columns.r[0],
+		columns.r[3] - columns.r[0],
+		columns.r[3] + columns.r[1],
+		columns.r[3] - columns.r[1],
+		columns.r[2],
+		columns.r[3] - columns.r[2],
+	};
+	for(int i = 0; i < 6; ++i)
+		XMStoreFloat4(&constants.FrustumPlanes[i], XMPlaneNormalize(planes[i]));
+
+	XMStoreFloat4x4(&constants.HiZViewProj, XMMatrixTranspose(XMLoadFloat4x4(&mHiZViewProj)));
+	constants.ObjectCB = objectCB;
+	constants.ObjCBByteSize = objCBByteSize;
+	constants.ItemCount = (UINT)mItems.size();
+	constants.MaterialCB = materialCB;
+	constants.MatCBByteSize = matCBByteSize;
+	constants.Occlusion = occlusion && mHiZValid ? 1 : 0;
+	constants.HiZSize = XMFLOAT2(0.5f * mDepthWidth, 0.5f * mDepthHeight);
+	constants.HiZMipCount = mHiZMipCount;
+	mCullCB->CopyData(frameResourceIndex, constants);
+
+	UINT cullCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(CullConstants));
+	D3D12_GPU_VIRTUAL_ADDRESS cullCBAddress =
+		mCullCB->Resource()->GetGPUVirtualAddress() + frameResourceIndex * cullCBByteSize;
+
+	// Zero the counters; the arguments only need to become writable.
+	D3D12_RESOURCE_BARRIER toWrite[] =
+	{
+		CD3DX12_RESOURCE_BARRIER::Transition(mArgumentBuffer.Get(),
+			D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, D3D12_RESOURCE_STATE_UNORDERED_ACCESS),
+		CD3DX12_RESOURCE_BARRIER::Transition(mCountBuffer.Get(),
+			D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT, D3D12_RESOURCE_STATE_COPY_DEST),
+	};
+	cmdList->ResourceBarrier(_countof(toWrite), toWrite);
+
+	cmdList->CopyBufferRegion(mCountBuffer.Get(), 0, mZeroCountBuffer.Get(), 0,
+		std::max<UINT>(mGroupCount, 1) * sizeof(UINT));
+
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mCountBuffer.Get(),
+		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hiZSrv(mhGpuDescriptor, 1, mDescriptorSize);
+
+	cmdList->SetComputeRootSignature(rootSig);
+	cmdList->SetPipelineState(cullPso);
+	cmdList->SetComputeRootConstantBufferView(0, cullCBAddress);
+	cmdList->SetComputeRootShaderResourceView(1, itemBuffer->Resource()->GetGPUVirtualAddress());
+	cmdList->SetComputeRootDescriptorTable(2, hiZSrv);
+	cmdList->SetComputeRootUnorderedAccessView(3, mArgumentBuffer->GetGPUVirtualAddress());
+	cmdList->SetComputeRootUnorderedAccessView(4, mCountBuffer->GetGPUVirtualAddress());
+
+	// 64 items per group, see CullCS.
+	UINT numGroups = ((UINT)mItems.size() + 63) / 64;
+	if(numGroups > 0)
+		cmdList->Dispatch(numGroups, 1, 1);
+
+	D3D12_RESOURCE_BARRIER toRead[] =
+	{
+		CD3DX12_RESOURCE_BARRIER::Transition(mArgumentBuffer.Get(),
+			D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT),
+		CD3DX12_RESOURCE_BARRIER::Transition(mCountBuffer.Get(),
+			D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT),
+	};
+	cmdList->ResourceBarrier(_countof(toRead), toRead);
+}
+
+void GpuCulling::Draw(ID3D12GraphicsCommandList* cmdList, UINT group)const
+{
+	if(mGroupCapacities[group] == 0)
+		return;
+
+	cmdList->ExecuteIndirect(mCommandSignature.Get(), mGroupCapacities[group],
+		mArgumentBuffer.Get(), mGroupOffsets[group] * mCommandByteStride,
+		mCountBuffer.Get(), group * sizeof(UINT));
+}
+
+void GpuCulling::BuildHiZ(
+	ID3D12GraphicsCommandList* cmdList,
+	ID3D12RootSignature* rootSig,
+	ID3D12PipelineState* depthPso,
+	ID3D12PipelineState* downsamplePso,
+	const XMFLOAT4X4& viewProj)
+{
+	D3D12_RESOURCE_BARRIER toWrite[] =
+	{
+		CD3DX12_RESOURCE_BARRIER::Transition(mDepthBuffer,
+			D3D12_RESOURCE_STATE_DEPTH_WRITE, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+		CD3DX12_RESOURCE_BARRIER::Transition(mHiZ.Get(),
+			D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_UNORDERED_ACCESS),
+	};
+	cmdList->ResourceBarrier(_countof(toWrite), toWrite);
+
+	cmdList->SetComputeRootSignature(rootSig);
+	cmdList->SetComputeRootDescriptorTable(1, mhGpuDescriptor);
+
+	UINT srcWidth = mDepthWidth;
+	UINT srcHeight = mDepthHeight;
+	for(UINT mip = 0; mip < mHiZMipCount; ++mip)
+	{
+		UINT dstWidth = std::max<UINT>(mHiZWidth >> mip, 1);
+		UINT dstHeight = std::max<UINT>(mHiZHeight >> mip, 1);
+
+		UINT sizes[] = { srcWidth, srcHeight, dstWidth, dstHeight };
+		cmdList->SetPipelineState(mip == 0 ? depthPso : downsamplePso);
+		cmdList->SetComputeRoot32BitConstants(0, _countof(sizes), sizes, 0);
+
+		// Mip 0 reads the depth buffer; its source UAV slot is bound but unused.
+		UINT srcMip = mip == 0 ? 0 : mip - 1;
+		cmdList->SetComputeRootDescriptorTable(2, CD3DX12_GPU_DESCRIPTOR_HANDLE(mhGpuDescriptor, 2 + srcMip, mDescriptorSize));
+		cmdList->SetComputeRootDescriptorTable(3, CD3DX12_GPU_DESCRIPTOR_HANDLE(mhGpuDescriptor, 2 + mip, mDescriptorSize));
+
+		// 8x8 threads per group, see GpuCulling.hlsl.
+		cmdList->Dispatch((dstWidth + 7) / 8, (dstHeight + 7) / 8, 1);
+		cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::UAV(mHiZ.Get()));
+
+		srcWidth = dstWidth;
+		srcHeight = dstHeight;
+	}
+
+	D3D12_RESOURCE_BARRIER toRead[] =
+	{
+		CD3DX12_RESOURCE_BARRIER::Transition(mDepthBuffer,
+			D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE, D3D12_RESOURCE_STATE_DEPTH_WRITE),
+		CD3DX12_RESOURCE_BARRIER::Transition(mHiZ.Get(),
+			D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE),
+	};
+	cmdList->ResourceBarrier(_countof(toRead), toRead);
+
+	mHiZViewProj = viewProj;
+	mHiZValid = true;
+}
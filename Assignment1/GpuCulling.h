@@ -0,0 +1,203 @@
+//***************************************************************************************
+// GpuCulling.h
+//
+// GPU-driven submission.  The draw items live in a structured buffer; each frame a
+// compute pass tests them against the view frustum and against a Hi-Z pyramid built
+// from the previous frame's depth buffer, and appends the survivors' commands to an
+// indirect argument buffer.  Items are grouped (e.g. by layer and texture), every group
+// owning a contiguous segment of that buffer and one counter, so a group is drawn by a
+// single ExecuteIndirect whatever its size.
+//
+// The commands either bind the object and material CBVs, or, for bindless shaders,
+// set two root constants holding their indices; then only the layer's PSO is shared
+// by a group and one group per layer suffices.
+//
+// Occlusion uses the previous frame's depth and camera, so an object uncovered by a
+// camera move may appear one frame late.
+//***************************************************************************************
+
+#pragma once
+
+#include "../Common/d3dUtil.h"
+#include "../Common/UploadBuffer.h"
+
+class GpuCulling
+{
+public:
+	// The command signature changes the CBVs at the given root parameters of
+	// drawRootSig, the vertex and index buffers, and draws.
+	GpuCulling(ID3D12Device* device, ID3D12RootSignature* drawRootSig,
+		UINT objectCBParameter, UINT materialCBParameter, UINT frameResourceCount);
+
+	// Bindless: the command signature sets the object and material indices as the two
+	// root constants at drawIndicesParameter.  The cull PSO must be compiled with
+	// BINDLESS defined.
+	GpuCulling(ID3D12Device* device, ID3D12RootSignature* drawRootSig,
+		UINT drawIndicesParameter, UINT frameResourceCount);
+	GpuCulling(const GpuCulling& rhs) = delete;
+	GpuCulling& operator=(const GpuCulling& rhs) = delete;
+	~GpuCulling() = default;
+
+	struct Item
+	{
+		// World space bounds.
+		DirectX::BoundingBox Bounds;
+
+		UINT ObjCBIndex = 0;
+		UINT MatCBIndex = 0;
+		UINT Group = 0;
+
+		D3D12_VERTEX_BUFFER_VIEW VertexBufferView = {};
+		D3D12_INDEX_BUFFER_VIEW IndexBufferView = {};
+
+		UINT IndexCount = 0;
+		UINT StartIndexLocation = 0;
+		INT BaseVertexLocation = 0;
+	};
+
+	// Replaces the item set.  Items may be given in any order.
+	void SetItems(const std::vector<Item>& items, UINT groupCount);
+
+	// Changes the draw arguments of one item, e.g. for a LOD switch.
+	void SetItemDraw(UINT item, UINT indexCount, UINT startIndexLocation, INT baseVertexLocation);
+
+	// Hi-Z mip chain SRV plus one UAV per mip, and the depth buffer SRV.
+	static const UINT MaxHiZMips = 16;
+	static const UINT DescriptorCount = MaxHiZMips + 2;
+
+	// OnResize must be called with the depth buffer once before the first Cull, and
+	// again whenever it is recreated; the previous Hi-Z pyramid is discarded.
+	void BuildDescriptors(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDescriptor,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuDescriptor,
+		UINT descriptorSize);
+	void OnResize(ID3D12Resource* depthBuffer, UINT width, UINT height, bool msaa);
+
+	// Records the culling pass.  The CB addresses are those of the frame resource being
+	// recorded, and ignored when bindless; viewProj is this frame's.  Leaves the argument buffers ready for Draw.
+	void Cull(
+		ID3D12GraphicsCommandList* cmdList,
+		UINT frameResourceIndex,
+		ID3D12RootSignature* rootSig,
+		ID3D12PipelineState* cullPso,
+		D3D12_GPU_VIRTUAL_ADDRESS objectCB, UINT objCBByteSize,
+		D3D12_GPU_VIRTUAL_ADDRESS materialCB, UINT matCBByteSize,
+		const DirectX::XMFLOAT4X4& viewProj,
+		bool occlusion);
+
+	// Draws the visible items of a group with the root signature, PSO, topology and
+	// remaining root arguments already set.  May be recorded from several threads.
+	void Draw(ID3D12GraphicsCommandList* cmdList, UINT group)const;
+
+	// Rebuilds the Hi-Z pyramid from the depth buffer, which must be in DEPTH_WRITE
+	// and is left there.  viewProj is the camera the depth was rendered with.
+	void BuildHiZ(
+		ID3D12GraphicsCommandList* cmdList,
+		ID3D12RootSignature* rootSig,
+		ID3D12PipelineState* depthPso,
+		ID3D12PipelineState* downsamplePso,
+		const DirectX::XMFLOAT4X4& viewProj);
+
+	UINT ItemCount()const;
+
+private:
+	// Layouts shared with GpuCulling.hlsl.
+	struct IndirectCommand
+	{
+		D3D12_GPU_VIRTUAL_ADDRESS ObjectCB;
+		D3D12_GPU_VIRTUAL_ADDRESS MaterialCB;
+		D3D12_VERTEX_BUFFER_VIEW VertexBufferView;
+		D3D12_INDEX_BUFFER_VIEW IndexBufferView;
+		D3D12_DRAW_INDEXED_ARGUMENTS DrawArguments;
+		UINT Pad;
+	};
+
+	struct BindlessIndirectCommand
+	{
+		UINT ObjectIndex;
+		UINT MaterialIndex;
+		D3D12_VERTEX_BUFFER_VIEW VertexBufferView;
+		D3D12_INDEX_BUFFER_VIEW IndexBufferView;
+		D3D12_DRAW_INDEXED_ARGUMENTS DrawArguments;
+		UINT Pad;
+	};
+
+	struct GpuItem
+	{
+		DirectX::XMFLOAT3 Center;
+		UINT ObjCBIndex;
+		DirectX::XMFLOAT3 Extents;
+		UINT MatCBIndex;
+		UINT Group;
+		UINT ArgOffset;
+		UINT Pad0;
+		UINT Pad1;
+
+		// The CB addresses, or the indices when bindless, are filled in by the culling
+		// pass.
+		IndirectCommand Command;
+	};
+
+	struct CullConstants
+	{
+		DirectX::XMFLOAT4 FrustumPlanes[6];
+		DirectX::XMFLOAT4X4 HiZViewProj;
+		D3D12_GPU_VIRTUAL_ADDRESS ObjectCB;
+		UINT ObjCBByteSize;
+		UINT ItemCount;
+		D3D12_GPU_VIRTUAL_ADDRESS MaterialCB;
+		UINT MatCBByteSize;
+		UINT Occlusion;
+		DirectX::XMFLOAT2 HiZSize;
+		UINT HiZMipCount;
+		UINT Pad;
+	};
+
+	void Initialize(const D3D12_INDIRECT_ARGUMENT_DESC* args, UINT argCount,
+		UINT byteStride, ID3D12RootSignature* drawRootSig, UINT frameResourceCount);
+	void BuildHiZResources();
+	void WriteDescriptors();
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	Microsoft::WRL::ComPtr<ID3D12CommandSignature> mCommandSignature;
+	UINT mCommandByteStride = 0;
+
+	std::vector<GpuItem> mItems;
+	UINT mGroupCount = 0;
+	std::vector<UINT> mGroupOffsets;
+	std::vector<UINT> mGroupCapacities;
+
+	// Per frame resource copies of mItems, refreshed while mItemsDirtyFrames > 0.
+	std::vector<std::unique_ptr<UploadBuffer<GpuItem>>> mItemBuffers;
+	int mItemsDirtyFrames = 0;
+
+	// One element per frame resource.
+	std::unique_ptr<UploadBuffer<CullConstants>> mCullCB;
+
+	// Written by the culling pass and read by ExecuteIndirect, on the same queue, so
+	// one copy serves all frame resources.  Kept in INDIRECT_ARGUMENT between frames.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mArgumentBuffer;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mCountBuffer;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mZeroCountBuffer;
+
+	// R32_FLOAT max-depth pyramid.  Mip 0 is half the depth buffer's size, rounded up,
+	// so every texel covers the 2x2 texels below it.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mHiZ;
+	ID3D12Resource* mDepthBuffer = nullptr;
+	UINT mDepthWidth = 0;
+	UINT mDepthHeight = 0;
+	bool mMsaa = false;
+	UINT mHiZWidth = 0;
+	UINT mHiZHeight = 0;
+	UINT mHiZMipCount = 0;
+
+	// Set once BuildHiZ has recorded a pyramid for the current depth buffer.
+	bool mHiZValid = false;
+	DirectX::XMFLOAT4X4 mHiZViewProj = MathHelper::Identity4x4();
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuDescriptor;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuDescriptor;
+	UINT mDescriptorSize = 0;
+};
@@ -0,0 +1,109 @@
+//***************************************************************************************
+// GpuWaves.h
+//
+// Performs the calculations for the wave simulation using the ComputeShader on the GPU.
+// The solution is saved to a floating-point texture.  The client must then set this
+// texture as a SRV and do the displacement mapping in the vertex shader over a grid.
+//***************************************************************************************
+
+#ifndef GPUWAVES_H
+#define GPUWAVES_H
+
+#include "../Common/d3dUtil.h"
+#include "../Common/GameTimer.h"
+
+class GpuWaves
+{
+public:
+	// m,n need not be multiples of the 16x16 thread group size; the
+	// out-of-range threads of the last groups write nothing.
+	GpuWaves(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList,
+		int m, int n, float dx, float dt, float speed, float damping);
+	GpuWaves(const GpuWaves& rhs) = delete;
+	GpuWaves& operator=(const GpuWaves& rhs) = delete;
+	~GpuWaves() = default;
+
+	UINT RowCount()const;
+	UINT ColumnCount()const;
+	UINT VertexCount()const;
+	UINT TriangleCount()const;
+	float Width()const;
+	float Depth()const;
+	float SpatialStep()const;
+
+	// SRV of the current solution, to be bound to the water vertex shader.
+	CD3DX12_GPU_DESCRIPTOR_HANDLE DisplacementMap()const;
+
+	// Number of SRV/UAV descriptors the simulation needs in the shader visible heap.
+	UINT DescriptorCount()const;
+
+	void BuildDescriptors(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDescriptor,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuDescriptor,
+		UINT descriptorSize);
+
+	// Once a full time step has accumulated, records one simulation step followed by the
+	// queued disturbances.  On return the current solution is readable by the VS.
+	//
+	// Only the texture the step writes changes state, so the list may run on a compute
+	// queue while the draws of the last two steps still read theirs.  The draws of the
+	// frame before those, which read the texture the step overwrites, must be complete.
+	void Update(
+		const GameTimer& gt,
+		ID3D12GraphicsCommandList* cmdList,
+		ID3D12RootSignature* rootSig,
+		ID3D12PipelineState* updatePso,
+		ID3D12PipelineState* disturbPso);
+
+	// Queues a disturbance; it is applied on the GPU after the next simulation step.
+	void Disturb(int i, int j, float magnitude);
+
+private:
+	void BuildResources(ID3D12GraphicsCommandList* cmdList);
+
+private:
+	struct Disturbance
+	{
+		UINT I = 0;
+		UINT J = 0;
+		float Magnitude = 0.0f;
+	};
+
+	UINT mNumRows = 0;
+	UINT mNumCols = 0;
+
+	UINT mVertexCount = 0;
+	UINT mTriangleCount = 0;
+
+	// Simulation constants we can precompute.
+	float mK[3];
+
+	float mTimeStep = 0.0f;
+	float mSpatialStep = 0.0f;
+
+	// Time accumulated since the last simulation step.
+	float mAccumTime = 0.0f;
+
+	std::vector<Disturbance> mDisturbances;
+
+	ID3D12Device* md3dDevice = nullptr;
+
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mPrevSolSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mCurrSolSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mNextSolSrv;
+
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mPrevSolUav;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mCurrSolUav;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mNextSolUav;
+
+	// Three textures for ping-ponging the solutions.  Between steps they are all in the
+	// NON_PIXEL_SHADER_RESOURCE state.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mPrevSol = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mCurrSol = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mNextSol = nullptr;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mPrevUploadBuffer = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mCurrUploadBuffer = nullptr;
+};
+
+#endif // GPUWAVES_H
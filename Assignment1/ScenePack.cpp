@@ -0,0 +1,379 @@
+//***************************************************************************************
+// ScenePack.cpp
+//***************************************************************************************
+
+#include "ScenePack.h"
+#include "../Common/StagingRing.h"
+#include <algorithm>
+#include <map>
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	const char PackMagic[4] = { 'S', 'C', 'N', 'P' };
+
+	UINT64 AlignUp(UINT64 value, UINT64 alignment)
+	{
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+
+	template<size_t N>
+	bool CopyName(char (&dst)[N], const std::string& src)
+	{
+		if(src.size() >= N)
+			return false;
+		memset(dst, 0, N);
+		memcpy(dst, src.data(), src.size());
+		return true;
+	}
+
+	template<size_t N>
+	bool IsTerminated(const char (&name)[N])
+	{
+		return memchr(name, '\0', N) != nullptr;
+	}
+
+	// [offset, offset + size) lies in [0, limit), without overflowing.
+	bool InRange(UINT64 offset, UINT64 size, UINT64 limit)
+	{
+		return offset <= limit && size <= limit - offset;
+	}
+
+	bool Contains(const std::vector<std::string>& names, const char* name)
+	{
+		return std::find(names.begin(), names.end(), name) != names.end();
+	}
+}
+
+ScenePack::~ScenePack()
+{
+	Close();
+}
+
+UINT64 ScenePack::HashKey(const std::string& description)
+{
+	UINT64 hash = 14695981039346656037ull;
+	for(char c : description)
+	{
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+bool ScenePack::Write(const std::wstring& filename, UINT64 key,
+	const std::vector<const MeshGeometry*>& geometries, const std::vector<Placement>& placements)
+{
+	std::vector<GeometryRecord> geometryRecords;
+	std::vector<SubmeshRecord> submeshRecords;
+	std::vector<PlacementRecord> placementRecords;
+
+	// Offsets into the data section, each stream aligned.
+	UINT64 dataSize = 0;
+	auto reserve = [&dataSize](UINT64 size)
+	{
+		UINT64 offset = dataSize;
+		dataSize = AlignUp(dataSize + size, DataAlignment);
+		return offset;
+	};
+
+	for(const MeshGeometry* geo : geometries)
+	{
+		if(geo->IndexBufferCPU == nullptr)
+			return false;
+
+		GeometryRecord g = {};
+		if(!CopyName(g.Name, geo->Name))
+			return false;
+		g.VertexByteStride = geo->VertexByteStride;
+		g.VertexBufferByteSize = geo->VertexBufferByteSize;
+		g.VertexDataSize = geo->VertexBufferCPU != nullptr ? (UINT32)geo->VertexBufferCPU->GetBufferSize() : 0;
+		g.IndexFormat = (UINT32)geo->IndexFormat;
+		g.IndexBufferByteSize = geo->IndexBufferByteSize;
+		g.VertexDataOffset = reserve(g.VertexDataSize);
+		g.IndexDataOffset = reserve(geo->IndexBufferCPU->GetBufferSize());
+
+		// By name, so the file does not depend on the hash order of DrawArgs.
+		g.FirstSubmesh = (UINT32)submeshRecords.size();
+		std::map<std::string, SubmeshGeometry> drawArgs(geo->DrawArgs.begin(), geo->DrawArgs.end());
+		for(auto& e : drawArgs)
+		{
+			SubmeshRecord s = {};
+			if(!CopyName(s.Name, e.first))
+				return false;
+			s.IndexCount = e.second.IndexCount;
+			s.StartIndexLocation = e.second.StartIndexLocation;
+			s.BaseVertexLocation = e.second.BaseVertexLocation;
+			s.Center = e.second.Bounds.Center;
+			s.Extents = e.second.Bounds.Extents;
+			submeshRecords.push_back(s);
+		}
+		g.SubmeshCount = (UINT32)drawArgs.size();
+
+		geometryRecords.push_back(g);
+	}
+
+	for(const Placement& p : placements)
+	{
+		PlacementRecord r = {};
+		if(!CopyName(r.Material, p.Material))
+			return false;
+
+		r.Geometry = (UINT32)geometries.size();
+		for(size_t i = 0; i < geometries.size(); ++i)
+		{
+			if(geometries[i]->Name == p.Geometry)
+				r.Geometry = (UINT32)i;
+		}
+		if(r.Geometry == geometries.size())
+			return false;
+
+		r.Layer = p.Layer;
+		r.IndexCount = p.IndexCount;
+		r.StartIndexLocation = p.StartIndexLocation;
+		r.BaseVertexLocation = p.BaseVertexLocation;
+		r.Center = p.Bounds.Center;
+		r.Extents = p.Bounds.Extents;
+		r.World = p.World;
+		r.TexTransform = p.TexTransform;
+		placementRecords.push_back(r);
+	}
+
+	Header header = {};
+	memcpy(header.Magic, PackMagic, sizeof(PackMagic));
+	header.Version = Version;
+	header.Key = key;
+	header.GeometryCount = (UINT32)geometryRecords.size();
+	header.SubmeshCount = (UINT32)submeshRecords.size();
+	header.PlacementCount = (UINT32)placementRecords.size();
+	header.DataOffset = AlignUp(sizeof(Header) +
+		geometryRecords.size() * sizeof(GeometryRecord) +
+		submeshRecords.size() * sizeof(SubmeshRecord) +
+		placementRecords.size() * sizeof(PlacementRecord), DataAlignment);
+	header.DataSize = dataSize;
+
+	std::vector<BYTE> data((size_t)dataSize, 0);
+	for(size_t i = 0; i < geometries.size(); ++i)
+	{
+		const GeometryRecord& g = geometryRecords[i];
+		if(g.VertexDataSize > 0)
+			memcpy(&data[(size_t)g.VertexDataOffset], geometries[i]->VertexBufferCPU->GetBufferPointer(), g.VertexDataSize);
+		memcpy(&data[(size_t)g.IndexDataOffset], geometries[i]->IndexBufferCPU->GetBufferPointer(),
+			geometries[i]->IndexBufferCPU->GetBufferSize());
+	}
+
+	std::ofstream file(filename, std::ios::binary);
+	if(!file)
+		return false;
+
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)geometryRecords.data(), geometryRecords.size() * sizeof(GeometryRecord));
+	file.write((const char*)submeshRecords.data(), submeshRecords.size() * sizeof(SubmeshRecord));
+	file.write((const char*)placementRecords.data(), placementRecords.size() * sizeof(PlacementRecord));
+
+	std::vector<char> pad((size_t)(header.DataOffset - (UINT64)file.tellp()), 0);
+	file.write(pad.data(), pad.size());
+	file.write((const char*)data.data(), data.size());
+
+	return (bool)file;
+}
+
+bool ScenePack::Open(const std::wstring& filename, UINT64 key, UINT layerCount,
+	const std::vector<std::string>& materials, const std::vector<std::string>& geometries)
+{
+	Close();
+
+	mFile = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(mFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize = {};
+	if(!GetFileSizeEx(mFile, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(Header))
+	{
+		Close();
+		return false;
+	}
+	mSize = (UINT64)fileSize.QuadPart;
+
+	mMapping = CreateFileMappingW(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(mMapping != nullptr)
+		mView = static_cast<const BYTE*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+	if(mView == nullptr)
+	{
+		Close();
+		return false;
+	}
+
+	// Check everything the loaders index before trusting it.
+	const Header& h = GetHeader();
+	UINT64 recordsEnd = sizeof(Header) +
+		(UINT64)h.GeometryCount * sizeof(GeometryRecord) +
+		(UINT64)h.SubmeshCount * sizeof(SubmeshRecord) +
+		(UINT64)h.PlacementCount * sizeof(PlacementRecord);
+
+	bool valid = memcmp(h.Magic, PackMagic, sizeof(PackMagic)) == 0 &&
+		h.Version == Version && h.Key == key &&
+		recordsEnd <= h.DataOffset && InRange(h.DataOffset, h.DataSize, mSize);
+
+	// The views cover the stored streams, whose index count bounds every draw.
+	std::vector<UINT64> indexCounts(valid ? h.GeometryCount : 0);
+	for(UINT32 i = 0; valid && i < h.GeometryCount; ++i)
+	{
+		const GeometryRecord& g = Geometries()[i];
+		UINT indexSize = g.IndexFormat == DXGI_FORMAT_R16_UINT ? 2 : 4;
+		indexCounts[i] = g.IndexBufferByteSize / indexSize;
+
+		valid = IsTerminated(g.Name) &&
+			(UINT64)g.FirstSubmesh + g.SubmeshCount <= h.SubmeshCount &&
+			InRange(g.VertexDataOffset, g.VertexDataSize, h.DataSize) &&
+			(g.VertexDataSize == 0 || (g.VertexByteStride > 0 && g.VertexBufferByteSize <= g.VertexDataSize)) &&
+			(g.IndexFormat == DXGI_FORMAT_R16_UINT || g.IndexFormat == DXGI_FORMAT_R32_UINT) &&
+			InRange(g.IndexDataOffset, g.IndexBufferByteSize, h.DataSize);
+
+		for(UINT32 j = 0; valid && j < g.SubmeshCount; ++j)
+		{
+			const SubmeshRecord& s = Submeshes()[g.FirstSubmesh + j];
+			valid = InRange(s.StartIndexLocation, s.IndexCount, indexCounts[i]);
+		}
+	}
+	for(UINT32 i = 0; valid && i < h.SubmeshCount; ++i)
+		valid = IsTerminated(Submeshes()[i].Name);
+	for(UINT32 i = 0; valid && i < h.PlacementCount; ++i)
+	{
+		const PlacementRecord& r = PlacementRecords()[i];
+		valid = IsTerminated(r.Material) && Contains(materials, r.Material) &&
+			r.Layer < layerCount && r.Geometry < h.GeometryCount &&
+			InRange(r.StartIndexLocation, r.IndexCount, indexCounts[r.Geometry]);
+	}
+	for(size_t i = 0; valid && i < geometries.size(); ++i)
+	{
+		valid = false;
+		for(UINT32 j = 0; !valid && j < h.GeometryCount; ++j)
+			valid = geometries[i] == Geometries()[j].Name;
+	}
+
+	if(!valid)
+		Close();
+	return valid;
+}
+
+void ScenePack::Close()
+{
+	if(mView != nullptr)
+		UnmapViewOfFile(mView);
+	if(mMapping != nullptr)
+		CloseHandle(mMapping);
+	if(mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+
+	mView = nullptr;
+	mMapping = nullptr;
+	mFile = INVALID_HANDLE_VALUE;
+	mSize = 0;
+}
+
+std::vector<std::unique_ptr<MeshGeometry>> ScenePack::CreateGeometries(ID3D12Device* device,
+	ID3D12GraphicsCommandList* cmdList, StagingRing& staging, bool keepCpuCopies)const
+{
+	const Header& h = GetHeader();
+	const BYTE* data = mView + h.DataOffset;
+
+	// The mapped pages are copied straight into the staging ring.
+	ComPtr<ID3D12Resource> buffer = d3dUtil::CreateDefaultBuffer(device, cmdList, data, h.DataSize, staging);
+
+	std::vector<std::unique_ptr<MeshGeometry>> geometries;
+	for(UINT32 i = 0; i < h.GeometryCount; ++i)
+	{
+		const GeometryRecord& g = Geometries()[i];
+
+		auto geo = std::make_unique<MeshGeometry>();
+		geo->Name = g.Name;
+
+		// Without stored vertices the app sets the vertex buffer itself.
+		if(g.VertexDataSize > 0)
+		{
+			geo->VertexBufferGPU = buffer;
+			geo->VertexBufferOffset = g.VertexDataOffset;
+		}
+		geo->IndexBufferGPU = buffer;
+		geo->IndexBufferOffset = g.IndexDataOffset;
+
+		geo->VertexByteStride = g.VertexByteStride;
+		geo->VertexBufferByteSize = g.VertexBufferByteSize;
+		geo->IndexFormat = (DXGI_FORMAT)g.IndexFormat;
+		geo->IndexBufferByteSize = g.IndexBufferByteSize;
+
+		if(keepCpuCopies)
+		{
+			if(g.VertexDataSize > 0)
+			{
+				ThrowIfFailed(D3DCreateBlob(g.VertexDataSize, &geo->VertexBufferCPU));
+				CopyMemory(geo->VertexBufferCPU->GetBufferPointer(), data + g.VertexDataOffset, g.VertexDataSize);
+			}
+
+			ThrowIfFailed(D3DCreateBlob(g.IndexBufferByteSize, &geo->IndexBufferCPU));
+			CopyMemory(geo->IndexBufferCPU->GetBufferPointer(), data + g.IndexDataOffset, g.IndexBufferByteSize);
+		}
+
+		for(UINT32 j = 0; j < g.SubmeshCount; ++j)
+		{
+			const SubmeshRecord& s = Submeshes()[g.FirstSubmesh + j];
+
+			SubmeshGeometry submesh;
+			submesh.IndexCount = s.IndexCount;
+			submesh.StartIndexLocation = s.StartIndexLocation;
+			submesh.BaseVertexLocation = s.BaseVertexLocation;
+			submesh.Bounds = BoundingBox(s.Center, s.Extents);
+			geo->DrawArgs[s.Name] = submesh;
+		}
+
+		geometries.push_back(std::move(geo));
+	}
+
+	return geometries;
+}
+
+std::vector<ScenePack::Placement> ScenePack::Placements()const
+{
+	std::vector<Placement> placements;
+	for(UINT32 i = 0; i < GetHeader().PlacementCount; ++i)
+	{
+		const PlacementRecord& r = PlacementRecords()[i];
+
+		Placement p;
+		p.Geometry = Geometries()[r.Geometry].Name;
+		p.Material = r.Material;
+		p.Layer = r.Layer;
+		p.IndexCount = r.IndexCount;
+		p.StartIndexLocation = r.StartIndexLocation;
+		p.BaseVertexLocation = r.BaseVertexLocation;
+		p.World = r.World;
+		p.TexTransform = r.TexTransform;
+		p.Bounds = BoundingBox(r.Center, r.Extents);
+		placements.push_back(p);
+	}
+	return placements;
+}
+
+const ScenePack::Header& ScenePack::GetHeader()const
+{
+	return *reinterpret_cast<const Header*>(mView);
+}
+
+const ScenePack::GeometryRecord* ScenePack::Geometries()const
+{
+	return reinterpret_cast<const GeometryRecord*>(mView + sizeof(Header));
+}
+
+const ScenePack::SubmeshRecord* ScenePack::Submeshes()const
+{
+	return reinterpret_cast<const SubmeshRecord*>(Geometries() + GetHeader().GeometryCount);
+}
+
+const ScenePack::PlacementRecord* ScenePack::PlacementRecords()const
+{
+	return reinterpret_cast<const PlacementRecord*>(Submeshes() + GetHeader().SubmeshCount);
+}
@@ -0,0 +1,140 @@
+//***************************************************************************************
+// ScenePack.h
+//
+// Binary cache of the scene's meshes and of the render items placed from them, so a
+// start-up with a current pack skips the procedural generation.  The file is
+//
+//   Header
+//   GeometryRecord[GeometryCount]
+//   SubmeshRecord[SubmeshCount]      grouped by geometry
+//   PlacementRecord[PlacementCount]
+//   data                             every vertex and index stream, DataAlignment aligned
+//
+// and the data section is laid out as the one GPU buffer all the geometries share, so
+// loading is a file mapping, one staging allocation and one copy.  A pack is only used
+// when its Version and its key, a hash of the options the contents depend on, match.
+//***************************************************************************************
+
+#ifndef SCENEPACK_H
+#define SCENEPACK_H
+
+#include "../Common/d3dUtil.h"
+
+class StagingRing;
+
+class ScenePack
+{
+public:
+	ScenePack() = default;
+	ScenePack(const ScenePack& rhs) = delete;
+	ScenePack& operator=(const ScenePack& rhs) = delete;
+	~ScenePack();
+
+	// Bump whenever the records or what the app bakes into them change.
+	static const UINT32 Version = 1;
+	static const UINT64 DataAlignment = 256;
+	static const int NameLength = 32;
+
+	// A render item as the pack stores it.  Layer is the app's RenderLayer.
+	struct Placement
+	{
+		std::string Geometry;
+		std::string Material;
+		UINT Layer = 0;
+		UINT IndexCount = 0;
+		UINT StartIndexLocation = 0;
+		INT BaseVertexLocation = 0;
+		DirectX::XMFLOAT4X4 World;
+		DirectX::XMFLOAT4X4 TexTransform;
+		DirectX::BoundingBox Bounds;
+	};
+
+	// FNV-1a of a description of the options the pack's contents depend on.
+	static UINT64 HashKey(const std::string& description);
+
+	// Writes the geometries, from their CPU copies, and the placements.  A geometry
+	// without a CPU vertex copy, like the dynamic CPU waves, is stored without vertices.
+	static bool Write(const std::wstring& filename, UINT64 key,
+		const std::vector<const MeshGeometry*>& geometries, const std::vector<Placement>& placements);
+
+	// Maps the file.  Fails if it is missing, truncated, or of another version or key,
+	// or if a stream or draw range lies outside its data, a placement's Layer is not
+	// below layerCount or its material not in materials, or a name of geometries is
+	// not stored.
+	bool Open(const std::wstring& filename, UINT64 key, UINT layerCount,
+		const std::vector<std::string>& materials, const std::vector<std::string>& geometries);
+	void Close();
+
+	// Uploads the data section into one default buffer and creates the geometries on
+	// it, with CPU copies of their streams only if keepCpuCopies.
+	std::vector<std::unique_ptr<MeshGeometry>> CreateGeometries(ID3D12Device* device,
+		ID3D12GraphicsCommandList* cmdList, StagingRing& staging, bool keepCpuCopies)const;
+
+	std::vector<Placement> Placements()const;
+
+private:
+	struct Header
+	{
+		char Magic[4];
+		UINT32 Version;
+		UINT64 Key;
+		UINT32 GeometryCount;
+		UINT32 SubmeshCount;
+		UINT32 PlacementCount;
+		UINT32 Pad;
+		UINT64 DataOffset;
+		UINT64 DataSize;
+	};
+
+	struct GeometryRecord
+	{
+		char Name[NameLength];
+		UINT32 VertexByteStride;
+		UINT32 VertexBufferByteSize;
+		UINT32 VertexDataSize;      // 0 when the vertices are not stored
+		UINT32 IndexFormat;
+		UINT32 IndexBufferByteSize;
+		UINT32 FirstSubmesh;
+		UINT32 SubmeshCount;
+		UINT32 Pad;
+		UINT64 VertexDataOffset;    // from the start of the data section
+		UINT64 IndexDataOffset;
+	};
+
+	struct SubmeshRecord
+	{
+		char Name[NameLength];
+		UINT32 IndexCount;
+		UINT32 StartIndexLocation;
+		INT32 BaseVertexLocation;
+		DirectX::XMFLOAT3 Center;
+		DirectX::XMFLOAT3 Extents;
+	};
+
+	struct PlacementRecord
+	{
+		char Material[NameLength];
+		UINT32 Geometry;
+		UINT32 Layer;
+		UINT32 IndexCount;
+		UINT32 StartIndexLocation;
+		INT32 BaseVertexLocation;
+		DirectX::XMFLOAT3 Center;
+		DirectX::XMFLOAT3 Extents;
+		DirectX::XMFLOAT4X4 World;
+		DirectX::XMFLOAT4X4 TexTransform;
+	};
+
+	const Header& GetHeader()const;
+	const GeometryRecord* Geometries()const;
+	const SubmeshRecord* Submeshes()const;
+	const PlacementRecord* PlacementRecords()const;
+
+private:
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+	const BYTE* mView = nullptr;
+	UINT64 mSize = 0;
+};
+
+#endif // SCENEPACK_H
@@ -0,0 +1,162 @@
+//***************************************************************************************
+// ClusteredLighting.hlsl
+//
+// Point and spot lights binned into view space clusters: CLUSTER_COUNT_X by
+// CLUSTER_COUNT_Y screen tiles times CLUSTER_COUNT_Z depth slices, spaced
+// exponentially between the near and far planes.
+//
+// CullLightsCS(): Compiled with CULL_LIGHTS defined.  One thread per cluster tests
+//     every light's sphere against the cluster's view space box and writes its list.
+//
+// Otherwise declares ComputeClusteredLighting() for the pixel shaders; include it
+// after LightingUtil.hlsl and cbPass.
+//***************************************************************************************
+
+#ifdef CULL_LIGHTS
+#include "LightingUtil.hlsl"
+#endif
+
+// Shared with ClusteredLighting.h.
+#define CLUSTER_COUNT_X 16
+#define CLUSTER_COUNT_Y 8
+#define CLUSTER_COUNT_Z 24
+
+// A list is the light count followed by up to CLUSTER_STRIDE - 1 light indices.
+#define CLUSTER_STRIDE 64
+
+#define LIGHT_POINT 0
+#define LIGHT_SPOT 1
+
+struct LightData
+{
+    Light  L;
+    uint   Type;
+    float3 Pad;
+};
+
+uint ClusterIndex(uint3 cluster)
+{
+    return (cluster.z * CLUSTER_COUNT_Y + cluster.y) * CLUSTER_COUNT_X + cluster.x;
+}
+
+#ifdef CULL_LIGHTS
+
+cbuffer cbClusters : register(b0)
+{
+    float4x4 gView;
+    float4x4 gInvProj;
+    float    gNearZ;
+    float    gFarZ;
+    uint     gLightCount;
+    uint     gClustersPad;
+};
+
+StructuredBuffer<LightData> gLightData : register(t0);
+RWStructuredBuffer<uint> gClusterLights : register(u0);
+
+// View space point on the ray through ndc, at view depth z.
+float3 ViewRay(float2 ndc, float z)
+{
+    float4 p = mul(float4(ndc, 1.0f, 1.0f), gInvProj);
+    p.xyz /= p.w;
+    return p.xyz * (z / p.z);
+}
+
+[numthreads(64, 1, 1)]
+void CullLightsCS(int3 dispatchThreadID : SV_DispatchThreadID)
+{
+    uint index = dispatchThreadID.x;
+    if(index >= CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z)
+        return;
+
+    uint3 cluster = uint3(index % CLUSTER_COUNT_X,
+                          (index / CLUSTER_COUNT_X) % CLUSTER_COUNT_Y,
+                          index / (CLUSTER_COUNT_X * CLUSTER_COUNT_Y));
+
+    // The tile in NDC; tile rows run down the screen.
+    float2 uvMin = (float2)cluster.xy / float2(CLUSTER_COUNT_X, CLUSTER_COUNT_Y);
+    float2 uvMax = (float2)(cluster.xy + 1) / float2(CLUSTER_COUNT_X, CLUSTER_COUNT_Y);
+    float2 ndcMin = float2(2.0f * uvMin.x - 1.0f, 1.0f - 2.0f * uvMax.y);
+    float2 ndcMax = float2(2.0f * uvMax.x - 1.0f, 1.0f - 2.0f * uvMin.y);
+
+    float sliceScale = 1.0f / CLUSTER_COUNT_Z;
+    float zNear = gNearZ * pow(gFarZ / gNearZ, cluster.z * sliceScale);
+    float zFar = gNearZ * pow(gFarZ / gNearZ, (cluster.z + 1) * sliceScale);
+
+    // The frustum segment's bounding box.
+    float3 boxMin = 3.4e38f;
+    float3 boxMax = -3.4e38f;
+
+    [unroll]
+    for(int i = 0; i < 8; ++i)
+    {
+        float2 ndc = float2(i & 1 ? ndcMax.x : ndcMin.x, i & 2 ? ndcMax.y : ndcMin.y);
+        float3 p = ViewRay(ndc, i & 4 ? zFar : zNear);
+        boxMin = min(boxMin, p);
+        boxMax = max(boxMax, p);
+    }
+
+    uint offset = index * CLUSTER_STRIDE;
+    uint count = 0;
+    for(uint l = 0; l < gLightCount && count < CLUSTER_STRIDE - 1; ++l)
+    {
+        // Spot lights are bounded by their sphere too.
+        Light light = gLightData[l].L;
+        float3 center = mul(float4(light.Position, 1.0f), gView).xyz;
+        float3 d = center - clamp(center, boxMin, boxMax);
+
+        if(dot(d, d) <= light.FalloffEnd * light.FalloffEnd)
+        {
+            gClusterLights[offset + 1 + count] = l;
+            ++count;
+        }
+    }
+
+    gClusterLights[offset] = count;
+}
+
+#else
+
+StructuredBuffer<LightData> gLightData     : register(t0, space4);
+StructuredBuffer<uint>      gClusterLights : register(t1, space4);
+
+// Sums the point and spot lights of the cluster holding the pixel at posPixel
+// (SV_Position) and world position posW; only those of the types selected by
+// CLUSTERED_POINT_LIGHTS and CLUSTERED_SPOT_LIGHTS.
+float3 ComputeClusteredLighting(float2 posPixel, float3 posW, Material mat, float3 normal, float3 toEye)
+{
+    float viewZ = mul(float4(posW, 1.0f), gView).z;
+    float slice = log(viewZ / gNearZ) * CLUSTER_COUNT_Z / log(gFarZ / gNearZ);
+
+    uint3 cluster;
+    cluster.xy = min((uint2)(posPixel * gInvRenderTargetSize * float2(CLUSTER_COUNT_X, CLUSTER_COUNT_Y)),
+                     uint2(CLUSTER_COUNT_X - 1, CLUSTER_COUNT_Y - 1));
+    cluster.z = (uint)clamp(slice, 0.0f, CLUSTER_COUNT_Z - 1.0f);
+
+    uint offset = ClusterIndex(cluster) * CLUSTER_STRIDE;
+    uint count = gClusterLights[offset];
+
+    float3 result = 0.0f;
+    for(uint i = 0; i < count; ++i)
+    {
+        LightData light = gLightData[gClusterLights[offset + 1 + i]];
+#if defined(CLUSTERED_POINT_LIGHTS) && defined(CLUSTERED_SPOT_LIGHTS)
+        if(light.Type == LIGHT_SPOT)
+            result += ComputeSpotLight(light.L, mat, posW, normal, toEye);
+        else
+            result += ComputePointLight(light.L, mat, posW, normal, toEye);
+#elif defined(CLUSTERED_SPOT_LIGHTS)
+        // The variant is only used where the other type cannot reach, so skipping it
+        // changes nothing.
+        if(light.Type == LIGHT_SPOT)
+            result += ComputeSpotLight(light.L, mat, posW, normal, toEye);
+#else
+        if(light.Type != LIGHT_SPOT)
+            result += ComputePointLight(light.L, mat, posW, normal, toEye);
+#endif
+    }
+
+    return result;
+}
+
+#endif
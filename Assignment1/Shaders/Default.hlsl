@@ -2,6 +2,19 @@
 // Default.hlsl 
 //
 // Default shader, currently supports lighting.
+//
+// Compiled with BINDLESS defined, the object constants, materials and diffuse
+// textures are indexed from structured buffers and one texture array of
+// BINDLESS_TEXTURE_COUNT SRVs by the indices in cbDrawIndices, instead of being bound
+// per draw.
+//
+// The directional lights come from cbPass; the point and spot lights from the light
+// list of the pixel's cluster, see ClusteredLighting.hlsl.
+//
+// The app compiles a variant per feature set, see ShaderPermutations.h: TEX_TRANSFORM
+// applies the texture transforms, FOG blends in the fog, and CLUSTERED_POINT_LIGHTS
+// and CLUSTERED_SPOT_LIGHTS shade the clustered lights of the type; without either,
+// the cluster lookup is skipped.
 //***************************************************************************************
 
 // Defaults for number of lights.
@@ -10,17 +23,43 @@
 #endif
 
 #ifndef NUM_POINT_LIGHTS
-#define NUM_POINT_LIGHTS 1
+#define NUM_POINT_LIGHTS 0
 #endif
 
 #ifndef NUM_SPOT_LIGHTS
-#define NUM_SPOT_LIGHTS 4
+#define NUM_SPOT_LIGHTS 0
 #endif
 
 // Include structures and functions for lighting.
 #include "LightingUtil.hlsl"
 
+#ifndef BINDLESS
 Texture2D    gDiffuseMap : register(t0);
+#endif
+
+#if defined(DISPLACEMENT_MAP) || defined(TERRAIN)
+// Height field centred on the origin: the GPU wave simulation (WaveSim.hlsl) or the
+// terrain height map (Terrain.cpp).  gDisplacementMapTexelSize is its texel size and
+// gGridSpatialStep the world distance between texels.
+Texture2D    gHeightMap : register(t1);
+#endif
+
+#ifdef INSTANCED
+struct InstanceData
+{
+    float4x4 World;
+    float4x4 TexTransform;
+};
+
+// Transforms of every instanced render item; a batch's instances are contiguous.
+StructuredBuffer<InstanceData> gInstanceData : register(t0, space1);
+
+// Index of the batch's first element in gInstanceData.
+cbuffer cbInstanceBatch : register(b3)
+{
+    uint gFirstInstance;
+};
+#endif
 
 
 SamplerState gsamPointWrap        : register(s0);
@@ -30,12 +69,66 @@ SamplerState gsamLinearClamp      : register(s3);
 SamplerState gsamAnisotropicWrap  : register(s4);
 SamplerState gsamAnisotropicClamp : register(s5);
 
+#ifdef BINDLESS
+// Layouts shared with ObjectConstants and MaterialData in FrameResource.h.
+struct ObjectData
+{
+    float4x4 World;
+    float4x4 TexTransform;
+    float2   DisplacementMapTexelSize;
+    float    GridSpatialStep;
+    float    Pad;
+    float4   Pad1[7];
+};
+
+struct MaterialData
+{
+    float4   DiffuseAlbedo;
+    float3   FresnelR0;
+    float    Roughness;
+    float4x4 MatTransform;
+    uint     DiffuseMapIndex;
+    uint     Pad0;
+    uint     Pad1;
+    uint     Pad2;
+    float4   Pad3[9];
+};
+
+StructuredBuffer<ObjectData>   gObjects   : register(t0, space2);
+StructuredBuffer<MaterialData> gMaterials : register(t1, space2);
+
+// The texture SRVs at the start of the heap; the views after them, UAVs included, are
+// out of its reach.
+Texture2D gTextures[BINDLESS_TEXTURE_COUNT] : register(t0, space3);
+
+// Set per draw, or by the indirect commands.
+cbuffer cbDrawIndices : register(b4)
+{
+    uint gObjectIndex;
+    uint gMaterialIndex;
+};
+
+// The shader bodies below are shared with the bound path.
+#define gWorld                    gObjects[gObjectIndex].World
+#define gTexTransform             gObjects[gObjectIndex].TexTransform
+#define gDisplacementMapTexelSize gObjects[gObjectIndex].DisplacementMapTexelSize
+#define gGridSpatialStep          gObjects[gObjectIndex].GridSpatialStep
+#define gDiffuseAlbedo            gMaterials[gMaterialIndex].DiffuseAlbedo
+#define gFresnelR0                gMaterials[gMaterialIndex].FresnelR0
+#define gRoughness                gMaterials[gMaterialIndex].Roughness
+#define gMatTransform             gMaterials[gMaterialIndex].MatTransform
+#define gDiffuseMap               gTextures[min(gMaterials[gMaterialIndex].DiffuseMapIndex, BINDLESS_TEXTURE_COUNT - 1u)]
+#else
 // Constant data that varies per frame.
 cbuffer cbPerObject : register(b0)
 {
     float4x4 gWorld;
     float4x4 gTexTransform;
+    float2   gDisplacementMapTexelSize;
+    float    gGridSpatialStep;
+    float    cbPerObjectPad0;
 };
+#endif
 
 // Constant data that varies per pass.
 cbuffer cbPass : register(b1)
@@ -63,13 +156,15 @@ cbuffer cbPass : register(b1)
     float gFogRange;
     float2 cbPerObjectPad2;
 
-    // Indices [0, NUM_DIR_LIGHTS) are directional lights;
-    // indices [NUM_DIR_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHTS) are point lights;
-    // indices [NUM_DIR_LIGHTS+NUM_POINT_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHT+NUM_SPOT_LIGHTS)
-    // are spot lights for a maximum of MaxLights per object.
+    // Indices [0, NUM_DIR_LIGHTS) are directional lights; the point and spot lights are
+    // clustered, see ClusteredLighting.hlsl.
     Light gLights[MaxLights];
 };
 
+// Point and spot lights, binned per cluster.
+#include "ClusteredLighting.hlsl"
+
+#ifndef BINDLESS
 cbuffer cbMaterial : register(b2)
 {
     float4   gDiffuseAlbedo;
@@ -77,12 +172,21 @@ cbuffer cbMaterial : register(b2)
     float    gRoughness;
     float4x4 gMatTransform;
 };
+#endif
 
 struct VertexIn
 {
     float3 PosL    : POSITION;
+#ifdef COMPACT_VERTEX
+    // Octahedral encoded, see MeshOptimizer::OctahedralEncode; the tex-coords are halfs.
+    float2 NormalL : NORMAL;
+#else
     float3 NormalL : NORMAL;
+#endif
     float2 TexC    : TEXCOORD;
+#ifdef INSTANCED
+    uint InstanceID : SV_InstanceID;
+#endif
 };
 
 struct VertexOut
@@ -93,23 +197,82 @@ struct VertexOut
     float2 TexC    : TEXCOORD;
 };
 
+#ifdef COMPACT_VERTEX
+// Unfolds the lower half of the octahedron back over the diagonals.
+float3 OctahedralDecode(float2 e)
+{
+    float3 n = float3(e, 1.0f - abs(e.x) - abs(e.y));
+    float t = saturate(-n.z);
+    n.xy += n.xy >= 0.0f ? -t : t;
+    return normalize(n);
+}
+#endif
+
 VertexOut VS(VertexIn vin)
 {
     VertexOut vout = (VertexOut)0.0f;
 
+#ifdef INSTANCED
+    InstanceData instData = gInstanceData[gFirstInstance + vin.InstanceID];
+    float4x4 world = instData.World;
+    float4x4 texTransform = instData.TexTransform;
+#else
+    float4x4 world = gWorld;
+    float4x4 texTransform = gTexTransform;
+#endif
+
     // Transform to world space.
-    float4 posW = mul(float4(vin.PosL, 1.0f), gWorld);
-    vout.PosW = posW.xyz;
+    float4 posW = mul(float4(vin.PosL, 1.0f), world);
+
+#if defined(DISPLACEMENT_MAP) || defined(TERRAIN)
+    // The mesh is flat; address the height field by world position.  Terrain edge
+    // vertices shared by neighbouring tiles land on the same texels, and the water
+    // clipmap can slide with the camera over the fixed simulation.
+    float2 heightTexC = posW.xz * gDisplacementMapTexelSize / gGridSpatialStep + 0.5f;
+    float heightScale = 1.0f;
+#ifdef DISPLACEMENT_MAP
+    // Calm the waves over the last few texels so the water is flat outside the simulation.
+    float2 edge = min(heightTexC, 1.0f - heightTexC) / (4.0f * gDisplacementMapTexelSize);
+    heightScale = saturate(min(edge.x, edge.y));
+#endif
+    posW.y += heightScale * gHeightMap.SampleLevel(gsamLinearClamp, heightTexC, 0.0f).r;
+
+    // Estimate normal using finite difference; rows run along +z.
+    float du = gDisplacementMapTexelSize.x;
+    float dv = gDisplacementMapTexelSize.y;
+    float l = gHeightMap.SampleLevel(gsamLinearClamp, heightTexC - float2(du, 0.0f), 0.0f).r;
+    float r = gHeightMap.SampleLevel(gsamLinearClamp, heightTexC + float2(du, 0.0f), 0.0f).r;
+    float t = gHeightMap.SampleLevel(gsamLinearClamp, heightTexC - float2(0.0f, dv), 0.0f).r;
+    float b = gHeightMap.SampleLevel(gsamLinearClamp, heightTexC + float2(0.0f, dv), 0.0f).r;
+    vout.NormalW = normalize(float3(heightScale * (l - r), 2.0f * gGridSpatialStep, heightScale * (t - b)));
+
+#ifdef DISPLACEMENT_MAP
+    // The clipmap has no tex-coords of its own; the water texture follows the simulation.
+    vin.TexC = heightTexC;
+#endif
+#else
+#ifdef COMPACT_VERTEX
+    float3 normalL = OctahedralDecode(vin.NormalL);
+#else
+    float3 normalL = vin.NormalL;
+#endif
 
     // Assumes nonuniform scaling; otherwise, need to use inverse-transpose of world matrix.
-    vout.NormalW = mul(vin.NormalL, (float3x3)gWorld);
+    vout.NormalW = mul(normalL, (float3x3)world);
+#endif
+
+    vout.PosW = posW.xyz;
 
     // Transform to homogeneous clip space.
     vout.PosH = mul(posW, gViewProj);
 
     // Output vertex attributes for interpolation across triangle.
-    float4 texC = mul(float4(vin.TexC, 0.0f, 1.0f), gTexTransform);
+#ifdef TEX_TRANSFORM
+    float4 texC = mul(float4(vin.TexC, 0.0f, 1.0f), texTransform);
     vout.TexC = mul(texC, gMatTransform).xy;
+#else
+    vout.TexC = vin.TexC;
+#endif
 
     return vout;
 }
@@ -141,13 +304,17 @@ float4 PS(VertexOut pin) : SV_Target
     float3 shadowFactor = 1.0f;
     float4 directLight = ComputeLighting(gLights, mat, pin.PosW,
         pin.NormalW, toEyeW, shadowFactor);
+#if defined(CLUSTERED_POINT_LIGHTS) || defined(CLUSTERED_SPOT_LIGHTS)
+    directLight.rgb += ComputeClusteredLighting(pin.PosH.xy, pin.PosW, mat,
+        pin.NormalW, toEyeW);
+#endif
 
     float4 litColor = ambient + directLight;
-//
-//#ifdef FOG
-//    float fogAmount = saturate((distToEye - gFogStart) / gFogRange);
-//    litColor = lerp(litColor, gFogColor, fogAmount);
-//#endif
+
+#ifdef FOG
+    float fogAmount = saturate((distToEye - gFogStart) / gFogRange);
+    litColor = lerp(litColor, gFogColor, fogAmount);
+#endif
 
     // Common convention to take alpha from diffuse albedo.
     litColor.a = diffuseAlbedo.a;
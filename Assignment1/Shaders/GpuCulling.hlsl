@@ -0,0 +1,272 @@
+//***************************************************************************************
+// GpuCulling.hlsl
+//
+// CullCS(): Tests one draw item per thread against the view frustum and the Hi-Z
+//     pyramid, and appends the visible ones to their group's indirect commands.
+//     Compiled with CULL defined; the Hi-Z passes use a different root signature.
+//     With BINDLESS also defined, the commands carry the object and material indices
+//     as root constants instead of their CBV addresses.
+//
+// HiZDepthCS(): Builds Hi-Z mip 0 as the 2x2 maximum of the depth buffer.  Compiled
+//     with MSAA defined for a multisampled depth buffer.
+//
+// HiZDownsampleCS(): Builds the next Hi-Z mip as the maximum of the one above.
+//***************************************************************************************
+
+// Layouts shared with GpuCulling.h.
+struct IndirectCommand
+{
+    uint2 ObjectCB;
+    uint2 MaterialCB;
+    uint2 VertexBufferLocation;
+    uint  VertexBufferSize;
+    uint  VertexBufferStride;
+    uint2 IndexBufferLocation;
+    uint  IndexBufferSize;
+    uint  IndexBufferFormat;
+    uint  IndexCountPerInstance;
+    uint  InstanceCount;
+    uint  StartIndexLocation;
+    int   BaseVertexLocation;
+    uint  StartInstanceLocation;
+    uint  Pad;
+};
+
+struct BindlessIndirectCommand
+{
+    uint  ObjectIndex;
+    uint  MaterialIndex;
+    uint2 VertexBufferLocation;
+    uint  VertexBufferSize;
+    uint  VertexBufferStride;
+    uint2 IndexBufferLocation;
+    uint  IndexBufferSize;
+    uint  IndexBufferFormat;
+    uint  IndexCountPerInstance;
+    uint  InstanceCount;
+    uint  StartIndexLocation;
+    int   BaseVertexLocation;
+    uint  StartInstanceLocation;
+    uint  Pad;
+};
+
+struct CullItem
+{
+    float3 Center;
+    uint   ObjCBIndex;
+    float3 Extents;
+    uint   MatCBIndex;
+    uint   Group;
+    uint   ArgOffset;
+    uint2  Pad;
+    IndirectCommand Command;
+};
+
+#ifdef CULL
+
+cbuffer cbCull : register(b0)
+{
+    float4   gFrustumPlanes[6];
+    float4x4 gHiZViewProj;
+    uint2    gObjectCB;
+    uint     gObjCBByteSize;
+    uint     gItemCount;
+    uint2    gMaterialCB;
+    uint     gMatCBByteSize;
+    uint     gOcclusion;
+    float2   gHiZSize;
+    uint     gHiZMipCount;
+    uint     gCullPad;
+};
+
+StructuredBuffer<CullItem> gItems : register(t0);
+Texture2D<float> gHiZ : register(t1);
+
+#ifdef BINDLESS
+RWStructuredBuffer<BindlessIndirectCommand> gCommands : register(u0);
+#else
+RWStructuredBuffer<IndirectCommand> gCommands : register(u0);
+#endif
+RWByteAddressBuffer gCounts : register(u1);
+
+// 64-bit GPU virtual address plus a byte offset.
+uint2 OffsetAddress(uint2 address, uint offset)
+{
+    uint low = address.x + offset;
+    return uint2(low, address.y + (low < address.x ? 1 : 0));
+}
+
+bool OutsideFrustum(float3 center, float3 extents)
+{
+    [unroll]
+    for(int i = 0; i < 6; ++i)
+    {
+        float4 plane = gFrustumPlanes[i];
+        if(dot(plane.xyz, center) + plane.w + dot(abs(plane.xyz), extents) < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+// Compares the nearest depth of the box with the farthest depth recorded under its
+// screen rectangle, on the Hi-Z mip where the rectangle spans at most 2x2 texels.
+bool Occluded(float3 center, float3 extents)
+{
+    float2 minUv = 1.0f;
+    float2 maxUv = 0.0f;
+    float minZ = 1.0f;
+
+    [unroll]
+    for(int i = 0; i < 8; ++i)
+    {
+        float3 corner = center + extents * float3(i & 1 ? 1.0f : -1.0f,
+                                                  i & 2 ? 1.0f : -1.0f,
+                                                  i & 4 ? 1.0f : -1.0f);
+        float4 posH = mul(float4(corner, 1.0f), gHiZViewProj);
+
+        // Crosses the camera plane: no usable rectangle.
+        if(posH.w <= 0.0f)
+            return false;
+
+        float3 ndc = posH.xyz / posH.w;
+        float2 uv = ndc.xy * float2(0.5f, -0.5f) + 0.5f;
+        minUv = min(minUv, uv);
+        maxUv = max(maxUv, uv);
+        minZ = min(minZ, ndc.z);
+    }
+
+    minUv = saturate(minUv);
+    maxUv = saturate(maxUv);
+
+    float2 texels = (maxUv - minUv) * gHiZSize;
+    uint mip = (uint)clamp(ceil(log2(max(max(texels.x, texels.y), 1.0f))), 0.0f, gHiZMipCount - 1.0f);
+
+    uint width, height, levels;
+    gHiZ.GetDimensions(mip, width, height, levels);
+    uint2 lastTexel = uint2(width, height) - 1;
+
+    // The edge texels of a mip also cover the odd texels left over from the one above,
+    // so clamping to them stays conservative.
+    uint2 lo = min((uint2)(minUv * gHiZSize) >> mip, lastTexel);
+    uint2 hi = min((uint2)(maxUv * gHiZSize) >> mip, lastTexel);
+
+    float maxZ = max(max(gHiZ.Load(int3(lo.x, lo.y, mip)), gHiZ.Load(int3(hi.x, lo.y, mip))),
+                     max(gHiZ.Load(int3(lo.x, hi.y, mip)), gHiZ.Load(int3(hi.x, hi.y, mip))));
+
+    return minZ > maxZ;
+}
+
+[numthreads(64, 1, 1)]
+void CullCS(int3 dispatchThreadID : SV_DispatchThreadID)
+{
+    uint index = dispatchThreadID.x;
+    if(index >= gItemCount)
+        return;
+
+    CullItem item = gItems[index];
+
+    if(OutsideFrustum(item.Center, item.Extents))
+        return;
+
+    if(gOcclusion != 0 && Occluded(item.Center, item.Extents))
+        return;
+
+#ifdef BINDLESS
+    BindlessIndirectCommand command;
+    command.ObjectIndex = item.ObjCBIndex;
+    command.MaterialIndex = item.MatCBIndex;
+    command.VertexBufferLocation = item.Command.VertexBufferLocation;
+    command.VertexBufferSize = item.Command.VertexBufferSize;
+    command.VertexBufferStride = item.Command.VertexBufferStride;
+    command.IndexBufferLocation = item.Command.IndexBufferLocation;
+    command.IndexBufferSize = item.Command.IndexBufferSize;
+    command.IndexBufferFormat = item.Command.IndexBufferFormat;
+    command.IndexCountPerInstance = item.Command.IndexCountPerInstance;
+    command.InstanceCount = item.Command.InstanceCount;
+    command.StartIndexLocation = item.Command.StartIndexLocation;
+    command.BaseVertexLocation = item.Command.BaseVertexLocation;
+    command.StartInstanceLocation = item.Command.StartInstanceLocation;
+    command.Pad = 0;
+#else
+    IndirectCommand command = item.Command;
+    command.ObjectCB = OffsetAddress(gObjectCB, item.ObjCBIndex * gObjCBByteSize);
+    command.MaterialCB = OffsetAddress(gMaterialCB, item.MatCBIndex * gMatCBByteSize);
+#endif
+
+    uint slot;
+    gCounts.InterlockedAdd(item.Group * 4, 1, slot);
+    gCommands[item.ArgOffset + slot] = command;
+}
+
+#else
+
+cbuffer cbHiZ : register(b0)
+{
+    uint2 gSrcSize;
+    uint2 gDstSize;
+};
+
+#ifdef MSAA
+Texture2DMS<float> gDepth : register(t0);
+#else
+Texture2D<float> gDepth : register(t0);
+#endif
+
+RWTexture2D<float> gHiZSrc : register(u0);
+RWTexture2D<float> gHiZDst : register(u1);
+
+float LoadDepth(int2 p)
+{
+    p = min(p, (int2)gSrcSize - 1);
+#ifdef MSAA
+    // Farthest of the 4x MSAA samples.
+    return max(max(gDepth.Load(p, 0), gDepth.Load(p, 1)),
+               max(gDepth.Load(p, 2), gDepth.Load(p, 3)));
+#else
+    return gDepth.Load(int3(p, 0));
+#endif
+}
+
+float LoadHiZ(int2 p)
+{
+    return gHiZSrc[min(p, (int2)gSrcSize - 1)];
+}
+
+[numthreads(8, 8, 1)]
+void HiZDepthCS(int3 dispatchThreadID : SV_DispatchThreadID)
+{
+    if(any((uint2)dispatchThreadID.xy >= gDstSize))
+        return;
+
+    // Mip 0 is half the depth buffer rounded up, so the clamped 2x2 covers everything.
+    int2 p = dispatchThreadID.xy * 2;
+    gHiZDst[dispatchThreadID.xy] = max(max(LoadDepth(p), LoadDepth(p + int2(1, 0))),
+                                       max(LoadDepth(p + int2(0, 1)), LoadDepth(p + int2(1, 1))));
+}
+
+[numthreads(8, 8, 1)]
+void HiZDownsampleCS(int3 dispatchThreadID : SV_DispatchThreadID)
+{
+    uint2 id = (uint2)dispatchThreadID.xy;
+    if(any(id >= gDstSize))
+        return;
+
+    int2 p = id * 2;
+    float z = max(max(LoadHiZ(p), LoadHiZ(p + int2(1, 0))),
+                  max(LoadHiZ(p + int2(0, 1)), LoadHiZ(p + int2(1, 1))));
+
+    // Mip sizes round down, so with an odd source size the last row and column of
+    // the destination also take the source's third texel.
+    bool extraX = id.x == gDstSize.x - 1 && (gSrcSize.x & 1) != 0;
+    bool extraY = id.y == gDstSize.y - 1 && (gSrcSize.y & 1) != 0;
+    if(extraX)
+        z = max(z, max(LoadHiZ(p + int2(2, 0)), LoadHiZ(p + int2(2, 1))));
+    if(extraY)
+        z = max(z, max(LoadHiZ(p + int2(0, 2)), LoadHiZ(p + int2(1, 2))));
+    if(extraX && extraY)
+        z = max(z, LoadHiZ(p + int2(2, 2)));
+
+    gHiZDst[id] = z;
+}
+
+#endif
@@ -1,10 +1,13 @@
 //***************************************************************************************
 // TreeSprite.hlsl.
+//
+// Billboard trees, see Foliage.h.  Every instance is one TreeInstance; the vertex shader
+// expands it into a y-axis aligned quad facing the eye, drawn as a four vertex strip.
 //***************************************************************************************
 
 // Defaults for number of lights.
 #ifndef NUM_DIR_LIGHTS
-    #define NUM_DIR_LIGHTS 3
+    #define NUM_DIR_LIGHTS 1
 #endif
 
 #ifndef NUM_POINT_LIGHTS
@@ -17,6 +20,10 @@
 
 // Include structures and functions for lighting.
 #include "LightingUtil.hlsl"
+// Shared with Foliage.h.
+#define TREE_FADE_START 160.0f
+#define TREE_FADE_END 200.0f
+
 //step5
 Texture2DArray gTreeMapArray : register(t0);
 
@@ -31,13 +38,6 @@ SamplerState gsamLinearClamp      : register(s3);
 SamplerState gsamAnisotropicWrap  : register(s4);
 SamplerState gsamAnisotropicClamp : register(s5);
 
-// Constant data that varies per frame.
-cbuffer cbPerObject : register(b0)
-{
-    float4x4 gWorld;
-	float4x4 gTexTransform;
-};
-
 // Constant data that varies per material.
 cbuffer cbPass : register(b1)
 {
@@ -62,10 +62,8 @@ cbuffer cbPass : register(b1)
 	float gFogRange;
 	float2 cbPerObjectPad2;
 
-    // Indices [0, NUM_DIR_LIGHTS) are directional lights;
-    // indices [NUM_DIR_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHTS) are point lights;
-    // indices [NUM_DIR_LIGHTS+NUM_POINT_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHT+NUM_SPOT_LIGHTS)
-    // are spot lights for a maximum of MaxLights per object.
+    // Indices [0, NUM_DIR_LIGHTS) are directional lights; the point and spot lights are
+    // clustered, see ClusteredLighting.hlsl.
     Light gLights[MaxLights];
 };
 
@@ -76,105 +74,94 @@ cbuffer cbMaterial : register(b2)
     float    gRoughness;
 	float4x4 gMatTransform;
 };
- 
-struct VertexIn
+
+struct TreeInstance
 {
-	float3 PosW  : POSITION;
-	float2 SizeW : SIZE;
+    float3 CenterW;
+    uint   Slice;
+    float2 SizeW;
+    float2 Pad;
 };
 
-struct VertexOut
+// Every tree; a cell's trees are contiguous.
+StructuredBuffer<TreeInstance> gTrees : register(t0, space1);
+
+// Index of the cell's first tree in gTrees.
+cbuffer cbInstanceBatch : register(b3)
 {
-	float3 CenterW : POSITION;
-	float2 SizeW   : SIZE;
+    uint gFirstInstance;
 };
 
-struct GeoOut
+struct VertexOut
 {
 	float4 PosH    : SV_POSITION;
     float3 PosW    : POSITION;
     float3 NormalW : NORMAL;
     float2 TexC    : TEXCOORD;
-    uint   PrimID  : SV_PrimitiveID;
+    nointerpolation uint  Slice : SLICE;
+    nointerpolation float Fade  : FADE;
 };
 
-VertexOut VS(VertexIn vin)
+VertexOut VS(uint vertexID : SV_VertexID, uint instanceID : SV_InstanceID)
 {
-	VertexOut vout;
+	TreeInstance tree = gTrees[gFirstInstance + instanceID];
 
-	// Just pass data over to geometry shader.
-	vout.CenterW = vin.PosW;
-	vout.SizeW   = vin.SizeW;
-
-	return vout;
-}
- 
-//step4
- // We expand each point into a quad (4 vertices), so the maximum number of vertices
- // we output per geometry shader invocation is 4.
-[maxvertexcount(4)]
-void GS(point VertexOut gin[1], //PrimitiveType InputVertexType InputName[NumElements]-> one vertex for a point, two for aline, threefor atriangle, four for line with adjacency, and six for a triangle with adjacency.
-        uint primID : SV_PrimitiveID, //inout StreamOutputObject<OutputVertexType>
-        inout TriangleStream<GeoOut> triStream)  //OutputName
-{	
 	//
 	// Compute the local coordinate system of the sprite relative to the world
 	// space such that the billboard is aligned with the y-axis and faces the eye.
 	//
 
 	float3 up = float3(0.0f, 1.0f, 0.0f);
-	float3 look = gEyePosW - gin[0].CenterW;
+	float3 look = gEyePosW - tree.CenterW;
 	look.y = 0.0f; // y-axis aligned, so project to xz-plane
-	look = normalize(look);
+	float dist = length(look);
+	look = dist > 0.0f ? look / dist : float3(0.0f, 0.0f, 1.0f);
 	float3 right = cross(up, look);
 
-	//
-	// Compute triangle strip vertices (quad) in world space.
-	//
-	float halfWidth  = 0.5f*gin[0].SizeW.x;
-	float halfHeight = 0.5f*gin[0].SizeW.y;
-	
-	float4 v[4];
-	v[0] = float4(gin[0].CenterW + halfWidth*right - halfHeight*up, 1.0f);
-	v[1] = float4(gin[0].CenterW + halfWidth*right + halfHeight*up, 1.0f);
-	v[2] = float4(gin[0].CenterW - halfWidth*right - halfHeight*up, 1.0f);
-	v[3] = float4(gin[0].CenterW - halfWidth*right + halfHeight*up, 1.0f);
+	// Strip order: (+right, -up), (+right, +up), (-right, -up), (-right, +up).
+	float2 corner = float2(vertexID < 2 ? 1.0f : -1.0f, (vertexID & 1) ? 1.0f : -1.0f);
+	float3 posW = tree.CenterW + 0.5f * tree.SizeW.x * corner.x * right + 0.5f * tree.SizeW.y * corner.y * up;
 
-	//
-	// Transform quad vertices to world space and output 
-	// them as a triangle strip.
-	//
-	
-	float2 texC[4] = 
+	VertexOut vout;
+	vout.PosH    = mul(float4(posW, 1.0f), gViewProj);
+	vout.PosW    = posW;
+	vout.NormalW = look;
+	vout.TexC    = float2(vertexID < 2 ? 0.0f : 1.0f, (vertexID & 1) ? 0.0f : 1.0f);
+	vout.Slice   = tree.Slice;
+	vout.Fade    = saturate((TREE_FADE_END - dist) / (TREE_FADE_END - TREE_FADE_START));
+
+	// Collapse the trees past the fade distance so the rasterizer drops them.
+	if(vout.Fade <= 0.0f)
+		vout.PosH = float4(0.0f, 0.0f, 0.0f, 1.0f);
+
+	return vout;
+}
+
+// 4x4 ordered dither threshold in (0, 1) for the pixel.
+float DitherThreshold(float2 posPixel)
+{
+	static const float bayer[16] =
 	{
-		float2(0.0f, 1.0f),
-		float2(0.0f, 0.0f),
-		float2(1.0f, 1.0f),
-		float2(1.0f, 0.0f)
+		 0.0f,  8.0f,  2.0f, 10.0f,
+		12.0f,  4.0f, 14.0f,  6.0f,
+		 3.0f, 11.0f,  1.0f,  9.0f,
+		15.0f,  7.0f, 13.0f,  5.0f
 	};
-	
-	GeoOut gout;
-	[unroll]
-	for(int i = 0; i < 4; ++i)
-	{
-		gout.PosH     = mul(v[i], gViewProj);
-		gout.PosW     = v[i].xyz;
-		gout.NormalW  = look;
-		gout.TexC     = texC[i];
-		gout.PrimID   = primID;
-		
-		triStream.Append(gout);
-	}
+	uint2 p = (uint2)posPixel % 4;
+	return (bayer[p.y * 4 + p.x] + 0.5f) / 16.0f;
 }
 
 //step6
-float4 PS(GeoOut pin) : SV_Target
+float4 PS(VertexOut pin) : SV_Target
 {
-	float3 uvw = float3(pin.TexC, pin.PrimID%3);
+	// Screen-door fade; unlike blending it needs no sorting.
+	clip(pin.Fade - DitherThreshold(pin.PosH.xy));
+
+	float3 uvw = float3(pin.TexC, pin.Slice);
     float4 diffuseAlbedo = gTreeMapArray.Sample(gsamAnisotropicWrap, uvw) * gDiffuseAlbedo;
 
     //using dynamic indexing
-    //float4 diffuseAlbedo = gTreeMapArray[pin.PrimID % 3].Sample(gsamAnisotropicWrap, pin.TexC) * gDiffuseAlbedo;
+    //float4 diffuseAlbedo = gTreeMapArray[pin.Slice].Sample(gsamAnisotropicWrap, pin.TexC) * gDiffuseAlbedo;
 
 	
 #ifdef ALPHA_TEST
@@ -202,11 +189,11 @@ float4 PS(GeoOut pin) : SV_Target
         pin.NormalW, toEyeW, shadowFactor);
 
     float4 litColor = ambient + directLight;
-//
-//#ifdef FOG
-//	float fogAmount = saturate((distToEye - gFogStart) / gFogRange);
-//	litColor = lerp(litColor, gFogColor, fogAmount);
-//#endif
+
+#ifdef FOG
+	float fogAmount = saturate((distToEye - gFogStart) / gFogRange);
+	litColor = lerp(litColor, gFogColor, fogAmount);
+#endif
 
     // Common convention to take alpha from diffuse albedo.
     litColor.a = diffuseAlbedo.a;
@@ -0,0 +1,39 @@
+//***************************************************************************************
+// Upscale.hlsl
+//
+// Stretches the rendered corner of the dynamic resolution scene target over the whole
+// output with one full screen triangle and bilinear filtering.
+//***************************************************************************************
+
+cbuffer cbUpscale : register(b0)
+{
+	float2 gUvScale;	// rendered size over the target size
+	float2 gUvMax;		// centre of the last rendered texel
+};
+
+Texture2D gScene : register(t0);
+
+SamplerState gsamLinearClamp : register(s3);
+
+struct VertexOut
+{
+	float4 PosH : SV_POSITION;
+	float2 TexC : TEXCOORD;
+};
+
+VertexOut VS(uint vertexId : SV_VertexID)
+{
+	VertexOut vout;
+
+	// (0,0), (2,0), (0,2): covers the screen, the uvs cover [0,1] on it.
+	vout.TexC = float2((vertexId << 1) & 2, vertexId & 2);
+	vout.PosH = float4(vout.TexC * float2(2.0f, -2.0f) + float2(-1.0f, 1.0f), 0.0f, 1.0f);
+
+	return vout;
+}
+
+float4 PS(VertexOut pin) : SV_Target
+{
+	float2 uv = min(pin.TexC * gUvScale, gUvMax);
+	return gScene.SampleLevel(gsamLinearClamp, uv, 0.0f);
+}
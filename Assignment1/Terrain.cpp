@@ -0,0 +1,318 @@
+//***************************************************************************************
+// Terrain.cpp
+//***************************************************************************************
+
+#include "Terrain.h"
+#include "../Common/GpuAllocator.h"
+#include "../Common/StagingRing.h"
+#include <cassert>
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+Terrain::Terrain(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList, StagingRing& staging,
+	int tilesPerSide, int patchQuads, float size,
+	const std::function<float(float, float)>& height)
+	: md3dDevice(device), mTilesPerSide(tilesPerSide), mPatchQuads(patchQuads), mSize(size)
+{
+	assert(patchQuads >= 2 && (patchQuads & (patchQuads - 1)) == 0);
+	assert((patchQuads + 1) * (patchQuads + 1) <= 0x10000);
+
+	mTileSize = mSize / mTilesPerSide;
+
+	// Levels down to two quads per side.
+	for(int quads = mPatchQuads; quads >= 2; quads /= 2)
+		++mLodCount;
+
+	mHeightMapDim = mTilesPerSide * mPatchQuads + 1;
+	mHeights.resize(mHeightMapDim * mHeightMapDim);
+
+	float step = SpatialStep();
+	float halfSize = 0.5f * mSize;
+	for(int i = 0; i < mHeightMapDim; ++i)
+	{
+		float z = -halfSize + i * step;
+		for(int j = 0; j < mHeightMapDim; ++j)
+		{
+			float x = -halfSize + j * step;
+			mHeights[i * mHeightMapDim + j] = height(x, z);
+		}
+	}
+
+	int tileCount = TileCount();
+	mTileMinHeight.resize(tileCount, +MathHelper::Infinity);
+	mTileMaxHeight.resize(tileCount, -MathHelper::Infinity);
+	mTileLods.resize(tileCount, 0);
+	mTileStitch.resize(tileCount, 0);
+
+	for(int tz = 0; tz < mTilesPerSide; ++tz)
+	{
+		for(int tx = 0; tx < mTilesPerSide; ++tx)
+		{
+			int tile = tz * mTilesPerSide + tx;
+			for(int i = tz * mPatchQuads; i <= (tz + 1) * mPatchQuads; ++i)
+			{
+				for(int j = tx * mPatchQuads; j <= (tx + 1) * mPatchQuads; ++j)
+				{
+					float h = mHeights[i * mHeightMapDim + j];
+					mTileMinHeight[tile] = MathHelper::Min(mTileMinHeight[tile], h);
+					mTileMaxHeight[tile] = MathHelper::Max(mTileMaxHeight[tile], h);
+				}
+			}
+		}
+	}
+
+	BuildIndices();
+	BuildHeightMap(cmdList, staging);
+}
+
+int Terrain::TilesPerSide()const
+{
+	return mTilesPerSide;
+}
+
+int Terrain::TileCount()const
+{
+	return mTilesPerSide * mTilesPerSide;
+}
+
+int Terrain::PatchQuads()const
+{
+	return mPatchQuads;
+}
+
+int Terrain::LodCount()const
+{
+	return mLodCount;
+}
+
+float Terrain::TileSize()const
+{
+	return mTileSize;
+}
+
+float Terrain::SpatialStep()const
+{
+	return mSize / (mHeightMapDim - 1);
+}
+
+XMFLOAT2 Terrain::HeightMapTexelSize()const
+{
+	return XMFLOAT2(1.0f / mHeightMapDim, 1.0f / mHeightMapDim);
+}
+
+const std::vector<std::uint16_t>& Terrain::Indices()const
+{
+	return mIndices;
+}
+
+XMFLOAT4X4 Terrain::TileWorld(int tile)const
+{
+	float x = -0.5f * mSize + (tile % mTilesPerSide) * mTileSize;
+	float z = -0.5f * mSize + (tile / mTilesPerSide) * mTileSize;
+
+	XMFLOAT4X4 world;
+	XMStoreFloat4x4(&world, XMMatrixScaling(mTileSize, 1.0f, mTileSize) * XMMatrixTranslation(x, 0.0f, z));
+	return world;
+}
+
+BoundingBox Terrain::TileBounds(int tile)const
+{
+	float minH = mTileMinHeight[tile];
+	float maxH = mTileMaxHeight[tile];
+
+	// Linear filtering between texels never leaves the texels' range.
+	return BoundingBox(
+		XMFLOAT3(0.5f, 0.5f * (minH + maxH), 0.5f),
+		XMFLOAT3(0.5f, 0.5f * (maxH - minH) + 0.01f, 0.5f));
+}
+
+bool Terrain::SelectLods(const XMFLOAT3& eyePosW)
+{
+	// Each level covers twice the distance of the previous one.
+	const float lod0Distance = 1.5f * mTileSize;
+
+	std::vector<int> lods(TileCount());
+	for(int tile = 0; tile < TileCount(); ++tile)
+	{
+		float cx = -0.5f * mSize + ((tile % mTilesPerSide) + 0.5f) * mTileSize;
+		float cz = -0.5f * mSize + ((tile / mTilesPerSide) + 0.5f) * mTileSize;
+		float cy = 0.5f * (mTileMinHeight[tile] + mTileMaxHeight[tile]);
+
+		float dx = cx - eyePosW.x;
+		float dy = cy - eyePosW.y;
+		float dz = cz - eyePosW.z;
+		float dist = sqrtf(dx * dx + dy * dy + dz * dz);
+
+		int lod = 0;
+		for(float d = lod0Distance; dist > d && lod < mLodCount - 1; d *= 2.0f)
+			++lod;
+		lods[tile] = lod;
+	}
+
+	// Refine tiles until no neighbours are more than one level apart; refining only
+	// ever lowers a level, so this terminates.
+	bool changed = true;
+	while(changed)
+	{
+		changed = false;
+		for(int tz = 0; tz < mTilesPerSide; ++tz)
+		{
+			for(int tx = 0; tx < mTilesPerSide; ++tx)
+			{
+				int& lod = lods[tz * mTilesPerSide + tx];
+				int finest = lod;
+				if(tx > 0)                 finest = MathHelper::Min(finest, lods[tz * mTilesPerSide + tx - 1] + 1);
+				if(tx < mTilesPerSide - 1) finest = MathHelper::Min(finest, lods[tz * mTilesPerSide + tx + 1] + 1);
+				if(tz > 0)                 finest = MathHelper::Min(finest, lods[(tz - 1) * mTilesPerSide + tx] + 1);
+				if(tz < mTilesPerSide - 1) finest = MathHelper::Min(finest, lods[(tz + 1) * mTilesPerSide + tx] + 1);
+				if(finest < lod)
+				{
+					lod = finest;
+					changed = true;
+				}
+			}
+		}
+	}
+
+	bool argsChanged = false;
+	for(int tz = 0; tz < mTilesPerSide; ++tz)
+	{
+		for(int tx = 0; tx < mTilesPerSide; ++tx)
+		{
+			int tile = tz * mTilesPerSide + tx;
+			int lod = lods[tile];
+
+			int stitch = 0;
+			if(tx > 0 && lods[tile - 1] > lod)                             stitch |= StitchNegX;
+			if(tx < mTilesPerSide - 1 && lods[tile + 1] > lod)             stitch |= StitchPosX;
+			if(tz > 0 && lods[tile - mTilesPerSide] > lod)                 stitch |= StitchNegZ;
+			if(tz < mTilesPerSide - 1 && lods[tile + mTilesPerSide] > lod) stitch |= StitchPosZ;
+
+			argsChanged |= mTileLods[tile] != lod || mTileStitch[tile] != stitch;
+			mTileLods[tile] = lod;
+			mTileStitch[tile] = stitch;
+		}
+	}
+
+	return argsChanged;
+}
+
+const SubmeshGeometry& Terrain::TileDrawArgs(int tile)const
+{
+	return mDrawArgs[mTileLods[tile] * StitchCombinations + mTileStitch[tile]];
+}
+
+int Terrain::TileLod(int tile)const
+{
+	return mTileLods[tile];
+}
+
+CD3DX12_GPU_DESCRIPTOR_HANDLE Terrain::HeightMap()const
+{
+	return mHeightMapSrv;
+}
+
+void Terrain::BuildDescriptor(
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDescriptor,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuDescriptor)
+{
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = DXGI_FORMAT_R32_FLOAT;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.MipLevels = 1;
+
+	md3dDevice->CreateShaderResourceView(mHeightMap.Get(), &srvDesc, hCpuDescriptor);
+
+	mHeightMapSrv = hGpuDescriptor;
+}
+
+void Terrain::BuildIndices()
+{
+	const int n = mPatchQuads + 1;
+
+	mDrawArgs.resize(mLodCount * StitchCombinations);
+	for(int lod = 0; lod < mLodCount; ++lod)
+	{
+		const int s = 1 << lod;
+
+		for(int stitch = 0; stitch < StitchCombinations; ++stitch)
+		{
+			// Moves the odd vertices of stitched edges onto the even vertex before them,
+			// so those edges only use the vertices of the coarser neighbour.
+			auto vertex = [&](int x, int z) -> std::uint16_t
+			{
+				if(((stitch & StitchNegX) && x == 0) || ((stitch & StitchPosX) && x == mPatchQuads))
+				{
+					if((z / s) % 2 == 1)
+						z -= s;
+				}
+				if(((stitch & StitchNegZ) && z == 0) || ((stitch & StitchPosZ) && z == mPatchQuads))
+				{
+					if((x / s) % 2 == 1)
+						x -= s;
+				}
+				return (std::uint16_t)(z * n + x);
+			};
+
+			auto triangle = [&](std::uint16_t a, std::uint16_t b, std::uint16_t c)
+			{
+				// Snapping collapses some triangles along stitched edges.
+				if(a == b || b == c || a == c)
+					return;
+
+				mIndices.push_back(a);
+				mIndices.push_back(b);
+				mIndices.push_back(c);
+			};
+
+			SubmeshGeometry& args = mDrawArgs[lod * StitchCombinations + stitch];
+			args.StartIndexLocation = (UINT)mIndices.size();
+			args.BaseVertexLocation = 0;
+
+			for(int z = 0; z < mPatchQuads; z += s)
+			{
+				for(int x = 0; x < mPatchQuads; x += s)
+				{
+					std::uint16_t v00 = vertex(x, z);
+					std::uint16_t v10 = vertex(x + s, z);
+					std::uint16_t v01 = vertex(x, z + s);
+					std::uint16_t v11 = vertex(x + s, z + s);
+
+					// Clockwise seen from above.
+					triangle(v00, v01, v10);
+					triangle(v10, v01, v11);
+				}
+			}
+
+			args.IndexCount = (UINT)mIndices.size() - args.StartIndexLocation;
+		}
+	}
+}
+
+void Terrain::BuildHeightMap(ID3D12GraphicsCommandList* cmdList, StagingRing& staging)
+{
+	D3D12_RESOURCE_DESC texDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R32_FLOAT,
+		mHeightMapDim, mHeightMapDim, 1, 1);
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_DEFAULT,
+		&texDesc,
+		D3D12_RESOURCE_STATE_COPY_DEST,
+		nullptr,
+		IID_PPV_ARGS(&mHeightMap)));
+
+	StagingRing::Allocation upload = staging.Allocate(cmdList,
+		GetRequiredIntermediateSize(mHeightMap.Get(), 0, 1));
+
+	D3D12_SUBRESOURCE_DATA subResourceData = {};
+	subResourceData.pData = mHeights.data();
+	subResourceData.RowPitch = mHeightMapDim * sizeof(float);
+	subResourceData.SlicePitch = subResourceData.RowPitch * mHeightMapDim;
+
+	UpdateSubresources(cmdList, mHeightMap.Get(), upload.Resource, upload.Offset, 0, 1, &subResourceData);
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mHeightMap.Get(),
+		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE));
+}
@@ -0,0 +1,106 @@
+//***************************************************************************************
+// Terrain.h
+//
+// Tiled height-field terrain.  The heights are baked into a floating-point texture that
+// the terrain vertex shader samples, so every tile draws the same flat patch of
+// patchQuads x patchQuads quads, scaled and translated by its world matrix.
+//
+// Each tile picks a level of detail from its distance to the camera; neighbours differ
+// by at most one level.  Every level has an index list per combination of coarser
+// neighbours, in which the odd vertices of those edges are snapped to the even ones so
+// the shared edges match exactly and the terrain has no cracks.
+//***************************************************************************************
+
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include "../Common/d3dUtil.h"
+#include <functional>
+
+class StagingRing;
+
+class Terrain
+{
+public:
+	// The terrain is size x size world units, centred on the origin.  patchQuads must
+	// be a power of two.  height(x, z) is sampled once per height map texel.
+	Terrain(ID3D12Device* device, ID3D12GraphicsCommandList* cmdList, StagingRing& staging,
+		int tilesPerSide, int patchQuads, float size,
+		const std::function<float(float, float)>& height);
+	Terrain(const Terrain& rhs) = delete;
+	Terrain& operator=(const Terrain& rhs) = delete;
+	~Terrain() = default;
+
+	int TilesPerSide()const;
+	int TileCount()const;
+	int PatchQuads()const;
+	int LodCount()const;
+	float TileSize()const;
+
+	// Distance between height map texels, and the size of one texel in [0,1]^2.
+	float SpatialStep()const;
+	DirectX::XMFLOAT2 HeightMapTexelSize()const;
+
+	// Indices of the patch for every level and stitching combination; the patch has
+	// (PatchQuads()+1)^2 vertices laid out row by row along +z, x in [0,1], z in [0,1].
+	const std::vector<std::uint16_t>& Indices()const;
+
+	// Tile transforms and bounds.  The bounds are in patch space.
+	DirectX::XMFLOAT4X4 TileWorld(int tile)const;
+	DirectX::BoundingBox TileBounds(int tile)const;
+
+	// Chooses the level of every tile for the eye position.  Returns whether any
+	// tile's draw arguments changed.
+	bool SelectLods(const DirectX::XMFLOAT3& eyePosW);
+
+	// Range of Indices() to draw the tile with at its current level.
+	const SubmeshGeometry& TileDrawArgs(int tile)const;
+	int TileLod(int tile)const;
+
+	// SRV of the height map, to be bound to the terrain vertex shader.
+	CD3DX12_GPU_DESCRIPTOR_HANDLE HeightMap()const;
+
+	void BuildDescriptor(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDescriptor,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuDescriptor);
+
+private:
+	// Edges whose neighbour is one level coarser.
+	enum StitchEdge
+	{
+		StitchNegX = 1,
+		StitchPosX = 2,
+		StitchNegZ = 4,
+		StitchPosZ = 8,
+		StitchCombinations = 16
+	};
+
+	void BuildIndices();
+	void BuildHeightMap(ID3D12GraphicsCommandList* cmdList, StagingRing& staging);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	int mTilesPerSide = 0;
+	int mPatchQuads = 0;
+	int mLodCount = 0;
+	float mSize = 0.0f;
+	float mTileSize = 0.0f;
+
+	// Height map, (TilesPerSide*PatchQuads+1)^2 texels, row by row along +z.
+	int mHeightMapDim = 0;
+	std::vector<float> mHeights;
+
+	std::vector<std::uint16_t> mIndices;
+	std::vector<SubmeshGeometry> mDrawArgs;   // [lod * StitchCombinations + stitch]
+
+	std::vector<float> mTileMinHeight;
+	std::vector<float> mTileMaxHeight;
+	std::vector<int> mTileLods;
+	std::vector<int> mTileStitch;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mHeightMap = nullptr;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mHeightMapSrv;
+};
+
+#endif // TERRAIN_H
@@ -7,9 +7,141 @@
 #include <algorithm>
 #include <vector>
 #include <cassert>
+#include <cmath>
+#include <xmmintrin.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 using namespace DirectX;
 
+namespace
+{
+	// One row of the height update over interior points.  prev/curr/up/down point at
+	// column 1 of the row being solved and of its neighbour rows; prev is written in
+	// place exactly like the AoS loop.
+	void UpdateHeightsRow(float* prev, const float* curr, const float* up, const float* down,
+		int count, float k1, float k2, float k3)
+	{
+		int j = 0;
+
+#if defined(__AVX__)
+		const __m256 k1x8 = _mm256_set1_ps(k1);
+		const __m256 k2x8 = _mm256_set1_ps(k2);
+		const __m256 k3x8 = _mm256_set1_ps(k3);
+		for(; j + 8 <= count; j += 8)
+		{
+			__m256 neighbours = _mm256_add_ps(
+				_mm256_add_ps(_mm256_loadu_ps(down + j), _mm256_loadu_ps(up + j)),
+				_mm256_add_ps(_mm256_loadu_ps(curr + j + 1), _mm256_loadu_ps(curr + j - 1)));
+
+			__m256 h = _mm256_add_ps(
+				_mm256_add_ps(_mm256_mul_ps(k1x8, _mm256_loadu_ps(prev + j)),
+				              _mm256_mul_ps(k2x8, _mm256_loadu_ps(curr + j))),
+				_mm256_mul_ps(k3x8, neighbours));
+
+			_mm256_storeu_ps(prev + j, h);
+		}
+#endif
+
+		const __m128 k1x4 = _mm_set1_ps(k1);
+		const __m128 k2x4 = _mm_set1_ps(k2);
+		const __m128 k3x4 = _mm_set1_ps(k3);
+		for(; j + 4 <= count; j += 4)
+		{
+			__m128 neighbours = _mm_add_ps(
+				_mm_add_ps(_mm_loadu_ps(down + j), _mm_loadu_ps(up + j)),
+				_mm_add_ps(_mm_loadu_ps(curr + j + 1), _mm_loadu_ps(curr + j - 1)));
+
+			__m128 h = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(k1x4, _mm_loadu_ps(prev + j)),
+				           _mm_mul_ps(k2x4, _mm_loadu_ps(curr + j))),
+				_mm_mul_ps(k3x4, neighbours));
+
+			_mm_storeu_ps(prev + j, h);
+		}
+
+		// Same operation order as the vector lanes.
+		for(; j < count; ++j)
+		{
+			float neighbours = (down[j] + up[j]) + (curr[j + 1] + curr[j - 1]);
+			prev[j] = (k1*prev[j] + k2*curr[j]) + k3*neighbours;
+		}
+	}
+
+	// One row of the finite difference normals and x-tangents.  Pointers are at column 1.
+	void UpdateNormalsRow(const float* curr, const float* up, const float* down,
+		float* nx, float* ny, float* nz, float* tx, float* ty, int count, float twoDx)
+	{
+		int j = 0;
+
+#if defined(__AVX__)
+		const __m256 twoDxx8 = _mm256_set1_ps(twoDx);
+		const __m256 twoDxSqx8 = _mm256_set1_ps(twoDx*twoDx);
+		const __m256 onex8 = _mm256_set1_ps(1.0f);
+		for(; j + 8 <= count; j += 8)
+		{
+			__m256 l = _mm256_loadu_ps(curr + j - 1);
+			__m256 r = _mm256_loadu_ps(curr + j + 1);
+			__m256 t = _mm256_loadu_ps(up + j);
+			__m256 b = _mm256_loadu_ps(down + j);
+
+			__m256 x = _mm256_sub_ps(l, r);
+			__m256 z = _mm256_sub_ps(b, t);
+			__m256 lenSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), twoDxSqx8), _mm256_mul_ps(z, z));
+			__m256 invLen = _mm256_div_ps(onex8, _mm256_sqrt_ps(lenSq));
+			_mm256_storeu_ps(nx + j, _mm256_mul_ps(x, invLen));
+			_mm256_storeu_ps(ny + j, _mm256_mul_ps(twoDxx8, invLen));
+			_mm256_storeu_ps(nz + j, _mm256_mul_ps(z, invLen));
+
+			__m256 dy = _mm256_sub_ps(r, l);
+			__m256 invTLen = _mm256_div_ps(onex8, _mm256_sqrt_ps(_mm256_add_ps(twoDxSqx8, _mm256_mul_ps(dy, dy))));
+			_mm256_storeu_ps(tx + j, _mm256_mul_ps(twoDxx8, invTLen));
+			_mm256_storeu_ps(ty + j, _mm256_mul_ps(dy, invTLen));
+		}
+#endif
+
+		const __m128 twoDxx4 = _mm_set1_ps(twoDx);
+		const __m128 twoDxSqx4 = _mm_set1_ps(twoDx*twoDx);
+		const __m128 onex4 = _mm_set1_ps(1.0f);
+		for(; j + 4 <= count; j += 4)
+		{
+			__m128 l = _mm_loadu_ps(curr + j - 1);
+			__m128 r = _mm_loadu_ps(curr + j + 1);
+			__m128 t = _mm_loadu_ps(up + j);
+			__m128 b = _mm_loadu_ps(down + j);
+
+			__m128 x = _mm_sub_ps(l, r);
+			__m128 z = _mm_sub_ps(b, t);
+			__m128 lenSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), twoDxSqx4), _mm_mul_ps(z, z));
+			__m128 invLen = _mm_div_ps(onex4, _mm_sqrt_ps(lenSq));
+			_mm_storeu_ps(nx + j, _mm_mul_ps(x, invLen));
+			_mm_storeu_ps(ny + j, _mm_mul_ps(twoDxx4, invLen));
+			_mm_storeu_ps(nz + j, _mm_mul_ps(z, invLen));
+
+			__m128 dy = _mm_sub_ps(r, l);
+			__m128 invTLen = _mm_div_ps(onex4, _mm_sqrt_ps(_mm_add_ps(twoDxSqx4, _mm_mul_ps(dy, dy))));
+			_mm_storeu_ps(tx + j, _mm_mul_ps(twoDxx4, invTLen));
+			_mm_storeu_ps(ty + j, _mm_mul_ps(dy, invTLen));
+		}
+
+		for(; j < count; ++j)
+		{
+			float x = curr[j - 1] - curr[j + 1];
+			float z = down[j] - up[j];
+			float invLen = 1.0f / sqrtf((x*x + twoDx*twoDx) + z*z);
+			nx[j] = x*invLen;
+			ny[j] = twoDx*invLen;
+			nz[j] = z*invLen;
+
+			float dy = curr[j + 1] - curr[j - 1];
+			float invTLen = 1.0f / sqrtf(twoDx*twoDx + dy*dy);
+			tx[j] = twoDx*invTLen;
+			ty[j] = dy*invTLen;
+		}
+	}
+}
+
 Waves::Waves(int m, int n, float dx, float dt, float speed, float damping)
 {
     mNumRows = m;
@@ -49,10 +181,46 @@ Waves::Waves(int m, int n, float dx, float dt, float speed, float damping)
             mTangentX[i*n + j] = XMFLOAT3(1.0f, 0.0f, 0.0f);
         }
     }
+
+    mGridX.resize(n);
+    mGridZ.resize(m);
+    for(int j = 0; j < n; ++j)
+        mGridX[j] = -halfWidth + j*dx;
+    for(int i = 0; i < m; ++i)
+        mGridZ[i] = halfDepth - i*dx;
+
+    mPrevHeights.assign(m*n, 0.0f);
+    mCurrHeights.assign(m*n, 0.0f);
+    mNormalsX.assign(m*n, 0.0f);
+    mNormalsY.assign(m*n, 1.0f);
+    mNormalsZ.assign(m*n, 0.0f);
+    mTangentsX.assign(m*n, 1.0f);
+    mTangentsY.assign(m*n, 0.0f);
+
+    for(Solution& s : mSolutions)
+    {
+        s.Positions = mCurrSolution;
+        s.Normals = mNormals;
+        s.TangentX = mTangentX;
+        s.Version = mNextVersion;
+    }
+    ++mNextVersion;
 }
 
 Waves::~Waves()
 {
+	// The job references this object; let it finish.  Its result is discarded, and an
+	// exception it threw must not escape a destructor.
+	if(mJobInFlight)
+	{
+		try
+		{
+			mJob.wait();
+		}
+		catch(...)
+		{
+		}
+	}
 }
 
 int Waves::RowCount()const
@@ -85,73 +253,305 @@ float Waves::Depth()const
 	return mNumRows*mSpatialStep;
 }
 
+Waves::Solver Waves::GetSolver()const
+{
+	return mSolver;
+}
+
+void Waves::SetSolver(Solver solver)
+{
+	if(solver == mSolver)
+		return;
+
+	WaitForAsync();
+
+	if(solver == Solver::SoA)
+	{
+		for(int k = 0; k < mVertexCount; ++k)
+		{
+			mPrevHeights[k] = mPrevSolution[k].y;
+			mCurrHeights[k] = mCurrSolution[k].y;
+			mNormalsX[k] = mNormals[k].x;
+			mNormalsY[k] = mNormals[k].y;
+			mNormalsZ[k] = mNormals[k].z;
+			mTangentsX[k] = mTangentX[k].x;
+			mTangentsY[k] = mTangentX[k].y;
+		}
+	}
+	else
+	{
+		for(int k = 0; k < mVertexCount; ++k)
+		{
+			mPrevSolution[k].y = mPrevHeights[k];
+			mCurrSolution[k].y = mCurrHeights[k];
+			mNormals[k] = XMFLOAT3(mNormalsX[k], mNormalsY[k], mNormalsZ[k]);
+			mTangentX[k] = XMFLOAT3(mTangentsX[k], mTangentsY[k], 0.0f);
+		}
+	}
+
+	mSolver = solver;
+}
+
+float Waves::CompareSolvers(int steps)
+{
+	WaitForAsync();
+
+	// Everything a step or SetSolver writes, restored at the end.
+	const Solver solver = mSolver;
+	const std::vector<XMFLOAT3> prevSolution = mPrevSolution;
+	const std::vector<XMFLOAT3> currSolution = mCurrSolution;
+	const std::vector<XMFLOAT3> normals = mNormals;
+	const std::vector<XMFLOAT3> tangentX = mTangentX;
+	const std::vector<float> prevHeights = mPrevHeights;
+	const std::vector<float> currHeights = mCurrHeights;
+	const std::vector<float> normalsX = mNormalsX;
+	const std::vector<float> normalsY = mNormalsY;
+	const std::vector<float> normalsZ = mNormalsZ;
+	const std::vector<float> tangentsX = mTangentsX;
+	const std::vector<float> tangentsY = mTangentsY;
+
+	auto restore = [&]()
+	{
+		mSolver = solver;
+		mPrevSolution = prevSolution;
+		mCurrSolution = currSolution;
+		mNormals = normals;
+		mTangentX = tangentX;
+		mPrevHeights = prevHeights;
+		mCurrHeights = currHeights;
+		mNormalsX = normalsX;
+		mNormalsY = normalsY;
+		mNormalsZ = normalsZ;
+		mTangentsX = tangentsX;
+		mTangentsY = tangentsY;
+	};
+
+	SetSolver(Solver::AoS);
+	for(int k = 0; k < steps; ++k)
+		StepAoS();
+
+	std::vector<float> aosHeights(mVertexCount);
+	for(int k = 0; k < mVertexCount; ++k)
+		aosHeights[k] = mCurrSolution[k].y;
+
+	restore();
+	SetSolver(Solver::SoA);
+	for(int k = 0; k < steps; ++k)
+		StepSoA();
+
+	float maxDiff = 0.0f;
+	for(int k = 0; k < mVertexCount; ++k)
+		maxDiff = std::max<float>(maxDiff, fabsf(mCurrHeights[k] - aosHeights[k]));
+
+	restore();
+	return maxDiff;
+}
+
+int Waves::TakeSteps()
+{
+	int steps = (int)(mAccumTime / mTimeStep);
+	mAccumTime -= steps*mTimeStep;
+
+	// Drop the time we cannot catch up on rather than falling further behind.
+	if(steps > MaxStepsPerUpdate)
+		steps = MaxStepsPerUpdate;
+
+	return steps;
+}
+
 void Waves::Update(float dt)
 {
-	static float t = 0;
+	WaitForAsync();
 
 	// Accumulate time.
-	t += dt;
+	mAccumTime += dt;
 
 	// Only update the simulation at the specified time step.
-	if( t >= mTimeStep )
+	int steps = TakeSteps();
+	if(steps == 0 && mPendingDisturbances.empty())
+		return;
+
+	// Nobody else is writing, so publish straight into the front solution.
+	Simulate(mPendingDisturbances, steps, mSolutions[mFrontSolution]);
+	mPendingDisturbances.clear();
+}
+
+void Waves::UpdateAsync(float dt)
+{
+	mAccumTime += dt;
+
+	if(mJobInFlight)
 	{
-		// Only update interior points; we use zero boundary conditions.
-		concurrency::parallel_for(1, mNumRows - 1, [this](int i)
-		//for(int i = 1; i < mNumRows-1; ++i)
-		{
-			for(int j = 1; j < mNumCols-1; ++j)
-			{
-				// After this update we will be discarding the old previous
-				// buffer, so overwrite that buffer with the new update.
-				// Note how we can do this inplace (read/write to same element) 
-				// because we won't need prev_ij again and the assignment happens last.
-
-				// Note j indexes x and i indexes z: h(x_j, z_i, t_k)
-				// Moreover, our +z axis goes "down"; this is just to 
-				// keep consistent with our row indices going down.
-
-				mPrevSolution[i*mNumCols+j].y = 
-					mK1*mPrevSolution[i*mNumCols+j].y +
-					mK2*mCurrSolution[i*mNumCols+j].y +
-					mK3*(mCurrSolution[(i+1)*mNumCols+j].y + 
-					     mCurrSolution[(i-1)*mNumCols+j].y + 
-					     mCurrSolution[i*mNumCols+j+1].y + 
-						 mCurrSolution[i*mNumCols+j-1].y);
-			}
-		});
+		if(!mJob.is_done())
+			return;
+
+		RetireJob();
+	}
+
+	int steps = TakeSteps();
+	if(steps == 0 && mPendingDisturbances.empty())
+		return;
 
-		// We just overwrote the previous buffer with the new data, so
-		// this data needs to become the current solution and the old
-		// current solution becomes the new previous solution.
-		std::swap(mPrevSolution, mCurrSolution);
+	// The job owns the simulation state and the back solution until it is retired.
+	Solution& back = mSolutions[1 - mFrontSolution];
+	std::vector<Disturbance> disturbances;
+	disturbances.swap(mPendingDisturbances);
 
-		t = 0.0f; // reset time
+	mJobInFlight = true;
+	mJob = concurrency::create_task([this, &back, disturbances, steps]()
+	{
+		Simulate(disturbances, steps, back);
+	});
+}
 
-		//
-		// Compute normals using finite difference scheme.
-		//
-		concurrency::parallel_for(1, mNumRows - 1, [this](int i)
-		//for(int i = 1; i < mNumRows - 1; ++i)
+void Waves::WaitForAsync()
+{
+	if(!mJobInFlight)
+		return;
+
+	mJob.wait();
+	RetireJob();
+}
+
+void Waves::RetireJob()
+{
+	// get() rethrows anything the job threw.
+	mJob.get();
+	mJobInFlight = false;
+
+	mFrontSolution = 1 - mFrontSolution;
+}
+
+void Waves::Simulate(const std::vector<Disturbance>& disturbances, int steps, Solution& out)
+{
+	for(const Disturbance& d : disturbances)
+		ApplyDisturbance(d);
+
+	for(int k = 0; k < steps; ++k)
+	{
+		if(mSolver == Solver::AoS)
+			StepAoS();
+		else
+			StepSoA();
+	}
+
+	Publish(out);
+}
+
+void Waves::Publish(Solution& out)
+{
+	if(mSolver == Solver::AoS)
+	{
+		std::copy(mCurrSolution.begin(), mCurrSolution.end(), out.Positions.begin());
+		std::copy(mNormals.begin(), mNormals.end(), out.Normals.begin());
+		std::copy(mTangentX.begin(), mTangentX.end(), out.TangentX.begin());
+	}
+	else
+	{
+		for(int i = 0; i < mNumRows; ++i)
 		{
-			for(int j = 1; j < mNumCols-1; ++j)
+			for(int j = 0; j < mNumCols; ++j)
 			{
-				float l = mCurrSolution[i*mNumCols+j-1].y;
-				float r = mCurrSolution[i*mNumCols+j+1].y;
-				float t = mCurrSolution[(i-1)*mNumCols+j].y;
-				float b = mCurrSolution[(i+1)*mNumCols+j].y;
-				mNormals[i*mNumCols+j].x = -r+l;
-				mNormals[i*mNumCols+j].y = 2.0f*mSpatialStep;
-				mNormals[i*mNumCols+j].z = b-t;
-
-				XMVECTOR n = XMVector3Normalize(XMLoadFloat3(&mNormals[i*mNumCols+j]));
-				XMStoreFloat3(&mNormals[i*mNumCols+j], n);
-
-				mTangentX[i*mNumCols+j] = XMFLOAT3(2.0f*mSpatialStep, r-l, 0.0f);
-				XMVECTOR T = XMVector3Normalize(XMLoadFloat3(&mTangentX[i*mNumCols+j]));
-				XMStoreFloat3(&mTangentX[i*mNumCols+j], T);
+				const int k = i*mNumCols + j;
+				out.Positions[k] = XMFLOAT3(mGridX[j], mCurrHeights[k], mGridZ[i]);
+				out.Normals[k] = XMFLOAT3(mNormalsX[k], mNormalsY[k], mNormalsZ[k]);
+				out.TangentX[k] = XMFLOAT3(mTangentsX[k], mTangentsY[k], 0.0f);
 			}
-		});
+		}
 	}
+
+	out.Version = mNextVersion++;
+}
+
+void Waves::StepAoS()
+{
+	// Only update interior points; we use zero boundary conditions.
+	concurrency::parallel_for(1, mNumRows - 1, [this](int i)
+	//for(int i = 1; i < mNumRows-1; ++i)
+	{
+		for(int j = 1; j < mNumCols-1; ++j)
+		{
+			// After this update we will be discarding the old previous
+			// buffer, so overwrite that buffer with the new update.
+			// Note how we can do this inplace (read/write to same element) 
+			// because we won't need prev_ij again and the assignment happens last.
+
+			// Note j indexes x and i indexes z: h(x_j, z_i, t_k)
+			// Moreover, our +z axis goes "down"; this is just to 
+			// keep consistent with our row indices going down.
+
+			mPrevSolution[i*mNumCols+j].y = 
+				mK1*mPrevSolution[i*mNumCols+j].y +
+				mK2*mCurrSolution[i*mNumCols+j].y +
+				mK3*(mCurrSolution[(i+1)*mNumCols+j].y + 
+				     mCurrSolution[(i-1)*mNumCols+j].y + 
+				     mCurrSolution[i*mNumCols+j+1].y + 
+					 mCurrSolution[i*mNumCols+j-1].y);
+		}
+	});
+
+	// We just overwrote the previous buffer with the new data, so
+	// this data needs to become the current solution and the old
+	// current solution becomes the new previous solution.
+	std::swap(mPrevSolution, mCurrSolution);
+
+	//
+	// Compute normals using finite difference scheme.
+	//
+	concurrency::parallel_for(1, mNumRows - 1, [this](int i)
+	//for(int i = 1; i < mNumRows - 1; ++i)
+	{
+		for(int j = 1; j < mNumCols-1; ++j)
+		{
+			float l = mCurrSolution[i*mNumCols+j-1].y;
+			float r = mCurrSolution[i*mNumCols+j+1].y;
+			float t = mCurrSolution[(i-1)*mNumCols+j].y;
+			float b = mCurrSolution[(i+1)*mNumCols+j].y;
+			mNormals[i*mNumCols+j].x = -r+l;
+			mNormals[i*mNumCols+j].y = 2.0f*mSpatialStep;
+			mNormals[i*mNumCols+j].z = b-t;
+
+			XMVECTOR n = XMVector3Normalize(XMLoadFloat3(&mNormals[i*mNumCols+j]));
+			XMStoreFloat3(&mNormals[i*mNumCols+j], n);
+
+			mTangentX[i*mNumCols+j] = XMFLOAT3(2.0f*mSpatialStep, r-l, 0.0f);
+			XMVECTOR T = XMVector3Normalize(XMLoadFloat3(&mTangentX[i*mNumCols+j]));
+			XMStoreFloat3(&mTangentX[i*mNumCols+j], T);
+		}
+	});
+}
+
+void Waves::StepSoA()
+{
+	const int n = mNumCols;
+	const int count = n - 2;
+
+	// Only update interior points; we use zero boundary conditions.
+	concurrency::parallel_for(1, mNumRows - 1, [this, n, count](int i)
+	{
+		UpdateHeightsRow(
+			&mPrevHeights[i*n + 1],
+			&mCurrHeights[i*n + 1],
+			&mCurrHeights[(i - 1)*n + 1],
+			&mCurrHeights[(i + 1)*n + 1],
+			count, mK1, mK2, mK3);
+	});
+
+	// The previous buffer now holds the new solution.
+	std::swap(mPrevHeights, mCurrHeights);
+
+	const float twoDx = 2.0f*mSpatialStep;
+	concurrency::parallel_for(1, mNumRows - 1, [this, n, count, twoDx](int i)
+	{
+		const int k = i*n + 1;
+		UpdateNormalsRow(
+			&mCurrHeights[k],
+			&mCurrHeights[k - n],
+			&mCurrHeights[k + n],
+			&mNormalsX[k], &mNormalsY[k], &mNormalsZ[k],
+			&mTangentsX[k], &mTangentsY[k],
+			count, twoDx);
+	});
 }
 
 void Waves::Disturb(int i, int j, float magnitude)
@@ -160,8 +560,31 @@ void Waves::Disturb(int i, int j, float magnitude)
 	assert(i > 1 && i < mNumRows-2);
 	assert(j > 1 && j < mNumCols-2);
 
+	Disturbance d;
+	d.I = i;
+	d.J = j;
+	d.Magnitude = magnitude;
+	mPendingDisturbances.push_back(d);
+}
+
+void Waves::ApplyDisturbance(const Disturbance& d)
+{
+	const int i = d.I;
+	const int j = d.J;
+	const float magnitude = d.Magnitude;
+
 	float halfMag = 0.5f*magnitude;
 
+	if(mSolver == Solver::SoA)
+	{
+		mCurrHeights[i*mNumCols+j]     += magnitude;
+		mCurrHeights[i*mNumCols+j+1]   += halfMag;
+		mCurrHeights[i*mNumCols+j-1]   += halfMag;
+		mCurrHeights[(i+1)*mNumCols+j] += halfMag;
+		mCurrHeights[(i-1)*mNumCols+j] += halfMag;
+		return;
+	}
+
 	// Disturb the ijth vertex height and its neighbors.
 	mCurrSolution[i*mNumCols+j].y     += magnitude;
 	mCurrSolution[i*mNumCols+j+1].y   += halfMag;
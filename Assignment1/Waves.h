@@ -4,17 +4,32 @@
 // Performs the calculations for the wave simulation.  After the simulation has been
 // updated, the client must copy the current solution into vertex buffers for rendering.
 // This class only does the calculations, it does not do any drawing.
+//
+// The simulation advances in fixed time steps.  UpdateAsync runs the steps on a
+// background task and publishes into a double-buffered solution, so readers only
+// ever see the latest finished solution and the render thread never waits.
 //***************************************************************************************
 
 #ifndef WAVES_H
 #define WAVES_H
 
 #include <vector>
+#include <cstdint>
 #include <DirectXMath.h>
+#include <ppltasks.h>
 
 class Waves
 {
 public:
+	// AoS is the original XMFLOAT3-per-vertex layout.  SoA keeps the heights,
+	// normals and tangents in separate float arrays and runs SSE/AVX kernels over
+	// them.  Both solve the same equations, so their output can be diffed.
+	enum class Solver
+	{
+		AoS,
+		SoA
+	};
+
     Waves(int m, int n, float dx, float dt, float speed, float damping);
     Waves(const Waves& rhs) = delete;
     Waves& operator=(const Waves& rhs) = delete;
@@ -28,17 +43,75 @@ public:
 	float Depth()const;
 
 	// Returns the solution at the ith grid point.
-    const DirectX::XMFLOAT3& Position(int i)const { return mCurrSolution[i]; }
+	const DirectX::XMFLOAT3& Position(int i)const { return mSolutions[mFrontSolution].Positions[i]; }
 
 	// Returns the solution normal at the ith grid point.
-    const DirectX::XMFLOAT3& Normal(int i)const { return mNormals[i]; }
+	const DirectX::XMFLOAT3& Normal(int i)const { return mSolutions[mFrontSolution].Normals[i]; }
 
 	// Returns the unit tangent vector at the ith grid point in the local x-axis direction.
-    const DirectX::XMFLOAT3& TangentX(int i)const { return mTangentX[i]; }
+	const DirectX::XMFLOAT3& TangentX(int i)const { return mSolutions[mFrontSolution].TangentX[i]; }
+
+	// Incremented every time a new solution is published; lets clients skip
+	// re-uploading a solution they already have.
+	std::uint64_t SolutionVersion()const { return mSolutions[mFrontSolution].Version; }
+
+	Solver GetSolver()const;
+
+	// Switches the layout the simulation runs in; the current state is converted
+	// so the waves carry on where they were.  Waits for a running job first.
+	void SetSolver(Solver solver);
+
+	// Runs steps time steps from the current state with each solver and returns the
+	// largest height difference between the two results.  The simulation itself does
+	// not advance.  Waits for a running job first.
+	float CompareSolvers(int steps);
+
+	// Writes the current solution straight into a vertex array (typically mapped
+	// upload memory).  VertexT needs Pos, Normal and TexC members; tex-coords are
+	// derived from position by mapping [-w/2,w/2] --> [0,1].
+	template<typename VertexT>
+	void CopyVertices(VertexT* dst)const;
 
+	// Advances the simulation by every whole time step accumulated, on the calling thread.
 	void Update(float dt);
+
+	// Same as Update, but the steps run on a background task.  If the previous job is
+	// still running, dt is only accumulated and the job is picked up by a later call.
+	void UpdateAsync(float dt);
+
+	// Blocks until the job in flight (if any) has published its solution.
+	void WaitForAsync();
+
+	// Disturbances are queued and applied before the next batch of steps.
 	void Disturb(int i, int j, float magnitude);
 
+private:
+	struct Disturbance
+	{
+		int I;
+		int J;
+		float Magnitude;
+	};
+
+	// Output of the simulation in the layout the renderer consumes.
+	struct Solution
+	{
+		std::vector<DirectX::XMFLOAT3> Positions;
+		std::vector<DirectX::XMFLOAT3> Normals;
+		std::vector<DirectX::XMFLOAT3> TangentX;
+		std::uint64_t Version = 0;
+	};
+
+	// Consumes the accumulated time and returns the number of steps to take.
+	int TakeSteps();
+	void Simulate(const std::vector<Disturbance>& disturbances, int steps, Solution& out);
+	void ApplyDisturbance(const Disturbance& d);
+	void Publish(Solution& out);
+	void RetireJob();
+
+	void StepAoS();
+	void StepSoA();
+
 private:
     int mNumRows = 0;
     int mNumCols = 0;
@@ -54,10 +127,58 @@ private:
     float mTimeStep = 0.0f;
     float mSpatialStep = 0.0f;
 
+	// Fixed-step accumulator; never more than MaxStepsPerUpdate are taken at once
+	// so a long frame cannot snowball into even longer ones.
+	static const int MaxStepsPerUpdate = 4;
+	float mAccumTime = 0.0f;
+
+	std::vector<Disturbance> mPendingDisturbances;
+
+	// mSolutions[mFrontSolution] is what the accessors read.  A background job only
+	// writes the other one, and the two are flipped once the job has finished.
+	Solution mSolutions[2];
+	int mFrontSolution = 0;
+	std::uint64_t mNextVersion = 1;
+
+	concurrency::task<void> mJob;
+	bool mJobInFlight = false;
+
     std::vector<DirectX::XMFLOAT3> mPrevSolution;
     std::vector<DirectX::XMFLOAT3> mCurrSolution;
     std::vector<DirectX::XMFLOAT3> mNormals;
     std::vector<DirectX::XMFLOAT3> mTangentX;
+
+	Solver mSolver = Solver::AoS;
+
+	// SoA state.  The x/z positions never change, so only one value per column
+	// and per row is kept.
+	std::vector<float> mGridX;
+	std::vector<float> mGridZ;
+	std::vector<float> mPrevHeights;
+	std::vector<float> mCurrHeights;
+	std::vector<float> mNormalsX;
+	std::vector<float> mNormalsY;
+	std::vector<float> mNormalsZ;
+	std::vector<float> mTangentsX;
+	std::vector<float> mTangentsY;
 };
 
+template<typename VertexT>
+void Waves::CopyVertices(VertexT* dst)const
+{
+	const float invWidth = 1.0f / Width();
+	const float invDepth = 1.0f / Depth();
+
+	const Solution& s = mSolutions[mFrontSolution];
+	for(int i = 0; i < mVertexCount; ++i)
+	{
+		const DirectX::XMFLOAT3& p = s.Positions[i];
+
+		dst[i].Pos = p;
+		dst[i].Normal = s.Normals[i];
+		dst[i].TexC.x = 0.5f + p.x*invWidth;
+		dst[i].TexC.y = 0.5f - p.z*invDepth;
+	}
+}
+
 #endif // WAVES_H
\ No newline at end of file
@@ -21,9 +21,12 @@
 #include <assert.h>
 #include <algorithm>
 #include <memory>
+#include <vector>
 #include <wrl.h>
 
 #include "DDSTextureLoader.h" 
+#include "GpuAllocator.h"
+#include "StagingRing.h"
 
 using namespace Microsoft::WRL;
 
@@ -130,6 +133,10 @@ typedef public std::unique_ptr<void, handle_closer> ScopedHandle;
 
 inline HANDLE safe_handle( HANDLE h ) { return (h == INVALID_HANDLE_VALUE) ? 0 : h; }
 
+struct view_unmapper { void operator()(const void* p) { if (p) UnmapViewOfFile(p); } };
+
+typedef public std::unique_ptr<const uint8_t, view_unmapper> ScopedView;
+
 template<UINT TNameLength>
 inline void SetDebugObjectName(_In_ ID3D11DeviceChild* resource, _In_ const char (&name)[TNameLength])
 {
@@ -268,6 +275,75 @@ static HRESULT LoadTextureDataFromFile( _In_z_ const wchar_t* fileName,
     return S_OK;
 }
 
+//--------------------------------------------------------------------------------------
+// Maps the whole file read-only.  The texture data is then copied straight from the
+// view into the upload heap, without an intermediate heap copy of the file.
+static HRESULT MapTextureFile( _In_z_ const wchar_t* fileName,
+                               ScopedView& ddsView,
+                               size_t* ddsDataSize
+                             )
+{
+    if (!ddsDataSize)
+    {
+        return E_POINTER;
+    }
+
+#if (_WIN32_WINNT >= _WIN32_WINNT_WIN8)
+    ScopedHandle hFile( safe_handle( CreateFile2( fileName,
+                                                  GENERIC_READ,
+                                                  FILE_SHARE_READ,
+                                                  OPEN_EXISTING,
+                                                  nullptr ) ) );
+#else
+    ScopedHandle hFile( safe_handle( CreateFileW( fileName,
+                                                  GENERIC_READ,
+                                                  FILE_SHARE_READ,
+                                                  nullptr,
+                                                  OPEN_EXISTING,
+                                                  FILE_ATTRIBUTE_NORMAL,
+                                                  nullptr ) ) );
+#endif
+
+    if ( !hFile )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    LARGE_INTEGER FileSize = { 0 };
+    if ( !GetFileSizeEx( hFile.get(), &FileSize ) )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    // Same limits as LoadTextureDataFromFile
+    if (FileSize.HighPart > 0)
+    {
+        return E_FAIL;
+    }
+
+    if (FileSize.LowPart < ( sizeof(DDS_HEADER) + sizeof(uint32_t) ) )
+    {
+        return E_FAIL;
+    }
+
+    // The view keeps the mapping alive once both handles are closed
+    ScopedHandle hMapping( CreateFileMappingW( hFile.get(), nullptr, PAGE_READONLY, 0, 0, nullptr ) );
+    if ( !hMapping )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    ddsView.reset( static_cast<const uint8_t*>( MapViewOfFile( hMapping.get(), FILE_MAP_READ, 0, 0, 0 ) ) );
+    if ( !ddsView )
+    {
+        return HRESULT_FROM_WIN32( GetLastError() );
+    }
+
+    *ddsDataSize = FileSize.LowPart;
+
+    return S_OK;
+}
+
 
 //--------------------------------------------------------------------------------------
 // Return the BPP for a particular format
@@ -1240,8 +1316,12 @@ static HRESULT CreateD3DResources12(
 	_In_ bool forceSRGB,
 	_In_ bool isCubeMap,
 	_In_reads_opt_(mipCount*arraySize) D3D12_SUBRESOURCE_DATA* initData,
+	_In_ size_t firstMip,
+	_In_ size_t uploadMips,
 	ComPtr<ID3D12Resource>& texture,
-	ComPtr<ID3D12Resource>& textureUploadHeap
+	ComPtr<ID3D12Resource>& textureUploadHeap,
+	_In_ D3D12_RESOURCE_STATES afterState,
+	_In_opt_ StagingRing* staging
 	)
 {
 	if (device == nullptr)
@@ -1250,33 +1330,48 @@ static HRESULT CreateD3DResources12(
 	if (forceSRGB)
 		format = MakeSRGB(format);
 
+	// Only mips [firstMip, firstMip + uploadMips) of every slice are copied.
+	if (firstMip >= mipCount)
+		firstMip = mipCount - 1;
+	if (uploadMips > mipCount - firstMip)
+		uploadMips = mipCount - firstMip;
+
 	HRESULT hr = E_FAIL;
 	switch (resDim)
 	{
 	case D3D12_RESOURCE_DIMENSION_TEXTURE2D:
 	{
-		D3D12_RESOURCE_DESC texDesc;
-		ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
-		texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
-		texDesc.Alignment = 0;
-		texDesc.Width = width;
-		texDesc.Height = (uint32_t)height;
-		texDesc.DepthOrArraySize = (depth > 1) ? (uint16_t)depth : (uint16_t)arraySize;
-		texDesc.MipLevels = (uint16_t)mipCount;
-		texDesc.Format = format;
-		texDesc.SampleDesc.Count = 1;
-		texDesc.SampleDesc.Quality = 0;
-		texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
-		texDesc.Flags = D3D12_RESOURCE_FLAG_NONE;
-
-		hr = device->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-			D3D12_HEAP_FLAG_NONE,
-			&texDesc,
-			D3D12_RESOURCE_STATE_COMMON,
-			nullptr,
-			IID_PPV_ARGS(&texture)
-			);
+		// A texture passed in was created by an earlier call, which uploaded its other
+		// mips, and may be in use; it is kept even if this upload fails.
+		const bool created = !texture;
+		if (created)
+		{
+			D3D12_RESOURCE_DESC texDesc;
+			ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
+			texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+			texDesc.Alignment = 0;
+			texDesc.Width = width;
+			texDesc.Height = (uint32_t)height;
+			texDesc.DepthOrArraySize = (depth > 1) ? (uint16_t)depth : (uint16_t)arraySize;
+			texDesc.MipLevels = (uint16_t)mipCount;
+			texDesc.Format = format;
+			texDesc.SampleDesc.Count = 1;
+			texDesc.SampleDesc.Quality = 0;
+			texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+			texDesc.Flags = D3D12_RESOURCE_FLAG_NONE;
+
+			hr = CreateGpuResource(device,
+				D3D12_HEAP_TYPE_DEFAULT,
+				&texDesc,
+				D3D12_RESOURCE_STATE_COMMON,
+				nullptr,
+				IID_PPV_ARGS(&texture)
+				);
+		}
+		else
+		{
+			hr = S_OK;
+		}
 
 		if (FAILED(hr))
 		{
@@ -1285,31 +1380,78 @@ static HRESULT CreateD3DResources12(
 		}
 		else
 		{
-			const UINT num2DSubresources = texDesc.DepthOrArraySize * texDesc.MipLevels;
-			const UINT64 uploadBufferSize = GetRequiredIntermediateSize(texture.Get(), 0, num2DSubresources);
-
-			hr = device->CreateCommittedResource(
-				&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
-				D3D12_HEAP_FLAG_NONE,
+			const UINT mipLevels = (UINT)mipCount;
+			const UINT sliceCount = texture->GetDesc().DepthOrArraySize;
+
+			// A slice's mips are consecutive subresources, so each slice is one
+			// UpdateSubresources call at its own aligned offset of the upload memory.
+			const UINT64 sliceUploadSize = (GetRequiredIntermediateSize(texture.Get(), (UINT)firstMip, (UINT)uploadMips)
+				+ D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT - 1) & ~(UINT64)(D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT - 1);
+			const UINT64 uploadBufferSize = sliceUploadSize * sliceCount;
+
+			// With a staging ring the upload memory is suballocated and recycled by the
+			// ring, and textureUploadHeap is left empty.
+			ID3D12Resource* intermediate = nullptr;
+			UINT64 intermediateOffset = 0;
+			if (staging)
+			{
+				StagingRing::Allocation upload = staging->Allocate(cmdList, uploadBufferSize);
+				intermediate = upload.Resource;
+				intermediateOffset = upload.Offset;
+				hr = S_OK;
+			}
+			else
+			{
+				hr = CreateGpuResource(device,
+				D3D12_HEAP_TYPE_UPLOAD,
 				&CD3DX12_RESOURCE_DESC::Buffer(uploadBufferSize),
 				D3D12_RESOURCE_STATE_GENERIC_READ,
 				nullptr,
 				IID_PPV_ARGS(&textureUploadHeap));
+				intermediate = textureUploadHeap.Get();
+			}
 			if (FAILED(hr))
 			{
-				texture = nullptr;
+				if (created)
+					texture = nullptr;
 				return hr;
 			}
 			else
 			{
-				cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
-					D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST));
+				// Only the copied subresources change state; the others may be in use
+				// by another queue.
+				std::vector<D3D12_RESOURCE_BARRIER> barriers;
+				barriers.reserve(sliceCount * uploadMips);
+				for (UINT slice = 0; slice < sliceCount; ++slice)
+				{
+					for (UINT mip = (UINT)firstMip; mip < firstMip + uploadMips; ++mip)
+					{
+						barriers.push_back(CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
+							D3D12_RESOURCE_STATE_COMMON, D3D12_RESOURCE_STATE_COPY_DEST,
+							D3D12CalcSubresource(mip, slice, 0, mipLevels, sliceCount)));
+					}
+				}
+				cmdList->ResourceBarrier((UINT)barriers.size(), barriers.data());
 
 				// Use Heap-allocating UpdateSubresources implementation for variable number of subresources (which is the case for textures).
-				UpdateSubresources(cmdList, texture.Get(), textureUploadHeap.Get(), 0, 0, num2DSubresources, initData);
+				for (UINT slice = 0; slice < sliceCount; ++slice)
+				{
+					UINT firstSubresource = D3D12CalcSubresource((UINT)firstMip, slice, 0, mipLevels, sliceCount);
+					UpdateSubresources(cmdList, texture.Get(), intermediate, intermediateOffset + slice * sliceUploadSize,
+						firstSubresource, (UINT)uploadMips, initData + firstSubresource);
+				}
 
-				cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(texture.Get(),
-					D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE));
+				// Copy command lists cannot transition to shader resource states; they
+				// pass COMMON and let the consuming queue promote the texture.
+				if (afterState != D3D12_RESOURCE_STATE_COPY_DEST)
+				{
+					for (auto& barrier : barriers)
+					{
+						barrier.Transition.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST;
+						barrier.Transition.StateAfter = afterState;
+					}
+					cmdList->ResourceBarrier((UINT)barriers.size(), barriers.data());
+				}
 			}
 		}
 	} break;
@@ -1677,8 +1819,12 @@ static HRESULT CreateTextureFromDDS12(
 	_In_ size_t bitSize,
 	_In_ size_t maxsize,
 	_In_ bool forceSRGB,
+	_In_ size_t firstMip,
+	_In_ size_t uploadMips,
 	ComPtr<ID3D12Resource>& texture,
-	ComPtr<ID3D12Resource>& textureUploadHeap)
+	ComPtr<ID3D12Resource>& textureUploadHeap,
+	_In_ D3D12_RESOURCE_STATES afterState,
+	_In_opt_ StagingRing* staging)
 {
 	HRESULT hr = S_OK;
 
@@ -1866,8 +2012,12 @@ static HRESULT CreateTextureFromDDS12(
 			false, // forceSRGB
 			isCubeMap,
 			initData.get(),
+			firstMip,
+			uploadMips,
 			texture, 
-			textureUploadHeap);
+			textureUploadHeap,
+			afterState,
+			staging);
 	}
 
 	return hr;
@@ -1918,25 +2068,23 @@ HRESULT DirectX::CreateDDSTextureFromMemory( ID3D11Device* d3dDevice,
 }
 
 _Use_decl_annotations_
-HRESULT DirectX::CreateDDSTextureFromMemory12(
+// Validates the headers and uploads mips [firstMip, firstMip + uploadMips) of ddsData,
+// which may be a mapped view of the file.
+static HRESULT CreateTextureFromMemory12(
 	ID3D12Device* device,
 	_In_ ID3D12GraphicsCommandList* cmdList,
 	_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
 	_In_ size_t ddsDataSize,
+	_In_ size_t maxsize,
+	_Out_opt_ DDS_ALPHA_MODE* alphaMode,
+	_In_ size_t firstMip,
+	_In_ size_t uploadMips,
 	ComPtr<ID3D12Resource>& texture,
 	ComPtr<ID3D12Resource>& textureUploadHeap,
-	_In_ size_t maxsize,
-	_Out_opt_ DDS_ALPHA_MODE* alphaMode
+	_In_ D3D12_RESOURCE_STATES afterState,
+	_In_opt_ StagingRing* staging
 	)
 {
-	if (alphaMode)
-		(*alphaMode) = DDS_ALPHA_MODE_UNKNOWN;
-
-	if (!device || !cmdList || !ddsData || !ddsDataSize)
-	{
-		return E_INVALIDARG;
-	}
-
 	uint32_t dwMagicNumber = *(const uint32_t*)(ddsData);
 	if (dwMagicNumber != DDS_MAGIC)
 	{
@@ -1978,8 +2126,12 @@ HRESULT DirectX::CreateDDSTextureFromMemory12(
 		ddsDataSize - offset,
 		maxsize,
 		false,
+		firstMip,
+		uploadMips,
 		texture,
-		textureUploadHeap
+		textureUploadHeap,
+		afterState,
+		staging
 		);
 
 	if (SUCCEEDED(hr))
@@ -1991,6 +2143,31 @@ HRESULT DirectX::CreateDDSTextureFromMemory12(
 	return hr;
 }
 
+HRESULT DirectX::CreateDDSTextureFromMemory12(
+	ID3D12Device* device,
+	_In_ ID3D12GraphicsCommandList* cmdList,
+	_In_reads_bytes_(ddsDataSize) const uint8_t* ddsData,
+	_In_ size_t ddsDataSize,
+	ComPtr<ID3D12Resource>& texture,
+	ComPtr<ID3D12Resource>& textureUploadHeap,
+	_In_ size_t maxsize,
+	_Out_opt_ DDS_ALPHA_MODE* alphaMode,
+	_In_ D3D12_RESOURCE_STATES afterState,
+	_In_opt_ StagingRing* staging
+	)
+{
+	if (alphaMode)
+		(*alphaMode) = DDS_ALPHA_MODE_UNKNOWN;
+
+	if (!device || !cmdList || !ddsData || !ddsDataSize)
+	{
+		return E_INVALIDARG;
+	}
+
+	return CreateTextureFromMemory12(device, cmdList, ddsData, ddsDataSize, maxsize, alphaMode,
+		0, (size_t)-1, texture, textureUploadHeap, afterState, staging);
+}
+
 _Use_decl_annotations_
 HRESULT DirectX::CreateDDSTextureFromMemory( ID3D11Device* d3dDevice,
                                              ID3D11DeviceContext* d3dContext,
@@ -2140,7 +2317,8 @@ HRESULT DirectX::CreateDDSTextureFromFile12(_In_ ID3D12Device* device,
 	_Out_ ComPtr<ID3D12Resource>& texture,
 	_Out_ ComPtr<ID3D12Resource>& textureUploadHeap,
 	_In_ size_t maxsize,
-	_Out_opt_ DDS_ALPHA_MODE* alphaMode)
+	_Out_opt_ DDS_ALPHA_MODE* alphaMode,
+	_In_opt_ StagingRing* staging)
 {
 	if (texture)
 	{
@@ -2155,24 +2333,21 @@ HRESULT DirectX::CreateDDSTextureFromFile12(_In_ ID3D12Device* device,
 		*alphaMode = DDS_ALPHA_MODE_UNKNOWN;
 	}
 
-	if (!device || !szFileName)
+	if (!device || !cmdList || !szFileName)
 	{
 		return E_INVALIDARG;
 	}
 
-	DDS_HEADER* header = nullptr;
-	uint8_t* bitData = nullptr;
-	size_t bitSize = 0;
-
-	std::unique_ptr<uint8_t[]> ddsData;
-	HRESULT hr = LoadTextureDataFromFile(szFileName, ddsData, &header, &bitData, &bitSize);
+	ScopedView ddsView;
+	size_t ddsDataSize = 0;
+	HRESULT hr = MapTextureFile(szFileName, ddsView, &ddsDataSize);
 	if (FAILED(hr))
 	{
 		return hr;
 	}
 
-	hr = CreateTextureFromDDS12(device, cmdList, header,
-		bitData, bitSize, maxsize, false, texture, textureUploadHeap);
+	hr = CreateTextureFromMemory12(device, cmdList, ddsView.get(), ddsDataSize, maxsize, alphaMode,
+		0, (size_t)-1, texture, textureUploadHeap, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE, staging);
 
 	if (SUCCEEDED(hr))
 	{
@@ -2221,13 +2396,43 @@ HRESULT DirectX::CreateDDSTextureFromFile12(_In_ ID3D12Device* device,
 		}
 #endif
 */
-		if (alphaMode)
-			*alphaMode = GetAlphaMode(header);
 	}
 
 	return hr;
 }
 
+HRESULT DirectX::LoadDDSTextureMipsFromFile12(_In_ ID3D12Device* device,
+	_In_ ID3D12GraphicsCommandList* cmdList,
+	_In_z_ const wchar_t* szFileName,
+	_In_ size_t firstMip,
+	_In_ size_t mipLevels,
+	_Inout_ ComPtr<ID3D12Resource>& texture,
+	_Out_ ComPtr<ID3D12Resource>& textureUploadHeap,
+	_In_ D3D12_RESOURCE_STATES afterState,
+	_In_opt_ StagingRing* staging)
+{
+	if (textureUploadHeap)
+	{
+		textureUploadHeap = nullptr;
+	}
+
+	if (!device || !cmdList || !szFileName || !mipLevels)
+	{
+		return E_INVALIDARG;
+	}
+
+	ScopedView ddsView;
+	size_t ddsDataSize = 0;
+	HRESULT hr = MapTextureFile(szFileName, ddsView, &ddsDataSize);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	return CreateTextureFromMemory12(device, cmdList, ddsView.get(), ddsDataSize, 0, nullptr,
+		firstMip, mipLevels, texture, textureUploadHeap, afterState, staging);
+}
+
 _Use_decl_annotations_
 HRESULT DirectX::CreateDDSTextureFromFile( ID3D11Device* d3dDevice,
                                            ID3D11DeviceContext* d3dContext,
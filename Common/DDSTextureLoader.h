@@ -32,6 +32,8 @@
 
 #pragma warning(pop)
 
+class StagingRing;
+
 #if defined(_MSC_VER) && (_MSC_VER<1610) && !defined(_In_reads_)
 #define _In_reads_(exp)
 #define _Out_writes_(exp)
@@ -72,7 +74,9 @@ namespace DirectX
 		                                 _Out_ Microsoft::WRL::ComPtr<ID3D12Resource>& texture,
 		                                 _Out_ Microsoft::WRL::ComPtr<ID3D12Resource>& textureUploadHeap,
 		                                 _In_ size_t maxsize = 0,
-		                                 _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr
+		                                 _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr,
+		                                 _In_ D3D12_RESOURCE_STATES afterState = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
+		                                 _In_opt_ StagingRing* staging = nullptr
 		                                 );
 
     HRESULT CreateDDSTextureFromFile( _In_ ID3D11Device* d3dDevice,
@@ -89,9 +93,26 @@ namespace DirectX
 		                               _Out_ Microsoft::WRL::ComPtr<ID3D12Resource>& texture,
 		                               _Out_ Microsoft::WRL::ComPtr<ID3D12Resource>& textureUploadHeap,
 		                               _In_ size_t maxsize = 0,
-		                               _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr
+		                               _Out_opt_ DDS_ALPHA_MODE* alphaMode = nullptr,
+		                               _In_opt_ StagingRing* staging = nullptr
 		                               );
 
+	// Memory-maps the file and uploads mips [firstMip, firstMip + mipLevels) of every
+	// array slice, creating texture with the file's full mip chain if it is null.
+	// firstMip is clamped to the last mip and mipLevels to the mips after firstMip, so
+	// a streamer can upload the mip tail first and fill in the top mips by a later call
+	// on the same texture.  The subresources uploaded must be in COMMON.
+	HRESULT LoadDDSTextureMipsFromFile12(_In_ ID3D12Device* device,
+		                                 _In_ ID3D12GraphicsCommandList* cmdList,
+		                                 _In_z_ const wchar_t* szFileName,
+		                                 _In_ size_t firstMip,
+		                                 _In_ size_t mipLevels,
+		                                 _Inout_ Microsoft::WRL::ComPtr<ID3D12Resource>& texture,
+		                                 _Out_ Microsoft::WRL::ComPtr<ID3D12Resource>& textureUploadHeap,
+		                                 _In_ D3D12_RESOURCE_STATES afterState = D3D12_RESOURCE_STATE_COMMON,
+		                                 _In_opt_ StagingRing* staging = nullptr
+		                                 );
+
     // Standard version with optional auto-gen mipmap support
     HRESULT CreateDDSTextureFromMemory( _In_ ID3D11Device* d3dDevice,
                                         _In_opt_ ID3D11DeviceContext* d3dContext,
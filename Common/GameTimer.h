@@ -18,9 +18,21 @@ public:
 	void Stop();  // Call when paused.
 	void Tick();  // Call every frame.
 
+	// With a step > 0, every Tick advances the clock by exactly that many seconds
+	// regardless of the real time, e.g. for reproducible benchmark runs; 0 restores
+	// the real clock.
+	void SetFixedStep(double seconds);
+
+	// Raw performance counter reading, and its period, for timing code sections
+	// on the same clock as the frame timer.
+	static __int64 Counter();
+	double SecondsPerCount()const;
+
 private:
 	double mSecondsPerCount;
 	double mDeltaTime;
+	double mFixedStep;
+	double mFixedTime;
 
 	__int64 mBaseTime;
 	__int64 mPausedTime;
@@ -0,0 +1,343 @@
+//***************************************************************************************
+// GpuAllocator.cpp
+//***************************************************************************************
+
+#include "GpuAllocator.h"
+
+using Microsoft::WRL::ComPtr;
+
+GpuAllocator* gGpuAllocator = nullptr;
+
+namespace
+{
+	// Private data slot of a resource holding its GpuAllocator::Allocation.
+	// {4C1E7B52-93A6-4F0D-8B27-E05A19D3C6F4}
+	const GUID AllocationGuid =
+		{ 0x4c1e7b52, 0x93a6, 0x4f0d, { 0x8b, 0x27, 0xe0, 0x5a, 0x19, 0xd3, 0xc6, 0xf4 } };
+}
+
+// Owned by the resource through its private data; returns the heap block, if placed,
+// when the resource is destroyed and releases its last reference.
+class GpuAllocator::Allocation final : public IUnknown
+{
+public:
+	Allocation(GpuAllocator* owner, Heap* heap, UINT64 offset, UINT order, UINT64 requestedBytes, Kind kind)
+		: mOwner(owner), mHeap(heap), mOffset(offset), mOrder(order), mRequestedBytes(requestedBytes), mKind(kind)
+	{
+	}
+
+	HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
+	{
+		if(object == nullptr)
+			return E_POINTER;
+
+		if(riid == __uuidof(IUnknown))
+		{
+			*object = static_cast<IUnknown*>(this);
+			AddRef();
+			return S_OK;
+		}
+
+		*object = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	ULONG STDMETHODCALLTYPE AddRef() override
+	{
+		return (ULONG)InterlockedIncrement(&mRefCount);
+	}
+
+	ULONG STDMETHODCALLTYPE Release() override
+	{
+		ULONG refCount = (ULONG)InterlockedDecrement(&mRefCount);
+		if(refCount == 0)
+		{
+			mOwner->Free(mHeap, mOffset, mOrder, mRequestedBytes, mKind);
+			delete this;
+		}
+		return refCount;
+	}
+
+private:
+	volatile LONG mRefCount = 1;
+
+	GpuAllocator* mOwner;
+	Heap* mHeap;
+	UINT64 mOffset;
+	UINT mOrder;
+	UINT64 mRequestedBytes;
+	Kind mKind;
+};
+
+GpuAllocator::GpuAllocator(ID3D12Device* device, UINT64 heapSize)
+	: md3dDevice(device), mHeapSize(heapSize)
+{
+	// The heap has to be a power-of-two number of blocks for the buddy scheme.
+	while((MinBlockSize << mMaxOrder) < mHeapSize)
+		++mMaxOrder;
+	mHeapSize = MinBlockSize << mMaxOrder;
+
+	mPools[0].Type = D3D12_HEAP_TYPE_DEFAULT;
+	mPools[0].Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+	mPools[1].Type = D3D12_HEAP_TYPE_DEFAULT;
+	mPools[1].Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_NON_RT_DS_TEXTURES;
+	mPools[2].Type = D3D12_HEAP_TYPE_UPLOAD;
+	mPools[2].Flags = D3D12_HEAP_FLAG_ALLOW_ONLY_BUFFERS;
+}
+
+HRESULT GpuAllocator::CreateResource(
+	D3D12_HEAP_TYPE heapType,
+	const D3D12_RESOURCE_DESC* desc,
+	D3D12_RESOURCE_STATES initialState,
+	const D3D12_CLEAR_VALUE* optimizedClearValue,
+	REFIID riid,
+	void** resource)
+{
+	Pool* pool = FindPool(heapType, *desc);
+	if(pool == nullptr)
+		return CreateCommitted(heapType, desc, initialState, optimizedClearValue, riid, resource);
+
+	D3D12_RESOURCE_ALLOCATION_INFO info = md3dDevice->GetResourceAllocationInfo(0, 1, desc);
+	if(info.SizeInBytes == UINT64_MAX)
+		return E_INVALIDARG;
+
+	// Buddy blocks are aligned to their own size, which covers any alignment up to it.
+	UINT64 blockBytes = std::max<UINT64>(info.SizeInBytes, info.Alignment);
+	UINT order = 0;
+	while((MinBlockSize << order) < blockBytes)
+		++order;
+	if(order > mMaxOrder)
+		return CreateCommitted(heapType, desc, initialState, optimizedClearValue, riid, resource);
+
+	Heap* heap = nullptr;
+	UINT64 offset = 0;
+	bool allocated = false;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		allocated = AllocateBlock(*pool, order, heap, offset);
+		if(allocated)
+		{
+			++mPlacedCount;
+			mAllocatedBytes += MinBlockSize << order;
+			mRequestedBytes += info.SizeInBytes;
+			mKindBytes[KindOf(heapType, *desc)] += info.SizeInBytes;
+		}
+	}
+
+	// No heap could be created for the block, but a committed resource needs no more
+	// than its own size and may still fit.
+	if(!allocated)
+		return CreateCommitted(heapType, desc, initialState, optimizedClearValue, riid, resource);
+
+	ComPtr<ID3D12Resource> placed;
+	HRESULT hr = md3dDevice->CreatePlacedResource(heap->Resource.Get(), offset, desc,
+		initialState, optimizedClearValue, IID_PPV_ARGS(&placed));
+
+	// From here on the allocation object owns the block; releasing it frees it.
+	ComPtr<IUnknown> allocation;
+	allocation.Attach(new Allocation(this, heap, offset, order, info.SizeInBytes, KindOf(heapType, *desc)));
+
+	if(SUCCEEDED(hr))
+		hr = placed->SetPrivateDataInterface(AllocationGuid, allocation.Get());
+	if(FAILED(hr))
+		return hr;
+
+	return placed->QueryInterface(riid, resource);
+}
+
+void GpuAllocator::SetTexturesCommitted(bool committed)
+{
+	mTexturesCommitted = committed;
+}
+
+GpuAllocator::Kind GpuAllocator::KindOf(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC& desc)
+{
+	if(heapType != D3D12_HEAP_TYPE_DEFAULT)
+		return UploadKind;
+	return desc.Dimension == D3D12_RESOURCE_DIMENSION_BUFFER ? BufferKind : TextureKind;
+}
+
+GpuAllocator::Pool* GpuAllocator::FindPool(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC& desc)
+{
+	if(desc.Dimension == D3D12_RESOURCE_DIMENSION_BUFFER)
+	{
+		if(heapType == D3D12_HEAP_TYPE_DEFAULT)
+			return &mPools[0];
+		if(heapType == D3D12_HEAP_TYPE_UPLOAD)
+			return &mPools[2];
+		return nullptr;
+	}
+
+	// Render targets and depth buffers are few, large, and need their own
+	// initialization when placed; keep them committed.
+	const D3D12_RESOURCE_FLAGS targetFlags =
+		D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET | D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL;
+	if(heapType == D3D12_HEAP_TYPE_DEFAULT && (desc.Flags & targetFlags) == 0 && desc.SampleDesc.Count == 1 &&
+		!mTexturesCommitted)
+		return &mPools[1];
+
+	return nullptr;
+}
+
+bool GpuAllocator::AllocateBlock(Pool& pool, UINT order, Heap*& heap, UINT64& offset)
+{
+	for(int attempt = 0; attempt < 2; ++attempt)
+	{
+		for(auto& h : pool.Heaps)
+		{
+			// Smallest free block that is big enough, split down to the order asked for.
+			for(UINT k = order; k <= mMaxOrder; ++k)
+			{
+				auto& freeList = h->FreeLists[k];
+				if(freeList.empty())
+					continue;
+
+				offset = *freeList.begin();
+				freeList.erase(freeList.begin());
+				while(k > order)
+				{
+					--k;
+					h->FreeLists[k].insert(offset + (MinBlockSize << k));
+				}
+
+				heap = h.get();
+				return true;
+			}
+		}
+
+		if(attempt > 0)
+			break;
+
+		auto h = std::make_unique<Heap>();
+		CD3DX12_HEAP_DESC heapDesc(mHeapSize, pool.Type, 0, pool.Flags);
+		if(FAILED(md3dDevice->CreateHeap(&heapDesc, IID_PPV_ARGS(&h->Resource))))
+			return false;
+
+		h->FreeLists.resize(mMaxOrder + 1);
+		h->FreeLists[mMaxOrder].insert(0);
+		pool.Heaps.push_back(std::move(h));
+	}
+
+	return false;
+}
+
+void GpuAllocator::Free(Heap* heap, UINT64 offset, UINT order, UINT64 requestedBytes, Kind kind)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	mKindBytes[kind] -= requestedBytes;
+	if(heap == nullptr)
+	{
+		--mCommittedCount;
+		return;
+	}
+
+	--mPlacedCount;
+	mAllocatedBytes -= MinBlockSize << order;
+	mRequestedBytes -= requestedBytes;
+
+	// Merge with the buddy for as long as it is free too.
+	while(order < mMaxOrder)
+	{
+		UINT64 buddy = offset ^ (MinBlockSize << order);
+		auto it = heap->FreeLists[order].find(buddy);
+		if(it == heap->FreeLists[order].end())
+			break;
+
+		heap->FreeLists[order].erase(it);
+		offset = std::min<UINT64>(offset, buddy);
+		++order;
+	}
+
+	heap->FreeLists[order].insert(offset);
+}
+
+HRESULT GpuAllocator::CreateCommitted(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC* desc,
+	D3D12_RESOURCE_STATES initialState, const D3D12_CLEAR_VALUE* optimizedClearValue,
+	REFIID riid, void** resource)
+{
+	ComPtr<ID3D12Resource> committed;
+	HRESULT hr = md3dDevice->CreateCommittedResource(&CD3DX12_HEAP_PROPERTIES(heapType),
+		D3D12_HEAP_FLAG_NONE, desc, initialState, optimizedClearValue, IID_PPV_ARGS(&committed));
+	if(FAILED(hr))
+		return hr;
+
+	UINT64 bytes = md3dDevice->GetResourceAllocationInfo(0, 1, desc).SizeInBytes;
+	Kind kind = KindOf(heapType, *desc);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		++mCommittedCount;
+		mKindBytes[kind] += bytes;
+	}
+
+	// Only carries the accounting; the resource owns its memory.
+	ComPtr<IUnknown> allocation;
+	allocation.Attach(new Allocation(this, nullptr, 0, 0, bytes, kind));
+
+	hr = committed->SetPrivateDataInterface(AllocationGuid, allocation.Get());
+	if(FAILED(hr))
+		return hr;
+
+	return committed->QueryInterface(riid, resource);
+}
+
+GpuAllocator::Stats GpuAllocator::GetStats()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	Stats stats;
+	stats.PlacedCount = mPlacedCount;
+	stats.CommittedCount = mCommittedCount;
+	stats.AllocatedBytes = mAllocatedBytes;
+	stats.RequestedBytes = mRequestedBytes;
+	stats.TextureBytes = mKindBytes[TextureKind];
+	stats.BufferBytes = mKindBytes[BufferKind];
+	stats.UploadBytes = mKindBytes[UploadKind];
+
+	for(auto& pool : mPools)
+	{
+		for(auto& h : pool.Heaps)
+		{
+			++stats.HeapCount;
+			stats.ReservedBytes += mHeapSize;
+
+			for(UINT k = mMaxOrder + 1; k-- > 0;)
+			{
+				if(!h->FreeLists[k].empty())
+				{
+					stats.LargestFreeBlock = std::max<UINT64>(stats.LargestFreeBlock, MinBlockSize << k);
+					break;
+				}
+			}
+		}
+	}
+
+	return stats;
+}
+
+float GpuAllocator::Stats::InternalFragmentation()const
+{
+	return AllocatedBytes > 0 ? 1.0f - (float)RequestedBytes / AllocatedBytes : 0.0f;
+}
+
+float GpuAllocator::Stats::ExternalFragmentation()const
+{
+	UINT64 freeBytes = ReservedBytes - AllocatedBytes;
+	return freeBytes > 0 ? 1.0f - (float)LargestFreeBlock / freeBytes : 0.0f;
+}
+
+HRESULT CreateGpuResource(
+	ID3D12Device* device,
+	D3D12_HEAP_TYPE heapType,
+	const D3D12_RESOURCE_DESC* desc,
+	D3D12_RESOURCE_STATES initialState,
+	const D3D12_CLEAR_VALUE* optimizedClearValue,
+	REFIID riid,
+	void** resource)
+{
+	if(gGpuAllocator != nullptr)
+		return gGpuAllocator->CreateResource(heapType, desc, initialState, optimizedClearValue, riid, resource);
+
+	return device->CreateCommittedResource(&CD3DX12_HEAP_PROPERTIES(heapType),
+		D3D12_HEAP_FLAG_NONE, desc, initialState, optimizedClearValue, riid, resource);
+}
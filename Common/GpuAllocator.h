@@ -0,0 +1,150 @@
+//***************************************************************************************
+// GpuAllocator.h
+//
+// Places buffers and textures into large ID3D12Heaps instead of giving each one its own
+// committed resource.  Every heap is managed by a buddy allocator whose smallest block
+// is the 64 KB placement alignment, so a resource costs at most twice its size, and
+// usually much less, with one heap allocation serving hundreds of resources.
+//
+// Heaps are kept separately per heap type and for buffers and textures, to stay within
+// resource heap tier 1.  Render target/depth textures, MSAA textures, resources
+// larger than a heap, and any resource when no new heap can be created are created
+// committed.  The heap block of a placed resource is
+// released with the resource itself, through an object attached as private data, so
+// callers keep using plain ComPtr<ID3D12Resource>; committed resources carry one too,
+// so the totals by kind cover every live resource created through the allocator.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <atomic>
+#include <mutex>
+#include <set>
+
+class GpuAllocator
+{
+public:
+	GpuAllocator(ID3D12Device* device, UINT64 heapSize = 32 * 1024 * 1024);
+	GpuAllocator(const GpuAllocator& rhs) = delete;
+	GpuAllocator& operator=(const GpuAllocator& rhs) = delete;
+	~GpuAllocator() = default;
+
+	// Same contract as ID3D12Device::CreateCommittedResource with default heap
+	// properties and flags.  Thread safe.
+	HRESULT CreateResource(
+		D3D12_HEAP_TYPE heapType,
+		const D3D12_RESOURCE_DESC* desc,
+		D3D12_RESOURCE_STATES initialState,
+		const D3D12_CLEAR_VALUE* optimizedClearValue,
+		REFIID riid,
+		void** resource);
+
+	// While set, textures are created committed, so that a ResidencyManager can evict
+	// them one by one; an ID3D12Heap is only paged as a whole.  Thread safe.
+	void SetTexturesCommitted(bool committed);
+
+	struct Stats
+	{
+		UINT HeapCount = 0;
+		UINT PlacedCount = 0;
+		UINT CommittedCount = 0;
+
+		// Heap memory reserved, handed out in buddy blocks, and actually requested
+		// by the placed resources.
+		UINT64 ReservedBytes = 0;
+		UINT64 AllocatedBytes = 0;
+		UINT64 RequestedBytes = 0;
+
+		// Largest free block of any heap.
+		UINT64 LargestFreeBlock = 0;
+
+		// Sizes of the live resources, placed or committed: textures, render targets
+		// included; default heap buffers, e.g. MeshGeometry's; upload and readback
+		// buffers, e.g. UploadBuffer's.
+		UINT64 TextureBytes = 0;
+		UINT64 BufferBytes = 0;
+		UINT64 UploadBytes = 0;
+
+		// Share of the allocated blocks lost to rounding up to a power of two.
+		float InternalFragmentation()const;
+
+		// Share of the free memory that is not in the largest free block.
+		float ExternalFragmentation()const;
+	};
+
+	Stats GetStats()const;
+
+private:
+	struct Heap
+	{
+		Microsoft::WRL::ComPtr<ID3D12Heap> Resource;
+
+		// Offsets of the free blocks of each order; a block of order k is
+		// MinBlockSize << k bytes.
+		std::vector<std::set<UINT64>> FreeLists;
+	};
+
+	struct Pool
+	{
+		D3D12_HEAP_TYPE Type = D3D12_HEAP_TYPE_DEFAULT;
+		D3D12_HEAP_FLAGS Flags = D3D12_HEAP_FLAG_NONE;
+		std::vector<std::unique_ptr<Heap>> Heaps;
+	};
+
+	class Allocation;
+
+	enum Kind
+	{
+		TextureKind = 0,
+		BufferKind,
+		UploadKind,
+		KindCount
+	};
+
+	static Kind KindOf(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC& desc);
+
+	Pool* FindPool(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC& desc);
+	bool AllocateBlock(Pool& pool, UINT order, Heap*& heap, UINT64& offset);
+
+	// Returns the block of a placed resource, or just its accounting for a committed
+	// one (heap null).
+	void Free(Heap* heap, UINT64 offset, UINT order, UINT64 requestedBytes, Kind kind);
+
+	HRESULT CreateCommitted(D3D12_HEAP_TYPE heapType, const D3D12_RESOURCE_DESC* desc,
+		D3D12_RESOURCE_STATES initialState, const D3D12_CLEAR_VALUE* optimizedClearValue,
+		REFIID riid, void** resource);
+
+private:
+	static const UINT64 MinBlockSize = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+
+	ID3D12Device* md3dDevice = nullptr;
+	UINT64 mHeapSize = 0;
+	UINT mMaxOrder = 0;
+
+	Pool mPools[3];
+
+	UINT mPlacedCount = 0;
+	UINT mCommittedCount = 0;
+	UINT64 mAllocatedBytes = 0;
+	UINT64 mRequestedBytes = 0;
+	UINT64 mKindBytes[KindCount] = {};
+
+	std::atomic<bool> mTexturesCommitted{ false };
+
+	mutable std::mutex mMutex;
+};
+
+// The allocator the d3dUtil helpers, UploadBuffer and the DDS loader place their
+// resources with.  When null they create committed resources.
+extern GpuAllocator* gGpuAllocator;
+
+// Creates the resource through gGpuAllocator if one is installed, or committed.
+HRESULT CreateGpuResource(
+	ID3D12Device* device,
+	D3D12_HEAP_TYPE heapType,
+	const D3D12_RESOURCE_DESC* desc,
+	D3D12_RESOURCE_STATES initialState,
+	const D3D12_CLEAR_VALUE* optimizedClearValue,
+	REFIID riid,
+	void** resource);
@@ -0,0 +1,79 @@
+//***************************************************************************************
+// LinearAllocator.cpp
+//***************************************************************************************
+
+#include "LinearAllocator.h"
+
+LinearAllocator::LinearAllocator(ID3D12Device* device, UINT64 pageSize)
+	: md3dDevice(device), mPageSize(pageSize)
+{
+}
+
+LinearAllocator::Allocation LinearAllocator::Allocate(UINT64 byteSize, UINT64 alignment)
+{
+	UINT64 offset = (mOffset + alignment - 1) & ~(alignment - 1);
+
+	if(mUsedPages == 0 || offset + byteSize > mPages[mUsedPages - 1].Size)
+	{
+		// Move on to the next page, replacing it if it is too small for the request.
+		// Pages are placed at D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT, so every
+		// alignment a shader needs holds at offset 0.
+		if(mUsedPages == (UINT)mPages.size())
+			mPages.emplace_back();
+
+		Page& page = mPages[mUsedPages];
+		if(page.Size < byteSize)
+			CreatePage(page, std::max<UINT64>(mPageSize, byteSize));
+
+		++mUsedPages;
+		offset = 0;
+	}
+
+	Page& page = mPages[mUsedPages - 1];
+	mOffset = offset + byteSize;
+	mBytesUsed += byteSize;
+
+	Allocation a;
+	a.CpuAddress = page.CpuAddress + offset;
+	a.GpuAddress = page.Resource->GetGPUVirtualAddress() + offset;
+	a.Resource = page.Resource.Get();
+	a.Offset = offset;
+	return a;
+}
+
+void LinearAllocator::Reset()
+{
+	mPages.resize(mUsedPages);
+	mUsedPages = 0;
+	mOffset = 0;
+	mBytesUsed = 0;
+}
+
+UINT64 LinearAllocator::BytesUsed()const
+{
+	return mBytesUsed;
+}
+
+UINT64 LinearAllocator::BytesReserved()const
+{
+	UINT64 bytes = 0;
+	for(auto& page : mPages)
+		bytes += page.Size;
+	return bytes;
+}
+
+void LinearAllocator::CreatePage(Page& page, UINT64 size)
+{
+	page = Page();
+
+	ThrowIfFailed(CreateGpuResource(md3dDevice,
+		D3D12_HEAP_TYPE_UPLOAD,
+		&CD3DX12_RESOURCE_DESC::Buffer(size),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&page.Resource)));
+
+	// Stays mapped until the page is released.
+	ThrowIfFailed(page.Resource->Map(0, nullptr, reinterpret_cast<void**>(&page.CpuAddress)));
+	page.Size = size;
+}
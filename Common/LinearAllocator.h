@@ -0,0 +1,67 @@
+//***************************************************************************************
+// LinearAllocator.h
+//
+// Bump allocator over persistently mapped upload pages, for data written once per
+// frame (constant buffers, structured buffers read by the shaders).  Allocations stay
+// valid until Reset(), which the owner calls once the GPU has finished with them,
+// e.g. when the frame resource's fence has been reached.  A request that does not fit
+// the current page opens another one, so the capacity follows what a frame actually
+// uses; the pages a frame did not need are released by Reset().  Not thread safe.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include "GpuAllocator.h"
+
+class LinearAllocator
+{
+public:
+	LinearAllocator(ID3D12Device* device, UINT64 pageSize);
+	LinearAllocator(const LinearAllocator& rhs) = delete;
+	LinearAllocator& operator=(const LinearAllocator& rhs) = delete;
+	~LinearAllocator() = default;
+
+	struct Allocation
+	{
+		BYTE* CpuAddress = nullptr;
+		D3D12_GPU_VIRTUAL_ADDRESS GpuAddress = 0;
+
+		// The page and offset, e.g. as the source of a CopyBufferRegion.
+		ID3D12Resource* Resource = nullptr;
+		UINT64 Offset = 0;
+	};
+
+	// The default alignment is that of a constant buffer view.  Write the memory
+	// sequentially and never read it back; it is write-combined.
+	Allocation Allocate(UINT64 byteSize,
+		UINT64 alignment = D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+
+	// Frees every allocation.
+	void Reset();
+
+	// Bytes allocated since the last Reset, and held in pages.
+	UINT64 BytesUsed()const;
+	UINT64 BytesReserved()const;
+
+private:
+	struct Page
+	{
+		Microsoft::WRL::ComPtr<ID3D12Resource> Resource;
+		BYTE* CpuAddress = nullptr;
+		UINT64 Size = 0;
+	};
+
+	void CreatePage(Page& page, UINT64 size);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	UINT64 mPageSize = 0;
+
+	// mPages[0, mUsedPages) hold this frame's allocations; mOffset is the first free
+	// byte of the last of them.
+	std::vector<Page> mPages;
+	UINT mUsedPages = 0;
+	UINT64 mOffset = 0;
+	UINT64 mBytesUsed = 0;
+};
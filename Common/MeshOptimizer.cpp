@@ -0,0 +1,311 @@
+//***************************************************************************************
+// MeshOptimizer.cpp
+//***************************************************************************************
+
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+using namespace DirectX;
+
+namespace
+{
+	// Forsyth's scoring: the last triangle's vertices score a little less than the next
+	// few cache entries so the order does not double back, and vertices with few
+	// triangles left are boosted so they are finished off and leave the cache.
+	float VertexScore(int cachePosition, MeshOptimizer::uint32 remainingTriangles)
+	{
+		if(remainingTriangles == 0)
+			return -1.0f;
+
+		float score = 0.0f;
+		if(cachePosition >= 0)
+		{
+			if(cachePosition < 3)
+				score = 0.75f;
+			else
+				score = powf(1.0f - (float)(cachePosition - 3) / (MeshOptimizer::CacheSize - 3), 1.5f);
+		}
+
+		return score + 2.0f * powf((float)remainingTriangles, -0.5f);
+	}
+
+	// Runs the indices through a FIFO cache of cacheSize vertices.  Returns the positions
+	// in indices that miss, or with fromRestarts the triangles whose three vertices miss.
+	std::vector<size_t> SimulateFifo(const std::vector<MeshOptimizer::uint32>& indices,
+		MeshOptimizer::uint32 cacheSize, bool fromRestarts)
+	{
+		std::vector<size_t> result;
+		std::deque<MeshOptimizer::uint32> cache;
+		for(size_t t = 0; t < indices.size() / 3; ++t)
+		{
+			int misses = 0;
+			for(int k = 0; k < 3; ++k)
+			{
+				MeshOptimizer::uint32 v = indices[3 * t + k];
+				if(std::find(cache.begin(), cache.end(), v) != cache.end())
+					continue;
+
+				++misses;
+				if(!fromRestarts)
+					result.push_back(3 * t + k);
+
+				cache.push_back(v);
+				if(cache.size() > cacheSize)
+					cache.pop_front();
+			}
+
+			if(fromRestarts && misses == 3)
+				result.push_back(t);
+		}
+		return result;
+	}
+}
+
+void MeshOptimizer::Optimize(GeometryGenerator::MeshData& mesh)
+{
+	OptimizeVertexCache(mesh.Indices32, mesh.Vertices.size());
+	OptimizeOverdraw(mesh);
+	OptimizeVertexFetch(mesh);
+}
+
+void MeshOptimizer::OptimizeVertexCache(std::vector<uint32>& indices, size_t vertexCount)
+{
+	const size_t triangleCount = indices.size() / 3;
+	if(triangleCount == 0)
+		return;
+
+	// The triangles of each vertex, packed: vertex v's are at triangleOffsets[v], and
+	// the first remaining[v] of them are not emitted yet.
+	std::vector<uint32> triangleOffsets(vertexCount + 1, 0);
+	for(uint32 v : indices)
+		triangleOffsets[v + 1]++;
+	for(size_t v = 0; v < vertexCount; ++v)
+		triangleOffsets[v + 1] += triangleOffsets[v];
+
+	std::vector<uint32> remaining(vertexCount, 0);
+	std::vector<uint32> vertexTriangles(indices.size());
+	for(size_t t = 0; t < triangleCount; ++t)
+	{
+		for(int k = 0; k < 3; ++k)
+		{
+			uint32 v = indices[3 * t + k];
+			vertexTriangles[triangleOffsets[v] + remaining[v]++] = (uint32)t;
+		}
+	}
+
+	std::vector<int> cachePosition(vertexCount, -1);
+	std::vector<float> vertexScore(vertexCount);
+	for(size_t v = 0; v < vertexCount; ++v)
+		vertexScore[v] = VertexScore(-1, remaining[v]);
+
+	std::vector<float> triangleScore(triangleCount);
+	std::vector<bool> emitted(triangleCount, false);
+	auto scoreTriangle = [&](size_t t)
+	{
+		triangleScore[t] = vertexScore[indices[3 * t]] + vertexScore[indices[3 * t + 1]] + vertexScore[indices[3 * t + 2]];
+	};
+
+	size_t best = 0;
+	for(size_t t = 0; t < triangleCount; ++t)
+	{
+		scoreTriangle(t);
+		if(triangleScore[t] > triangleScore[best])
+			best = t;
+	}
+
+	std::vector<uint32> cache;
+	std::vector<uint32> newCache;
+	std::vector<uint32> output;
+	output.reserve(indices.size());
+	size_t cursor = 0;
+
+	while(true)
+	{
+		emitted[best] = true;
+		for(int k = 0; k < 3; ++k)
+		{
+			uint32 v = indices[3 * best + k];
+			output.push_back(v);
+
+			// Swap the triangle out of the vertex's remaining ones.
+			uint32* tris = &vertexTriangles[triangleOffsets[v]];
+			uint32 last = --remaining[v];
+			for(uint32 i = 0; i <= last; ++i)
+			{
+				if(tris[i] == best)
+				{
+					std::swap(tris[i], tris[last]);
+					break;
+				}
+			}
+		}
+
+		// The triangle's vertices move to the front of the LRU cache.
+		newCache.assign(indices.begin() + 3 * best, indices.begin() + 3 * best + 3);
+		for(uint32 v : cache)
+		{
+			if(v != newCache[0] && v != newCache[1] && v != newCache[2])
+				newCache.push_back(v);
+		}
+
+		for(size_t i = 0; i < newCache.size(); ++i)
+		{
+			uint32 v = newCache[i];
+			cachePosition[v] = i < (size_t)CacheSize ? (int)i : -1;
+			vertexScore[v] = VertexScore(cachePosition[v], remaining[v]);
+		}
+
+		// Rescore the triangles around every vertex whose score changed, evicted ones
+		// included, and pick the best of them.
+		float bestScore = -1.0f;
+		for(uint32 v : newCache)
+		{
+			const uint32* tris = &vertexTriangles[triangleOffsets[v]];
+			for(uint32 i = 0; i < remaining[v]; ++i)
+			{
+				scoreTriangle(tris[i]);
+				if(cachePosition[v] >= 0 && triangleScore[tris[i]] > bestScore)
+				{
+					bestScore = triangleScore[tris[i]];
+					best = tris[i];
+				}
+			}
+		}
+
+		if(newCache.size() > (size_t)CacheSize)
+			newCache.resize(CacheSize);
+		cache.swap(newCache);
+
+		// Nothing left around the cache: go on with the next triangle not emitted, which
+		// keeps the whole pass linear.
+		if(bestScore < 0.0f)
+		{
+			while(cursor < triangleCount && emitted[cursor])
+				++cursor;
+			if(cursor == triangleCount)
+				break;
+			best = cursor;
+		}
+	}
+
+	indices.swap(output);
+}
+
+void MeshOptimizer::OptimizeOverdraw(GeometryGenerator::MeshData& mesh)
+{
+	const std::vector<uint32>& indices = mesh.Indices32;
+	const size_t triangleCount = indices.size() / 3;
+	if(triangleCount == 0)
+		return;
+
+	// Clusters start where the cache order restarts; a cluster starts with a cold cache
+	// either way, so drawing them in another order costs no extra vertices.
+	std::vector<size_t> clusterStarts = SimulateFifo(indices, CacheSize, true);
+	if(clusterStarts.empty() || clusterStarts[0] != 0)
+		clusterStarts.insert(clusterStarts.begin(), 0);
+	clusterStarts.push_back(triangleCount);
+
+	auto position = [&](uint32 v) { return XMLoadFloat3(&mesh.Vertices[v].Position); };
+
+	XMVECTOR meshCentroid = XMVectorZero();
+	for(const auto& v : mesh.Vertices)
+		meshCentroid += XMLoadFloat3(&v.Position);
+	meshCentroid /= (float)std::max<size_t>(mesh.Vertices.size(), 1);
+
+	// Outward facing clusters are likely to cover the rest of the mesh, so they are
+	// drawn first: sort by how far the area weighted centroid lies along the area
+	// weighted normal, from the mesh centroid.
+	std::vector<std::pair<float, size_t>> clusters;
+	for(size_t c = 0; c + 1 < clusterStarts.size(); ++c)
+	{
+		XMVECTOR centroid = XMVectorZero();
+		XMVECTOR normal = XMVectorZero();
+		float area = 0.0f;
+		for(size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t)
+		{
+			XMVECTOR p0 = position(indices[3 * t]);
+			XMVECTOR p1 = position(indices[3 * t + 1]);
+			XMVECTOR p2 = position(indices[3 * t + 2]);
+			XMVECTOR n = XMVector3Cross(p1 - p0, p2 - p0);
+			float a = XMVectorGetX(XMVector3Length(n));
+
+			centroid += (p0 + p1 + p2) * (a / 3.0f);
+			normal += n;
+			area += a;
+		}
+
+		centroid = area > 0.0f ? centroid / area : position(indices[3 * clusterStarts[c]]);
+		float normalLength = XMVectorGetX(XMVector3Length(normal));
+		float key = normalLength > 0.0f ?
+			XMVectorGetX(XMVector3Dot(centroid - meshCentroid, normal)) / normalLength : 0.0f;
+		clusters.push_back({ -key, c });
+	}
+	std::stable_sort(clusters.begin(), clusters.end(),
+		[](const std::pair<float, size_t>& a, const std::pair<float, size_t>& b) { return a.first < b.first; });
+
+	std::vector<uint32> output;
+	output.reserve(indices.size());
+	for(auto& c : clusters)
+	{
+		output.insert(output.end(), indices.begin() + 3 * clusterStarts[c.second],
+			indices.begin() + 3 * clusterStarts[c.second + 1]);
+	}
+	mesh.Indices32.swap(output);
+}
+
+void MeshOptimizer::OptimizeVertexFetch(GeometryGenerator::MeshData& mesh)
+{
+	const uint32 unused = (uint32)-1;
+	std::vector<uint32> remap(mesh.Vertices.size(), unused);
+
+	std::vector<GeometryGenerator::Vertex> vertices;
+	vertices.reserve(mesh.Vertices.size());
+	for(uint32& i : mesh.Indices32)
+	{
+		if(remap[i] == unused)
+		{
+			remap[i] = (uint32)vertices.size();
+			vertices.push_back(mesh.Vertices[i]);
+		}
+		i = remap[i];
+	}
+
+	// Vertices no triangle uses go last, so the vertex count stays the same.
+	for(size_t v = 0; v < mesh.Vertices.size(); ++v)
+	{
+		if(remap[v] == unused)
+			vertices.push_back(mesh.Vertices[v]);
+	}
+
+	mesh.Vertices.swap(vertices);
+}
+
+float MeshOptimizer::AverageCacheMissRatio(const std::vector<uint32>& indices, uint32 cacheSize)
+{
+	if(indices.size() < 3)
+		return 0.0f;
+
+	return (float)SimulateFifo(indices, cacheSize, false).size() / (indices.size() / 3);
+}
+
+XMFLOAT2 MeshOptimizer::OctahedralEncode(const XMFLOAT3& n)
+{
+	float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	if(l1 == 0.0f)
+		return XMFLOAT2(0.0f, 0.0f);
+
+	// Project onto the octahedron |x| + |y| + |z| = 1, then fold the lower half over
+	// the diagonals.
+	float x = n.x / l1;
+	float y = n.y / l1;
+	if(n.z < 0.0f)
+	{
+		float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = foldedX;
+		y = foldedY;
+	}
+	return XMFLOAT2(x, y);
+}
@@ -0,0 +1,43 @@
+//***************************************************************************************
+// MeshOptimizer.h
+//
+// Reorders the triangles and vertices of a GeometryGenerator mesh for the GPU:
+//   1. Triangles are ordered for the post-transform vertex cache with Tom Forsyth's
+//      linear-speed algorithm, so each vertex is shaded about once.
+//   2. The cache-ordered triangles are cut into clusters where the order restarts
+//      (a triangle with no vertex in the cache), and the clusters are sorted to draw
+//      the outward facing ones first, which reduces overdraw without hurting the cache
+//      (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and
+//      Reduced Overdraw").
+//   3. Vertices are renumbered in the order the indices first use them, so vertex
+//      fetch walks the vertex buffer forwards.
+// The vertex and index counts are unchanged.
+//***************************************************************************************
+
+#pragma once
+
+#include "GeometryGenerator.h"
+
+class MeshOptimizer
+{
+public:
+	using uint32 = GeometryGenerator::uint32;
+
+	// All three steps, in order.
+	static void Optimize(GeometryGenerator::MeshData& mesh);
+
+	static void OptimizeVertexCache(std::vector<uint32>& indices, size_t vertexCount);
+	static void OptimizeOverdraw(GeometryGenerator::MeshData& mesh);
+	static void OptimizeVertexFetch(GeometryGenerator::MeshData& mesh);
+
+	// Average number of vertices shaded per triangle with a FIFO cache of cacheSize
+	// entries; 0.5 is about the best a regular grid can do, 3 the worst.
+	static float AverageCacheMissRatio(const std::vector<uint32>& indices, uint32 cacheSize);
+
+	// Unit vector to the octahedral map in [-1, 1]^2; its inverse is OctahedralDecode in
+	// Default.hlsl.
+	static DirectX::XMFLOAT2 OctahedralEncode(const DirectX::XMFLOAT3& n);
+
+	// Size of the vertex cache the orders are optimized for.
+	static const int CacheSize = 32;
+};
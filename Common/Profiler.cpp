@@ -0,0 +1,256 @@
+//***************************************************************************************
+// Profiler.cpp
+//***************************************************************************************
+
+#include "Profiler.h"
+#include <cmath>
+
+using Microsoft::WRL::ComPtr;
+
+Profiler::Profiler(ID3D12Device* device, ID3D12CommandQueue* queue,
+	UINT frameResourceCount, UINT maxGpuScopes, UINT historyLength)
+	: mMaxGpuScopes(maxGpuScopes), mHistoryLength(historyLength)
+{
+	ThrowIfFailed(queue->GetTimestampFrequency(&mTimestampFrequency));
+
+	// Two timestamps per scope, in a separate region for each frame resource.
+	D3D12_QUERY_HEAP_DESC queryHeapDesc = {};
+	queryHeapDesc.Type = D3D12_QUERY_HEAP_TYPE_TIMESTAMP;
+	queryHeapDesc.Count = frameResourceCount * mMaxGpuScopes * 2;
+	queryHeapDesc.NodeMask = 0;
+	ThrowIfFailed(device->CreateQueryHeap(&queryHeapDesc, IID_PPV_ARGS(&mQueryHeap)));
+
+	mReadbackBuffers.resize(frameResourceCount);
+	mPendingReadback.resize(frameResourceCount, false);
+	for(auto& buffer : mReadbackBuffers)
+	{
+		ThrowIfFailed(device->CreateCommittedResource(
+			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+			D3D12_HEAP_FLAG_NONE,
+			&CD3DX12_RESOURCE_DESC::Buffer(mMaxGpuScopes * 2 * sizeof(UINT64)),
+			D3D12_RESOURCE_STATE_COPY_DEST,
+			nullptr,
+			IID_PPV_ARGS(&buffer)));
+	}
+}
+
+UINT Profiler::CpuScope(const std::string& name)
+{
+	for(UINT i = 0; i < (UINT)mCpuScopes.size(); ++i)
+	{
+		if(mCpuScopes[i].Name == name)
+			return i;
+	}
+
+	Scope scope;
+	scope.Name = name;
+	mCpuScopes.push_back(scope);
+	return (UINT)mCpuScopes.size() - 1;
+}
+
+void Profiler::BeginCpu(UINT scope)
+{
+	mCpuScopes[scope].BeginCount = GameTimer::Counter();
+}
+
+void Profiler::EndCpu(UINT scope)
+{
+	Scope& s = mCpuScopes[scope];
+	double seconds = (GameTimer::Counter() - s.BeginCount) * mClock.SecondsPerCount();
+	s.AddSample((float)(seconds * 1000.0), mHistoryLength);
+}
+
+UINT Profiler::RegisterGpuScope(const std::string& name, ID3D12CommandQueue* queue)
+{
+	assert(mGpuScopes.size() < mMaxGpuScopes);
+
+	Scope scope;
+	scope.Name = name;
+	scope.TimestampFrequency = mTimestampFrequency;
+	if(queue != nullptr)
+	{
+		ThrowIfFailed(queue->GetTimestampFrequency(&scope.TimestampFrequency));
+		scope.OtherQueue = true;
+	}
+	mGpuScopes.push_back(scope);
+	return (UINT)mGpuScopes.size() - 1;
+}
+
+void Profiler::BeginGpu(ID3D12GraphicsCommandList* cmdList, UINT scope)
+{
+	UINT index = (mFrameIndex * mMaxGpuScopes + scope) * 2;
+	cmdList->EndQuery(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, index);
+}
+
+void Profiler::EndGpu(ID3D12GraphicsCommandList* cmdList, UINT scope)
+{
+	UINT index = (mFrameIndex * mMaxGpuScopes + scope) * 2 + 1;
+	cmdList->EndQuery(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP, index);
+}
+
+void Profiler::ResolveGpu(ID3D12GraphicsCommandList* cmdList)
+{
+	if(mGpuScopes.empty())
+		return;
+
+	cmdList->ResolveQueryData(mQueryHeap.Get(), D3D12_QUERY_TYPE_TIMESTAMP,
+		mFrameIndex * mMaxGpuScopes * 2, (UINT)mGpuScopes.size() * 2,
+		mReadbackBuffers[mFrameIndex].Get(), 0);
+}
+
+void Profiler::BeginFrame(UINT frameResourceIndex)
+{
+	mFrameIndex = frameResourceIndex;
+	if(!mPendingReadback[mFrameIndex] || mGpuScopes.empty())
+		return;
+
+	// The frame resource's fence has completed, so mapping does not stall.
+	UINT64* timestamps = nullptr;
+	D3D12_RANGE readRange = { 0, mGpuScopes.size() * 2 * sizeof(UINT64) };
+	ThrowIfFailed(mReadbackBuffers[mFrameIndex]->Map(0, &readRange, reinterpret_cast<void**>(&timestamps)));
+
+	for(size_t i = 0; i < mGpuScopes.size(); ++i)
+	{
+		UINT64 begin = timestamps[2 * i];
+		UINT64 end = timestamps[2 * i + 1];
+		double ms = end > begin ? (end - begin) * 1000.0 / mGpuScopes[i].TimestampFrequency : 0.0;
+		mGpuScopes[i].AddSample((float)ms, mHistoryLength);
+	}
+
+	D3D12_RANGE writtenRange = { 0, 0 };
+	mReadbackBuffers[mFrameIndex]->Unmap(0, &writtenRange);
+
+	mPendingReadback[mFrameIndex] = false;
+}
+
+void Profiler::EndFrame()
+{
+	mPendingReadback[mFrameIndex] = true;
+}
+
+Profiler::Stats Profiler::CpuStats(UINT scope)const
+{
+	return ComputeStats(mCpuScopes[scope].History);
+}
+
+Profiler::Stats Profiler::GpuStats(UINT scope)const
+{
+	return ComputeStats(mGpuScopes[scope].History);
+}
+
+UINT Profiler::CpuScopeCount()const
+{
+	return (UINT)mCpuScopes.size();
+}
+
+UINT Profiler::GpuScopeCount()const
+{
+	return (UINT)mGpuScopes.size();
+}
+
+const std::string& Profiler::CpuScopeName(UINT scope)const
+{
+	return mCpuScopes[scope].Name;
+}
+
+const std::string& Profiler::GpuScopeName(UINT scope)const
+{
+	return mGpuScopes[scope].Name;
+}
+
+void Profiler::ResetHistory()
+{
+	for(auto& s : mCpuScopes)
+	{
+		s.History.clear();
+		s.Next = 0;
+	}
+	for(auto& s : mGpuScopes)
+	{
+		s.History.clear();
+		s.Next = 0;
+	}
+}
+
+float Profiler::GpuTotalAvgMs()const
+{
+	float total = 0.0f;
+	for(auto& s : mGpuScopes)
+	{
+		if(!s.OtherQueue)
+			total += ComputeStats(s.History).AvgMs;
+	}
+	return total;
+}
+
+float Profiler::GpuTotalLastMs()const
+{
+	float total = 0.0f;
+	for(auto& s : mGpuScopes)
+	{
+		if(!s.OtherQueue && !s.History.empty())
+			total += s.History[(s.Next + mHistoryLength - 1) % mHistoryLength];
+	}
+	return total;
+}
+
+bool Profiler::WriteCsv(const std::wstring& filename)const
+{
+	std::ofstream csv(filename);
+	if(!csv)
+		return false;
+
+	csv << "scope,clock,min_ms,avg_ms,p99_ms,samples\n";
+
+	auto writeScopes = [&csv](const std::vector<Scope>& scopes, const char* clock)
+	{
+		for(auto& s : scopes)
+		{
+			Stats stats = ComputeStats(s.History);
+			csv << s.Name << ',' << clock << ',' << stats.MinMs << ',' << stats.AvgMs << ','
+				<< stats.P99Ms << ',' << stats.Samples << '\n';
+		}
+	};
+	writeScopes(mCpuScopes, "cpu");
+	writeScopes(mGpuScopes, "gpu");
+
+	return true;
+}
+
+void Profiler::Scope::AddSample(float ms, UINT historyLength)
+{
+	if(History.size() < historyLength)
+		History.push_back(ms);
+	else
+		History[Next] = ms;
+
+	Next = (Next + 1) % historyLength;
+}
+
+Profiler::Stats Profiler::ComputeStats(std::vector<float> samples)
+{
+	Stats stats;
+	if(samples.empty())
+		return stats;
+
+	std::sort(samples.begin(), samples.end());
+
+	float sum = 0.0f;
+	for(float ms : samples)
+		sum += ms;
+
+	// Nearest-rank percentiles.
+	auto percentile = [&samples](double p)
+	{
+		return samples[(size_t)std::ceil(p * samples.size()) - 1];
+	};
+
+	stats.MinMs = samples.front();
+	stats.AvgMs = sum / samples.size();
+	stats.P50Ms = percentile(0.50);
+	stats.P95Ms = percentile(0.95);
+	stats.P99Ms = percentile(0.99);
+	stats.MaxMs = samples.back();
+	stats.Samples = (UINT)samples.size();
+	return stats;
+}
@@ -0,0 +1,138 @@
+//***************************************************************************************
+// Profiler.h
+//
+// Rolling CPU and GPU timings of named scopes.  CPU scopes are timed on the GameTimer
+// (QueryPerformanceCounter) clock.  GPU scopes are bracketed by timestamp queries that
+// are resolved into one readback buffer per frame resource and read back only when
+// that frame resource is reused, i.e. after its fence has completed, so the CPU never
+// waits on the GPU for the results.  A GPU scope may be timed on another queue than the
+// one given to the constructor, e.g. a compute queue whose work overlaps the frame; the
+// frame's lists must then be submitted so that they all complete before its fence.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include "GameTimer.h"
+
+class Profiler
+{
+public:
+	Profiler(ID3D12Device* device, ID3D12CommandQueue* queue,
+		UINT frameResourceCount, UINT maxGpuScopes = 16, UINT historyLength = HistoryLength);
+	Profiler(const Profiler& rhs) = delete;
+	Profiler& operator=(const Profiler& rhs) = delete;
+	~Profiler() = default;
+
+	struct Stats
+	{
+		float MinMs = 0.0f;
+		float AvgMs = 0.0f;
+		float P50Ms = 0.0f;
+		float P95Ms = 0.0f;
+		float P99Ms = 0.0f;
+		float MaxMs = 0.0f;
+		UINT Samples = 0;
+	};
+
+	// Default number of most recent samples the statistics are computed over.
+	static const UINT HistoryLength = 240;
+
+	static Stats ComputeStats(std::vector<float> samples);
+
+	// Returns the id of the named CPU scope, registering it on first use.
+	// CPU scopes are for the main thread only.
+	UINT CpuScope(const std::string& name);
+	void BeginCpu(UINT scope);
+	void EndCpu(UINT scope);
+
+	// Registers a GPU scope; call before recording starts.  Every registered GPU
+	// scope must be recorded once per frame, since the whole range is resolved.
+	// Begin/End of different scopes may be recorded from different threads.  queue is
+	// the one the scope executes on, if not the constructor's.
+	UINT RegisterGpuScope(const std::string& name, ID3D12CommandQueue* queue = nullptr);
+	void BeginGpu(ID3D12GraphicsCommandList* cmdList, UINT scope);
+	void EndGpu(ID3D12GraphicsCommandList* cmdList, UINT scope);
+
+	// Copies this frame's timestamps to its readback buffer.  Must be recorded after
+	// every EndGpu of the frame, in submission order.
+	void ResolveGpu(ID3D12GraphicsCommandList* cmdList);
+
+	// Call with the index of the frame resource about to be recorded, once its fence
+	// has completed; collects the GPU timings written the last time it was used.
+	void BeginFrame(UINT frameResourceIndex);
+
+	// Call after the frame's command lists have been submitted.
+	void EndFrame();
+
+	Stats CpuStats(UINT scope)const;
+	Stats GpuStats(UINT scope)const;
+
+	UINT CpuScopeCount()const;
+	UINT GpuScopeCount()const;
+	const std::string& CpuScopeName(UINT scope)const;
+	const std::string& GpuScopeName(UINT scope)const;
+
+	// Discards the samples of every scope, e.g. after a warm-up.
+	void ResetHistory();
+
+	// Sum of the average GPU time of the scopes on the constructor's queue; the ones
+	// on other queues overlap them.
+	float GpuTotalAvgMs()const;
+
+	// Sum of the GPU time of the scopes on the constructor's queue in the most recently
+	// collected frame, or 0 before the first one.
+	float GpuTotalLastMs()const;
+
+	// Writes one line per scope: scope,clock,min_ms,avg_ms,p99_ms,samples.
+	bool WriteCsv(const std::wstring& filename)const;
+
+	// Times its own lifetime as the named CPU scope.
+	class ScopedCpu
+	{
+	public:
+		ScopedCpu(Profiler& profiler, const std::string& name)
+			: mProfiler(profiler), mScope(profiler.CpuScope(name))
+		{
+			mProfiler.BeginCpu(mScope);
+		}
+		~ScopedCpu() { mProfiler.EndCpu(mScope); }
+
+	private:
+		Profiler& mProfiler;
+		UINT mScope;
+	};
+
+private:
+	struct Scope
+	{
+		std::string Name;
+		std::vector<float> History;
+		UINT Next = 0;
+		__int64 BeginCount = 0;
+
+		// GPU scopes only.
+		UINT64 TimestampFrequency = 0;
+		bool OtherQueue = false;
+
+		void AddSample(float ms, UINT historyLength);
+	};
+
+private:
+	GameTimer mClock;
+
+	std::vector<Scope> mCpuScopes;
+	std::vector<Scope> mGpuScopes;
+
+	UINT mMaxGpuScopes = 0;
+	UINT mHistoryLength = 0;
+	UINT mFrameIndex = 0;
+	UINT64 mTimestampFrequency = 0;
+
+	Microsoft::WRL::ComPtr<ID3D12QueryHeap> mQueryHeap = nullptr;
+
+	// One readback buffer per frame resource, and whether it holds results that
+	// have not been read yet.
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> mReadbackBuffers;
+	std::vector<bool> mPendingReadback;
+};
@@ -0,0 +1,77 @@
+//***************************************************************************************
+// Registry.h
+//
+// Owns scene entries (render items, materials) in a dense array addressed by handle.
+// A handle is the entry's index, so it doubles as its slot in per-frame constant
+// arrays.  Entries that change are recorded in a dirty list; FlushDirty() visits
+// just those, so a frame's update costs O(changed) rather than a scan of the scene.
+//***************************************************************************************
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+template<typename T>
+class Registry
+{
+public:
+	typedef UINT Handle;
+
+	Registry() = default;
+	Registry(const Registry& rhs) = delete;
+	Registry& operator=(const Registry& rhs) = delete;
+
+	// Takes ownership of entry and returns its handle.  New entries start dirty.
+	Handle Add(std::unique_ptr<T> entry)
+	{
+		Handle h = (Handle)mEntries.size();
+		mEntries.push_back(std::move(entry));
+		mDirty.push_back(false);
+		MarkDirty(h);
+		return h;
+	}
+
+	T* Get(Handle h)const
+	{
+		return mEntries[h].get();
+	}
+
+	UINT Size()const
+	{
+		return (UINT)mEntries.size();
+	}
+
+	// Cheap to call repeatedly; an entry is listed once until the next flush.
+	void MarkDirty(Handle h)
+	{
+		if(!mDirty[h])
+		{
+			mDirty[h] = true;
+			mDirtyList.push_back(h);
+		}
+	}
+
+	// Calls fn(handle, entry) once for each entry marked since the last flush.
+	template<typename Fn>
+	void FlushDirty(Fn&& fn)
+	{
+		for(Handle h : mDirtyList)
+		{
+			mDirty[h] = false;
+			fn(h, *mEntries[h]);
+		}
+		mDirtyList.clear();
+	}
+
+	// Every entry in handle order, for build-time passes.
+	typename std::vector<std::unique_ptr<T>>::const_iterator begin()const { return mEntries.begin(); }
+	typename std::vector<std::unique_ptr<T>>::const_iterator end()const { return mEntries.end(); }
+
+private:
+	std::vector<std::unique_ptr<T>> mEntries;
+
+	// mDirty[h] is set while h is in mDirtyList.
+	std::vector<bool> mDirty;
+	std::vector<Handle> mDirtyList;
+};
@@ -0,0 +1,205 @@
+//***************************************************************************************
+// ResidencyManager.cpp
+//***************************************************************************************
+
+#include "ResidencyManager.h"
+
+using Microsoft::WRL::ComPtr;
+
+const float ResidencyManager::Headroom = 0.05f;
+
+namespace
+{
+	D3D12_RESIDENCY_PRIORITY ToResidencyPriority(ResidencyManager::Priority priority)
+	{
+		switch(priority)
+		{
+		case ResidencyManager::Priority::Low:
+			return D3D12_RESIDENCY_PRIORITY_LOW;
+		case ResidencyManager::Priority::High:
+			return D3D12_RESIDENCY_PRIORITY_HIGH;
+		default:
+			return D3D12_RESIDENCY_PRIORITY_NORMAL;
+		}
+	}
+}
+
+ResidencyManager::ResidencyManager(ID3D12Device* device, IDXGIAdapter3* adapter)
+	: md3dDevice(device), mAdapter(adapter)
+{
+	device->QueryInterface(IID_PPV_ARGS(&mDevice1));
+
+	// Auto-reset: each signal is seen by one Update.
+	mBudgetEvent = CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS);
+	if(mBudgetEvent == nullptr)
+		ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+	ThrowIfFailed(mAdapter->RegisterVideoMemoryBudgetChangeNotificationEvent(mBudgetEvent, &mBudgetCookie));
+
+	QueryBudget();
+}
+
+ResidencyManager::~ResidencyManager()
+{
+	mAdapter->UnregisterVideoMemoryBudgetChangeNotification(mBudgetCookie);
+	CloseHandle(mBudgetEvent);
+}
+
+UINT ResidencyManager::Track(ID3D12Pageable* object, UINT64 bytes, Priority priority)
+{
+	UINT id;
+	if(!mFreeIds.empty())
+	{
+		id = mFreeIds.back();
+		mFreeIds.pop_back();
+	}
+	else
+	{
+		id = (UINT)mObjects.size();
+		mObjects.emplace_back();
+	}
+
+	Object& o = mObjects[id];
+	o = Object();
+	o.Pageable = object;
+	o.Bytes = bytes;
+	o.Level = priority;
+	o.LastUseFrame = mFrame;
+
+	if(mDevice1 != nullptr)
+	{
+		D3D12_RESIDENCY_PRIORITY residencyPriority = ToResidencyPriority(priority);
+		mDevice1->SetResidencyPriority(1, &object, &residencyPriority);
+	}
+
+	return id;
+}
+
+void ResidencyManager::Untrack(UINT id)
+{
+	mObjects[id] = Object();
+	mFreeIds.push_back(id);
+}
+
+void ResidencyManager::Use(UINT id, UINT64 fenceValue)
+{
+	Object& o = mObjects[id];
+	assert(o.Pageable != nullptr);
+
+	// Blocks until the pages are back; the object is not visible to the GPU before.
+	if(!o.Resident)
+	{
+		ThrowIfFailed(md3dDevice->MakeResident(1, &o.Pageable));
+		o.Resident = true;
+		mEvictedSinceQuery -= std::min<UINT64>(mEvictedSinceQuery, o.Bytes);
+		mLastQueryFrame = 0;
+		++mRestores;
+	}
+
+	o.LastUseFence = fenceValue;
+	o.LastUseFrame = mFrame;
+}
+
+bool ResidencyManager::IsResident(UINT id)const
+{
+	return mObjects[id].Resident;
+}
+
+void ResidencyManager::Update(UINT64 completedFence)
+{
+	++mFrame;
+
+	bool budgetChanged = WaitForSingleObject(mBudgetEvent, 0) == WAIT_OBJECT_0;
+	if(budgetChanged)
+		++mBudgetChanges;
+
+	if(budgetChanged || mLastQueryFrame == 0 || mFrame - mLastQueryFrame >= PollInterval)
+		QueryBudget();
+
+	EvictOverBudget(completedFence);
+}
+
+void ResidencyManager::SetBudgetOverride(UINT64 bytes)
+{
+	mBudgetOverride = bytes;
+}
+
+void ResidencyManager::QueryBudget()
+{
+	ThrowIfFailed(mAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &mLocalInfo));
+	ThrowIfFailed(mAdapter->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_NON_LOCAL, &mNonLocalInfo));
+
+	mEvictedSinceQuery = 0;
+	mLastQueryFrame = std::max<UINT64>(mFrame, 1);
+}
+
+void ResidencyManager::EvictOverBudget(UINT64 completedFence)
+{
+	UINT64 budget = mLocalInfo.Budget;
+	if(mBudgetOverride > 0)
+		budget = std::min<UINT64>(budget, mBudgetOverride);
+
+	UINT64 usage = mLocalInfo.CurrentUsage - std::min<UINT64>(mLocalInfo.CurrentUsage, mEvictedSinceQuery);
+	if(usage <= budget)
+		return;
+
+	// Least recently used first.
+	std::vector<UINT> candidates;
+	for(UINT id = 0; id < (UINT)mObjects.size(); ++id)
+	{
+		const Object& o = mObjects[id];
+		if(o.Pageable != nullptr && o.Resident && o.Level == Priority::Low &&
+			o.LastUseFence <= completedFence && mFrame - o.LastUseFrame >= EvictAfterFrames)
+		{
+			candidates.push_back(id);
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(),
+		[this](UINT a, UINT b) { return mObjects[a].LastUseFrame < mObjects[b].LastUseFrame; });
+
+	UINT64 target = (UINT64)(budget * (1.0 - Headroom));
+	std::vector<ID3D12Pageable*> evicted;
+	for(UINT id : candidates)
+	{
+		if(usage <= target)
+			break;
+
+		Object& o = mObjects[id];
+		o.Resident = false;
+		evicted.push_back(o.Pageable);
+
+		usage -= std::min<UINT64>(usage, o.Bytes);
+		mEvictedSinceQuery += o.Bytes;
+		++mEvictions;
+	}
+
+	if(!evicted.empty())
+		ThrowIfFailed(md3dDevice->Evict((UINT)evicted.size(), evicted.data()));
+}
+
+ResidencyManager::Stats ResidencyManager::GetStats()const
+{
+	Stats stats;
+	stats.LocalBudget = mBudgetOverride > 0 ? std::min<UINT64>(mLocalInfo.Budget, mBudgetOverride) : mLocalInfo.Budget;
+	stats.LocalUsage = mLocalInfo.CurrentUsage;
+	stats.NonLocalBudget = mNonLocalInfo.Budget;
+	stats.NonLocalUsage = mNonLocalInfo.CurrentUsage;
+
+	for(const Object& o : mObjects)
+	{
+		if(o.Pageable == nullptr)
+			continue;
+
+		++stats.TrackedCount;
+		stats.TrackedBytes += o.Bytes;
+		if(!o.Resident)
+		{
+			++stats.EvictedCount;
+			stats.EvictedBytes += o.Bytes;
+		}
+	}
+
+	stats.BudgetChanges = mBudgetChanges;
+	stats.Evictions = mEvictions;
+	stats.Restores = mRestores;
+	return stats;
+}
@@ -0,0 +1,122 @@
+//***************************************************************************************
+// ResidencyManager.h
+//
+// Watches the adapter's video memory budget and keeps the process under it.  The budget
+// and usage are queried with IDXGIAdapter3::QueryVideoMemoryInfo when the OS signals a
+// budget change, and every PollInterval frames in between.
+//
+// Clients track objects they can do without for a while, marking them used by each
+// frame that needs them.  While the local usage is over budget, the Low priority ones
+// unused for EvictAfterFrames frames, and no longer referenced by the GPU, are evicted
+// least recently used first; Use makes an evicted object resident again, waiting for the
+// paging.  Every tracked object also gets its priority as a residency priority hint, so
+// the OS pages it out before the untracked render targets and buffers.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+
+class ResidencyManager
+{
+public:
+	ResidencyManager(ID3D12Device* device, IDXGIAdapter3* adapter);
+	ResidencyManager(const ResidencyManager& rhs) = delete;
+	ResidencyManager& operator=(const ResidencyManager& rhs) = delete;
+	~ResidencyManager();
+
+	enum class Priority
+	{
+		Low = 0,	// may be evicted, e.g. a texture that nothing visible samples
+		Normal,
+		High
+	};
+
+	static const UINT PollInterval = 30;
+	static const UINT EvictAfterFrames = 120;
+
+	// Usage is kept under (1 - Headroom) of the budget once over it, so a fluctuating
+	// usage does not evict and restore the same objects every frame.
+	static const float Headroom;
+
+	static const UINT InvalidId = UINT_MAX;
+
+	// object must stay alive until untracked.  Returns its id.
+	UINT Track(ID3D12Pageable* object, UINT64 bytes, Priority priority);
+	void Untrack(UINT id);
+
+	// Marks the object used by the frame that signals fenceValue on the queue, and makes
+	// it resident first if it was evicted.  Record no use of it before calling this.
+	void Use(UINT id, UINT64 fenceValue);
+
+	bool IsResident(UINT id)const;
+
+	// Call once per frame with the queue's completed fence value.
+	void Update(UINT64 completedFence);
+
+	// Caps the local budget, e.g. to try out a smaller GPU; 0 removes the cap.
+	void SetBudgetOverride(UINT64 bytes);
+
+	struct Stats
+	{
+		// Local is the GPU's own memory; non-local the system memory it reaches.
+		UINT64 LocalBudget = 0;
+		UINT64 LocalUsage = 0;
+		UINT64 NonLocalBudget = 0;
+		UINT64 NonLocalUsage = 0;
+
+		UINT TrackedCount = 0;
+		UINT64 TrackedBytes = 0;
+		UINT EvictedCount = 0;
+		UINT64 EvictedBytes = 0;
+
+		// Budget change notifications so far, and objects evicted and restored.
+		UINT BudgetChanges = 0;
+		UINT Evictions = 0;
+		UINT Restores = 0;
+	};
+
+	Stats GetStats()const;
+
+private:
+	struct Object
+	{
+		ID3D12Pageable* Pageable = nullptr;
+		UINT64 Bytes = 0;
+		Priority Level = Priority::Normal;
+		bool Resident = true;
+		UINT64 LastUseFence = 0;
+		UINT64 LastUseFrame = 0;
+	};
+
+	void QueryBudget();
+	void EvictOverBudget(UINT64 completedFence);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	Microsoft::WRL::ComPtr<IDXGIAdapter3> mAdapter;
+
+	// Not available before Windows 10 1709; the priority hints are then skipped.
+	Microsoft::WRL::ComPtr<ID3D12Device1> mDevice1;
+
+	HANDLE mBudgetEvent = nullptr;
+	DWORD mBudgetCookie = 0;
+
+	DXGI_QUERY_VIDEO_MEMORY_INFO mLocalInfo = {};
+	DXGI_QUERY_VIDEO_MEMORY_INFO mNonLocalInfo = {};
+	UINT64 mBudgetOverride = 0;
+
+	// Bytes evicted since the last query, which its usage does not reflect yet.
+	UINT64 mEvictedSinceQuery = 0;
+
+	UINT64 mFrame = 0;
+	UINT64 mLastQueryFrame = 0;
+
+	// Indexed by id; untracked slots have no Pageable and are reused.
+	std::vector<Object> mObjects;
+	std::vector<UINT> mFreeIds;
+
+	UINT mBudgetChanges = 0;
+	UINT mEvictions = 0;
+	UINT mRestores = 0;
+};
@@ -0,0 +1,320 @@
+//***************************************************************************************
+// ShaderCache.cpp
+//***************************************************************************************
+
+#include "ShaderCache.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	// 64-bit FNV-1a.
+	const UINT64 FnvOffsetBasis = 14695981039346656037ull;
+
+	UINT64 Fnv1a(UINT64 hash, const void* data, size_t size)
+	{
+		const BYTE* bytes = static_cast<const BYTE*>(data);
+		for(size_t i = 0; i < size; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	UINT64 Fnv1a(UINT64 hash, const std::string& s)
+	{
+		// Include the terminator so that "ab","c" and "a","bc" differ.
+		return Fnv1a(hash, s.c_str(), s.size() + 1);
+	}
+
+	bool ReadFile(const std::wstring& filename, std::vector<char>& data)
+	{
+		std::ifstream fin(filename, std::ios::binary | std::ios::ate);
+		if(!fin)
+			return false;
+
+		data.resize((size_t)fin.tellg());
+		fin.seekg(0, std::ios::beg);
+		fin.read(data.data(), data.size());
+		return (bool)fin;
+	}
+
+	// Leads every cache file, so that a truncated or corrupted one is recognized.
+	struct CacheFileHeader
+	{
+		UINT32 Magic;
+		UINT32 Reserved;
+		UINT64 Size;
+		UINT64 Hash;
+	};
+
+	const UINT32 CacheFileMagic = 0x48435343; // "CSCH"
+
+	// Reads a file written by WriteCacheFile into data, without its header.  Fails if
+	// the file is missing or its size or hash do not match the header.
+	bool ReadCacheFile(const std::wstring& filename, std::vector<char>& data)
+	{
+		std::vector<char> file;
+		if(!ReadFile(filename, file) || file.size() < sizeof(CacheFileHeader))
+			return false;
+
+		CacheFileHeader header;
+		memcpy(&header, file.data(), sizeof(header));
+		if(header.Magic != CacheFileMagic || header.Size != file.size() - sizeof(header))
+			return false;
+
+		data.assign(file.begin() + sizeof(header), file.end());
+		return header.Hash == Fnv1a(FnvOffsetBasis, data.data(), data.size());
+	}
+
+	// Writes the header and data to a temporary file and renames it over filename, so
+	// that a crash or a concurrent run never leaves a partially written file in place.
+	bool WriteCacheFile(const std::wstring& filename, const void* data, size_t size)
+	{
+		CacheFileHeader header = {};
+		header.Magic = CacheFileMagic;
+		header.Size = size;
+		header.Hash = Fnv1a(FnvOffsetBasis, data, size);
+
+		std::wstring tempFile = filename + L".tmp";
+		{
+			std::ofstream fout(tempFile, std::ios::binary | std::ios::trunc);
+			if(!fout)
+				return false;
+
+			fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			fout.write(static_cast<const char*>(data), size);
+			if(!fout)
+			{
+				fout.close();
+				DeleteFileW(tempFile.c_str());
+				return false;
+			}
+		}
+
+		if(!MoveFileExW(tempFile.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+		{
+			DeleteFileW(tempFile.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	std::wstring ToHex(UINT64 value)
+	{
+		wchar_t buffer[17];
+		swprintf_s(buffer, L"%016llx", value);
+		return buffer;
+	}
+}
+
+ShaderCache::ShaderCache(ID3D12Device* device, const std::wstring& directory)
+	: md3dDevice(device), mDirectory(directory)
+{
+	// Fails harmlessly if the directory already exists.
+	CreateDirectoryW(mDirectory.c_str(), nullptr);
+
+	if(FAILED(md3dDevice->QueryInterface(IID_PPV_ARGS(&mDevice1))))
+		return;
+
+	// A library from another driver or adapter is rejected, as is a damaged file;
+	// start a new one then.
+	if(ReadCacheFile(mDirectory + L"\\Pipelines.bin", mLibraryData) && !mLibraryData.empty() &&
+		SUCCEEDED(mDevice1->CreatePipelineLibrary(mLibraryData.data(), mLibraryData.size(),
+			IID_PPV_ARGS(&mPipelineLibrary))))
+	{
+		return;
+	}
+
+	ResetPipelineLibrary();
+}
+
+ShaderCache::~ShaderCache()
+{
+	SavePipelineLibrary();
+}
+
+ComPtr<ID3DBlob> ShaderCache::CompileShader(
+	const std::wstring& filename,
+	const D3D_SHADER_MACRO* defines,
+	const std::string& entrypoint,
+	const std::string& target)
+{
+	std::vector<std::wstring> visited;
+	UINT64 key = HashSource(filename, visited);
+
+	for(const D3D_SHADER_MACRO* d = defines; d != nullptr && d->Name != nullptr; ++d)
+	{
+		key = Fnv1a(key, d->Name);
+		key = Fnv1a(key, d->Definition != nullptr ? d->Definition : "");
+	}
+	key = Fnv1a(key, entrypoint);
+	key = Fnv1a(key, target);
+
+	// d3dUtil::CompileShader compiles debug builds unoptimized.
+#if defined(DEBUG) || defined(_DEBUG)
+	key = Fnv1a(key, "debug");
+#endif
+
+	std::wstring stem = filename.substr(filename.find_last_of(L"\\/") + 1);
+	stem = stem.substr(0, stem.find_last_of(L'.'));
+	std::wstring cacheFile = mDirectory + L"\\" + stem + L"_" +
+		std::wstring(entrypoint.begin(), entrypoint.end()) + L"_" + ToHex(key) + L".cso";
+
+	// A damaged entry is compiled again and overwritten.
+	std::vector<char> cached;
+	if(ReadCacheFile(cacheFile, cached) && !cached.empty())
+	{
+		++mShaderHits;
+		ComPtr<ID3DBlob> blob;
+		ThrowIfFailed(D3DCreateBlob(cached.size(), &blob));
+		memcpy(blob->GetBufferPointer(), cached.data(), cached.size());
+		return blob;
+	}
+
+	++mShaderMisses;
+	ComPtr<ID3DBlob> byteCode = d3dUtil::CompileShader(filename, defines, entrypoint, target);
+
+	// Leaving the cache incomplete only costs a compile on the next run.
+	WriteCacheFile(cacheFile, byteCode->GetBufferPointer(), byteCode->GetBufferSize());
+
+	return byteCode;
+}
+
+// Hashes the file and, recursively, the files it includes with #include "...".
+UINT64 ShaderCache::HashSource(const std::wstring& filename, std::vector<std::wstring>& visited)const
+{
+	if(std::find(visited.begin(), visited.end(), filename) != visited.end())
+		return FnvOffsetBasis;
+	visited.push_back(filename);
+
+	std::vector<char> source;
+	if(!ReadFile(filename, source))
+		ThrowIfFailed(HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND));
+
+	UINT64 hash = Fnv1a(FnvOffsetBasis, source.data(), source.size());
+
+	std::wstring directory = filename.substr(0, filename.find_last_of(L"\\/") + 1);
+
+	std::istringstream lines(std::string(source.begin(), source.end()));
+	std::string line;
+	while(std::getline(lines, line))
+	{
+		size_t directive = line.find("#include");
+		if(directive == std::string::npos)
+			continue;
+
+		size_t begin = line.find('"', directive);
+		size_t end = begin != std::string::npos ? line.find('"', begin + 1) : std::string::npos;
+		if(end == std::string::npos)
+			continue;
+
+		// Only the name of an include that cannot be found, e.g. in a comment.
+		std::string include = line.substr(begin + 1, end - begin - 1);
+		std::wstring includeFile = directory + std::wstring(include.begin(), include.end());
+		if(GetFileAttributesW(includeFile.c_str()) == INVALID_FILE_ATTRIBUTES)
+		{
+			hash = Fnv1a(hash, include);
+			continue;
+		}
+
+		UINT64 includeHash = HashSource(includeFile, visited);
+		hash = Fnv1a(hash, &includeHash, sizeof(includeHash));
+	}
+
+	return hash;
+}
+
+ComPtr<ID3D12PipelineState> ShaderCache::CreateGraphicsPipeline(
+	const std::string& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc)
+{
+	std::wstring libraryName(name.begin(), name.end());
+
+	ComPtr<ID3D12PipelineState> pso;
+	if(mPipelineLibrary != nullptr &&
+		SUCCEEDED(mPipelineLibrary->LoadGraphicsPipeline(libraryName.c_str(), &desc, IID_PPV_ARGS(&pso))))
+	{
+		++mPipelineHits;
+	}
+	else
+	{
+		++mPipelineMisses;
+		ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso)));
+		StorePipeline(libraryName, pso.Get());
+	}
+
+	mPipelines.push_back(std::make_pair(libraryName, pso));
+	return pso;
+}
+
+ComPtr<ID3D12PipelineState> ShaderCache::CreateComputePipeline(
+	const std::string& name, const D3D12_COMPUTE_PIPELINE_STATE_DESC& desc)
+{
+	std::wstring libraryName(name.begin(), name.end());
+
+	ComPtr<ID3D12PipelineState> pso;
+	if(mPipelineLibrary != nullptr &&
+		SUCCEEDED(mPipelineLibrary->LoadComputePipeline(libraryName.c_str(), &desc, IID_PPV_ARGS(&pso))))
+	{
+		++mPipelineHits;
+	}
+	else
+	{
+		++mPipelineMisses;
+		ThrowIfFailed(md3dDevice->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pso)));
+		StorePipeline(libraryName, pso.Get());
+	}
+
+	mPipelines.push_back(std::make_pair(libraryName, pso));
+	return pso;
+}
+
+void ShaderCache::StorePipeline(const std::wstring& name, ID3D12PipelineState* pso)
+{
+	if(mPipelineLibrary == nullptr)
+		return;
+
+	if(SUCCEEDED(mPipelineLibrary->StorePipeline(name.c_str(), pso)))
+	{
+		mLibraryDirty = true;
+		return;
+	}
+
+	// The name holds a pipeline that no longer matches its description, and entries
+	// cannot be replaced; start over with this run's pipelines.
+	ResetPipelineLibrary();
+	if(mPipelineLibrary != nullptr && SUCCEEDED(mPipelineLibrary->StorePipeline(name.c_str(), pso)))
+		mLibraryDirty = true;
+}
+
+void ShaderCache::ResetPipelineLibrary()
+{
+	mPipelineLibrary = nullptr;
+	mLibraryData.clear();
+	mLibraryDirty = true;
+
+	// Drivers without pipeline library support fail here; PSOs are then not cached.
+	if(FAILED(mDevice1->CreatePipelineLibrary(nullptr, 0, IID_PPV_ARGS(&mPipelineLibrary))))
+	{
+		mPipelineLibrary = nullptr;
+		mLibraryDirty = false;
+		return;
+	}
+
+	for(auto& p : mPipelines)
+		mPipelineLibrary->StorePipeline(p.first.c_str(), p.second.Get());
+}
+
+void ShaderCache::SavePipelineLibrary()
+{
+	if(mPipelineLibrary == nullptr || !mLibraryDirty)
+		return;
+
+	std::vector<char> data(mPipelineLibrary->GetSerializedSize());
+	if(SUCCEEDED(mPipelineLibrary->Serialize(data.data(), data.size())) &&
+		WriteCacheFile(mDirectory + L"\\Pipelines.bin", data.data(), data.size()))
+	{
+		mLibraryDirty = false;
+	}
+}
@@ -0,0 +1,78 @@
+//***************************************************************************************
+// ShaderCache.h
+//
+// First-run caches for shader bytecode and pipeline state objects.
+//
+// Compiled shaders are written to the cache directory under a key hashed from the
+// source file, the files it #includes, the macro set, entry point, target and compile
+// flags; as long as none of those change, later runs load the bytecode
+// from disk instead of invoking the compiler.  Cache files carry their size
+// and hash and are renamed into place once fully written; one that fails the check
+// is treated as missing.
+//
+// PSOs are kept in an ID3D12PipelineLibrary that is serialized to the same directory.
+// A library that the driver rejects, or that holds a stale pipeline under a name, is
+// rebuilt from the pipelines of the current run.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <atomic>
+
+class ShaderCache
+{
+public:
+	ShaderCache(ID3D12Device* device, const std::wstring& directory);
+	ShaderCache(const ShaderCache& rhs) = delete;
+	ShaderCache& operator=(const ShaderCache& rhs) = delete;
+	~ShaderCache();
+
+	// Same as d3dUtil::CompileShader, through the cache.  May be called from several
+	// threads at once, for different shaders; the pipeline functions may not.
+	Microsoft::WRL::ComPtr<ID3DBlob> CompileShader(
+		const std::wstring& filename,
+		const D3D_SHADER_MACRO* defines,
+		const std::string& entrypoint,
+		const std::string& target);
+
+	// Loads the named pipeline from the library, or creates and stores it.
+	Microsoft::WRL::ComPtr<ID3D12PipelineState> CreateGraphicsPipeline(
+		const std::string& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc);
+	Microsoft::WRL::ComPtr<ID3D12PipelineState> CreateComputePipeline(
+		const std::string& name, const D3D12_COMPUTE_PIPELINE_STATE_DESC& desc);
+
+	// Writes the pipeline library if pipelines were added to it.  Also called on
+	// destruction.
+	void SavePipelineLibrary();
+
+	UINT ShaderHits()const { return mShaderHits; }
+	UINT ShaderMisses()const { return mShaderMisses; }
+	UINT PipelineHits()const { return mPipelineHits; }
+	UINT PipelineMisses()const { return mPipelineMisses; }
+
+private:
+	UINT64 HashSource(const std::wstring& filename, std::vector<std::wstring>& visited)const;
+	void StorePipeline(const std::wstring& name, ID3D12PipelineState* pso);
+	void ResetPipelineLibrary();
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	std::wstring mDirectory;
+
+	// Pipeline libraries need ID3D12Device1; without it PSOs are simply created.
+	Microsoft::WRL::ComPtr<ID3D12Device1> mDevice1;
+	Microsoft::WRL::ComPtr<ID3D12PipelineLibrary> mPipelineLibrary;
+
+	// The serialized library it was created from, which must outlive it.
+	std::vector<char> mLibraryData;
+	bool mLibraryDirty = false;
+
+	// Every pipeline of this run, to refill a library that had to be reset.
+	std::vector<std::pair<std::wstring, Microsoft::WRL::ComPtr<ID3D12PipelineState>>> mPipelines;
+
+	std::atomic<UINT> mShaderHits{ 0 };
+	std::atomic<UINT> mShaderMisses{ 0 };
+	UINT mPipelineHits = 0;
+	UINT mPipelineMisses = 0;
+};
@@ -0,0 +1,84 @@
+//***************************************************************************************
+// ShaderPermutations.cpp
+//***************************************************************************************
+
+#include "ShaderPermutations.h"
+#include <ppl.h>
+
+using Microsoft::WRL::ComPtr;
+
+ShaderPermutations::ShaderPermutations(ShaderCache* cache, const std::wstring& filename,
+	const std::vector<Feature>& features, const std::vector<D3D_SHADER_MACRO>& defines)
+	: mCache(cache), mFilename(filename), mFeatures(features), mDefines(defines)
+{
+}
+
+void ShaderPermutations::Request(UINT key, const std::string& entrypoint, const std::string& target)
+{
+	auto it = mVariants.emplace(std::make_pair(Mask(key), entrypoint), Variant()).first;
+	if(it->second.Target.empty())
+		it->second.Target = target;
+	assert(it->second.Target == target);
+}
+
+void ShaderPermutations::CompilePending()
+{
+	std::vector<std::pair<const std::pair<UINT, std::string>, Variant>*> pending;
+	for(auto& v : mVariants)
+	{
+		if(v.second.ByteCode == nullptr)
+			pending.push_back(&v);
+	}
+
+	// ShaderCache::CompileShader may be called concurrently; an exception from any of
+	// the tasks is rethrown here once they have all stopped.
+	concurrency::parallel_for(0, (int)pending.size(), [this, &pending](int i)
+	{
+		UINT key = pending[i]->first.first;
+
+		// Reserved, so the definitions are not moved by a later push_back.
+		std::vector<std::string> values;
+		values.reserve(mFeatures.size());
+
+		std::vector<D3D_SHADER_MACRO> macros = mDefines;
+		for(auto& f : mFeatures)
+		{
+			UINT value = (key >> f.Shift) & ((1u << f.Bits) - 1);
+			if(f.Bits > 1)
+			{
+				values.push_back(std::to_string(value));
+				macros.push_back({ f.Macro, values.back().c_str() });
+			}
+			else if(value != 0)
+			{
+				macros.push_back({ f.Macro, "1" });
+			}
+		}
+		macros.push_back({ NULL, NULL });
+
+		pending[i]->second.ByteCode = mCache->CompileShader(
+			mFilename, macros.data(), pending[i]->first.second, pending[i]->second.Target);
+	});
+}
+
+D3D12_SHADER_BYTECODE ShaderPermutations::Get(UINT key, const std::string& entrypoint)const
+{
+	auto it = mVariants.find(std::make_pair(Mask(key), entrypoint));
+	assert(it != mVariants.end() && it->second.ByteCode != nullptr);
+
+	ID3DBlob* byteCode = it->second.ByteCode.Get();
+	return { reinterpret_cast<BYTE*>(byteCode->GetBufferPointer()), byteCode->GetBufferSize() };
+}
+
+UINT ShaderPermutations::VariantCount()const
+{
+	return (UINT)mVariants.size();
+}
+
+UINT ShaderPermutations::Mask(UINT key)const
+{
+	UINT mask = 0;
+	for(auto& f : mFeatures)
+		mask |= ((1u << f.Bits) - 1) << f.Shift;
+	return key & mask;
+}
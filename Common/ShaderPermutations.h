@@ -0,0 +1,67 @@
+//***************************************************************************************
+// ShaderPermutations.h
+//
+// The compiled variants of one shader file, selected by a key of feature bits.
+//
+// Each Feature maps a field of the key to a macro: a one bit field defines the macro as
+// 1 when set and leaves it undefined otherwise, so the code under its #ifdef is
+// stripped; a wider field always defines the macro as the field's value, e.g. a light
+// count.  Callers request the variants they need, then CompilePending compiles the new
+// ones through the ShaderCache in parallel, one task per variant, so each variant is
+// compiled once however many materials or passes share it.
+//***************************************************************************************
+
+#pragma once
+
+#include "ShaderCache.h"
+#include <map>
+
+class ShaderPermutations
+{
+public:
+	struct Feature
+	{
+		const char* Macro;
+		UINT Shift;
+		UINT Bits;
+	};
+
+	// defines, without a terminator, are added to every variant.  The strings must
+	// outlive this, and so must cache.
+	ShaderPermutations(ShaderCache* cache, const std::wstring& filename,
+		const std::vector<Feature>& features, const std::vector<D3D_SHADER_MACRO>& defines);
+	ShaderPermutations(const ShaderPermutations& rhs) = delete;
+	ShaderPermutations& operator=(const ShaderPermutations& rhs) = delete;
+	~ShaderPermutations() = default;
+
+	// Queues the variant for CompilePending, unless already requested.  Bits of key
+	// outside the features are ignored.
+	void Request(UINT key, const std::string& entrypoint, const std::string& target);
+
+	// Compiles the variants requested since the last call.
+	void CompilePending();
+
+	// A variant compiled by CompilePending.
+	D3D12_SHADER_BYTECODE Get(UINT key, const std::string& entrypoint)const;
+
+	UINT VariantCount()const;
+
+private:
+	UINT Mask(UINT key)const;
+
+private:
+	struct Variant
+	{
+		std::string Target;
+		Microsoft::WRL::ComPtr<ID3DBlob> ByteCode;
+	};
+
+	ShaderCache* mCache = nullptr;
+	std::wstring mFilename;
+	std::vector<Feature> mFeatures;
+	std::vector<D3D_SHADER_MACRO> mDefines;
+
+	// By masked key and entry point; the nodes do not move, so the compile tasks write
+	// their own variant directly.
+	std::map<std::pair<UINT, std::string>, Variant> mVariants;
+};
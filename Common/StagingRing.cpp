@@ -0,0 +1,161 @@
+//***************************************************************************************
+// StagingRing.cpp
+//***************************************************************************************
+
+#include "StagingRing.h"
+
+using Microsoft::WRL::ComPtr;
+
+StagingRing::StagingRing(ID3D12Device* device, UINT64 capacity)
+	: md3dDevice(device), mCapacity(capacity)
+{
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(mCapacity),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&mBuffer)));
+
+	// Stays mapped for the lifetime of the ring; the CPU only writes to it.
+	ThrowIfFailed(mBuffer->Map(0, nullptr, reinterpret_cast<void**>(&mMappedData)));
+}
+
+StagingRing::~StagingRing()
+{
+	// Copies may still be reading from the ring; wait for every submitted one.
+	for(auto& b : mBlocks)
+	{
+		if(b.Fence != nullptr && b.Fence->GetCompletedValue() < b.FenceValue)
+			b.Fence->SetEventOnCompletion(b.FenceValue, nullptr);
+	}
+
+	if(mBuffer != nullptr)
+		mBuffer->Unmap(0, nullptr);
+
+	mMappedData = nullptr;
+}
+
+StagingRing::Allocation StagingRing::Allocate(ID3D12CommandList* cmdList, UINT64 byteSize, UINT64 alignment)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	if(byteSize > mCapacity)
+		return AllocateDedicated(cmdList, byteSize);
+
+	for(;;)
+	{
+		ReclaimLocked();
+
+		// Align the start, and skip the end of the ring if the block would straddle it.
+		UINT64 wrapped = mHead % mCapacity;
+		UINT64 start = mHead + ((alignment - wrapped % alignment) % alignment);
+		if(start % mCapacity + byteSize > mCapacity || start % mCapacity < wrapped)
+		{
+			start = mHead + (mCapacity - wrapped);
+
+			// Nothing is in use, so the skipped end need not be kept: restart the ring.
+			if(mBlocks.empty())
+			{
+				mHead = start;
+				mTail = mHead;
+			}
+		}
+
+		if(start + byteSize - mTail <= mCapacity)
+		{
+			Block block;
+			block.End = start + byteSize;
+			block.Owner = cmdList;
+			mBlocks.push_back(block);
+			mHead = block.End;
+
+			Allocation a;
+			a.Resource = mBuffer.Get();
+			a.Offset = start % mCapacity;
+			a.CpuAddress = mMappedData + a.Offset;
+			return a;
+		}
+
+		// The ring is full up to the oldest block.  If its copy has been submitted,
+		// wait for it; otherwise it may be ours and waiting would never return.
+		// Waiting under the lock is fine: every block ahead of us is already submitted.
+		if(mBlocks.empty() || mBlocks.front().Fence == nullptr)
+			return AllocateDedicated(cmdList, byteSize);
+
+		Block& oldest = mBlocks.front();
+
+		ThrowIfFailed(oldest.Fence->SetEventOnCompletion(oldest.FenceValue, nullptr));
+	}
+}
+
+StagingRing::Allocation StagingRing::AllocateDedicated(ID3D12CommandList* cmdList, UINT64 byteSize)
+{
+	Block block;
+	block.End = mHead;
+	block.DedicatedSize = byteSize;
+	block.Owner = cmdList;
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(byteSize),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&block.Dedicated)));
+
+	// Mapped until the buffer is released.
+	Allocation a;
+	a.Resource = block.Dedicated.Get();
+	a.Offset = 0;
+	ThrowIfFailed(block.Dedicated->Map(0, nullptr, reinterpret_cast<void**>(&a.CpuAddress)));
+
+	mDedicatedBytes += byteSize;
+	mBlocks.push_back(block);
+	return a;
+}
+
+void StagingRing::Submitted(ID3D12CommandList* cmdList, ID3D12Fence* fence, UINT64 fenceValue)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+
+	for(auto& b : mBlocks)
+	{
+		if(b.Owner == cmdList && b.Fence == nullptr)
+		{
+			b.Fence = fence;
+			b.FenceValue = fenceValue;
+		}
+	}
+}
+
+void StagingRing::Reclaim()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	ReclaimLocked();
+}
+
+void StagingRing::ReclaimLocked()
+{
+	// Blocks are freed in allocation order, so one that is still in flight holds back
+	// the ones behind it.
+	while(!mBlocks.empty())
+	{
+		Block& b = mBlocks.front();
+		if(b.Fence == nullptr || b.Fence->GetCompletedValue() < b.FenceValue)
+			break;
+
+		mTail = b.End;
+		mDedicatedBytes -= b.DedicatedSize;
+		mBlocks.pop_front();
+	}
+
+	if(mBlocks.empty())
+		mTail = mHead;
+}
+
+UINT64 StagingRing::BytesInUse()const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return (mHead - mTail) + mDedicatedBytes;
+}
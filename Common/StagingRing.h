@@ -0,0 +1,82 @@
+//***************************************************************************************
+// StagingRing.h
+//
+// Suballocates upload memory from one persistently mapped upload heap used as a ring.
+// An allocation belongs to the command list that records the copy out of it; once
+// that list has been submitted, Submitted() tags its allocations with the fence value
+// that marks the copy as consumed, and Reclaim() gives the space back in allocation
+// order.  Requests that do not fit behind an allocation that has not been submitted
+// yet, or that are larger than the ring, get a dedicated upload buffer that is released
+// the same way.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include <deque>
+#include <mutex>
+
+class StagingRing
+{
+public:
+	StagingRing(ID3D12Device* device, UINT64 capacity);
+	StagingRing(const StagingRing& rhs) = delete;
+	StagingRing& operator=(const StagingRing& rhs) = delete;
+	~StagingRing();
+
+	struct Allocation
+	{
+		ID3D12Resource* Resource = nullptr;
+		UINT64 Offset = 0;
+		BYTE* CpuAddress = nullptr;
+	};
+
+	// Returns byteSize bytes of upload memory for copies recorded on cmdList.  Blocks
+	// while the ring is full of submitted copies.  Thread safe.
+	Allocation Allocate(ID3D12CommandList* cmdList, UINT64 byteSize,
+		UINT64 alignment = D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+
+	// Call after cmdList has been executed and fence is signalled to fenceValue behind
+	// it; the allocations made for cmdList since its last submission are free once the
+	// fence reaches that value.  Thread safe.
+	void Submitted(ID3D12CommandList* cmdList, ID3D12Fence* fence, UINT64 fenceValue);
+
+	// Frees the allocations whose copies have completed.  Thread safe.
+	void Reclaim();
+
+	// Bytes of the ring, plus dedicated buffers, still waiting for their copies.
+	UINT64 BytesInUse()const;
+
+private:
+	struct Block
+	{
+		// Ring position (monotonic, not wrapped) just past the block, and the size
+		// of a dedicated buffer, which takes no ring space.
+		UINT64 End = 0;
+		UINT64 DedicatedSize = 0;
+		Microsoft::WRL::ComPtr<ID3D12Resource> Dedicated;
+
+		ID3D12CommandList* Owner = nullptr;
+		ID3D12Fence* Fence = nullptr;
+		UINT64 FenceValue = 0;
+	};
+
+	void ReclaimLocked();
+	Allocation AllocateDedicated(ID3D12CommandList* cmdList, UINT64 byteSize);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mBuffer;
+	BYTE* mMappedData = nullptr;
+	UINT64 mCapacity = 0;
+
+	// Monotonic ring positions: mHead is where the next allocation starts and
+	// mTail is the start of the oldest block still in use.
+	UINT64 mHead = 0;
+	UINT64 mTail = 0;
+	UINT64 mDedicatedBytes = 0;
+
+	std::deque<Block> mBlocks;
+	mutable std::mutex mMutex;
+};
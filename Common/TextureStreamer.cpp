@@ -0,0 +1,149 @@
+//***************************************************************************************
+// TextureStreamer.cpp
+//***************************************************************************************
+
+#include "TextureStreamer.h"
+
+using Microsoft::WRL::ComPtr;
+
+TextureStreamer::TextureStreamer(ID3D12Device* device, StagingRing& staging)
+	: md3dDevice(device), mStaging(staging)
+{
+	D3D12_COMMAND_QUEUE_DESC queueDesc = {};
+	queueDesc.Type = D3D12_COMMAND_LIST_TYPE_COPY;
+	queueDesc.Flags = D3D12_COMMAND_QUEUE_FLAG_NONE;
+	ThrowIfFailed(md3dDevice->CreateCommandQueue(&queueDesc, IID_PPV_ARGS(&mCopyQueue)));
+
+	ThrowIfFailed(md3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&mFence)));
+}
+
+TextureStreamer::~TextureStreamer()
+{
+	// Let the workers finish, then wait for the copy queue to drain so no
+	// upload heap is released while the GPU still reads it.
+	for(auto& r : mRequests)
+	{
+		// A failed request has nothing in flight; its error is not ours to report here.
+		try { r->Top.Task.wait(); }
+		catch(...) { }
+	}
+
+	if(mFence->GetCompletedValue() < mFenceValue)
+	{
+		HANDLE eventHandle = CreateEventEx(nullptr, nullptr, false, EVENT_ALL_ACCESS);
+		if(eventHandle != nullptr)
+		{
+			mFence->SetEventOnCompletion(mFenceValue, eventHandle);
+			WaitForSingleObject(eventHandle, INFINITE);
+			CloseHandle(eventHandle);
+		}
+	}
+}
+
+void TextureStreamer::Load(Texture* tex)
+{
+	auto request = std::make_unique<Request>();
+	request->Tex = tex;
+
+	Request* r = request.get();
+	request->Tail.Task = concurrency::create_task([this, r]()
+	{
+		// The loader clamps the range to the texture's last mip.
+		Record(*r, r->Tail, TopMipCount, UINT_MAX);
+		r->TailMip = std::min<UINT>(TopMipCount, r->Tex->Resource->GetDesc().MipLevels - 1);
+	});
+
+	// Not run if the tail failed; its error then surfaces from both tasks.
+	request->Top.Task = request->Tail.Task.then([this, r]()
+	{
+		if(r->TailMip > 0)
+			Record(*r, r->Top, 0, r->TailMip);
+		else
+			r->Top.Fence = r->Tail.Fence;
+	});
+
+	mRequests.push_back(std::move(request));
+}
+
+// Runs on a worker thread.  The first pass creates tex->Resource.
+void TextureStreamer::Record(Request& request, Pass& pass, UINT firstMip, UINT mipLevels)
+{
+	Texture* tex = request.Tex;
+
+	ThrowIfFailed(md3dDevice->CreateCommandAllocator(
+		D3D12_COMMAND_LIST_TYPE_COPY,
+		IID_PPV_ARGS(pass.CmdListAlloc.GetAddressOf())));
+
+	ThrowIfFailed(md3dDevice->CreateCommandList(
+		0,
+		D3D12_COMMAND_LIST_TYPE_COPY,
+		pass.CmdListAlloc.Get(),
+		nullptr,
+		IID_PPV_ARGS(pass.CmdList.GetAddressOf())));
+
+	// File IO dominates, and is what we want off the main thread.  The mapped pages
+	// are read as the mips are copied into the staging ring.
+	ThrowIfFailed(DirectX::LoadDDSTextureMipsFromFile12(md3dDevice,
+		pass.CmdList.Get(), tex->Filename.c_str(), firstMip, mipLevels,
+		tex->Resource, tex->UploadHeap, D3D12_RESOURCE_STATE_COMMON, &mStaging));
+
+	ThrowIfFailed(pass.CmdList->Close());
+
+	std::lock_guard<std::mutex> lock(mSubmitMutex);
+
+	ID3D12CommandList* cmdsLists[] = { pass.CmdList.Get() };
+	mCopyQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
+
+	pass.Fence = ++mFenceValue;
+	ThrowIfFailed(mCopyQueue->Signal(mFence.Get(), pass.Fence));
+	mStaging.Submitted(pass.CmdList.Get(), mFence.Get(), pass.Fence);
+}
+
+bool TextureStreamer::Completed(Pass& pass, UINT64 completedFence)
+{
+	// Task completion also publishes the worker's writes to the request and its texture.
+	if(!pass.Task.is_done())
+		return false;
+
+	// Rethrows a failure of the worker.
+	pass.Task.get();
+
+	return pass.Fence <= completedFence;
+}
+
+std::vector<Texture*> TextureStreamer::CollectCompleted()
+{
+	std::vector<Texture*> completed;
+
+	UINT64 completedFence = mFence->GetCompletedValue();
+	for(auto it = mRequests.begin(); it != mRequests.end();)
+	{
+		Request& r = **it;
+
+		// The copy queue runs the passes in order, so a finished top also means a
+		// finished tail; the texture is then returned once, fully resident.
+		if(Completed(r.Top, completedFence))
+		{
+			r.Tex->ResidentMip = 0;
+			completed.push_back(r.Tex);
+			it = mRequests.erase(it);
+			continue;
+		}
+
+		if(!r.TailCollected && Completed(r.Tail, completedFence))
+		{
+			r.Tex->ResidentMip = r.TailMip;
+			r.TailCollected = true;
+			completed.push_back(r.Tex);
+		}
+
+		++it;
+	}
+
+	return completed;
+}
+
+UINT TextureStreamer::PendingCount()const
+{
+	return (UINT)mRequests.size();
+}
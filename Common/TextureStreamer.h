@@ -0,0 +1,88 @@
+//***************************************************************************************
+// TextureStreamer.h
+//
+// Loads DDS textures in the background.  Each request memory-maps its file on a PPL
+// worker thread, records the upload into its own copy command list and submits it
+// to a dedicated D3D12_COMMAND_LIST_TYPE_COPY queue.  The textures are left in the
+// COMMON state, from which the direct queue promotes them to a shader resource state
+// on first use.  Upload memory comes from a StagingRing and is recycled as soon as
+// the copy completes.  The client polls CollectCompleted() and keeps drawing with its own
+// placeholder until a texture is returned from it.
+//
+// The mip tail is uploaded first and the top TopMipCount mips by a second submission,
+// so a texture is returned once with ResidentMip at its tail and again with
+// ResidentMip 0.  Until then the client must not view mips above ResidentMip, which
+// the copy queue may still be writing.
+//***************************************************************************************
+
+#pragma once
+
+#include "d3dUtil.h"
+#include "StagingRing.h"
+#include <mutex>
+#include <ppltasks.h>
+
+class TextureStreamer
+{
+public:
+	TextureStreamer(ID3D12Device* device, StagingRing& staging);
+	TextureStreamer(const TextureStreamer& rhs) = delete;
+	TextureStreamer& operator=(const TextureStreamer& rhs) = delete;
+	~TextureStreamer();
+
+	// Starts loading tex->Filename into tex->Resource.  tex must stay alive until it
+	// is returned by CollectCompleted().
+	void Load(Texture* tex);
+
+	// Returns the textures whose copies have finished on the GPU since the last call.
+	// Rethrows the error of a request that failed.  Main thread only.
+	std::vector<Texture*> CollectCompleted();
+
+	// Number of requests not yet returned with all their mips by CollectCompleted().
+	UINT PendingCount()const;
+
+	// Mips uploaded after the tail.  The top two hold about 15/16 of a texture.
+	static const UINT TopMipCount = 2;
+
+private:
+	// One upload of a mip range of every array slice.
+	struct Pass
+	{
+		Microsoft::WRL::ComPtr<ID3D12CommandAllocator> CmdListAlloc;
+		Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> CmdList;
+
+		// Copy queue fence value of the submitted upload; set by the worker.
+		UINT64 Fence = 0;
+
+		concurrency::task<void> Task;
+	};
+
+	struct Request
+	{
+		Texture* Tex = nullptr;
+
+		// Most detailed mip of the tail; set by the tail pass.
+		UINT TailMip = 0;
+		bool TailCollected = false;
+
+		// Top continues Tail's task.
+		Pass Tail;
+		Pass Top;
+	};
+
+	void Record(Request& request, Pass& pass, UINT firstMip, UINT mipLevels);
+	static bool Completed(Pass& pass, UINT64 completedFence);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	StagingRing& mStaging;
+
+	Microsoft::WRL::ComPtr<ID3D12CommandQueue> mCopyQueue;
+	Microsoft::WRL::ComPtr<ID3D12Fence> mFence;
+
+	// Serializes submission so fence values are signalled in increasing order.
+	std::mutex mSubmitMutex;
+	UINT64 mFenceValue = 0;
+
+	std::vector<std::unique_ptr<Request>> mRequests;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "d3dUtil.h"
+#include "GpuAllocator.h"
 
 template<typename T>
 class UploadBuffer
@@ -21,9 +22,8 @@ public:
         if(isConstantBuffer)
             mElementByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(T));
 
-        ThrowIfFailed(device->CreateCommittedResource(
-            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
-            D3D12_HEAP_FLAG_NONE,
+        ThrowIfFailed(CreateGpuResource(device,
+            D3D12_HEAP_TYPE_UPLOAD,
             &CD3DX12_RESOURCE_DESC::Buffer(mElementByteSize*elementCount),
 			D3D12_RESOURCE_STATE_GENERIC_READ,
             nullptr,
@@ -55,6 +55,41 @@ public:
         memcpy(&mMappedData[elementIndex*mElementByteSize], &data, sizeof(T));
     }
 
+    // Copies count elements starting at firstElement.  Non-constant buffers are
+    // tightly packed, so this is a single contiguous memcpy.
+    void CopyRange(int firstElement, int count, const T* data)
+    {
+        if(!mIsConstantBuffer)
+        {
+            memcpy(&mMappedData[firstElement*mElementByteSize], data, count*sizeof(T));
+        }
+        else
+        {
+            for(int i = 0; i < count; ++i)
+                memcpy(&mMappedData[(firstElement + i)*mElementByteSize], &data[i], sizeof(T));
+        }
+    }
+
+    // Typed view of the persistently mapped memory so callers can write their data
+    // in place.  Only non-constant buffers are tightly packed; constant buffer
+    // elements must be addressed through ElementPtr.  The memory is write-combined,
+    // so write it sequentially and never read it back.
+    T* MappedData()
+    {
+        assert(!mIsConstantBuffer);
+        return reinterpret_cast<T*>(mMappedData);
+    }
+
+    T* ElementPtr(int elementIndex)
+    {
+        return reinterpret_cast<T*>(&mMappedData[elementIndex*mElementByteSize]);
+    }
+
+    UINT ElementByteSize()const
+    {
+        return mElementByteSize;
+    }
+
 private:
     Microsoft::WRL::ComPtr<ID3D12Resource> mUploadBuffer;
     BYTE* mMappedData = nullptr;
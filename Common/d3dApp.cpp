@@ -35,6 +35,11 @@ D3DApp::~D3DApp()
 {
 	if(md3dDevice != nullptr)
 		FlushCommandQueue();
+
+	if(mFrameLatencyWaitableObject != nullptr)
+		CloseHandle(mFrameLatencyWaitableObject);
+	if(mFlushEvent != nullptr)
+		CloseHandle(mFlushEvent);
 }
 
 HINSTANCE D3DApp::AppInst()const
@@ -90,6 +95,11 @@ int D3DApp::Run()
 
 			if( !mAppPaused )
 			{
+				//! Block until the swap chain can take another frame, so the frame we are
+				//! about to build is shown with at most mMaxFrameLatency frames of lag.
+				if(mFrameLatencyWaitableObject != nullptr)
+					WaitForSingleObjectEx(mFrameLatencyWaitableObject, 1000, true);
+
 				CalculateFrameStats();
 				Update(mTimer);	
                 Draw(mTimer);
@@ -106,7 +116,7 @@ int D3DApp::Run()
 
 bool D3DApp::Initialize()
 {
-	if(!InitMainWindow())
+	if(!mHeadless && !InitMainWindow())
 		return false;
 
 	if(!InitDirect3D())
@@ -141,7 +151,7 @@ void D3DApp::CreateRtvAndDsvDescriptorHeaps()
 void D3DApp::OnResize()
 {
 	assert(md3dDevice);
-	assert(mSwapChain);
+	assert(mSwapChain || mHeadless);
     assert(mDirectCmdListAlloc);
 
 	//! Flush before changing any resources.
@@ -155,18 +165,37 @@ void D3DApp::OnResize()
     mDepthStencilBuffer.Reset();
 	
 	//! Resize the swap chain.
-    ThrowIfFailed(mSwapChain->ResizeBuffers(
-		SwapChainBufferCount, 
-		mClientWidth, mClientHeight, 
-		mBackBufferFormat, 
-		DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH));
+	if(!mHeadless)
+	{
+		ThrowIfFailed(mSwapChain->ResizeBuffers(
+			SwapChainBufferCount, 
+			mClientWidth, mClientHeight, 
+			mBackBufferFormat, 
+			SwapChainFlags()));
+	}
 
 	mCurrBackBuffer = 0;
  
 	CD3DX12_CPU_DESCRIPTOR_HANDLE rtvHeapHandle(mRtvHeap->GetCPUDescriptorHandleForHeapStart());
 	for (UINT i = 0; i < SwapChainBufferCount; i++)
 	{
-		ThrowIfFailed(mSwapChain->GetBuffer(i, IID_PPV_ARGS(&mSwapChainBuffer[i])));
+		if(mHeadless)
+		{
+			//! Offscreen stand-ins, created in PRESENT like the swap chain's buffers.
+			D3D12_RESOURCE_DESC backBufferDesc = CD3DX12_RESOURCE_DESC::Tex2D(mBackBufferFormat,
+				mClientWidth, mClientHeight, 1, 1, 1, 0, D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET);
+			ThrowIfFailed(md3dDevice->CreateCommittedResource(
+				&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+				D3D12_HEAP_FLAG_NONE,
+				&backBufferDesc,
+				D3D12_RESOURCE_STATE_PRESENT,
+				nullptr,
+				IID_PPV_ARGS(&mSwapChainBuffer[i])));
+		}
+		else
+		{
+			ThrowIfFailed(mSwapChain->GetBuffer(i, IID_PPV_ARGS(&mSwapChainBuffer[i])));
+		}
 		md3dDevice->CreateRenderTargetView(mSwapChainBuffer[i].Get(), nullptr, rtvHeapHandle);
 		rtvHeapHandle.Offset(1, mRtvDescriptorSize);
 	}
@@ -364,6 +393,8 @@ LRESULT D3DApp::MsgProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         }
         else if((int)wParam == VK_F2)
             Set4xMsaaState(!m4xMsaaState);
+        else
+            OnKeyUp(wParam);
 
         return 0;
 	}
@@ -465,6 +496,22 @@ bool D3DApp::InitDirect3D()
 	ThrowIfFailed(md3dDevice->CreateFence(0, D3D12_FENCE_FLAG_NONE,
 		IID_PPV_ARGS(&mFence)));
 
+	mFlushEvent = CreateEventEx(nullptr, nullptr, false, EVENT_ALL_ACCESS);
+	if(mFlushEvent == nullptr)
+		ThrowIfFailed(HRESULT_FROM_WIN32(GetLastError()));
+
+	//! Tearing (variable refresh rate) needs DXGI 1.5 and driver support.
+	ComPtr<IDXGIFactory5> factory5;
+	if(SUCCEEDED(mdxgiFactory.As(&factory5)))
+	{
+		BOOL allowTearing = FALSE;
+		if(SUCCEEDED(factory5->CheckFeatureSupport(DXGI_FEATURE_PRESENT_ALLOW_TEARING,
+			&allowTearing, sizeof(allowTearing))))
+		{
+			mTearingSupported = allowTearing == TRUE;
+		}
+	}
+
 	mRtvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
 	mDsvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_DSV);
 	mCbvSrvUavDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
@@ -491,7 +538,8 @@ bool D3DApp::InitDirect3D()
 #endif
 
 	CreateCommandObjects();
-    CreateSwapChain();
+	if(!mHeadless)
+		CreateSwapChain();
     CreateRtvAndDsvDescriptorHeaps();
 
 	return true;
@@ -523,10 +571,34 @@ void D3DApp::CreateCommandObjects()
 	mCommandList->Close();
 }
 
+UINT D3DApp::SwapChainFlags()const
+{
+	//! ResizeBuffers must be given the same flags the swap chain was created with.
+	UINT flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+	if(mMaxFrameLatency > 0)
+		flags |= DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT;
+	if(mAllowTearing && mTearingSupported)
+		flags |= DXGI_SWAP_CHAIN_FLAG_ALLOW_TEARING;
+	return flags;
+}
+
+UINT D3DApp::PresentFlags()const
+{
+	//! Tearing is only legal with a sync interval of 0 and outside exclusive fullscreen.
+	if(mSyncInterval == 0 && mAllowTearing && mTearingSupported && !mFullscreenState)
+		return DXGI_PRESENT_ALLOW_TEARING;
+	return 0;
+}
+
 void D3DApp::CreateSwapChain()
 {
     //! Release the previous swapchain we will be recreating.
     mSwapChain.Reset();
+	if(mFrameLatencyWaitableObject != nullptr)
+	{
+		CloseHandle(mFrameLatencyWaitableObject);
+		mFrameLatencyWaitableObject = nullptr;
+	}
 
     DXGI_SWAP_CHAIN_DESC sd;
     sd.BufferDesc.Width = mClientWidth;
@@ -543,13 +615,21 @@ void D3DApp::CreateSwapChain()
     sd.OutputWindow = mhMainWnd;
     sd.Windowed = true;
 	sd.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-    sd.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+    sd.Flags = SwapChainFlags();
 
 	// Note: Swap chain uses queue to perform flush.
     ThrowIfFailed(mdxgiFactory->CreateSwapChain(
 		mCommandQueue.Get(),
 		&sd, 
 		mSwapChain.GetAddressOf()));
+
+	if(mMaxFrameLatency > 0)
+	{
+		ComPtr<IDXGISwapChain2> swapChain2;
+		ThrowIfFailed(mSwapChain.As(&swapChain2));
+		ThrowIfFailed(swapChain2->SetMaximumFrameLatency(mMaxFrameLatency));
+		mFrameLatencyWaitableObject = swapChain2->GetFrameLatencyWaitableObject();
+	}
 }
 
 void D3DApp::FlushCommandQueue()
@@ -565,19 +645,23 @@ void D3DApp::FlushCommandQueue()
 	//! Wait until the GPU has completed commands up to this fence point.
     if(mFence->GetCompletedValue() < mCurrentFence)
 	{
-		HANDLE eventHandle = CreateEventEx(nullptr, nullptr, false, EVENT_ALL_ACCESS);
-
         //! Fire event when GPU hits current fence.  
-        ThrowIfFailed(mFence->SetEventOnCompletion(mCurrentFence, eventHandle));
+        ThrowIfFailed(mFence->SetEventOnCompletion(mCurrentFence, mFlushEvent));
 
         //! Wait until the GPU hits current fence event is fired.
-		WaitForSingleObject(eventHandle, INFINITE);
-        CloseHandle(eventHandle);
+		WaitForSingleObject(mFlushEvent, INFINITE);
 	}
 }
 
 
 
+void D3DApp::PresentBackBuffer()
+{
+	if(mSwapChain)
+		ThrowIfFailed(mSwapChain->Present(mSyncInterval, PresentFlags()));
+	mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
+}
+
 ID3D12Resource* D3DApp::CurrentBackBuffer()const
 {
 	return mSwapChainBuffer[mCurrBackBuffer].Get();
@@ -618,9 +702,11 @@ void D3DApp::CalculateFrameStats()
 
         wstring windowText = mMainWndCaption +
             L"    fps: " + fpsStr +
-            L"   mspf: " + mspfStr;
+            L"   mspf: " + mspfStr +
+            FrameStatsText();
 
-        SetWindowText(mhMainWnd, windowText.c_str());
+		if(mhMainWnd != nullptr)
+			SetWindowText(mhMainWnd, windowText.c_str());
 		
 		// Reset for next average.
 		frameCnt = 0;
@@ -51,15 +51,27 @@ protected:
 	virtual void OnMouseUp(WPARAM btnState, int x, int y)  { }
 	virtual void OnMouseMove(WPARAM btnState, int x, int y){ }
 
+	// Called for key releases the framework does not handle itself (Esc, F2).
+	virtual void OnKeyUp(WPARAM key){ }
+
+	// Extra text appended to the fps/mspf caption by CalculateFrameStats.
+	virtual std::wstring FrameStatsText()const { return L""; }
+
 protected:
 
 	bool InitMainWindow();
 	bool InitDirect3D();
 	void CreateCommandObjects();
     void CreateSwapChain();
+	UINT SwapChainFlags()const;
+	UINT PresentFlags()const;
 
 	void FlushCommandQueue();
 
+	// Presents the current back buffer, if there is a swap chain, and advances
+	// mCurrBackBuffer.
+	void PresentBackBuffer();
+
 	ID3D12Resource* CurrentBackBuffer()const;
 	D3D12_CPU_DESCRIPTOR_HANDLE CurrentBackBufferView()const;
 	D3D12_CPU_DESCRIPTOR_HANDLE DepthStencilView()const;
@@ -86,6 +98,22 @@ protected:
     bool      m4xMsaaState = false;    // 4X MSAA enabled
     UINT      m4xMsaaQuality = 0;      // quality level of 4X MSAA
 
+	// Frame pacing.  Derived classes may set the requested values in their
+	// constructor.  A non-zero mMaxFrameLatency creates the swap chain with a frame
+	// latency waitable object and Run() waits on it before every frame.  Tearing is
+	// only used when it was requested, the OS/driver supports it and mSyncInterval is 0.
+	UINT      mSyncInterval = 0;
+	UINT      mMaxFrameLatency = 0;
+	bool      mAllowTearing = false;
+	bool      mTearingSupported = false;
+	HANDLE    mFrameLatencyWaitableObject = nullptr;
+	HANDLE    mFlushEvent = nullptr;
+
+	// Set in the derived constructor to run without a window or swap chain.  The back
+	// buffers are then plain render target textures, and PresentBackBuffer only moves
+	// on to the next one.  Run() keeps going until a WM_QUIT is posted.
+	bool      mHeadless = false;
+
 	// Used to keep track of the delta-time?and game time.
 	GameTimer mTimer;
 	